@@ -0,0 +1,487 @@
+/* File: bench.cpp
+ * Purpose: Benchmarks one of the preprocessors on synthetic corpora. It's
+ *  built once per implementation (see build-bench.sh), with that
+ *  implementation compiled in and its main() renamed, so that each run can
+ *  count the allocations it makes. Every run happens in a forked child, which
+ *  gives it a fresh heap and lets its peak RSS be read back on its own.
+ *
+ *  usage: ./bench-better [-s MB] [-r repeats] [-j threads] corpus-dir
+ *
+ *  The corpora are generated into corpus-dir the first time (and again if
+ *  the scale changes), so both implementations can be run over the same
+ *  files. For each corpus and each way of running the implementation, the
+ *  best of the repeats is reported as input MB/s and tokens/s, along with the
+ *  allocations made and the peak RSS.
+ *
+ *  Last, every corpus is run through one reused Preprocessor, the library
+ *  class, a second time after it's warmed up on them. That pass must make no
+ *  allocations at all, conditionals and all; the exit status is 1 if it does.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <initializer_list>
+#include <iterator>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// The implementation counts its own allocations, as it does for --stats
+#define COUNT_ALLOCATIONS 1
+#define main implementationMain
+#ifdef BENCH_BETTER
+    #include "better.cpp"
+#else
+    #include "ginevra++.cpp"
+#endif
+#undef main
+#include "harness.h"
+
+// The rest of the stats would slow the runs being timed
+#if ENABLE_STATS
+    #error "build the bench without ENABLE_STATS"
+#endif
+
+// Every allocation made through operator new, by any thread. Counted rather
+// than timed, since it's the number that regresses quietly.
+#ifdef BENCH_BETTER
+constexpr std::string_view ImplementationName = "better";
+std::atomic<std::uint64_t> &allocationCount = stats::allocations;
+#else
+constexpr std::string_view ImplementationName = "ginevra++";
+std::uint64_t &allocationCount = stats::counters.allocations;
+#endif
+
+namespace generate {
+
+// A plain line of code, the kind that fills out every corpus
+void codeLine(std::string &out, Random &random)
+{
+    static constexpr std::string_view words[] = {
+	"int", "value", "count", "return", "if", "while", "for", "result", "index",
+	"buffer", "size", "const", "static", "void", "data", "next", "total"
+    };
+    out += "    ";
+    const std::size_t length = 3 + random.below(8);
+    for(std::size_t i = 0; i < length; ++i) {
+	out += words[random.below(std::size(words))];
+	out += " =+-*(),;"[random.below(9)];
+	if(random.below(4) == 0) {
+	    out += std::to_string(random.below(1000));
+	    out += ' ';
+	}
+    }
+    out += ";\n";
+}
+
+// Many object-like and function-like macros, used densely, some of them
+// behind conditionals
+std::string macroHeavy(std::size_t size, Random &random)
+{
+    std::string out;
+    const std::size_t macros = 256 + size / 4096;
+    for(std::size_t i = 0; i < macros; ++i) {
+	out += "#define " + nameOf('M', i);
+	if(i % 4 == 3) {
+	    out += "(a, b) ((a) + (b) * " + nameOf('M', random.below(i)) + ")\n";
+	} else if(i > 0 && i % 2 == 1) {
+	    out += " (" + nameOf('M', random.below(i)) + " + " + std::to_string(i) + ")\n";
+	} else {
+	    out += ' ' + std::to_string(i) + '\n';
+	}
+    }
+    while(out.size() < size) {
+	if(random.below(16) == 0) {
+	    // Every fourth macro is a plain number
+	    out += "#if " + nameOf('M', random.below(macros) & ~std::size_t(3)) + " > 100\n";
+	    codeLine(out, random);
+	    out += "#else\n";
+	    codeLine(out, random);
+	    out += "#endif\n";
+	}
+	out += "    x = ";
+	for(std::size_t i = 0; i < 6; ++i) {
+	    const std::size_t macro = random.below(macros);
+	    out += nameOf('M', macro);
+	    if(macro % 4 == 3) {
+		out += "(y, " + nameOf('M', random.below(macros)) + ")";
+	    }
+	    out += i < 5 ? " + " : ";\n";
+	}
+    }
+    return out;
+}
+
+// Mostly comments, in blocks of every size, between a little code
+std::string commentHeavy(std::size_t size, Random &random)
+{
+    std::string out("#define LIMIT 64\n");
+    while(out.size() < size) {
+	out += "/* ";
+	const std::size_t lines = 1 + random.below(12);
+	for(std::size_t i = 0; i < lines; ++i) {
+	    out += " * Notes on what follows, which go on for a while, with a # or two\n";
+	}
+	out += " */\n";
+	codeLine(out, random);
+	out += "    size = LIMIT; /* inline remark */ total = LIMIT;\n";
+    }
+    return out;
+}
+
+// Long string and char literals, with the odd escape
+std::string stringHeavy(std::size_t size, Random &random)
+{
+    std::string out("#define PREFIX \"log: \"\n");
+    while(out.size() < size) {
+	out += "    puts(PREFIX \"";
+	const std::size_t words = 4 + random.below(24);
+	for(std::size_t i = 0; i < words; ++i) {
+	    out += random.below(8) == 0 ? "\\n" : random.below(2) == 0 ? "message " : "text ";
+	}
+	out += "\");\n";
+	out += "    c = 'x'; d = '\\t';\n";
+    }
+    return out;
+}
+
+// A bit of everything, in the proportions of ordinary code: macros defined
+// and used up front, then comments, strings and plain code
+std::string mixed(std::size_t size, Random &random)
+{
+    std::string out(macroHeavy(size / 4, random));
+    while(out.size() < size) {
+	const std::size_t part = std::min<std::size_t>(16 * 1024, size - out.size());
+	switch(random.below(3)) {
+	case 0: out += commentHeavy(part, random); break;
+	case 1: out += stringHeavy(part, random); break;
+	default:
+	    for(std::size_t start = out.size(); out.size() - start < part;) codeLine(out, random);
+	}
+    }
+    return out;
+}
+
+void writeFile(const std::filesystem::path &path, std::string_view text)
+{
+    std::ofstream(path, std::ios::binary).write(text.data(), text.size());
+}
+
+}
+
+// A set of generated inputs: either one file or a directory of them
+struct Corpus {
+    std::string name;
+    std::vector<std::string> files;
+    std::uint64_t bytes = 0;
+    std::uint64_t tokens = 0;
+};
+
+// Counts tokens roughly the way a C preprocessor sees them, to give
+// throughput in terms that don't depend on line length
+std::uint64_t countTokens(std::string_view text)
+{
+    std::uint64_t count = 0;
+    std::size_t i = 0;
+    while(i < text.size()) {
+	const unsigned char c = text[i];
+	if(std::isspace(c)) {
+	    ++i;
+	    continue;
+	} else if(text.compare(i, 2, "/*") == 0) {
+	    const std::size_t close = text.find("*/", i + 2);
+	    i = close == std::string_view::npos ? text.size() : close + 2;
+	    continue;
+	}
+	++count;
+	if(std::isalnum(c) || c == '_') {
+	    while(i < text.size() && (std::isalnum(static_cast<unsigned char>(text[i]))
+				      || text[i] == '_')) ++i;
+	} else if(c == '"' || c == '\'') {
+	    for(++i; i < text.size() && text[i] != c && text[i] != '\n'; ++i) {
+		if(text[i] == '\\') ++i;
+	    }
+	    ++i;
+	} else {
+	    ++i;
+	}
+    }
+    return count;
+}
+
+// Generates the corpora under directory, unless a run at the same scale
+// already has
+std::vector<Corpus> prepareCorpora(const std::filesystem::path &directory, std::size_t megabytes)
+{
+    const std::size_t size = megabytes * 1024 * 1024;
+    const std::filesystem::path stamp(directory / (".generated-" + std::to_string(megabytes)));
+    const bool generate = !std::filesystem::exists(stamp);
+    if(generate) {
+	std::filesystem::remove_all(directory);
+	std::filesystem::create_directories(directory / "small-files");
+	std::cerr << "generating " << megabytes << " MB corpora in " << directory.string() << '\n';
+    }
+    std::vector<Corpus> corpora;
+    const auto single = [&](const std::string &name, std::string (*make)(std::size_t, generate::Random&),
+			    std::size_t bytes) {
+	const std::filesystem::path path(directory / (name + ".cpp"));
+	if(generate) {
+	    generate::Random random(corpora.size() + 1);
+	    generate::writeFile(path, make(bytes, random));
+	}
+	corpora.push_back({name, {path.string()}});
+    };
+    single("macro-heavy", generate::macroHeavy, size);
+    single("comment-heavy", generate::commentHeavy, size);
+    single("string-heavy", generate::stringHeavy, size);
+    single("one-huge-file", generate::mixed, size * 8);
+
+    // Files of about 4 KB, as many as make up the same total
+    Corpus small{"many-small-files", {}};
+    const std::size_t fileCount = std::max<std::size_t>(1, size / 4096);
+    generate::Random random(99);
+    for(std::size_t i = 0; i < fileCount; ++i) {
+	const std::filesystem::path path(directory / "small-files" / (std::to_string(i) + ".cpp"));
+	if(generate) {
+	    generate::writeFile(path, generate::mixed(4096, random));
+	}
+	small.files.push_back(path.string());
+    }
+    corpora.push_back(std::move(small));
+    if(generate) {
+	generate::writeFile(stamp, "");
+    }
+
+    for(Corpus &corpus : corpora) {
+	for(const std::string &file : corpus.files) {
+	    std::ifstream in(file, std::ios::binary);
+	    const std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	    corpus.bytes += text.size();
+	    corpus.tokens += countTokens(text);
+	}
+    }
+    return corpora;
+}
+
+// One way of running the implementation over a corpus: the argument lists
+// to call its main() with, one after the other in the same process, and the
+// file to give it as standard input, if any
+struct Run {
+    std::vector<std::vector<std::string>> calls;
+    std::string input;
+};
+
+struct Mode {
+    std::string name;
+    // Whether it's for corpora of one file or of many
+    bool manyFiles;
+    Run (*plan)(const Corpus &corpus, std::size_t jobs, const std::string &scratch);
+};
+
+const std::vector<Mode>& modes()
+{
+    static const std::vector<Mode> all{
+	{"file", false, [](const Corpus &corpus, std::size_t, const std::string&) {
+	    return Run{{{corpus.files[0]}}, {}};
+	}},
+	// A process per file, as a build would run it
+	{"each", true, [](const Corpus &corpus, std::size_t, const std::string&) {
+	    Run run;
+	    for(const std::string &file : corpus.files) {
+		run.calls.push_back({file});
+	    }
+	    return run;
+	}},
+#ifdef BENCH_BETTER
+	{"stdin", false, [](const Corpus &corpus, std::size_t, const std::string&) {
+	    return Run{{{"-"}}, corpus.files[0]};
+	}},
+	{"split", false, [](const Corpus &corpus, std::size_t jobs, const std::string&) {
+	    return Run{{{"--split", "-j", std::to_string(jobs), corpus.files[0]}}, {}};
+	}},
+	{"batch", true, [](const Corpus &corpus, std::size_t jobs, const std::string &scratch) {
+	    std::vector<std::string> call{"-j", std::to_string(jobs), "-o", scratch + "/out"};
+	    call.insert(call.end(), corpus.files.begin(), corpus.files.end());
+	    return Run{{call}, {}};
+	}},
+#endif
+    };
+    return all;
+}
+
+struct Measurement {
+    double seconds = 0;
+    std::uint64_t allocations = 0;
+    long peakKilobytes = 0;
+    bool ok = false;
+};
+
+// Runs the calls in a forked child with its output thrown away
+Measurement measure(const Run &run)
+{
+    const auto child = runInChild<Measurement>([&run](Measurement &result) {
+	if(!run.input.empty()) {
+	    const int input = ::open(run.input.c_str(), O_RDONLY);
+	    dup2(input, STDIN_FILENO);
+	}
+	allocationCount = 0;
+	const auto start = std::chrono::steady_clock::now();
+	bool ok = true;
+	for(const std::vector<std::string> &call : run.calls) {
+	    ok = callMain(ImplementationName, call) == 0 && ok;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.allocations = allocationCount;
+	result.ok = ok;
+	return true;
+    });
+    if(!child.reported) {
+	return {};
+    }
+    Measurement result(child.result);
+    result.peakKilobytes = child.peakKilobytes;
+    return result;
+}
+
+// Throws away whatever is written to it
+class NullSink : public OutputSink {
+public:
+    bool write(std::string_view) override { return true; }
+};
+
+// Takes the library's Preprocessor through every corpus twice, timing and
+// counting the allocations of the second pass only. By then everything it
+// keeps from one input to the next has grown to fit, so that pass should
+// allocate nothing at all.
+Measurement measureReuse(const std::vector<Corpus> &corpora)
+{
+    std::vector<std::string> texts;
+    for(const Corpus &corpus : corpora) {
+	for(const std::string &file : corpus.files) {
+	    std::ifstream in(file, std::ios::binary);
+	    texts.emplace_back(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+    }
+    // Diagnostics are dropped, without allocating
+    std::streambuf *const errors = std::cerr.rdbuf(nullptr);
+    Preprocessor preprocessor;
+    NullSink sink;
+    Measurement result;
+    result.ok = true;
+    for(int pass = 0; pass < 2; ++pass) {
+	allocationCount = 0;
+	const auto start = std::chrono::steady_clock::now();
+	for(const std::string &text : texts) {
+	    preprocessor.process(text, sink);
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	result.allocations = allocationCount;
+    }
+    std::cerr.rdbuf(errors);
+    std::cerr.clear();
+    return result;
+}
+
+void benchUsage()
+{
+    std::cout << "usage: ./bench-" << ImplementationName
+	      << " [-s MB] [-r repeats] [-j threads] corpus-dir\n";
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t megabytes = 8;
+    std::size_t repeats = 3;
+    std::size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    std::string directory;
+    for(int i = 1; i < argc; ++i) {
+	const std::string_view arg(argv[i]);
+	if(arg == "-s" && i + 1 < argc) {
+	    megabytes = std::max<std::size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-r" && i + 1 < argc) {
+	    repeats = std::max<std::size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-j" && i + 1 < argc) {
+	    jobs = std::max<std::size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+	} else if(directory.empty() && !arg.empty() && arg[0] != '-') {
+	    directory = arg;
+	} else {
+	    benchUsage();
+	}
+    }
+    if(directory.empty()) {
+	benchUsage();
+    }
+    const std::vector<Corpus> corpora(prepareCorpora(directory, megabytes));
+    const std::string scratch(directory + "/scratch");
+    std::filesystem::create_directories(scratch);
+
+    std::printf("%-10s %-17s %-6s %9s %9s %12s %10s\n", "impl", "corpus", "mode", "MB/s",
+		"Mtok/s", "allocs", "peak RSS");
+    for(const Corpus &corpus : corpora) {
+	const bool manyFiles = corpus.files.size() > 1;
+	for(const Mode &mode : modes()) {
+	    if(mode.manyFiles != manyFiles) {
+		continue;
+	    }
+	    const Run run(mode.plan(corpus, jobs, scratch));
+	    Measurement best;
+	    for(std::size_t i = 0; i < repeats; ++i) {
+		const Measurement result(measure(run));
+		if(i == 0 || result.seconds < best.seconds) {
+		    best = result;
+		}
+	    }
+	    const double seconds = std::max(best.seconds, 1e-9);
+	    std::printf("%-10s %-17s %-6s %9.1f %9.2f %12llu %8ld KB%s\n",
+			std::string(ImplementationName).c_str(), corpus.name.c_str(),
+			mode.name.c_str(), corpus.bytes / seconds / (1024 * 1024),
+			corpus.tokens / seconds / 1e6,
+			static_cast<unsigned long long>(best.allocations), best.peakKilobytes,
+			best.ok ? "" : "  (failed)");
+	    std::fflush(stdout);
+	}
+    }
+    std::filesystem::remove_all(scratch);
+
+    // Every corpus, conditionals and all, through one Preprocessor
+    Corpus all{"all", {}};
+    for(const Corpus &corpus : corpora) {
+	all.bytes += corpus.bytes;
+	all.tokens += corpus.tokens;
+    }
+    const Measurement reuse(measureReuse(corpora));
+    const double seconds = std::max(reuse.seconds, 1e-9);
+    std::printf("%-10s %-17s %-6s %9.1f %9.2f %12llu %11s%s\n",
+		std::string(ImplementationName).c_str(), all.name.c_str(), "reuse",
+		all.bytes / seconds / (1024 * 1024), all.tokens / seconds / 1e6,
+		static_cast<unsigned long long>(reuse.allocations), "-",
+		reuse.allocations == 0 ? "" : "  (allocates)");
+    return reuse.allocations == 0 ? 0 : 1;
+}
@@ -14,9 +14,55 @@
  */
 #include <iostream>
 #include <fstream>
+#include <sstream>
+#include <memory>
 #include <string>
-#include <utility> //for std::pair
-#include <map>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <optional>
+#include <initializer_list>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <new>
+#include <cstdint>
+#include <cstdio> //for EOF
+#include <cstring> //for std::memchr
+#include <cctype>
+#include <climits>
+#include <cstdlib> //for exit()
+#include <cerrno>
+// POSIX file access for memory-mapped input
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <unistd.h>
+// Overlapped reads and writes through io_uring, when the kernel headers have it
+#if defined(__linux__) && __has_include(<linux/io_uring.h>) && !defined(NO_IO_URING)
+    #include <linux/io_uring.h>
+    #include <sys/syscall.h>
+    #define HAVE_IO_URING 1
+#endif
+// Vector fast paths for skipping runs of chars, when available. Build with
+// -DNO_SIMD for the plain loops alone, say to check the two against each
+// other.
+#if defined(__SSE2__) && !defined(NO_SIMD)
+    #include <emmintrin.h>
+    #define HAVE_SIMD 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(NO_SIMD)
+    #include <arm_neon.h>
+    #define HAVE_SIMD 1
+#endif
 
 // The different types of tokens
 enum class State : char {
@@ -24,222 +70,6078 @@ enum class State : char {
     InDoubleQuote, EoF, Bad, Other
 };
 
-class Scanner {
+// How the Start state treats each char
+enum class CharKind : char {
+    Blank, IdentStart, SingleQuote, DoubleQuote, Slash, Newline, End, Other
+};
+
+// A dialect: the token rules the scanner is specialized on at compile time,
+// so that no char is checked against a setting while scanning. Identifiers
+// start with a letter or `#`; the rest are
+//  - identDigits: whether digits can continue one
+//  - identChars: what else can, besides letters
+//  - lineComments: whether `//` starts a comment running to the end of the
+//    line, as well as `/*` starting one running to `*/`
+//  - name: what the identifier rules are called, for the output cache
+// This program's own rules:
+struct BetterDialect {
+    static constexpr bool identDigits = false;
+    static constexpr std::string_view identChars = ".";
+    static constexpr bool lineComments = false;
+    static constexpr std::string_view name = "better";
+};
+
+// Identifiers as in ginevra++: letters and digits
+struct GinevraDialect {
+    static constexpr bool identDigits = true;
+    static constexpr std::string_view identChars = "";
+    static constexpr bool lineComments = false;
+    static constexpr std::string_view name = "ginevra";
+};
+
+// Either of the above, also taking C++-style `//` comments
+template<typename Base>
+struct LineComments : Base {
+    static constexpr bool lineComments = true;
+};
+
+// The dialect this program is built for. Build with, for example,
+// -DSCANNER_DIALECT='LineComments<BetterDialect>' to pick another.
+#ifndef SCANNER_DIALECT
+    #define SCANNER_DIALECT BetterDialect
+#endif
+using Dialect = SCANNER_DIALECT;
+
+constexpr std::array<CharKind,256> makeStartTable()
+{
+    std::array<CharKind,256> table{};
+    for(auto &kind : table) kind = CharKind::Other;
+    for(int c = 'a'; c <= 'z'; ++c) {
+	table[c] = CharKind::IdentStart;
+	table[c - 'a' + 'A'] = CharKind::IdentStart;
+    }
+    table['#'] = CharKind::IdentStart;
+    table[' '] = CharKind::Blank;
+    table['\t'] = CharKind::Blank;
+    table['\''] = CharKind::SingleQuote;
+    table['"'] = CharKind::DoubleQuote;
+    table['/'] = CharKind::Slash;
+    table['\n'] = CharKind::Newline;
+    // EOF, when stored in a char, is indistinguishable from 0xFF
+    table[static_cast<unsigned char>(EOF)] = CharKind::End;
+    return table;
+}
+
+// Chars that can continue an identifier in dialect D
+template<typename D>
+constexpr std::array<bool,256> makeIdentTable()
+{
+    std::array<bool,256> table{};
+    for(int c = 'a'; c <= 'z'; ++c) {
+	table[c] = true;
+	table[c - 'a' + 'A'] = true;
+    }
+    for(int c = '0'; c <= '9'; ++c) {
+	table[c] = D::identDigits;
+    }
+    for(const char c : D::identChars) {
+	table[static_cast<unsigned char>(c)] = true;
+    }
+    return table;
+}
+
+template<typename D>
+constexpr std::array<bool,256> identTable = makeIdentTable<D>();
+constexpr auto startTable = makeStartTable();
+
+inline CharKind kindOf(char c) { return startTable[static_cast<unsigned char>(c)]; }
+template<typename D = Dialect>
+inline bool isIdentChar(char c) { return identTable<D>[static_cast<unsigned char>(c)]; }
+
+#ifdef HAVE_SIMD
+// The handful of 16-byte vector operations the fast paths below need
+namespace simd {
+    constexpr int Width = 16;
+#if defined(__SSE2__)
+    using Bytes = __m128i;
+    inline Bytes load(const char *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    inline Bytes eq(Bytes v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+    inline Bytes either(Bytes a, Bytes b) { return _mm_or_si128(a, b); }
+    inline Bytes lower(Bytes v) { return _mm_or_si128(v, _mm_set1_epi8(0x20)); }
+    // Lanes holding a char in [low, high]
+    inline Bytes inRange(Bytes v, char low, char high)
+    {
+	const Bytes offset = _mm_sub_epi8(v, _mm_set1_epi8(low));
+	return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+    }
+    // Index of the first set lane, or Width if there isn't one
+    inline int firstSet(Bytes mask)
+    {
+	const unsigned bits = _mm_movemask_epi8(mask);
+	return bits != 0 ? __builtin_ctz(bits) : Width;
+    }
+    inline int firstClear(Bytes mask)
+    {
+	const unsigned bits = ~_mm_movemask_epi8(mask) & 0xFFFF;
+	return bits != 0 ? __builtin_ctz(bits) : Width;
+    }
+#else
+    using Bytes = uint8x16_t;
+    inline Bytes load(const char *p) { return vld1q_u8(reinterpret_cast<const uint8_t*>(p)); }
+    inline Bytes eq(Bytes v, char c) { return vceqq_u8(v, vdupq_n_u8(c)); }
+    inline Bytes either(Bytes a, Bytes b) { return vorrq_u8(a, b); }
+    inline Bytes lower(Bytes v) { return vorrq_u8(v, vdupq_n_u8(0x20)); }
+    inline Bytes inRange(Bytes v, char low, char high)
+    {
+	return vcleq_u8(vsubq_u8(v, vdupq_n_u8(low)), vdupq_n_u8(high - low));
+    }
+    inline int firstSet(Bytes mask)
+    {
+	// Narrow each lane to 4 bits so the whole mask fits in 64 bits
+	const uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+	    vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+	return bits != 0 ? __builtin_ctzll(bits) / 4 : Width;
+    }
+    inline int firstClear(Bytes mask) { return firstSet(vmvnq_u8(mask)); }
+#endif
+}
+#endif
+
+// Returns the first char in [p, end) that isn't a space or tab
+inline const char* skipBlanks(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::Width; p += simd::Width) {
+	const simd::Bytes v = simd::load(p);
+	const int i = simd::firstClear(simd::either(simd::eq(v, ' '), simd::eq(v, '\t')));
+	if(i < simd::Width) return p + i;
+    }
+#endif
+    while(p < end && kindOf(*p) == CharKind::Blank) ++p;
+    return p;
+}
+
+// Returns the first char in [p, end) that can't continue an identifier in
+// dialect D
+template<typename D>
+inline const char* skipIdentChars(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::Width; p += simd::Width) {
+	const simd::Bytes v = simd::load(p);
+	simd::Bytes ident = simd::inRange(simd::lower(v), 'a', 'z');
+	if constexpr(D::identDigits) {
+	    ident = simd::either(ident, simd::inRange(v, '0', '9'));
+	}
+	// Unrolled, since identChars is a constant
+	for(const char c : D::identChars) {
+	    ident = simd::either(ident, simd::eq(v, c));
+	}
+	const int i = simd::firstClear(ident);
+	if(i < simd::Width) return p + i;
+    }
+#endif
+    while(p < end && isIdentChar<D>(*p)) ++p;
+    return p;
+}
+
+// Returns the first char in [p, end) that a string body can't simply keep:
+// the closing quote, a backslash, a newline or an EOF-valued char
+inline const char* findStringStop(const char *p, const char *end, char quote)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::Width; p += simd::Width) {
+	const simd::Bytes v = simd::load(p);
+	const int i = simd::firstSet(simd::either(
+	    simd::either(simd::eq(v, quote), simd::eq(v, '\\')),
+	    simd::either(simd::eq(v, '\n'), simd::eq(v, EOF))));
+	if(i < simd::Width) return p + i;
+    }
+#endif
+    while(p < end && *p != quote && *p != '\\' && *p != '\n' && *p != EOF) ++p;
+    return p;
+}
+
+// Returns the first char in [p, end) at which a comment can end: a `*`, a
+// char followed by `/`, or an EOF-valued char
+inline const char* findCommentEnd(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p > simd::Width; p += simd::Width) {
+	const simd::Bytes v = simd::load(p);
+	const simd::Bytes next = simd::load(p + 1);
+	const int i = simd::firstSet(simd::either(
+	    simd::either(simd::eq(v, '*'), simd::eq(next, '/')), simd::eq(v, EOF)));
+	if(i < simd::Width) return p + i;
+    }
+#endif
+    while(p < end && *p != '*' && *p != EOF && !(p + 1 < end && p[1] == '/')) ++p;
+    return p;
+}
+
+// Where a `//` comment starts in line, or line.size() if none does. String
+// literals and `/*` comments are stepped over, since they could hold a `//`.
+inline std::size_t lineCommentStart(std::string_view line)
+{
+    std::size_t i = 0;
+    while((i = line.find_first_of("/\"'", i)) < line.size()) {
+	if(line[i] != '/') {
+	    const char quote = line[i];
+	    for(++i; i < line.size() && line[i] != quote; i += line[i] == '\\' ? 2 : 1) {}
+	    ++i;
+	} else if(i + 1 < line.size() && line[i + 1] == '/') {
+	    return i;
+	} else if(i + 1 < line.size() && line[i + 1] == '*') {
+	    i = line.find("*/", i + 2);
+	    if(i == std::string_view::npos) break;
+	    i += 2;
+	} else {
+	    ++i;
+	}
+    }
+    return line.size();
+}
+
+// The directive names, told apart by the scanner so that the main loop
+// compares integers rather than text
+enum class Keyword : char {
+    None, Define, Include, Pragma, If, Ifdef, Ifndef, Elif, Else, Endif
+};
+
+// A token's type and its text. The text views either the source buffer or,
+// when the token had to be rewritten, the scanner's scratch buffer, so it is
+// only valid until the next call to nextToken(). Identifiers also carry the
+// hash of their text so the symbol table doesn't have to rehash it, and
+// which directive they name, if any.
+struct Token {
+    State state;
+    Keyword keyword;
+    std::string_view text;
+    std::uint64_t hash;
+};
+
+// Counters for --stats. They're only kept if the program is built with
+// -DENABLE_STATS=1; otherwise every hook below is an empty inline function,
+// so the hot paths compile to exactly what they'd be without them.
+#ifndef ENABLE_STATS
+    #define ENABLE_STATS 0
+#endif
+constexpr bool StatsEnabled = ENABLE_STATS;
+
+namespace stats {
+    // Where a thread's time goes. It's charged to the innermost phase
+    // running, so the phases add up to all of the time the threads spent.
+    enum class Phase : std::size_t { Other, Read, Scan, Expand, Write, Count };
+    constexpr std::size_t PhaseCount = static_cast<std::size_t>(Phase::Count);
+    constexpr std::array<const char*, PhaseCount> PhaseNames{
+	"other", "read", "scan", "expand", "write"
+    };
+    constexpr std::size_t StateCount = static_cast<std::size_t>(State::Other) + 1;
+    constexpr std::array<const char*, StateCount> StateNames{
+	"start", "identifier", "in_identifier", "in_comment", "string",
+	"in_single_quote", "in_double_quote", "eof", "bad", "other"
+    };
+
+    // One thread's counts. Each thread only ever touches its own, so none
+    // of them need to be atomic.
+    struct Counters {
+	std::array<std::uint64_t, PhaseCount> nanoseconds{};
+	Phase phase = Phase::Other;
+	std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+	// Tokens returned by nextToken(), by state, and the input each one
+	// took up, including any blanks and comments before it
+	std::array<std::uint64_t, StateCount> tokens{};
+	std::array<std::uint64_t, StateCount> tokenBytes{};
+	// Lines read whole by nextLine(): directives and skipped lines
+	std::uint64_t lines = 0;
+	std::uint64_t lineBytes = 0;
+	// Symbol table probes: lookups, lookups that found a symbol, and
+	// slots looked at
+	std::uint64_t lookups = 0;
+	std::uint64_t hits = 0;
+	std::uint64_t slots = 0;
+	// Object-like macros replaced by their values, and function-like
+	// macro bodies substituted, counting those inside other calls
+	std::uint64_t substitutions = 0;
+	std::uint64_t calls = 0;
+	std::uint64_t outputBytes = 0;
+	std::uint64_t writes = 0;
+    };
+
+    const auto startTime = std::chrono::steady_clock::now();
+    std::mutex registryMutex;
+    // Every thread's counters, kept until the report sums them
+    std::vector<std::unique_ptr<Counters>> registry;
+    // Counted by operator new, which can't safely reach the thread's own
+    // counters
+    std::atomic<std::uint64_t> allocations{0};
+    std::atomic<std::uint64_t> allocatedBytes{0};
+
+    inline Counters& local()
+    {
+	thread_local Counters *counters = nullptr;
+	if(counters == nullptr) {
+	    std::lock_guard<std::mutex> lock(registryMutex);
+	    registry.push_back(std::make_unique<Counters>());
+	    counters = registry.back().get();
+	}
+	return *counters;
+    }
+
+    // Charges the time since the last switch to the phase running, then
+    // starts on the given one, returning the old one
+    inline Phase switchTo(Phase phase)
+    {
+	Counters &counters = local();
+	const auto now = std::chrono::steady_clock::now();
+	counters.nanoseconds[static_cast<std::size_t>(counters.phase)] +=
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(now - counters.since).count();
+	counters.since = now;
+	const Phase outer = counters.phase;
+	counters.phase = phase;
+	return outer;
+    }
+
+    // Runs the rest of a scope in the given phase, then goes back to the
+    // one it interrupted
+    class PhaseTimer {
+    private:
+	Phase m_outer = Phase::Other;
+    public:
+	explicit PhaseTimer(Phase phase)
+	{
+	    if constexpr(StatsEnabled) m_outer = switchTo(phase);
+	}
+	~PhaseTimer()
+	{
+	    if constexpr(StatsEnabled) switchTo(m_outer);
+	}
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+    };
+
+    inline void token(State state, std::size_t bytes)
+    {
+	if constexpr(StatsEnabled) {
+	    Counters &counters = local();
+	    ++counters.tokens[static_cast<std::size_t>(state)];
+	    counters.tokenBytes[static_cast<std::size_t>(state)] += bytes;
+	}
+    }
+
+    inline void line(std::size_t bytes)
+    {
+	if constexpr(StatsEnabled) {
+	    Counters &counters = local();
+	    ++counters.lines;
+	    counters.lineBytes += bytes;
+	}
+    }
+
+    inline void lookup(std::size_t slots, bool hit)
+    {
+	if constexpr(StatsEnabled) {
+	    Counters &counters = local();
+	    ++counters.lookups;
+	    counters.hits += hit;
+	    counters.slots += slots;
+	}
+    }
+
+    inline void substitution()
+    {
+	if constexpr(StatsEnabled) ++local().substitutions;
+    }
+
+    inline void call()
+    {
+	if constexpr(StatsEnabled) ++local().calls;
+    }
+
+    inline void output(std::size_t bytes)
+    {
+	if constexpr(StatsEnabled) {
+	    Counters &counters = local();
+	    ++counters.writes;
+	    counters.outputBytes += bytes;
+	}
+    }
+
+    // Every thread's counts summed. Only meant to be called once the other
+    // threads are done.
+    Counters total()
+    {
+	switchTo(Phase::Other);
+	Counters sum;
+	std::lock_guard<std::mutex> lock(registryMutex);
+	for(const auto &counters : registry) {
+	    for(std::size_t i = 0; i < PhaseCount; ++i) {
+		sum.nanoseconds[i] += counters->nanoseconds[i];
+	    }
+	    for(std::size_t i = 0; i < StateCount; ++i) {
+		sum.tokens[i] += counters->tokens[i];
+		sum.tokenBytes[i] += counters->tokenBytes[i];
+	    }
+	    sum.lines += counters->lines;
+	    sum.lineBytes += counters->lineBytes;
+	    sum.lookups += counters->lookups;
+	    sum.hits += counters->hits;
+	    sum.slots += counters->slots;
+	    sum.substitutions += counters->substitutions;
+	    sum.calls += counters->calls;
+	    sum.outputBytes += counters->outputBytes;
+	    sum.writes += counters->writes;
+	}
+	return sum;
+    }
+
+    std::uint64_t wallNanoseconds()
+    {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    // For people: the counts that aren't zero, with a few ratios
+    void report(std::ostream &out)
+    {
+	const Counters sum(total());
+	const auto ms = [](std::uint64_t ns) { return ns / 1e6; };
+	out << "stats: " << ms(wallNanoseconds()) << " ms wall, " << registry.size()
+	    << " thread(s)\n  time (ms, all threads):";
+	for(std::size_t i = 0; i < PhaseCount; ++i) {
+	    out << ' ' << PhaseNames[i] << ' ' << ms(sum.nanoseconds[i]);
+	}
+	out << "\n  tokens:";
+	for(std::size_t i = 0; i < StateCount; ++i) {
+	    if(sum.tokens[i] != 0) {
+		out << ' ' << StateNames[i] << ' ' << sum.tokens[i]
+		    << " (" << sum.tokenBytes[i] << " bytes)";
+	    }
+	}
+	out << "\n  lines read whole: " << sum.lines << " (" << sum.lineBytes << " bytes)"
+	    << "\n  symbol lookups: " << sum.lookups << ", " << sum.hits << " hits, "
+	    << sum.lookups - sum.hits << " misses, "
+	    << (sum.lookups == 0 ? 0.0 : double(sum.slots) / sum.lookups) << " slots each"
+	    << "\n  substitutions: " << sum.substitutions << " object-like, "
+	    << sum.calls << " function-like"
+	    << "\n  allocations: " << allocations << " (" << allocatedBytes << " bytes)"
+	    << "\n  output: " << sum.outputBytes << " bytes in " << sum.writes << " writes\n";
+    }
+
+    // For dashboards: everything, on one line
+    void reportJson(std::ostream &out)
+    {
+	const Counters sum(total());
+	out << "{\"implementation\":\"better\",\"wall_ns\":" << wallNanoseconds()
+	    << ",\"threads\":" << registry.size() << ",\"phase_ns\":{";
+	for(std::size_t i = 0; i < PhaseCount; ++i) {
+	    out << (i == 0 ? "" : ",") << '"' << PhaseNames[i] << "\":" << sum.nanoseconds[i];
+	}
+	out << "},\"tokens\":{";
+	for(std::size_t i = 0; i < StateCount; ++i) {
+	    out << (i == 0 ? "" : ",") << '"' << StateNames[i] << "\":{\"count\":"
+		<< sum.tokens[i] << ",\"bytes\":" << sum.tokenBytes[i] << '}';
+	}
+	out << "},\"lines\":{\"count\":" << sum.lines << ",\"bytes\":" << sum.lineBytes
+	    << "},\"symbols\":{\"lookups\":" << sum.lookups << ",\"hits\":" << sum.hits
+	    << ",\"misses\":" << sum.lookups - sum.hits << ",\"slots\":" << sum.slots
+	    << "},\"substitutions\":{\"object_like\":" << sum.substitutions
+	    << ",\"function_like\":" << sum.calls
+	    << "},\"allocations\":{\"count\":" << allocations << ",\"bytes\":" << allocatedBytes
+	    << "},\"output\":{\"bytes\":" << sum.outputBytes << ",\"writes\":" << sum.writes
+	    << "}}\n";
+    }
+}
+
+// Allocations can also be counted without the rest of the stats, with
+// -DCOUNT_ALLOCATIONS=1, which is how bench.cpp counts them
+#ifndef COUNT_ALLOCATIONS
+    #define COUNT_ALLOCATIONS ENABLE_STATS
+#endif
+
+#if COUNT_ALLOCATIONS
+// Counts every allocation for --stats. Kept out of line, like the deletes,
+// since wherever both are inlined the compiler takes free() on memory from
+// malloc() via operator new for a mismatch.
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    stats::allocations.fetch_add(1, std::memory_order_relaxed);
+    stats::allocatedBytes.fetch_add(size, std::memory_order_relaxed);
+    if(void *p = std::malloc(size == 0 ? 1 : size)) {
+	return p;
+    }
+    throw std::bad_alloc();
+}
+
+// The array forms end up in these
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void* operator new[](std::size_t size) { return operator new(size); }
+#endif
+
+// 64-bit FNV-1a
+constexpr std::uint64_t hashText(std::string_view text)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for(const char c : text) {
+	hash ^= static_cast<unsigned char>(c);
+	hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Each directive name and its hash, worked out at compile time
+struct KeywordSpelling {
+    std::string_view text;
+    std::uint64_t hash;
+    Keyword keyword;
+};
+
+constexpr std::array<KeywordSpelling, 9> Keywords{{
+    {"#define", hashText("#define"), Keyword::Define},
+    {"#include", hashText("#include"), Keyword::Include},
+    {"#pragma", hashText("#pragma"), Keyword::Pragma},
+    {"#if", hashText("#if"), Keyword::If},
+    {"#ifdef", hashText("#ifdef"), Keyword::Ifdef},
+    {"#ifndef", hashText("#ifndef"), Keyword::Ifndef},
+    {"#elif", hashText("#elif"), Keyword::Elif},
+    {"#else", hashText("#else"), Keyword::Else},
+    {"#endif", hashText("#endif"), Keyword::Endif}
+}};
+
+// The directive an identifier names, given the hash of its text. A token
+// picks up the newlines from the lines before it; anything that doesn't
+// start with a `#` past them is turned away without hashing again, and the
+// rest only have their text compared once the hash has matched.
+Keyword lookUpKeyword(std::string_view text, std::uint64_t hash, std::size_t start)
+{
+    if(start > 0) {
+	text.remove_prefix(start);
+	hash = hashText(text);
+    }
+    for(const KeywordSpelling &spelling : Keywords) {
+	if(spelling.hash == hash) {
+	    return spelling.text == text ? spelling.keyword : Keyword::None;
+	}
+    }
+    return Keyword::None;
+}
+
+inline Keyword keywordOf(std::string_view text, std::uint64_t hash)
+{
+    std::size_t start = 0;
+    while(start < text.size() && text[start] == '\n') ++start;
+    if(start == text.size() || text[start] != '#') {
+	return Keyword::None;
+    }
+    return lookUpKeyword(text, hash, start);
+}
+
+// Encoding of the fields of the binary files written here (symbol images and
+// cache entries): integers as they are in memory, since a file is only ever
+// read back on the kind of machine that wrote it, and strings as a 32-bit
+// length and their chars
+template<typename Integer>
+void putInteger(std::string &out, Integer value)
+{
+    out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+void putString(std::string &out, std::string_view text)
+{
+    putInteger(out, static_cast<std::uint32_t>(text.size()));
+    out += text;
+}
+
+// Reads fields back, failing (for good) rather than reading past the end
+class EntryReader {
+private:
+    std::string_view m_data;
+    bool m_ok = true;
+public:
+    explicit EntryReader(std::string_view data) : m_data(data) {}
+    bool ok() const { return m_ok; }
+    std::string_view bytes(std::size_t count)
+    {
+	if(count > m_data.size()) {
+	    m_ok = false;
+	    count = m_data.size();
+	}
+	const std::string_view result(m_data.substr(0, count));
+	m_data.remove_prefix(count);
+	return result;
+    }
+    template<typename Integer>
+    Integer integer()
+    {
+	Integer value = 0;
+	const std::string_view raw(bytes(sizeof(value)));
+	if(m_ok) std::memcpy(&value, raw.data(), sizeof(value));
+	return value;
+    }
+    std::string_view string() { return bytes(integer<std::uint32_t>()); }
+    std::string_view rest() { return bytes(m_data.size()); }
+};
+
+// One token of a macro's body, split out when the macro is defined so that
+// expanding it never has to rescan the text
+struct BodyToken {
+    State state;
+    // Whether blanks or a comment came before it
+    bool spaceBefore;
+    // For a function-like macro, which parameter the token names, counting
+    // from 1; 0 if none
+    std::uint16_t param;
+    // Where the token came from within the macro's value
+    std::uint32_t offset;
+    std::uint32_t length;
+    // The symbol an identifier named when the macro was defined (its
+    // SymbolTable index), or SymbolTable::NoSymbol
+    std::uint32_t symbol;
+};
+
+// A defined symbol: the value it expands to, ready to be written out as is,
+// and the BodyTokens it's made of. A function-like macro's value is just its
+// body, after the parameter list.
+struct Macro {
+    std::string_view value;
+    std::uint32_t firstToken;
+    std::uint32_t tokenCount;
+    // How many parameters a function-like macro takes; -1 for object-like
+    std::int32_t paramCount;
+};
+
+// Maps each #define'd symbol to its value. An open-addressing hash table
+// (linear probing, power-of-two capacity) whose slots hold just the low half
+// of each hash plus an index into a dense array of entries, so a probe only
+// touches the entry itself when the hash fragment already matches.
+//
+// A table can also be layered on another (see layerOn()), which it then
+// reads through without copying: its own entries carry on the numbering
+// from the base's, and a symbol the base has that's redefined is shadowed,
+// keeping its index so that bodies naming it see the new definition. The
+// base is only ever read, so any number of threads can share it.
+class SymbolTable {
+private:
+    // Bump-pointer storage for names and values. They're never freed one at
+    // a time, so each block is only released when the table is destroyed,
+    // or in the case of one too big to share, cleared.
+    class Arena {
+    private:
+	static constexpr std::size_t BlockSize = 64 * 1024;
+	std::vector<std::unique_ptr<char[]>> m_blocks;
+	std::vector<std::unique_ptr<char[]>> m_large;
+	// The block being filled, as an index into m_blocks plus one
+	std::size_t m_current = 0;
+	char *m_next = nullptr;
+	std::size_t m_left = 0;
+    public:
+	std::string_view copy(std::string_view text);
+	// Forgets everything copied, keeping the blocks to fill again
+	void clear()
+	{
+	    m_large.clear();
+	    m_current = 0;
+	    m_next = nullptr;
+	    m_left = 0;
+	}
+    };
+    struct Slot {
+	std::uint32_t hash;
+	// Index into m_entries plus one; 0 marks an empty slot
+	std::uint32_t entry;
+    };
+    struct Entry {
+	std::string_view name;
+	Macro macro;
+	std::uint64_t hash;
+    };
+    // How an Entry is kept in an image: its strings as offsets into the pool
+    struct StoredEntry {
+	std::uint64_t hash;
+	std::uint32_t name;
+	std::uint32_t nameLength;
+	std::uint32_t value;
+	std::uint32_t valueLength;
+	std::uint32_t firstToken;
+	std::uint32_t tokenCount;
+	std::int32_t paramCount;
+	std::uint32_t unused;
+    };
+    static constexpr std::string_view ImageMagic = "gsymB01\n";
+    Arena m_arena;
+    std::vector<Slot> m_slots;
+    std::vector<Entry> m_entries;
+    // Every macro's body tokens, back to back
+    std::vector<BodyToken> m_tokens;
+    // The table this one is layered on, if any, and how many entries and
+    // tokens it has, which is where this one's indices start. Its symbols
+    // that have been redefined here are in m_shadows, and m_shadowIndex
+    // holds, for each of its entries, the shadow's place plus one or 0;
+    // it stays empty until something is shadowed.
+    const SymbolTable *m_base = nullptr;
+    std::size_t m_baseSize = 0;
+    std::uint32_t m_baseTokens = 0;
+    std::vector<Entry> m_shadows;
+    std::vector<std::uint32_t> m_shadowIndex;
+    std::size_t m_mask = 0;
+    // Counts changes, so a copy can tell whether it's still the same
+    std::size_t m_version = 0;
+    // A bit for each pair of first two chars some name starts with, for
+    // mayHave()
+    std::array<std::uint64_t, 64> m_prefixes{};
+    std::size_t probe(std::string_view name, std::uint64_t hash) const;
+    void rehash(std::size_t slotCount);
+    // The entry with the given index, from whichever layer has it
+    const Entry& entryAt(std::size_t index) const
+    {
+	if(index >= m_baseSize) {
+	    return m_entries[index - m_baseSize];
+	} else if(!m_shadowIndex.empty() && m_shadowIndex[index] != 0) {
+	    return m_shadows[m_shadowIndex[index] - 1];
+	}
+	return m_base->m_entries[index];
+    }
+    // Makes the table a flat one with the same contents as layered
+    void flattenFrom(const SymbolTable &layered);
+    static std::size_t prefixBit(char first, char second)
+    {
+	return (static_cast<unsigned char>(first) & 63) << 6 | (static_cast<unsigned char>(second) & 63);
+    }
+    void addPrefix(std::string_view name)
+    {
+	const std::size_t bit = prefixBit(name[0], name.size() > 1 ? name[1] : 0);
+	m_prefixes[bit / 64] |= std::uint64_t(1) << bit % 64;
+    }
+public:
+    static constexpr std::uint32_t NoSymbol = UINT32_MAX;
+    SymbolTable() { m_slots.resize(16); m_mask = 15; }
+    // Removes every symbol, keeping the memory they took up for the next
+    // ones, so that a table reused from one input to the next stops
+    // allocating once it's as big as it gets
+    void clear();
+    const Macro* find(std::string_view name, std::uint64_t hash) const;
+    bool define(std::string_view name, std::uint64_t hash, std::string_view value,
+		const std::vector<BodyToken> &tokens = {}, std::int32_t paramCount = -1);
+    bool undefine(std::string_view name, std::uint64_t hash);
+    const Macro& at(std::size_t index) const { return entryAt(index).macro; }
+    const BodyToken* tokens(const Macro &macro) const
+    {
+	return macro.firstToken < m_baseTokens ? m_base->m_tokens.data() + macro.firstToken
+	    : m_tokens.data() + (macro.firstToken - m_baseTokens);
+    }
+    std::size_t size() const { return m_baseSize + m_entries.size(); }
+    // Empties the table and layers it on base, which must outlive it and
+    // not change while it does, and mustn't be layered itself. Until the
+    // next clear(), load() or undefine(), the table reads as a copy of base
+    // plus whatever is defined in it, for the cost of only what's defined.
+    void layerOn(const SymbolTable &base);
+    // How many entries the table holds itself, rather than reads through to
+    // its base, which is what copying it costs
+    std::size_t ownSize() const { return m_entries.size() + m_shadows.size(); }
+    // Position of the symbol in definition order, or size() if undefined
+    std::size_t indexOf(std::string_view name, std::uint64_t hash) const;
+    // Whether some symbol's name might start with first and then second (0
+    // for a name one char long). Never false when one does, and cheap
+    // enough to rule names out before they're even hashed.
+    bool mayHave(char first, char second) const
+    {
+	const std::size_t bit = prefixBit(first, second);
+	return (m_prefixes[bit / 64] >> bit % 64 & 1) != 0;
+    }
+    // Makes the table a copy of base. Names and values are shared rather
+    // than copied, so base must outlive it. A layered base's copy is layered
+    // on the same table.
+    void copyFrom(const SymbolTable &base);
+    // The same, but with names and values of its own
+    void cloneFrom(const SymbolTable &base);
+    // Changes with every define or undefine, and is copied along with the
+    // rest, so two tables from the same copy with the same version are equal
+    std::size_t version() const { return m_version; }
+    // Whether the two define the same symbols, in the same order, the same way
+    bool sameAs(const SymbolTable &other) const;
+    // The table in the .gsym format that load() reads
+    std::string image() const;
+    bool load(std::string_view image, std::uint64_t &hash);
+};
+
+std::string_view SymbolTable::Arena::copy(std::string_view text)
+{
+    if(text.empty()) {
+	return {};
+    }
+    if(text.size() > m_left) {
+	// Anything too big to share a block gets one to itself, so the rest of
+	// the current block isn't wasted
+	if(text.size() > BlockSize / 4) {
+	    m_large.emplace_back(new char[text.size()]);
+	    std::memcpy(m_large.back().get(), text.data(), text.size());
+	    return {m_large.back().get(), text.size()};
+	}
+	if(m_current == m_blocks.size()) {
+	    m_blocks.emplace_back(new char[BlockSize]);
+	}
+	m_next = m_blocks[m_current++].get();
+	m_left = BlockSize;
+    }
+    std::memcpy(m_next, text.data(), text.size());
+    const std::string_view copied(m_next, text.size());
+    m_next += text.size();
+    m_left -= text.size();
+    return copied;
+}
+
+// Returns the index of the slot holding name, or else of the empty slot
+// where it belongs
+inline std::size_t SymbolTable::probe(std::string_view name, std::uint64_t hash) const
+{
+    const auto fragment = static_cast<std::uint32_t>(hash);
+    for(std::size_t i = hash & m_mask, slots = 1;; i = (i + 1) & m_mask, ++slots) {
+	const Slot &slot = m_slots[i];
+	if(slot.entry == 0 || (slot.hash == fragment
+			       && m_entries[slot.entry - 1].name == name)) {
+	    stats::lookup(slots, slot.entry != 0);
+	    return i;
+	}
+    }
+}
+
+// Rebuilds the slots at the given capacity, reinserting every entry by its
+// stored hash
+void SymbolTable::rehash(std::size_t slotCount)
+{
+    m_slots.assign(slotCount, Slot{0, 0});
+    m_mask = m_slots.size() - 1;
+    if(m_base != nullptr) {
+	m_prefixes = m_base->m_prefixes;
+    } else {
+	m_prefixes.fill(0);
+    }
+    for(std::size_t index = 0; index < m_entries.size(); ++index) {
+	addPrefix(m_entries[index].name);
+	const std::uint64_t hash = m_entries[index].hash;
+	std::size_t i = hash & m_mask;
+	while(m_slots[i].entry != 0) {
+	    i = (i + 1) & m_mask;
+	}
+	m_slots[i] = {static_cast<std::uint32_t>(hash),
+		      static_cast<std::uint32_t>(index + 1)};
+    }
+}
+
+// Returns the value of the symbol, or nullptr if it isn't defined
+inline const Macro* SymbolTable::find(std::string_view name, std::uint64_t hash) const
+{
+    const Slot &slot = m_slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	return &m_entries[slot.entry - 1].macro;
+    } else if(m_base == nullptr) {
+	return nullptr;
+    }
+    const std::size_t index = m_base->indexOf(name, hash);
+    return index == m_baseSize ? nullptr : &entryAt(index).macro;
+}
+
+inline std::size_t SymbolTable::indexOf(std::string_view name, std::uint64_t hash) const
+{
+    const Slot &slot = m_slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	return m_baseSize + slot.entry - 1;
+    } else if(m_base == nullptr) {
+	return size();
+    }
+    const std::size_t index = m_base->indexOf(name, hash);
+    return index == m_baseSize ? size() : index;
+}
+
+// Sets the value of the symbol and the tokens it's made of, returning true if
+// it was already defined
+bool SymbolTable::define(std::string_view name, std::uint64_t hash, std::string_view value,
+			 const std::vector<BodyToken> &tokens, std::int32_t paramCount)
+{
+    const Macro macro{m_arena.copy(value), static_cast<std::uint32_t>(m_baseTokens + m_tokens.size()),
+		      static_cast<std::uint32_t>(tokens.size()), paramCount};
+    m_tokens.insert(m_tokens.end(), tokens.begin(), tokens.end());
+    ++m_version;
+    Slot &slot = m_slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	m_entries[slot.entry - 1].macro = macro;
+	return true;
+    }
+    if(m_base != nullptr) {
+	if(const std::size_t index = m_base->indexOf(name, hash); index != m_baseSize) {
+	    if(m_shadowIndex.empty()) {
+		m_shadowIndex.assign(m_baseSize, 0);
+	    }
+	    std::uint32_t &shadow = m_shadowIndex[index];
+	    if(shadow == 0) {
+		m_shadows.push_back({m_arena.copy(name), macro, hash});
+		shadow = static_cast<std::uint32_t>(m_shadows.size());
+	    } else {
+		m_shadows[shadow - 1].macro = macro;
+	    }
+	    return true;
+	}
+    }
+    m_entries.push_back({m_arena.copy(name), macro, hash});
+    addPrefix(name);
+    slot = {static_cast<std::uint32_t>(hash),
+	     static_cast<std::uint32_t>(m_entries.size())};
+    // Keep the load factor at or below 1/2 so probe sequences stay short
+    if(m_entries.size() * 2 > m_slots.size()) {
+	rehash(m_slots.size() * 2);
+    }
+    return false;
+}
+
+// Removes the symbol, returning false if it wasn't defined. Later entries
+// move down to fill its place and body tokens that named it go back to
+// naming nothing, as if it had never been defined. That's a pass over the
+// whole table, but symbols are only ever removed from the command line. A
+// layered table is flattened first.
+bool SymbolTable::undefine(std::string_view name, std::uint64_t hash)
+{
+    if(m_base != nullptr) {
+	SymbolTable flat;
+	flat.flattenFrom(*this);
+	flat.m_version = m_version;
+	*this = std::move(flat);
+    }
+    const std::size_t index = indexOf(name, hash);
+    if(index == m_entries.size()) {
+	return false;
+    }
+    m_entries.erase(m_entries.begin() + index);
+    ++m_version;
+    for(BodyToken &token : m_tokens) {
+	if(token.symbol == index) {
+	    token.symbol = NoSymbol;
+	} else if(token.symbol != NoSymbol && token.symbol > index) {
+	    --token.symbol;
+	}
+    }
+    rehash(m_slots.size());
+    return true;
+}
+
+void SymbolTable::clear()
+{
+    m_arena.clear();
+    m_slots.assign(16, Slot{0, 0});
+    m_mask = 15;
+    m_entries.clear();
+    m_tokens.clear();
+    m_prefixes.fill(0);
+    m_base = nullptr;
+    m_baseSize = 0;
+    m_baseTokens = 0;
+    m_shadows.clear();
+    m_shadowIndex.clear();
+    ++m_version;
+}
+
+void SymbolTable::layerOn(const SymbolTable &base)
+{
+    clear();
+    // An empty base would only be an extra probe for every miss
+    if(base.size() == 0) {
+	return;
+    }
+    m_base = &base;
+    m_baseSize = base.size();
+    m_baseTokens = static_cast<std::uint32_t>(base.m_tokens.size());
+    m_prefixes = base.m_prefixes;
+}
+
+void SymbolTable::flattenFrom(const SymbolTable &layered)
+{
+    clear();
+    std::vector<BodyToken> tokens;
+    for(std::size_t i = 0; i < layered.size(); ++i) {
+	const Entry &entry = layered.entryAt(i);
+	const BodyToken *first = layered.tokens(entry.macro);
+	tokens.assign(first, first + entry.macro.tokenCount);
+	define(entry.name, entry.hash, entry.macro.value, tokens, entry.macro.paramCount);
+    }
+}
+
+void SymbolTable::copyFrom(const SymbolTable &base)
+{
+    m_slots = base.m_slots;
+    m_entries = base.m_entries;
+    m_tokens = base.m_tokens;
+    m_mask = base.m_mask;
+    m_version = base.m_version;
+    m_prefixes = base.m_prefixes;
+    m_base = base.m_base;
+    m_baseSize = base.m_baseSize;
+    m_baseTokens = base.m_baseTokens;
+    m_shadows = base.m_shadows;
+    m_shadowIndex = base.m_shadowIndex;
+}
+
+bool SymbolTable::sameAs(const SymbolTable &other) const
+{
+    if(size() != other.size()) {
+	return false;
+    }
+    const auto sameToken = [](const BodyToken &a, const BodyToken &b) {
+	return std::tie(a.state, a.spaceBefore, a.param, a.offset, a.length, a.symbol)
+	    == std::tie(b.state, b.spaceBefore, b.param, b.offset, b.length, b.symbol);
+    };
+    for(std::size_t i = 0; i < size(); ++i) {
+	const Entry &entry = entryAt(i);
+	const Entry &otherEntry = other.entryAt(i);
+	// Both reading through to the same base
+	if(&entry == &otherEntry) {
+	    continue;
+	}
+	const Macro &a = entry.macro;
+	const Macro &b = otherEntry.macro;
+	if(entry.name != otherEntry.name || a.value != b.value
+	   || a.paramCount != b.paramCount
+	   || !std::equal(tokens(a), tokens(a) + a.tokenCount, other.tokens(b),
+			  other.tokens(b) + b.tokenCount, sameToken)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+void SymbolTable::cloneFrom(const SymbolTable &base)
+{
+    copyFrom(base);
+    for(std::vector<Entry> *entries : {&m_entries, &m_shadows}) {
+	for(Entry &entry : *entries) {
+	    entry.name = m_arena.copy(entry.name);
+	    entry.macro.value = m_arena.copy(entry.macro.value);
+	}
+    }
+}
+
+// An image is a header of a hash of the rest and counts and sizes, then the
+// slots, the entries, the body tokens and a pool of every name and value,
+// each laid out just as it is in memory. Loading one is then a few copies and
+// a bounds check per entry and token, with no scanning, hashing or inserting.
+std::string SymbolTable::image() const
+{
+    if(m_base != nullptr) {
+	SymbolTable flat;
+	flat.flattenFrom(*this);
+	return flat.image();
+    }
+    std::string pool;
+    std::vector<StoredEntry> stored;
+    std::vector<BodyToken> tokens;
+    stored.reserve(m_entries.size());
+    for(const Entry &entry : m_entries) {
+	const Macro &macro = entry.macro;
+	StoredEntry out{entry.hash, static_cast<std::uint32_t>(pool.size()),
+			static_cast<std::uint32_t>(entry.name.size()), 0,
+			static_cast<std::uint32_t>(macro.value.size()),
+			static_cast<std::uint32_t>(tokens.size()), macro.tokenCount,
+			macro.paramCount, 0};
+	pool += entry.name;
+	out.value = static_cast<std::uint32_t>(pool.size());
+	pool += macro.value;
+	// Only the tokens of each symbol's latest definition are kept
+	tokens.insert(tokens.end(), m_tokens.begin() + macro.firstToken,
+		      m_tokens.begin() + macro.firstToken + macro.tokenCount);
+	stored.push_back(out);
+    }
+    std::string body;
+    putInteger(body, static_cast<std::uint32_t>(stored.size()));
+    putInteger(body, static_cast<std::uint32_t>(m_slots.size()));
+    putInteger(body, static_cast<std::uint32_t>(tokens.size()));
+    putInteger(body, static_cast<std::uint32_t>(pool.size()));
+    putInteger(body, static_cast<std::uint32_t>(sizeof(StoredEntry)));
+    putInteger(body, static_cast<std::uint32_t>(sizeof(BodyToken)));
+    body.append(reinterpret_cast<const char*>(m_slots.data()), m_slots.size() * sizeof(Slot));
+    body.append(reinterpret_cast<const char*>(stored.data()), stored.size() * sizeof(StoredEntry));
+    body.append(reinterpret_cast<const char*>(tokens.data()), tokens.size() * sizeof(BodyToken));
+    body += pool;
+    std::string image(ImageMagic);
+    putInteger(image, hashText(body));
+    return image + body;
+}
+
+// Replaces the table's contents with those of an image, returning false (and
+// leaving the table as it was) if it isn't a sound one. Names and values are
+// used where they are in image, which must outlive the table. hash is set to
+// the one stored in the image, which stands for its contents without having
+// to read them all again.
+bool SymbolTable::load(std::string_view image, std::uint64_t &hash)
+{
+    EntryReader reader(image);
+    if(reader.bytes(ImageMagic.size()) != ImageMagic) {
+	return false;
+    }
+    const auto storedHash = reader.integer<std::uint64_t>();
+    const auto entryCount = reader.integer<std::uint32_t>();
+    const auto slotCount = reader.integer<std::uint32_t>();
+    const auto tokenCount = reader.integer<std::uint32_t>();
+    const auto poolSize = reader.integer<std::uint32_t>();
+    const auto entrySize = reader.integer<std::uint32_t>();
+    const auto tokenSize = reader.integer<std::uint32_t>();
+    // A different build may not lay things out the same way
+    if(!reader.ok() || entrySize != sizeof(StoredEntry) || tokenSize != sizeof(BodyToken)
+       || slotCount < 16 || (slotCount & (slotCount - 1)) != 0
+       || std::uint64_t(entryCount) * 2 > slotCount) {
+	return false;
+    }
+    const std::string_view slotBytes(reader.bytes(std::size_t(slotCount) * sizeof(Slot)));
+    const std::string_view entryBytes(reader.bytes(std::size_t(entryCount) * sizeof(StoredEntry)));
+    const std::string_view tokenBytes(reader.bytes(std::size_t(tokenCount) * sizeof(BodyToken)));
+    const std::string_view pool(reader.bytes(poolSize));
+    if(!reader.ok()) {
+	return false;
+    }
+    std::vector<Slot> slots(slotCount);
+    std::memcpy(slots.data(), slotBytes.data(), slotBytes.size());
+    std::vector<BodyToken> tokens(tokenCount);
+    if(tokenCount != 0) {
+	std::memcpy(tokens.data(), tokenBytes.data(), tokenBytes.size());
+    }
+    // Everything that's used as an index or offset has to be in range
+    const auto within = [](std::uint64_t start, std::uint64_t length, std::uint64_t limit) {
+	return start + length <= limit;
+    };
+    std::vector<Entry> entries;
+    entries.reserve(entryCount);
+    for(std::uint32_t i = 0; i < entryCount; ++i) {
+	StoredEntry stored;
+	std::memcpy(&stored, entryBytes.data() + std::size_t(i) * sizeof(StoredEntry), sizeof(stored));
+	if(stored.nameLength == 0 || !within(stored.name, stored.nameLength, poolSize)
+	   || !within(stored.value, stored.valueLength, poolSize)
+	   || !within(stored.firstToken, stored.tokenCount, tokenCount)
+	   || stored.paramCount < -1 || stored.paramCount > UINT16_MAX) {
+	    return false;
+	}
+	for(std::uint32_t t = stored.firstToken; t < stored.firstToken + stored.tokenCount; ++t) {
+	    const BodyToken &token = tokens[t];
+	    if(!within(token.offset, token.length, stored.valueLength)
+	       || token.param > std::max(stored.paramCount, 0)
+	       || (token.symbol >= entryCount && token.symbol != NoSymbol)) {
+		return false;
+	    }
+	}
+	entries.push_back({pool.substr(stored.name, stored.nameLength),
+			   {pool.substr(stored.value, stored.valueLength), stored.firstToken,
+			    stored.tokenCount, stored.paramCount},
+			   stored.hash});
+    }
+    // Every entry in exactly one slot under its own hash, which leaves
+    // enough slots empty for every probe to end
+    std::size_t used = 0;
+    std::vector<bool> placed(entryCount, false);
+    for(const Slot &slot : slots) {
+	if(slot.entry == 0) {
+	    continue;
+	} else if(slot.entry > entryCount || placed[slot.entry - 1]
+		  || slot.hash != static_cast<std::uint32_t>(entries[slot.entry - 1].hash)) {
+	    return false;
+	}
+	placed[slot.entry - 1] = true;
+	++used;
+    }
+    if(used != entryCount) {
+	return false;
+    }
+    clear();
+    m_slots = std::move(slots);
+    m_entries = std::move(entries);
+    m_tokens = std::move(tokens);
+    m_mask = slotCount - 1;
+    m_prefixes.fill(0);
+    for(const Entry &entry : m_entries) {
+	addPrefix(entry.name);
+    }
+    ++m_version;
+    hash = storedHash;
+    return true;
+}
+
+// The contents of an input file as one contiguous, read-only range of chars.
+// Regular files are mmap'd; anything that can't be mapped (pipes, FIFOs,
+// character devices) is read in one shot into an owned buffer instead.
+class SourceFile {
+private:
+    void *m_mapping = nullptr;
+    std::size_t m_mappingSize = 0;
+    std::string m_buffer;
+    const char *m_data = nullptr;
+    std::size_t m_size = 0;
+public:
+    SourceFile() = default;
+    ~SourceFile();
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    bool open(const std::string &path);
+    const char* begin() const { return m_data; }
+    const char* end() const { return m_data + m_size; }
+    std::size_t size() const { return m_size; }
+};
+
+SourceFile::~SourceFile()
+{
+    if(m_mapping != nullptr) {
+	munmap(m_mapping, m_mappingSize);
+    }
+}
+
+// Returns false if the file can't be opened or read
+bool SourceFile::open(const std::string &path)
+{
+    const stats::PhaseTimer timer(stats::Phase::Read);
+    const int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+	return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+	void *mapping = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(mapping != MAP_FAILED) {
+	    madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+	    // Have the kernel start reading it all in now rather than as the
+	    // scan faults its way through
+	    madvise(mapping, info.st_size, MADV_WILLNEED);
+	    m_mapping = mapping;
+	    m_mappingSize = info.st_size;
+	    m_data = static_cast<const char*>(mapping);
+	    m_size = m_mappingSize;
+	    close(fd);
+	    return true;
+	}
+    }
+    // Not mappable (e.g. a pipe); fall back to reading everything up front
+    char chunk[64 * 1024];
+    ssize_t count;
+    while((count = read(fd, chunk, sizeof(chunk))) != 0) {
+	if(count < 0) {
+	    close(fd);
+	    return false;
+	}
+	m_buffer.append(chunk, count);
+    }
+    close(fd);
+    m_data = m_buffer.data();
+    m_size = m_buffer.size();
+    return true;
+}
+
+// Somewhere other than a file descriptor for an OutputBuffer to send its
+// output, for code that uses the preprocessor as a library. It's handed
+// big chunks at a time.
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    // Returns false if it couldn't take the text
+    virtual bool write(std::string_view text) = 0;
+};
+
+// Overlapped I/O for streamed input and for output to a descriptor, so that
+// reading, preprocessing and writing run at once and a run takes about as
+// long as the slowest of them rather than all three added up. Each side has
+// two ways of doing it: io_uring, where the kernel has it, and otherwise a
+// thread of its own, handing blocks over through a pair of SpscQueues.
+namespace io {
+    // Blocks read or written at a time
+    constexpr std::size_t BlockSize = 64 * 1024;
+
+    // Whether handing I/O to a thread of its own can overlap it with the
+    // rest of the work; on a single core, it only adds context switches
+    bool threadsOverlap()
+    {
+	return std::thread::hardware_concurrency() > 1;
+    }
+
+    // A fixed-size queue between exactly one producer thread and one
+    // consumer thread. Pushing and popping are lock-free; a side that finds
+    // the queue full (or empty) spins for a moment, then sleeps until the
+    // other side has moved.
+    template<typename T, std::size_t Size>
+    class SpscQueue {
+    private:
+	std::array<T, Size> m_items;
+	// Every item ever popped and pushed, so the difference is the
+	// number queued. Kept apart so the two sides don't share a line.
+	alignas(64) std::atomic<std::size_t> m_head{0};
+	alignas(64) std::atomic<std::size_t> m_tail{0};
+	// Only used once a side has to sleep, which at most one can be
+	std::mutex m_mutex;
+	std::condition_variable m_moved;
+	std::atomic<bool> m_sleeping{false};
+	template<typename Ready>
+	void await(const Ready &ready)
+	{
+	    for(int i = 0; i < 64; ++i) {
+		if(ready()) return;
+		std::this_thread::yield();
+	    }
+	    std::unique_lock<std::mutex> lock(m_mutex);
+	    m_sleeping = true;
+	    m_moved.wait(lock, ready);
+	    m_sleeping = false;
+	}
+	void wake()
+	{
+	    if(m_sleeping) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_moved.notify_one();
+	    }
+	}
+    public:
+	void push(T item)
+	{
+	    const std::size_t tail = m_tail.load(std::memory_order_relaxed);
+	    await([&]() { return tail - m_head < Size; });
+	    m_items[tail % Size] = item;
+	    m_tail = tail + 1;
+	    wake();
+	}
+	T pop()
+	{
+	    const std::size_t head = m_head.load(std::memory_order_relaxed);
+	    await([&]() { return m_tail != head; });
+	    T item = m_items[head % Size];
+	    m_head = head + 1;
+	    wake();
+	    return item;
+	}
+	bool tryPop(T &item)
+	{
+	    const std::size_t head = m_head.load(std::memory_order_relaxed);
+	    if(m_tail == head) {
+		return false;
+	    }
+	    item = m_items[head % Size];
+	    m_head = head + 1;
+	    wake();
+	    return true;
+	}
+    };
+
+    // A block handed from one side to the other: where it is and how much of
+    // it is filled, or for input, the result of the read
+    struct Block {
+	char *data;
+	ssize_t size;
+    };
+
+#ifdef HAVE_IO_URING
+    // Just enough of io_uring to keep one read or write of a descriptor in
+    // flight at a time, through the raw system calls. Reads and writes go
+    // from the descriptor's current position, as with read() and write().
+    class Ring {
+    private:
+	int m_fd = -1;
+	void *m_rings = MAP_FAILED;
+	std::size_t m_ringsSize = 0;
+	void *m_completions = MAP_FAILED;
+	std::size_t m_completionsSize = 0;
+	io_uring_sqe *m_entries = static_cast<io_uring_sqe*>(MAP_FAILED);
+	std::size_t m_entriesSize = 0;
+	unsigned *m_sqHead = nullptr;
+	unsigned *m_sqTail = nullptr;
+	unsigned *m_sqMask = nullptr;
+	unsigned *m_sqArray = nullptr;
+	unsigned m_sqSize = 0;
+	unsigned *m_cqHead = nullptr;
+	unsigned *m_cqTail = nullptr;
+	unsigned *m_cqMask = nullptr;
+	io_uring_cqe *m_cqes = nullptr;
+	iovec m_vector{};
+    public:
+	Ring() = default;
+	~Ring();
+	Ring(const Ring&) = delete;
+	Ring& operator=(const Ring&) = delete;
+	// False if the kernel has no io_uring, won't let it be used, or is too
+	// old to read and write from the current position
+	bool open();
+	// Starts reading into (or writing from) size bytes at data
+	bool submit(std::uint8_t opcode, int fd, char *data, std::size_t size);
+	// Waits for the operation to finish; its result is as read() or
+	// write() would return it, with -errno for an error
+	bool complete(int &result);
+	// Stops the operation in flight, if it hasn't finished, and waits
+	// until the kernel is done with its buffer
+	void cancel();
+    };
+
+    Ring::~Ring()
+    {
+	if(m_entries != MAP_FAILED) munmap(m_entries, m_entriesSize);
+	if(m_completions != MAP_FAILED) munmap(m_completions, m_completionsSize);
+	if(m_rings != MAP_FAILED) munmap(m_rings, m_ringsSize);
+	if(m_fd >= 0) close(m_fd);
+    }
+
+    bool Ring::open()
+    {
+	io_uring_params params{};
+	m_fd = static_cast<int>(syscall(__NR_io_uring_setup, 2, &params));
+	if(m_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS)) {
+	    return false;
+	}
+	m_ringsSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_completionsSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	const bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+	if(single) {
+	    m_ringsSize = std::max(m_ringsSize, m_completionsSize);
+	}
+	m_rings = mmap(nullptr, m_ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       m_fd, IORING_OFF_SQ_RING);
+	if(m_rings == MAP_FAILED) {
+	    return false;
+	}
+	char *completions = static_cast<char*>(m_rings);
+	if(!single) {
+	    m_completions = mmap(nullptr, m_completionsSize, PROT_READ | PROT_WRITE,
+				 MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+	    if(m_completions == MAP_FAILED) {
+		return false;
+	    }
+	    completions = static_cast<char*>(m_completions);
+	}
+	m_entriesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_entries = static_cast<io_uring_sqe*>(mmap(nullptr, m_entriesSize,
+						    PROT_READ | PROT_WRITE,
+						    MAP_SHARED | MAP_POPULATE, m_fd,
+						    IORING_OFF_SQES));
+	if(m_entries == MAP_FAILED) {
+	    return false;
+	}
+	char *rings = static_cast<char*>(m_rings);
+	m_sqHead = reinterpret_cast<unsigned*>(rings + params.sq_off.head);
+	m_sqTail = reinterpret_cast<unsigned*>(rings + params.sq_off.tail);
+	m_sqMask = reinterpret_cast<unsigned*>(rings + params.sq_off.ring_mask);
+	m_sqArray = reinterpret_cast<unsigned*>(rings + params.sq_off.array);
+	m_sqSize = params.sq_entries;
+	m_cqHead = reinterpret_cast<unsigned*>(completions + params.cq_off.head);
+	m_cqTail = reinterpret_cast<unsigned*>(completions + params.cq_off.tail);
+	m_cqMask = reinterpret_cast<unsigned*>(completions + params.cq_off.ring_mask);
+	m_cqes = reinterpret_cast<io_uring_cqe*>(completions + params.cq_off.cqes);
+	return true;
+    }
+
+    bool Ring::submit(std::uint8_t opcode, int fd, char *data, std::size_t size)
+    {
+	// The kernel only reads the tail and only writes the head
+	const unsigned tail = *m_sqTail;
+	if(tail - __atomic_load_n(m_sqHead, __ATOMIC_ACQUIRE) >= m_sqSize) {
+	    return false;
+	}
+	const unsigned index = tail & *m_sqMask;
+	io_uring_sqe &entry = m_entries[index];
+	std::memset(&entry, 0, sizeof(entry));
+	m_vector = {data, size};
+	entry.opcode = opcode;
+	entry.fd = fd;
+	entry.addr = reinterpret_cast<std::uint64_t>(&m_vector);
+	entry.len = 1;
+	entry.off = static_cast<std::uint64_t>(-1);
+	entry.user_data = opcode;
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	long submitted;
+	do {
+	    submitted = syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0);
+	} while(submitted < 0 && errno == EINTR);
+	return submitted == 1;
+    }
+
+    bool Ring::complete(int &result)
+    {
+	while(true) {
+	    const unsigned head = *m_cqHead;
+	    if(head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+		const io_uring_cqe &completion = m_cqes[head & *m_cqMask];
+		const bool cancel = completion.user_data == IORING_OP_ASYNC_CANCEL;
+		result = completion.res;
+		__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+		// The outcome of a cancel() isn't anyone's business
+		if(cancel) continue;
+		return true;
+	    }
+	    if(syscall(__NR_io_uring_enter, m_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0) < 0
+	       && errno != EINTR) {
+		return false;
+	    }
+	}
+    }
+
+    void Ring::cancel()
+    {
+	const unsigned tail = *m_sqTail;
+	const unsigned index = tail & *m_sqMask;
+	io_uring_sqe &entry = m_entries[index];
+	std::memset(&entry, 0, sizeof(entry));
+	entry.opcode = IORING_OP_ASYNC_CANCEL;
+	entry.fd = -1;
+	// Whatever is in flight was tagged with its opcode
+	entry.addr = IORING_OP_READV;
+	entry.user_data = IORING_OP_ASYNC_CANCEL;
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	syscall(__NR_io_uring_enter, m_fd, 1, 0, 0, nullptr, 0);
+	int result;
+	complete(result);
+    }
+#endif
+
+    // Reads a descriptor ahead of whoever is using it, a block at a time,
+    // so the next block is on its way while the last one is being used
+    class Reader {
+    private:
+	static constexpr std::size_t BlockCount = 4;
+	int m_fd;
+	std::array<std::unique_ptr<char[]>, BlockCount> m_blocks;
+	// The block next() last returned, if it's still out
+	char *m_current = nullptr;
+	bool m_done = false;
+	// Whether reads are just done in next()
+	bool m_direct = false;
+#ifdef HAVE_IO_URING
+	std::unique_ptr<Ring> m_ring;
+	std::size_t m_reading = 0;
+#endif
+	// Otherwise, the thread reading, blocks free to read into and blocks
+	// read, and a pipe that tells the thread to stop waiting for input
+	std::thread m_thread;
+	SpscQueue<char*, BlockCount> m_free;
+	SpscQueue<Block, BlockCount> m_full;
+	std::atomic<bool> m_finished{false};
+	int m_stop[2] = {-1, -1};
+	void readBlocks();
+    public:
+	explicit Reader(int fd);
+	~Reader();
+	Reader(const Reader&) = delete;
+	Reader& operator=(const Reader&) = delete;
+	// The next input read, which stays valid until the next call. Empty
+	// at the end of the input; false on a read error.
+	bool next(std::string_view &block);
+    };
+
+    Reader::Reader(int fd) : m_fd(fd)
+    {
+	for(auto &block : m_blocks) {
+	    block.reset(new char[BlockSize]);
+	}
+#ifdef HAVE_IO_URING
+	m_ring = std::make_unique<Ring>();
+	if(m_ring->open() && m_ring->submit(IORING_OP_READV, m_fd, m_blocks[0].get(), BlockSize)) {
+	    return;
+	}
+	m_ring.reset();
+#endif
+	if(!threadsOverlap()) {
+	    m_direct = true;
+	    return;
+	}
+	if(pipe(m_stop) != 0) {
+	    m_stop[0] = m_stop[1] = -1;
+	}
+	for(auto &block : m_blocks) {
+	    m_free.push(block.get());
+	}
+	m_thread = std::thread(&Reader::readBlocks, this);
+    }
+
+    Reader::~Reader()
+    {
+#ifdef HAVE_IO_URING
+	if(m_ring != nullptr) {
+	    if(!m_done) {
+		m_ring->cancel();
+	    }
+	    return;
+	}
+#endif
+	if(m_direct) {
+	    return;
+	}
+	// The thread may be waiting for input, or for a block to read into
+	if(m_stop[1] >= 0) {
+	    const char stop = 0;
+	    while(write(m_stop[1], &stop, 1) < 0 && errno == EINTR) {}
+	}
+	Block block;
+	while(!m_finished) {
+	    if(m_full.tryPop(block)) {
+		m_free.push(block.data);
+	    } else {
+		std::this_thread::yield();
+	    }
+	}
+	m_thread.join();
+	for(const int fd : m_stop) {
+	    if(fd >= 0) close(fd);
+	}
+    }
+
+    void Reader::readBlocks()
+    {
+	while(true) {
+	    char *block = m_free.pop();
+	    pollfd waits[2] = {{m_fd, POLLIN, 0}, {m_stop[0], POLLIN, 0}};
+	    int ready;
+	    do {
+		ready = poll(waits, m_stop[0] >= 0 ? 2 : 1, -1);
+	    } while(ready < 0 && errno == EINTR);
+	    if(waits[1].revents != 0) {
+		break;
+	    }
+	    ssize_t count;
+	    do {
+		count = read(m_fd, block, BlockSize);
+	    } while(count < 0 && errno == EINTR);
+	    m_full.push({block, count});
+	    if(count <= 0) {
+		break;
+	    }
+	}
+	m_finished = true;
+    }
+
+    bool Reader::next(std::string_view &block)
+    {
+	block = {};
+	if(m_done) {
+	    return true;
+	}
+#ifdef HAVE_IO_URING
+	if(m_ring != nullptr) {
+	    int result;
+	    do {
+		if(!m_ring->complete(result)) {
+		    result = -EIO;
+		} else if((result == -EINTR || result == -EAGAIN)
+			  && !m_ring->submit(IORING_OP_READV, m_fd, m_blocks[m_reading].get(),
+					     BlockSize)) {
+		    result = -EIO;
+		}
+	    } while(result == -EINTR || result == -EAGAIN);
+	    if(result <= 0) {
+		m_done = true;
+		return result == 0;
+	    }
+	    // Two blocks take turns: one being read into, one being used
+	    char *read = m_blocks[m_reading].get();
+	    m_reading ^= 1;
+	    if(!m_ring->submit(IORING_OP_READV, m_fd, m_blocks[m_reading].get(), BlockSize)) {
+		m_done = true;
+		return false;
+	    }
+	    block = std::string_view(read, result);
+	    return true;
+	}
+#endif
+	if(m_direct) {
+	    ssize_t count;
+	    do {
+		count = read(m_fd, m_blocks[0].get(), BlockSize);
+	    } while(count < 0 && errno == EINTR);
+	    if(count <= 0) {
+		m_done = true;
+		return count == 0;
+	    }
+	    block = std::string_view(m_blocks[0].get(), count);
+	    return true;
+	}
+	if(m_current != nullptr) {
+	    m_free.push(m_current);
+	}
+	const Block read = m_full.pop();
+	m_current = read.data;
+	if(read.size <= 0) {
+	    m_done = true;
+	    return read.size == 0;
+	}
+	block = std::string_view(read.data, read.size);
+	return true;
+    }
+
+    // Writes blocks out to a descriptor behind whoever is filling them,
+    // which swaps each full block for an empty one rather than waiting for
+    // it to be written
+    class Writer {
+    private:
+	static constexpr std::size_t SpareCount = 3;
+	int m_fd;
+	std::size_t m_blockSize;
+	std::atomic<bool> m_failed{false};
+	// Whether blocks are just written in submit()
+	bool m_direct = false;
+	// Blocks swapped out and not back yet, and ones that are back but
+	// haven't been needed
+	std::size_t m_out = 0;
+	std::vector<char*> m_spares;
+#ifdef HAVE_IO_URING
+	std::unique_ptr<Ring> m_ring;
+	Block m_writing{nullptr, 0};
+	void finishWrite();
+#endif
+	// Otherwise, the thread writing, blocks to write, and blocks written
+	std::thread m_thread;
+	SpscQueue<Block, SpareCount + 1> m_full;
+	SpscQueue<char*, SpareCount + 1> m_free;
+	void writeBlocks();
+	void writeOut(const char *data, std::size_t size);
+    public:
+	Writer(int fd, std::size_t blockSize);
+	~Writer();
+	Writer(const Writer&) = delete;
+	Writer& operator=(const Writer&) = delete;
+	// Queues the first size bytes of block to be written, and returns an
+	// empty block of the same size to fill next
+	char* submit(char *block, std::size_t size);
+	// Waits until everything submitted has been written
+	void drain();
+	// Whether any write has failed
+	bool failed() const { return m_failed; }
+    };
+
+    Writer::Writer(int fd, std::size_t blockSize) : m_fd(fd), m_blockSize(blockSize)
+    {
+#ifdef HAVE_IO_URING
+	m_ring = std::make_unique<Ring>();
+	if(m_ring->open()) {
+	    // Only one block is ever being written
+	    m_spares.push_back(new char[m_blockSize]);
+	    return;
+	}
+	m_ring.reset();
+#endif
+	if(!threadsOverlap()) {
+	    m_direct = true;
+	    return;
+	}
+	for(std::size_t i = 0; i < SpareCount; ++i) {
+	    m_spares.push_back(new char[m_blockSize]);
+	}
+	m_thread = std::thread(&Writer::writeBlocks, this);
+    }
+
+    Writer::~Writer()
+    {
+	drain();
+	if(m_thread.joinable()) {
+	    m_full.push({nullptr, 0});
+	    m_thread.join();
+	}
+	for(char *block : m_spares) {
+	    delete[] block;
+	}
+    }
+
+    // Writes all of data, setting m_failed if it can't
+    void Writer::writeOut(const char *data, std::size_t size)
+    {
+	while(size > 0 && !m_failed) {
+	    const ssize_t count = ::write(m_fd, data, size);
+	    if(count < 0) {
+		if(errno == EINTR) continue;
+		m_failed = true;
+		return;
+	    }
+	    data += count;
+	    size -= count;
+	}
+    }
+
+    void Writer::writeBlocks()
+    {
+	while(true) {
+	    const Block block = m_full.pop();
+	    if(block.data == nullptr) {
+		return;
+	    }
+	    writeOut(block.data, block.size);
+	    m_free.push(block.data);
+	}
+    }
+
+#ifdef HAVE_IO_URING
+    // Waits for the block being written to be done with, finishing it off
+    // if the kernel only took part of it
+    void Writer::finishWrite()
+    {
+	std::size_t written = 0;
+	while(m_writing.data != nullptr) {
+	    int result;
+	    if(!m_ring->complete(result)) {
+		result = -EIO;
+	    }
+	    if(result > 0) {
+		written += result;
+	    }
+	    if(result == 0 || (result < 0 && result != -EINTR && result != -EAGAIN)) {
+		m_failed = true;
+	    } else if(written < static_cast<std::size_t>(m_writing.size)) {
+		if(m_ring->submit(IORING_OP_WRITEV, m_fd, m_writing.data + written,
+				  m_writing.size - written)) {
+		    continue;
+		}
+		writeOut(m_writing.data + written, m_writing.size - written);
+	    }
+	    m_spares.push_back(m_writing.data);
+	    m_writing = {nullptr, 0};
+	    --m_out;
+	}
+    }
+#endif
+
+    char* Writer::submit(char *block, std::size_t size)
+    {
+	++m_out;
+#ifdef HAVE_IO_URING
+	if(m_ring != nullptr) {
+	    finishWrite();
+	    if(m_failed) {
+		m_spares.push_back(block);
+		--m_out;
+	    } else if(m_ring->submit(IORING_OP_WRITEV, m_fd, block, size)) {
+		m_writing = {block, static_cast<ssize_t>(size)};
+	    } else {
+		writeOut(block, size);
+		m_spares.push_back(block);
+		--m_out;
+	    }
+	    char *next = m_spares.back();
+	    m_spares.pop_back();
+	    return next;
+	}
+#endif
+	if(m_direct) {
+	    --m_out;
+	    writeOut(block, size);
+	    return block;
+	}
+	m_full.push({block, static_cast<ssize_t>(size)});
+	if(m_spares.empty()) {
+	    m_spares.push_back(m_free.pop());
+	    --m_out;
+	}
+	char *next = m_spares.back();
+	m_spares.pop_back();
+	return next;
+    }
+
+    void Writer::drain()
+    {
+#ifdef HAVE_IO_URING
+	if(m_ring != nullptr) {
+	    finishWrite();
+	    return;
+	}
+#endif
+	for(; m_out > 0; --m_out) {
+	    m_spares.push_back(m_free.pop());
+	}
+    }
+}
+
+// How output is laid out. Tokens is each token as it was scanned, with a
+// space after every identifier. Preserve is the input as it was written,
+// spacing and comments and all, less its directives and skipped lines and
+// with its macros replaced, so the parts nothing happened to go out as they
+// are, a run at a time. Minify is Tokens with every space that doesn't keep
+// two tokens apart, and every blank line, taken out.
+enum class Whitespace { Tokens, Preserve, Minify };
+
+// Chars that run together into one word (a name, a number, or the prefix or
+// suffix on a literal) when nothing separates them
+constexpr std::array<bool,256> makeWordTable()
+{
+    std::array<bool,256> table{};
+    for(int c = 0; c < 256; ++c) {
+	table[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+	    || c == '_' || c == '.' || c == '$' || c >= 0x80;
+    }
+    return table;
+}
+
+constexpr auto wordTable = makeWordTable();
+
+// Whether a space between a and b keeps them from running together into
+// something else without it: another token, or a prefix or suffix on a
+// literal
+inline bool separates(char a, char b)
+{
+    const auto word = [](char c) { return wordTable[static_cast<unsigned char>(c)]; };
+    if(word(a)) {
+	// The sign of an exponent, as far as can be told from here
+	const bool exponent = a == 'e' || a == 'E' || a == 'p' || a == 'P';
+	return word(b) || b == '"' || b == '\'' || (exponent && (b == '+' || b == '-'));
+    } else if(a == '"' || a == '\'') {
+	return word(b);
+    }
+    switch(a) {
+    case '+': return b == '+' || b == '=';
+    case '-': return b == '-' || b == '=' || b == '>';
+    case '&': return b == '&' || b == '=';
+    case '|': return b == '|' || b == '=';
+    case '<': return b == '<' || b == '=' || b == ':' || b == '%';
+    case '>': return b == '>' || b == '=';
+    case '/': return b == '/' || b == '*' || b == '=';
+    case '*': return b == '/' || b == '=';
+    case '%': return b == '>' || b == ':' || b == '=';
+    case ':': return b == ':' || b == '>';
+    case '#': return b == '#';
+    case '=': case '!': case '^': return b == '=';
+    default: return false;
+    }
+}
+
+// Chars that a run of minified output can be copied straight through up to:
+// anything but blanks, newlines and quotes
+constexpr std::array<bool,256> makePlainTable()
+{
+    std::array<bool,256> table{};
+    for(auto &plain : table) plain = true;
+    for(const char c : {' ', '\t', '\n', '\r', '\f', '\v', '"', '\''}) {
+	table[static_cast<unsigned char>(c)] = false;
+    }
+    return table;
+}
+
+constexpr auto plainTable = makePlainTable();
+
+// Collects output in a large buffer and hands it to the OS (or a sink) in
+// big chunks, bypassing iostreams entirely. Flushed when full and on
+// destruction.
+class OutputBuffer {
+private:
+    static constexpr std::size_t Capacity = 256 * 1024;
+    int m_fd = -1;
+    OutputSink *m_sink = nullptr;
+    std::size_t m_size = 0;
+    char *m_data;
+    bool m_failed = false;
+    std::string *m_copy = nullptr;
+    // Set by writeBehind()
+    std::unique_ptr<io::Writer> m_writer;
+    // With Whitespace::Minify, what's been written so far: its last char
+    // that isn't a blank, whether blanks have come since, and the quote of
+    // the literal it ends inside, if any
+    bool m_minify = false;
+    char m_last = '\n';
+    bool m_blank = false;
+    char m_quote = 0;
+    bool m_escaped = false;
+    void writeAll(const char *data, std::size_t size);
+    void stopWriter();
+    void append(std::string_view text);
+    void writeMinified(std::string_view text);
+public:
+    explicit OutputBuffer(int fd) : m_fd(fd), m_data(new char[Capacity]) {}
+    explicit OutputBuffer(OutputSink &sink) : m_sink(&sink), m_data(new char[Capacity]) {}
+    ~OutputBuffer() { flush(); stopWriter(); delete[] m_data; }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    void put(char c);
+    void write(std::string_view text);
+    void flush();
+    // From now on, has each full buffer written out in the background while
+    // the next one fills, rather than waiting for it. Only for a descriptor;
+    // stops at redirect().
+    void writeBehind();
+    // Flushes what's buffered for the old descriptor, then starts on fd
+    void redirect(int fd);
+    // The same, but starts on sink, which takes the place of any descriptor
+    // until the next redirect
+    void redirect(OutputSink &sink)
+    {
+	redirect(-1);
+	m_sink = &sink;
+    }
+    // Minify is done here, on whatever is written; Preserve is up to the
+    // writer
+    void setWhitespace(Whitespace whitespace) { m_minify = whitespace == Whitespace::Minify; }
+    // Whether any write to the current descriptor has failed
+    bool failed() const { return m_failed; }
+    // Flushes, and waits for anything being written in the background to
+    // be done; false if any write to the current descriptor failed
+    bool finish()
+    {
+	flush();
+	stopWriter();
+	return !m_failed;
+    }
+    // Until called again with nullptr, also appends everything written to
+    // copy, which is all that's kept if the descriptor is -1. Whatever is
+    // buffered is flushed first, so it goes in whole.
+    void capture(std::string *copy) { flush(); m_copy = copy; }
+};
+
+void OutputBuffer::writeAll(const char *data, std::size_t size)
+{
+    const stats::PhaseTimer timer(stats::Phase::Write);
+    stats::output(size);
+    if(m_copy != nullptr) {
+	m_copy->append(data, size);
+    }
+    if(m_sink != nullptr) {
+	if(size > 0 && !m_sink->write(std::string_view(data, size))) {
+	    m_failed = true;
+	}
+	return;
+    }
+    // Nowhere to write but the copy
+    if(m_fd < 0) {
+	return;
+    }
+    // Anything written in the background has to go out first
+    if(m_writer != nullptr) {
+	m_writer->drain();
+    }
+    while(size > 0) {
+	const ssize_t count = ::write(m_fd, data, size);
+	if(count < 0) {
+	    if(errno == EINTR) continue;
+	    std::cerr << "Error: failed to write output\n";
+	    m_failed = true;
+	    return;
+	}
+	data += count;
+	size -= count;
+    }
+}
+
+inline void OutputBuffer::put(char c)
+{
+    if(m_minify) {
+	writeMinified(std::string_view(&c, 1));
+	return;
+    }
+    if(m_size == Capacity) flush();
+    m_data[m_size++] = c;
+}
+
+inline void OutputBuffer::write(std::string_view text)
+{
+    if(m_minify) {
+	writeMinified(text);
+	return;
+    }
+    append(text);
+}
+
+inline void OutputBuffer::append(std::string_view text)
+{
+    if(text.size() > Capacity - m_size) {
+	flush();
+	// Too big to be worth copying; send it straight through
+	if(text.size() >= Capacity) {
+	    writeAll(text.data(), text.size());
+	    return;
+	}
+    }
+    std::memcpy(m_data + m_size, text.data(), text.size());
+    m_size += text.size();
+}
+
+void OutputBuffer::flush()
+{
+    // A copy being kept means the buffer has to stay put until it's made
+    if(m_writer != nullptr && m_copy == nullptr) {
+	if(m_size > 0) {
+	    const stats::PhaseTimer timer(stats::Phase::Write);
+	    stats::output(m_size);
+	    m_data = m_writer->submit(m_data, m_size);
+	}
+	if(m_writer->failed() && !m_failed) {
+	    std::cerr << "Error: failed to write output\n";
+	    m_failed = true;
+	}
+    } else {
+	writeAll(m_data, m_size);
+    }
+    m_size = 0;
+}
+
+// Leaves out blanks at the start and end of lines, blank lines, and blanks
+// elsewhere that separates() says aren't needed, making what's left of each
+// run of blanks a single space. Literals are copied as they are.
+void OutputBuffer::writeMinified(std::string_view text)
+{
+    std::size_t i = 0;
+    while(i < text.size()) {
+	const char c = text[i];
+	std::size_t next = i + 1;
+	if(m_quote != 0) {
+	    // As far as the end of the literal, or of its line
+	    for(next = i; next < text.size(); ) {
+		const char d = text[next++];
+		if(m_escaped) {
+		    m_escaped = false;
+		} else if(d == '\\') {
+		    m_escaped = true;
+		} else if(d == m_quote || d == '\n') {
+		    m_quote = 0;
+		    m_escaped = false;
+		    break;
+		}
+	    }
+	} else if(c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+	    m_blank = true;
+	    i = next;
+	    continue;
+	} else if(c == '\n') {
+	    m_blank = false;
+	    if(m_last == '\n') {
+		i = next;
+		continue;
+	    }
+	} else {
+	    if(m_blank && m_last != '\n' && separates(m_last, c)) {
+		append(" ");
+	    }
+	    m_blank = false;
+	    if(c == '"' || c == '\'') {
+		m_quote = c;
+	    } else {
+		// The rest of the run that needs nothing done to it
+		while(next < text.size() && plainTable[static_cast<unsigned char>(text[next])]) {
+		    ++next;
+		}
+	    }
+	}
+	append(text.substr(i, next - i));
+	m_last = text[next - 1];
+	i = next;
+    }
+}
+
+void OutputBuffer::redirect(int fd)
+{
+    flush();
+    stopWriter();
+    m_fd = fd;
+    m_sink = nullptr;
+    m_failed = false;
+    // A new file starts on a new line
+    m_last = '\n';
+    m_blank = false;
+    m_quote = 0;
+    m_escaped = false;
+}
+
+void OutputBuffer::writeBehind()
+{
+    if(m_writer == nullptr && m_sink == nullptr && m_fd >= 0) {
+	m_writer = std::make_unique<io::Writer>(m_fd, Capacity);
+    }
+}
+
+// Waits for everything written in the background and goes back to writing
+// directly
+void OutputBuffer::stopWriter()
+{
+    if(m_writer == nullptr) {
+	return;
+    }
+    m_writer->drain();
+    if(m_writer->failed() && !m_failed) {
+	std::cerr << "Error: failed to write output\n";
+	m_failed = true;
+    }
+    m_writer.reset();
+}
+
+// Tokenizes a view of some source text, which must outlive it, following
+// the rules of dialect D
+template<typename D>
+class BasicScanner {
+private:
+    const char *m_curr;
+    const char *m_end;
+    // Where diagnostics go; nullptr to drop them
+    std::ostream *m_log = &std::cerr;
+    // Set once a read is attempted past the end of the input, mirroring
+    // the failbit of a stream
+    bool m_fail = false;
+    // Set on errors that stop the whole input from being processed
+    bool m_error = false;
+    // Whether the source holds the rest of the input or only what's been
+    // read of it so far, and if the latter, whether a read ran past it
+    bool m_complete = true;
+    bool m_needsMore = false;
+    // Text of the token being built. It stays a span of the source for as
+    // long as the token is a contiguous run of it, and is only copied into
+    // m_scratch once a skipped or rewritten char makes that impossible
+    const char *m_textBegin;
+    std::size_t m_textSize;
+    bool m_textOwned;
+    std::string m_scratch;
+    int get();
+    int peek();
+    void ignore();
+    void putback();
+    void endReached();
+    // An error found past the end of an incomplete source isn't final yet
+    void fatal() { m_fail = true; m_error = !m_needsMore; }
+    void report(const char *message) { if(m_log != nullptr) *m_log << message; }
+    void keepChar();
+    void keepRun(const char *runEnd);
+    void appendChar(char c);
+    std::string_view text() const;
+    void skipLineComment();
+public:
+    explicit BasicScanner(std::string_view source);
+    // Starts over on a new source. If complete is false, the source is just
+    // the input read so far; see needsMore().
+    void reset(std::string_view source, bool complete);
+    void setLog(std::ostream *log) { m_log = log; }
+    // Where the next token or line will be read from, and where the source
+    // ends
+    const char* position() const { return m_curr; }
+    const char* end() const { return m_end; }
+    // Continues scanning from pos, which must lie within the source
+    void seek(const char *pos);
+    bool hasNext() const { return !m_fail; }
+    // Whether scanning ran off the end of an incomplete source. The tokens
+    // and lines read since the last step began are then unreliable, and the
+    // step should be redone from there once the source has more input.
+    bool needsMore() const { return m_needsMore; }
+    // Whether the input couldn't be read or had a fatal error; once this is
+    // set, hasNext() is false and the token stream ends
+    bool hadError() const { return m_error; }
+    std::string_view nextLine();
+    const Token nextToken();
+};
+
+template<typename D>
+BasicScanner<D>::BasicScanner(std::string_view source)
+    : m_curr(source.data()), m_end(source.data() + source.size())
+{
+}
+
+template<typename D>
+void BasicScanner<D>::reset(std::string_view source, bool complete)
+{
+    m_curr = source.data();
+    m_end = source.data() + source.size();
+    m_complete = complete;
+    m_fail = m_error = m_needsMore = false;
+}
+
+template<typename D>
+void BasicScanner<D>::seek(const char *pos)
+{
+    m_curr = pos;
+    m_fail = m_error = m_needsMore = false;
+}
+
+template<typename D>
+inline int BasicScanner<D>::get()
+{
+    if(m_curr == m_end) {
+	endReached();
+	return EOF;
+    }
+    return static_cast<unsigned char>(*m_curr++);
+}
+
+template<typename D>
+inline int BasicScanner<D>::peek()
+{
+    if(m_curr == m_end) {
+	if(!m_complete) m_needsMore = true;
+	return EOF;
+    }
+    return static_cast<unsigned char>(*m_curr);
+}
+
+template<typename D>
+inline void BasicScanner<D>::ignore()
+{
+    if(m_curr < m_end) {
+	++m_curr;
+    } else if(!m_complete) {
+	m_needsMore = true;
+    }
+}
+
+// Called when a read runs past the end of the source. If the source is only
+// the part of the input read so far, the current step can't be finished yet
+// and has to be redone once more input has been read.
+template<typename D>
+inline void BasicScanner<D>::endReached()
+{
+    m_fail = true;
+    if(!m_complete) m_needsMore = true;
+}
+
+// Un-reads the last char returned by get(); a no-op once the end was reached
+template<typename D>
+inline void BasicScanner<D>::putback()
+{
+    if(!m_fail) --m_curr;
+}
+
+// Adds the char most recently returned by get() to the token text
+template<typename D>
+inline void BasicScanner<D>::keepChar()
+{
+    const char *pos = m_curr - 1;
+    if(m_textOwned) {
+	m_scratch += *pos;
+    } else if(m_textSize == 0) {
+	m_textBegin = pos;
+	m_textSize = 1;
+    } else if(m_textBegin + m_textSize == pos) {
+	++m_textSize;
+    } else {
+	// Some chars were skipped since the token started; no longer a span
+	m_scratch.assign(m_textBegin, m_textSize);
+	m_scratch += *pos;
+	m_textOwned = true;
+    }
+}
+
+// Adds the chars from the current position up to runEnd to the token text,
+// consuming them. Only called right after keepChar(), so the text is either
+// owned or a span ending at the current position.
+template<typename D>
+inline void BasicScanner<D>::keepRun(const char *runEnd)
+{
+    if(m_textOwned) {
+	m_scratch.append(m_curr, runEnd - m_curr);
+    } else {
+	m_textSize += runEnd - m_curr;
+    }
+    m_curr = runEnd;
+}
+
+// Adds a char that doesn't appear in the source to the token text
+template<typename D>
+void BasicScanner<D>::appendChar(char c)
+{
+    if(!m_textOwned) {
+	m_scratch.assign(m_textBegin, m_textSize);
+	m_textOwned = true;
+    }
+    m_scratch += c;
+}
+
+// Skips a `//` comment, whose first `/` was just read, up to the newline that
+// ends it
+template<typename D>
+void BasicScanner<D>::skipLineComment()
+{
+    const char *lineEnd = static_cast<const char*>(std::memchr(m_curr, '\n', m_end - m_curr));
+    m_curr = lineEnd != nullptr ? lineEnd : m_end;
+    // The comment might go on past what's been read so far
+    peek();
+}
+
+template<typename D>
+inline std::string_view BasicScanner<D>::text() const
+{
+    return m_textOwned ? std::string_view(m_scratch)
+	: std::string_view(m_textBegin, m_textSize);
+}
+
+template<typename D>
+std::string_view BasicScanner<D>::nextLine()
+{
+    // Same semantics as std::getline: the newline is consumed but not kept,
+    // and trying to read a line at the very end of input is a failure
+    const stats::PhaseTimer timer(stats::Phase::Scan);
+    if(m_curr == m_end) {
+	endReached();
+	return {};
+    }
+    const char *lineEnd = static_cast<const char*>(std::memchr(m_curr, '\n', m_end - m_curr));
+    if(lineEnd == nullptr) {
+	if(!m_complete) {
+	    endReached();
+	    return {};
+	}
+	lineEnd = m_end;
+    }
+    const std::string_view line(m_curr, lineEnd - m_curr);
+    m_curr = lineEnd < m_end ? lineEnd + 1 : m_end;
+    stats::line(line.size());
+    if constexpr(D::lineComments) {
+	return line.substr(0, lineCommentStart(line));
+    }
+    return line;
+}
+
+// Extract the next token from the text stream, additionally determining
+// the type (state) of that token, returning both.
+template<typename D>
+const Token BasicScanner<D>::nextToken()
+{
+    const stats::PhaseTimer timer(stats::Phase::Scan);
+    const char *start = m_curr;
+    bool done = false;
+    char currChar = get();
+    State currState = State::Start;
+    m_textBegin = m_curr;
+    m_textSize = 0;
+    m_textOwned = false;
+    m_scratch.clear();
+    while(!done) {
+	switch(currState) {
+	case State::Start: {
+	    switch(kindOf(currChar)) {
+	    // Skip whitespace; not significant
+	    case CharKind::Blank:
+		m_curr = skipBlanks(m_curr, m_end);
+		break;
+	    // Start of `#define` or another `identifier`
+	    case CharKind::IdentStart:
+		currState = State::InIdentifier;
+		keepChar();
+		break;
+	    // Opening of single-quote string
+	    case CharKind::SingleQuote:
+		currState = State::InSingleQuote;
+		keepChar();
+		break;
+	    // Opening of double-quote string
+	    case CharKind::DoubleQuote:
+		currState = State::InDoubleQuote;
+		keepChar();
+		break;
+	    // Opening of multi-line comment
+	    case CharKind::Slash:
+		if(peek() == '*') {
+		    ignore();
+		    currState = State::InComment;
+		} else if(D::lineComments && peek() == '/') {
+		    skipLineComment();
+		} else {
+		    currState = State::Other;
+		    keepChar();
+		}
+		break;
+	    // File stream is empty; stop extracting
+	    case CharKind::End:
+		currState = State::EoF;
+		done = true;
+		break;
+	    // Ignore newlines
+	    case CharKind::Newline:
+		keepChar();
+		break;
+	    // "Other" possibilities include things like parentheses, brackets,
+	    // and other non-string/identifier/comment things
+	    case CharKind::Other:
+		currState = State::Other;
+		keepChar();
+		break;
+	    }
+	    break;
+	}
+	case State::InIdentifier: {
+	    // Identifiers are words (with optional method calls on them)
+	    if(isIdentChar<D>(currChar)) {
+		keepChar();
+		keepRun(skipIdentChars<D>(m_curr, m_end));
+		break;
+	    }
+	    // If reached char that isn't part of identifier, put it back, stop
+	    putback();
+	    currState = State::Identifier;
+	    done = true;
+	    break;
+	}
+	case State::InSingleQuote: {
+	    // Closing of string
+	    if(currChar == '\'') {
+		currState = State::String;
+		keepChar();
+		done = true;
+	    // Escape backslashes within the string
+	    } else if(currChar == '\\' && peek() == '\'') {
+		appendChar(currChar + get());
+	    // Can't have newline in middle of string
+	    } else if(currChar == '\n') {
+		currState = State::Bad;
+		report("\nError: Malformed string\n");
+		currChar = get(); //Move onto next line
+		done = true;
+	    // Can't have string cut-off by end of file
+	    } else if(currChar == EOF) {
+		currState = State::Bad;
+		report("\nError: Unexpected end of file\n");
+		done = true;
+	    // Otherwise, just collect the contents of the string
+	    } else {
+		keepChar();
+		keepRun(findStringStop(m_curr, m_end, '\''));
+	    }
+	    break;
+	}
+	// Double quoted strings are treated essentially the same as single-quotes 
+	case State::InDoubleQuote: {
+	    if(currChar == '"') {
+		currState = State::String;
+		keepChar();
+		done = true;
+	    } else if(currChar == '\\' && peek() == '\"') {
+		get();
+	    } else if(currChar == '\n') {
+		currState = State::Bad;
+		report("\nError: Malformed string\n");
+		keepChar();
+		done = true;
+	    } else if(currChar == EOF) {
+		report("\nFatal error: Unexpected end of file\n");
+		fatal();
+		done = true;
+	    } else {
+		keepChar();
+		keepRun(findStringStop(m_curr, m_end, '"'));
+	    }
+	    break;
+	}
+	// Ignore all characters in comments until closing `*/`, then continue
+	case State::InComment: {
+	    if(currChar != '*' && currChar != EOF && peek() != '/') {
+		// Jump straight to the next char that could end the comment
+		m_curr = findCommentEnd(m_curr, m_end);
+		currChar = get();
+	    }
+	    if(currChar == '*' || peek() == '/') {
+		ignore();
+		if(peek() == '\n') ignore();
+		currState = State::Start;
+	    } else if(currChar == EOF) {
+		report("\nFatal error: Unexpected end of file\n");
+		fatal();
+		done = true;
+	    }
+	    break;
+	}
+	// Try to process `Other` characters, ignoring comments as necessary
+	case State::Other: {
+	    // Input ended in the middle of the token
+	    if(!hasNext()) {
+		done = true;
+		break;
+	    } else if(currChar == ' ' || currChar == '\n') {
+		done = true;
+	    } else if(currChar == '/' && peek() == '*') {
+		ignore();
+		currState = State::InComment;
+		break;
+	    } else if(D::lineComments && currChar == '/' && peek() == '/') {
+		skipLineComment();
+		break;
+	    }
+	    keepChar();
+	    break;
+	}
+	default:
+	    // Have no clue how to deal with the current character, stop
+	    currState = State::Bad;
+	    done = true;
+	}
+	// Every iteration until token is complete, pull a character from the
+	// stream
+	if(!done) {
+	    currChar = get();
+	}
+    }
+    stats::token(currState, m_curr - start);
+    if(m_error) {
+	return {State::EoF, Keyword::None, {}, 0};
+    }
+    // Tell caller what type (state) the token is, what the token's content is
+    const std::string_view tokenText(text());
+    if(currState == State::Identifier) {
+	const std::uint64_t hash = hashText(tokenText);
+	return {currState, keywordOf(tokenText, hash), tokenText, hash};
+    }
+    return {currState, Keyword::None, tokenText, 0};
+}
+
+using Scanner = BasicScanner<Dialect>;
+
+// Per-worker queues of indices into the list of input files. A worker takes
+// files from the back of its own queue and, once that runs dry, steals from
+// the front of the others', so one slow file can't hold up the rest.
+class WorkQueues {
+private:
+    struct Queue {
+	std::mutex lock;
+	std::deque<std::size_t> items;
+    };
+    std::vector<Queue> m_queues;
+    bool take(Queue &queue, bool fromBack, std::size_t &item);
+public:
+    WorkQueues(std::size_t workerCount, std::size_t itemCount);
+    bool next(std::size_t worker, std::size_t &item);
+};
+
+// Deals the items out to the workers in contiguous blocks
+WorkQueues::WorkQueues(std::size_t workerCount, std::size_t itemCount)
+    : m_queues(workerCount)
+{
+    for(std::size_t w = 0; w < workerCount; ++w) {
+	const std::size_t first = itemCount * w / workerCount;
+	const std::size_t last = itemCount * (w + 1) / workerCount;
+	for(std::size_t item = first; item < last; ++item) {
+	    m_queues[w].items.push_back(item);
+	}
+    }
+}
+
+bool WorkQueues::take(Queue &queue, bool fromBack, std::size_t &item)
+{
+    const std::lock_guard<std::mutex> guard(queue.lock);
+    if(queue.items.empty()) {
+	return false;
+    }
+    if(fromBack) {
+	item = queue.items.back();
+	queue.items.pop_back();
+    } else {
+	item = queue.items.front();
+	queue.items.pop_front();
+    }
+    return true;
+}
+
+// Gets the next item for the given worker, returning false once every
+// queue is empty. Items are never added, so an empty sweep means we're done.
+bool WorkQueues::next(std::size_t worker, std::size_t &item)
+{
+    if(take(m_queues[worker], true, item)) {
+	return true;
+    }
+    for(std::size_t i = 1; i < m_queues.size(); ++i) {
+	if(take(m_queues[(worker + i) % m_queues.size()], false, item)) {
+	    return true;
+	}
+    }
+    return false;
+}
+
+bool hasValidExtension(std::string_view path)
+{
+    const auto endsWith = [path](std::string_view suffix) {
+	return path.size() >= suffix.size()
+	    && path.substr(path.size() - suffix.size()) == suffix;
+    };
+    return endsWith(".h") || endsWith(".cpp");
+}
+
+// Where the output for input goes under outputDir: the same relative path,
+// minus any root or leading `..` parts so it can't escape outputDir
+std::filesystem::path mirroredPath(const std::filesystem::path &outputDir,
+				   const std::string &input)
+{
+    std::filesystem::path result(outputDir);
+    bool leading = true;
+    for(const auto &part : std::filesystem::path(input).lexically_normal().relative_path()) {
+	if(leading && part == "..") continue;
+	leading = false;
+	result /= part;
+    }
+    return result;
+}
+
+// The conditional directives. Unlike `#define`, these and `#include` are
+// also recognized on a line that follows ordinary text, where the token
+// picks up the preceding newlines.
+enum class Directive { None, If, Ifdef, Ifndef, Elif, Else, Endif };
+
+inline Directive directiveOf(Keyword keyword)
+{
+    switch(keyword) {
+    case Keyword::If: return Directive::If;
+    case Keyword::Ifdef: return Directive::Ifdef;
+    case Keyword::Ifndef: return Directive::Ifndef;
+    case Keyword::Elif: return Directive::Elif;
+    case Keyword::Else: return Directive::Else;
+    case Keyword::Endif: return Directive::Endif;
+    default: return Directive::None;
+    }
+}
+
+// What passThroughEnd() makes of each char: a blank, a punctuator (which
+// any token but a literal, a comment or an identifier ends on), a char that
+// can only go on with an identifier, one that can start one, a newline, or
+// one that rules out passing through
+enum class PassKind : std::uint8_t { Blank, Punctuator, Word, WordStart, Newline, Stop };
+
+template<typename D>
+constexpr std::array<PassKind,256> makePassTable()
+{
+    std::array<PassKind,256> table{};
+    for(int c = 0; c < 256; ++c) {
+	const CharKind kind = startTable[c];
+	const bool ident = identTable<D>[c];
+	table[c] = kind == CharKind::Blank ? PassKind::Blank
+	    : kind == CharKind::Newline ? PassKind::Newline
+	    : kind == CharKind::IdentStart && c != '#' ? PassKind::WordStart
+	    : kind == CharKind::Other && ident ? PassKind::Word
+	    : kind == CharKind::Other ? PassKind::Punctuator
+	    : PassKind::Stop;
+    }
+    return table;
+}
+
+constexpr auto passTable = makePassTable<Dialect>();
+
+// How far the input from `from` runs on without anything in it the steps
+// have to see, which is to say without a directive, a literal, a comment or
+// an identifier that symbols could have a name for: the end of the last
+// whole line in that run that finishes on a punctuator, where the scanner
+// would start a token of its own, or `from` if there's none. Identifiers are
+// over-counted, since any letter after a char that couldn't be in one is
+// taken as the start of one. blocked is set to where the run stopped, so
+// nothing before that point is worth trying again.
+const char* passThroughEnd(const char *from, const char *end, const SymbolTable &symbols,
+			   const char *&blocked)
+{
+    const auto kindAt = [](const char *p) { return passTable[static_cast<unsigned char>(*p)]; };
+    const char *passable = from;
+    PassKind last = PassKind::Blank;
+    const char *p = from;
+    for(; p < end; ++p) {
+	const PassKind kind = kindAt(p);
+	if(kind == PassKind::WordStart && last != PassKind::Word && last != PassKind::WordStart) {
+	    const char second = p + 1 < end && isIdentChar(p[1]) ? p[1] : 0;
+	    if(symbols.mayHave(*p, second)) {
+		break;
+	    }
+	} else if(kind == PassKind::Newline && last == PassKind::Punctuator) {
+	    passable = p + 1;
+	} else if(kind == PassKind::Stop) {
+	    break;
+	}
+	last = kind;
+    }
+    blocked = p;
+    return passable;
+}
+
+// The preprocessor's main loop: one step per token, except that a whole
+// `#define`, `#include` or conditional directive line is one step, and so
+// is each line being skipped, and so is a run of lines that passes through
+// unscanned. Steps are taken until the input runs out or a step would start
+// at or after stop. What each step does is up to Steps, which gets define(),
+// conditional(), skippedLine(), include(), identifier(), text() and error()
+// calls, says via skipping() whether input is being skipped, and says via
+// passThrough() how far the input can go by without being scanned, if at
+// all. include() returns false if it couldn't find the file, which leaves
+// the line to be read as ordinary text. text() is told whether its text is
+// the token just read, in which case the steps can find it in the input, up
+// to the scanner's position.
+//
+// Outside of conditionals and includes that are found, tokenizing never
+// depends on anything but the text, so where the steps start is purely a
+// function of where the first one does. A run that passes through ends
+// where a step would have started anyway, so that holds for the steps that
+// are still taken.
+template<typename Steps>
+void runSteps(Scanner &scanner, Steps &steps, const char *stop)
+{
+    const stats::PhaseTimer timer(stats::Phase::Expand);
+    while(scanner.hasNext() && scanner.position() < stop) {
+	steps.step(scanner.position());
+	// Skipped lines aren't tokenized at all
+	if(steps.skipping()) {
+	    const std::string_view line(scanner.nextLine());
+	    if(scanner.needsMore()) {
+		break;
+	    }
+	    steps.skippedLine(line);
+	    continue;
+	}
+	if(const char *passed = steps.passThrough(scanner.position(),
+						  std::min(stop, scanner.end()));
+	   passed != scanner.position()) {
+	    scanner.seek(passed);
+	    continue;
+	}
+	const auto [tokenState, keyword, tokenText, tokenHash] = scanner.nextToken();
+	// Add symbol/value from all `#define SYMBOL value` statements
+	if(keyword == Keyword::Define && tokenText.front() == '#') {
+	    const auto [symbolState, symbolKeyword, symbol, symbolHash] = scanner.nextToken();
+	    const std::string_view value(scanner.nextLine());
+	    if(scanner.needsMore()) {
+		break;
+	    } else if(symbolState != State::Identifier) {
+		steps.error("\nError: expected identifier after #define\n");
+		steps.text(symbol);
+		steps.text(" ");
+		steps.text(value);
+		steps.text("\n");
+	    } else {
+		steps.define(symbol, symbolHash, value);
+	    }
+	// Ran out of input read so far; the caller redoes this step with more
+	} else if(scanner.needsMore()) {
+	    break;
+	} else if(const Directive directive = directiveOf(keyword);
+		  directive != Directive::None) {
+	    const std::string_view rest(scanner.nextLine());
+	    if(scanner.needsMore()) {
+		break;
+	    }
+	    // Lines before the directive still end
+	    if(tokenText.front() == '\n') {
+		steps.text(tokenText.substr(0, tokenText.find('#')), false);
+	    }
+	    steps.conditional(directive, rest);
+	} else if(keyword == Keyword::Include) {
+	    const char *afterToken = scanner.position();
+	    const std::string_view rest(scanner.nextLine());
+	    if(scanner.needsMore()) {
+		break;
+	    } else if(!steps.include(tokenText.substr(0, tokenText.find('#')), rest)) {
+		// Not found; left for the compiler as written
+		scanner.seek(afterToken);
+		steps.identifier(tokenText, tokenHash);
+	    }
+	// Print out identifiers separated with 1 space; replace any known symbols
+	// with their mapped values
+	} else if(tokenState == State::Identifier) {
+	    steps.identifier(tokenText, tokenHash);
+	} else if(tokenState != State::Bad) {
+	    steps.text(tokenText);
+	} else {
+	    steps.error("Error: bad token: ");
+	    steps.error(tokenText);
+	    steps.error("\n");
+	}
+    }
+}
+
+// Where the string literal opened at text[start] ends: just past its closing
+// quote, or at the newline or end of text that cut it off
+std::size_t stringEnd(std::string_view text, std::size_t start)
+{
+    const char quote = text[start];
+    std::size_t i = start + 1;
+    while(i < text.size() && text[i] != quote && text[i] != '\n') {
+	i += text[i] == '\\' ? 2 : 1;
+    }
+    return i < text.size() && text[i] == quote ? i + 1 : std::min(i, text.size());
+}
+
+// Splits macro text into identifiers, string literals and single chars of
+// anything else, appending them to tokens. Blanks and comments only set the
+// next token's spaceBefore. Unlike Scanner, this sees every `(`, `,` and `)`,
+// which is what finding a function-like macro's parameters and arguments
+// takes.
+void lexMacroText(std::string_view text, std::vector<BodyToken> &tokens)
+{
+    bool space = false;
+    std::size_t i = 0;
+    while(i < text.size()) {
+	const char c = text[i];
+	const std::size_t start = i;
+	if(c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+	    space = true;
+	    ++i;
+	    continue;
+	} else if(c == '/' && i + 1 < text.size() && text[i + 1] == '*') {
+	    const std::size_t close = text.find("*/", i + 2);
+	    i = close == std::string_view::npos ? text.size() : close + 2;
+	    space = true;
+	    continue;
+	}
+	State state = State::Other;
+	if(kindOf(c) == CharKind::IdentStart) {
+	    state = State::Identifier;
+	    for(++i; i < text.size() && isIdentChar(text[i]); ++i) {}
+	} else if(c == '\'' || c == '"') {
+	    state = State::String;
+	    i = stringEnd(text, i);
+	} else {
+	    ++i;
+	}
+	tokens.push_back({state, space, 0, static_cast<std::uint32_t>(start),
+			  static_cast<std::uint32_t>(i - start), SymbolTable::NoSymbol});
+	space = false;
+    }
+}
+
+inline bool isPunctuator(const BodyToken &token, std::string_view text, char c)
+{
+    return token.state == State::Other && text[token.offset] == c;
+}
+
+// Records which symbol each identifier in tokens names so far
+void resolveSymbols(std::string_view text, const SymbolTable &symbols,
+		    std::vector<BodyToken> &tokens)
+{
+    for(BodyToken &token : tokens) {
+	if(token.state == State::Identifier && token.param == 0) {
+	    const std::string_view name(text.substr(token.offset, token.length));
+	    const std::size_t index = symbols.indexOf(name, hashText(name));
+	    if(index != symbols.size()) {
+		token.symbol = static_cast<std::uint32_t>(index);
+	    }
+	}
+    }
+}
+
+// Splits an object-like macro's value into tokens, resolving each identifier
+// against the symbols defined so far
+void tokenizeBody(std::string_view value, const SymbolTable &symbols,
+		  std::vector<BodyToken> &tokens)
+{
+    tokens.clear();
+    lexMacroText(value, tokens);
+    resolveSymbols(value, symbols, tokens);
+}
+
+// Splits the value of a function-like macro, `(a, b) body`, into its
+// parameter count, its body and the body's tokens, with each use of a
+// parameter marked. Returns false if the parameter list is malformed.
+bool tokenizeFunctionBody(std::string_view value, const SymbolTable &symbols,
+			  std::vector<BodyToken> &tokens, std::int32_t &paramCount,
+			  std::string_view &body)
+{
+    tokens.clear();
+    lexMacroText(value, tokens);
+    // The parameters are tokens 1, 3, 5 and so on, up to the `)`, so they
+    // can be looked up where they are rather than gathered up first
+    std::size_t params = 0;
+    const auto paramOf = [&](std::string_view name) {
+	for(std::size_t p = 0; p < params; ++p) {
+	    const BodyToken &param = tokens[1 + 2 * p];
+	    if(value.substr(param.offset, param.length) == name) {
+		return static_cast<std::uint16_t>(p + 1);
+	    }
+	}
+	return std::uint16_t(0);
+    };
+    std::size_t i = 1;
+    if(i < tokens.size() && isPunctuator(tokens[i], value, ')')) {
+	++i;
+    } else {
+	while(true) {
+	    if(i + 1 >= tokens.size() || tokens[i].state != State::Identifier) {
+		return false;
+	    }
+	    const std::string_view param(value.substr(tokens[i].offset, tokens[i].length));
+	    if(paramOf(param) != 0 || params == UINT16_MAX) {
+		return false;
+	    }
+	    ++params;
+	    if(isPunctuator(tokens[i + 1], value, ')')) {
+		i += 2;
+		break;
+	    } else if(!isPunctuator(tokens[i + 1], value, ',')) {
+		return false;
+	    }
+	    i += 2;
+	}
+    }
+    for(std::size_t t = i; t < tokens.size(); ++t) {
+	if(tokens[t].state == State::Identifier) {
+	    tokens[t].param = paramOf(value.substr(tokens[t].offset, tokens[t].length));
+	}
+    }
+    const std::uint32_t bodyStart = tokens[i - 1].offset + 1;
+    body = value.substr(bodyStart);
+    tokens.erase(tokens.begin(), tokens.begin() + i);
+    for(BodyToken &token : tokens) {
+	token.offset -= bodyStart;
+    }
+    if(!tokens.empty()) {
+	tokens.front().spaceBefore = false;
+    }
+    resolveSymbols(body, symbols, tokens);
+    paramCount = static_cast<std::int32_t>(params);
+    return true;
+}
+
+// Defines symbol as value, which is everything after the name the way a
+// #define line has it, tokenizing it into body. Returns false if a
+// function-like macro's parameter list is malformed; otherwise sets
+// redefined to whether the symbol was already defined.
+bool defineMacro(SymbolTable &symbols, std::string_view symbol, std::uint64_t hash,
+		 std::string_view value, std::vector<BodyToken> &body, bool &redefined)
+{
+    std::int32_t paramCount = -1;
+    // As in C, a `(` straight after the name makes the macro function-like
+    if(!value.empty() && value.front() == '(') {
+	if(!tokenizeFunctionBody(value, symbols, body, paramCount, value)) {
+	    return false;
+	}
+    } else {
+	tokenizeBody(value, symbols, body);
+    }
+    redefined = symbols.define(symbol, hash, value, body, paramCount);
+    return true;
+}
+
+// Expands calls to function-like macros. Arguments are fully expanded before
+// they're substituted, and the result is rescanned for more calls, but
+// object-like macros expand to their value as is, the same as they do
+// outside a call.
+//
+// There's no recursion: the expander works from an explicit stack of
+// contexts, each a range of tokens still to be read, tagged with the macro
+// whose body it is. A macro is disabled while any of its contexts are still
+// on the stack, and a disabled macro's name is painted so that it's never
+// expanded again, which is what stops a macro from expanding itself. While a
+// call's arguments are being expanded it sits on a stack of calls, and each
+// level of that stack has its own output buffer. All the buffers are reused
+// from one expansion to the next.
+class MacroExpander {
+private:
+    struct Piece {
+	State state;
+	bool spaceBefore;
+	// Never to be expanded
+	bool painted;
+	// The symbol an identifier names, if known already
+	std::uint32_t symbol;
+	std::string_view text;
+    };
+    struct Range {
+	std::uint32_t begin;
+	std::uint32_t end;
+    };
+    struct Context {
+	std::uint32_t next;
+	std::uint32_t end;
+	// The macro this is the body of, or NoSymbol
+	std::uint32_t macro;
+    };
+    // A call whose arguments are being expanded
+    struct Call {
+	std::uint32_t macro;
+	Piece name;
+	// Where its arguments are in m_args, first as read and then expanded
+	std::size_t firstArg;
+	std::size_t argCount;
+	std::size_t nextArg;
+	// Contexts from here up belong to the argument being expanded
+	std::size_t contextBase;
+    };
+    const SymbolTable *m_symbols = nullptr;
+    std::vector<Piece> m_pool;
+    std::vector<Context> m_contexts;
+    std::vector<Call> m_calls;
+    std::vector<Range> m_args;
+    std::vector<std::vector<Piece>> m_outputs;
+    // How many contexts each macro has on the stack. Every context is gone
+    // by the end of an expansion, so this is all zeros between them.
+    std::vector<std::uint32_t> m_active;
+    // Where the `)` matching each `(` in m_pool is, once known; 0 if not
+    std::vector<std::uint32_t> m_match;
+    std::vector<std::uint32_t> m_open;
+    std::vector<BodyToken> m_lexed;
+    std::string m_messages;
+    static bool isPunctuator(const Piece &piece, char c)
+    {
+	return piece.state == State::Other && piece.text.size() == 1 && piece.text[0] == c;
+    }
+    bool next(std::size_t base, Piece &piece);
+    bool nextIsOpenParen(std::size_t base);
+    std::uint32_t symbolOf(const Piece &piece) const;
+    bool argumentsInPlace(Range &raw);
+    bool argumentsCopied(std::size_t base, Range &raw);
+    void invoke(const Piece &name, std::uint32_t macro, std::size_t base);
+    void finishArgument();
+    void pushBody(const Piece &name, std::uint32_t macro, std::size_t firstArg,
+		  std::size_t argCount);
+public:
+    // Expands a call to the function-like macro with the given index, whose
+    // argument list (from its opening to its closing parenthesis) is
+    // arguments, appending the result to out
+    void expand(const SymbolTable &symbols, std::uint32_t macro, std::string_view name,
+		std::string_view arguments, std::string &out);
+    // Errors found by the last expand()
+    std::string_view messages() const { return m_messages; }
+};
+
+// Takes the next token from the current level's contexts, dropping any that
+// are used up
+bool MacroExpander::next(std::size_t base, Piece &piece)
+{
+    while(m_contexts.size() > base) {
+	Context &context = m_contexts.back();
+	if(context.next < context.end) {
+	    piece = m_pool[context.next++];
+	    return true;
+	}
+	if(context.macro != SymbolTable::NoSymbol) {
+	    --m_active[context.macro];
+	}
+	m_contexts.pop_back();
+    }
+    return false;
+}
+
+bool MacroExpander::nextIsOpenParen(std::size_t base)
+{
+    while(m_contexts.size() > base) {
+	const Context &context = m_contexts.back();
+	if(context.next < context.end) {
+	    const Piece &piece = m_pool[context.next];
+	    return piece.state == State::Other && piece.text == "(";
+	}
+	if(context.macro != SymbolTable::NoSymbol) {
+	    --m_active[context.macro];
+	}
+	m_contexts.pop_back();
+    }
+    return false;
+}
+
+inline std::uint32_t MacroExpander::symbolOf(const Piece &piece) const
+{
+    if(piece.symbol != SymbolTable::NoSymbol) {
+	return piece.symbol;
+    }
+    const std::size_t index = m_symbols->indexOf(piece.text, hashText(piece.text));
+    return index == m_symbols->size() ? SymbolTable::NoSymbol : static_cast<std::uint32_t>(index);
+}
+
+// Finds the arguments of the call whose `(` is next in the innermost context
+// without copying them, if the whole call is inside that context, which it
+// nearly always is. Matching parentheses found on the way are remembered, so
+// that calls nested in the arguments are skipped over when their turn comes
+// instead of being scanned again; that keeps deep nesting linear.
+bool MacroExpander::argumentsInPlace(Range &raw)
+{
+    Context &context = m_contexts.back();
+    if(m_match.size() < m_pool.size()) {
+	m_match.resize(m_pool.size(), 0);
+    }
+    const std::size_t firstArg = m_args.size();
+    m_open.clear();
+    m_open.push_back(context.next);
+    std::uint32_t argStart = context.next + 1;
+    for(std::uint32_t i = argStart; i < context.end; ++i) {
+	const Piece &piece = m_pool[i];
+	if(isPunctuator(piece, '(')) {
+	    if(m_match[i] != 0 && m_match[i] < context.end) {
+		i = m_match[i];
+	    } else {
+		m_open.push_back(i);
+	    }
+	} else if(isPunctuator(piece, ')')) {
+	    m_match[m_open.back()] = i;
+	    m_open.pop_back();
+	    if(m_open.empty()) {
+		m_args.push_back({argStart, i});
+		raw = {context.next, i + 1};
+		context.next = i + 1;
+		return true;
+	    }
+	} else if(isPunctuator(piece, ',') && m_open.size() == 1) {
+	    m_args.push_back({argStart, i});
+	    argStart = i + 1;
+	}
+    }
+    m_args.resize(firstArg);
+    return false;
+}
+
+// Reads the arguments of a call that runs on past the end of the innermost
+// context, copying them into m_pool as they're read
+bool MacroExpander::argumentsCopied(std::size_t base, Range &raw)
+{
+    raw.begin = static_cast<std::uint32_t>(m_pool.size());
+    Piece piece;
+    next(base, piece);
+    m_pool.push_back(piece);
+    std::size_t depth = 1;
+    auto argStart = static_cast<std::uint32_t>(m_pool.size());
+    bool closed = false;
+    while(!closed && next(base, piece)) {
+	if(isPunctuator(piece, '(')) {
+	    ++depth;
+	} else if((isPunctuator(piece, ',') || isPunctuator(piece, ')')) && depth == 1) {
+	    m_args.push_back({argStart, static_cast<std::uint32_t>(m_pool.size())});
+	    argStart = static_cast<std::uint32_t>(m_pool.size() + 1);
+	    closed = isPunctuator(piece, ')');
+	} else if(isPunctuator(piece, ')')) {
+	    --depth;
+	}
+	m_pool.push_back(piece);
+    }
+    raw.end = static_cast<std::uint32_t>(m_pool.size());
+    return closed;
+}
+
+// Reads the arguments of a call to macro, up to its closing parenthesis, and
+// starts expanding them. On an error the call is passed through unexpanded.
+void MacroExpander::invoke(const Piece &name, std::uint32_t macro, std::size_t base)
+{
+    const std::size_t firstArg = m_args.size();
+    Range raw;
+    const bool closed = argumentsInPlace(raw) || argumentsCopied(base, raw);
+    const Macro &definition = m_symbols->at(macro);
+    std::size_t argCount = m_args.size() - firstArg;
+    // `f()` has one empty argument, which is right for a macro taking none
+    if(definition.paramCount == 0 && argCount == 1 && m_args.back().begin == m_args.back().end) {
+	argCount = 0;
+    }
+    if(!closed || argCount != static_cast<std::size_t>(definition.paramCount)) {
+	m_messages += closed ? "\nError: wrong number of arguments to macro "
+	    : "\nError: unterminated call to macro ";
+	m_messages += name.text;
+	m_messages += '\n';
+	m_args.resize(firstArg);
+	std::vector<Piece> &output = m_outputs[m_calls.size()];
+	output.push_back(name);
+	output.back().painted = true;
+	for(std::uint32_t i = raw.begin; i < raw.end; ++i) {
+	    output.push_back(m_pool[i]);
+	}
+	return;
+    }
+    m_args.resize(firstArg + argCount);
+    if(argCount == 0) {
+	pushBody(name, macro, firstArg, 0);
+	return;
+    }
+    // Room for the expanded arguments after the ones as read
+    m_args.resize(firstArg + 2 * argCount);
+    m_calls.push_back({macro, name, firstArg, argCount, 0, m_contexts.size()});
+    if(m_outputs.size() <= m_calls.size()) {
+	m_outputs.emplace_back();
+    }
+    const Range first = m_args[firstArg];
+    m_contexts.push_back({first.begin, first.end, SymbolTable::NoSymbol});
+}
+
+// Called once the innermost call's current argument is fully expanded
+void MacroExpander::finishArgument()
+{
+    Call &call = m_calls.back();
+    std::vector<Piece> &output = m_outputs[m_calls.size()];
+    const auto begin = static_cast<std::uint32_t>(m_pool.size());
+    m_pool.insert(m_pool.end(), output.begin(), output.end());
+    output.clear();
+    m_args[call.firstArg + call.argCount + call.nextArg] =
+	{begin, static_cast<std::uint32_t>(m_pool.size())};
+    if(++call.nextArg < call.argCount) {
+	const Range arg = m_args[call.firstArg + call.nextArg];
+	m_contexts.push_back({arg.begin, arg.end, SymbolTable::NoSymbol});
+	return;
+    }
+    const Call done = call;
+    m_calls.pop_back();
+    pushBody(done.name, done.macro, done.firstArg, done.argCount);
+    m_args.resize(done.firstArg);
+}
+
+// Substitutes the expanded arguments into the macro's body and pushes the
+// result to be rescanned
+void MacroExpander::pushBody(const Piece &name, std::uint32_t macro, std::size_t firstArg,
+			     std::size_t argCount)
+{
+    const Macro &definition = m_symbols->at(macro);
+    const BodyToken *body = m_symbols->tokens(definition);
+    const auto begin = static_cast<std::uint32_t>(m_pool.size());
+    stats::call();
+    for(std::uint32_t i = 0; i < definition.tokenCount; ++i) {
+	const BodyToken &token = body[i];
+	if(token.param == 0) {
+	    m_pool.push_back({token.state, token.spaceBefore, false, token.symbol,
+			      definition.value.substr(token.offset, token.length)});
+	    continue;
+	}
+	const Range arg = m_args[firstArg + argCount + token.param - 1];
+	const std::size_t start = m_pool.size();
+	m_pool.reserve(start + (arg.end - arg.begin));
+	for(std::uint32_t j = arg.begin; j < arg.end; ++j) {
+	    m_pool.push_back(m_pool[j]);
+	}
+	if(m_pool.size() > start) {
+	    m_pool[start].spaceBefore = token.spaceBefore;
+	}
+    }
+    if(m_pool.size() > begin) {
+	m_pool[begin].spaceBefore = name.spaceBefore;
+    }
+    m_contexts.push_back({begin, static_cast<std::uint32_t>(m_pool.size()), macro});
+    ++m_active[macro];
+}
+
+void MacroExpander::expand(const SymbolTable &symbols, std::uint32_t macro,
+			   std::string_view name, std::string_view arguments, std::string &out)
+{
+    m_symbols = &symbols;
+    m_pool.clear();
+    m_contexts.clear();
+    m_calls.clear();
+    m_args.clear();
+    m_messages.clear();
+    m_match.clear();
+    if(m_active.size() < symbols.size()) {
+	m_active.resize(symbols.size(), 0);
+    }
+    if(m_outputs.empty()) {
+	m_outputs.emplace_back();
+    }
+    m_outputs[0].clear();
+    m_lexed.clear();
+    lexMacroText(arguments, m_lexed);
+    for(const BodyToken &token : m_lexed) {
+	m_pool.push_back({token.state, token.spaceBefore, false, SymbolTable::NoSymbol,
+			  arguments.substr(token.offset, token.length)});
+    }
+    m_contexts.push_back({0, static_cast<std::uint32_t>(m_pool.size()), SymbolTable::NoSymbol});
+    invoke({State::Identifier, false, false, macro, name}, macro, 0);
+
+    Piece piece;
+    while(true) {
+	const std::size_t base = m_calls.empty() ? 0 : m_calls.back().contextBase;
+	if(!next(base, piece)) {
+	    if(m_calls.empty()) {
+		break;
+	    }
+	    finishArgument();
+	    continue;
+	}
+	if(piece.state == State::Identifier && !piece.painted) {
+	    const std::uint32_t symbol = symbolOf(piece);
+	    if(symbol != SymbolTable::NoSymbol) {
+		const Macro &definition = symbols.at(symbol);
+		if(m_active[symbol] > 0) {
+		    piece.painted = true;
+		} else if(definition.paramCount < 0) {
+		    const std::size_t start = definition.value.find_first_not_of(" \t");
+		    piece = {State::Other, piece.spaceBefore, true, SymbolTable::NoSymbol,
+			     definition.value.substr(std::min(start, definition.value.size()))};
+		    stats::substitution();
+		} else if(nextIsOpenParen(base)) {
+		    invoke(piece, symbol, base);
+		    continue;
+		}
+	    }
+	}
+	m_outputs[m_calls.size()].push_back(piece);
+    }
+
+    bool first = true;
+    for(const Piece &output : m_outputs[0]) {
+	if(output.spaceBefore && !first) {
+	    out += ' ';
+	}
+	out += output.text;
+	first = false;
+    }
+}
+
+// Evaluates the expression of an #if or #elif, on long long as in C.
+// `defined NAME` and `defined(NAME)` test whether a macro is defined.
+// Object-like macros are expanded and, unlike elsewhere, rescanned, since
+// a name left over just counts as 0; so does any other identifier, including
+// a function-like macro's. Expansion goes through a stack of the values
+// being read, and a macro already on the stack isn't expanded again.
+class ConditionParser {
+private:
+    enum class Kind { Number, Identifier, Operator, End, Bad };
+    struct Segment {
+	std::string_view text;
+	std::size_t pos;
+	// The macro this is the value of, or NoSymbol
+	std::uint32_t macro;
+    };
+    // Deep enough for any sensible expression, shallow enough for the stack
+    static constexpr int MaxNesting = 256;
+    const SymbolTable &m_symbols;
+    std::vector<Segment> &m_segments;
+    Kind m_kind = Kind::End;
+    std::string_view m_text;
+    long long m_value = 0;
+    int m_nesting = 0;
+    // Inside the unevaluated side of `&&`, `||` or `?:`, where dividing by
+    // zero is harmless
+    int m_unevaluated = 0;
+    bool m_ok = true;
+    bool expanding(std::uint32_t macro) const;
+    void advance(bool expand = true);
+    bool accept(std::string_view op);
+    long long parseUnary();
+    long long parseBinary(int minPrecedence);
+    long long parseConditional();
+public:
+    // Room for the segments, which can be kept for the next parser so that
+    // it needn't allocate
+    using Stack = std::vector<Segment>;
+    ConditionParser(const SymbolTable &symbols, std::string_view expression, Stack &stack)
+	: m_symbols(symbols), m_segments(stack)
+    {
+	m_segments.assign(1, {expression, 0, SymbolTable::NoSymbol});
+    }
+    // Returns false if the expression is malformed
+    bool evaluate(long long &value);
+};
+
+bool ConditionParser::expanding(std::uint32_t macro) const
+{
+    for(const Segment &segment : m_segments) {
+	if(segment.macro == macro) return true;
+    }
+    return false;
+}
+
+// Moves on to the next token, expanding macro names along the way unless
+// told not to
+void ConditionParser::advance(bool expand)
+{
+    while(!m_segments.empty()) {
+	Segment &segment = m_segments.back();
+	const std::string_view text(segment.text);
+	std::size_t i = segment.pos;
+	while(i < text.size()) {
+	    if(text[i] == ' ' || text[i] == '\t' || text[i] == '\r') {
+		++i;
+	    } else if(text.compare(i, 2, "/*") == 0) {
+		const std::size_t close = text.find("*/", i + 2);
+		i = close == std::string_view::npos ? text.size() : close + 2;
+	    } else {
+		break;
+	    }
+	}
+	if(i == text.size()) {
+	    m_segments.pop_back();
+	    continue;
+	}
+	const std::size_t start = i;
+	const char c = text[i];
+	if(c >= '0' && c <= '9') {
+	    while(i < text.size() && (std::isalnum(static_cast<unsigned char>(text[i])))) ++i;
+	    const std::string digits(text.substr(start, i - start));
+	    char *suffix = nullptr;
+	    errno = 0;
+	    m_value = static_cast<long long>(std::strtoull(digits.c_str(), &suffix, 0));
+	    m_kind = errno == 0 && std::strspn(suffix, "uUlL") == std::strlen(suffix)
+		? Kind::Number : Kind::Bad;
+	} else if(c == '\'') {
+	    // A char constant, with the common escapes
+	    i = stringEnd(text, i);
+	    std::string_view body(text.substr(start + 1, i - start - 2));
+	    m_kind = i - start >= 3 && text[i - 1] == '\'' ? Kind::Number : Kind::Bad;
+	    if(m_kind == Kind::Number && body[0] == '\\' && body.size() == 2) {
+		const char escaped = body[1];
+		m_value = escaped == 'n' ? '\n' : escaped == 't' ? '\t' : escaped == '0' ? 0 : escaped;
+	    } else if(m_kind == Kind::Number && body.size() == 1) {
+		m_value = static_cast<unsigned char>(body[0]);
+	    } else {
+		m_kind = Kind::Bad;
+	    }
+	} else if(kindOf(c) == CharKind::IdentStart && c != '#') {
+	    for(++i; i < text.size() && isIdentChar(text[i]); ++i) {}
+	    m_text = text.substr(start, i - start);
+	    m_kind = Kind::Identifier;
+	} else {
+	    static constexpr std::string_view Pairs[] = {
+		"<<", ">>", "<=", ">=", "==", "!=", "&&", "||"
+	    };
+	    m_kind = Kind::Operator;
+	    m_text = text.substr(start, 1);
+	    for(const std::string_view pair : Pairs) {
+		if(text.compare(start, 2, pair) == 0) {
+		    m_text = text.substr(start, 2);
+		}
+	    }
+	    if(m_text.size() == 1 && std::string_view("+-*/%<>&^|!~?:()").find(c)
+	       == std::string_view::npos) {
+		m_kind = Kind::Bad;
+	    }
+	    i = start + m_text.size();
+	}
+	segment.pos = i;
+	if(m_kind != Kind::Identifier || !expand) {
+	    return;
+	} else if(m_text == "defined") {
+	    // The operand is taken as written, not expanded
+	    advance(false);
+	    const bool parenthesized = m_kind == Kind::Operator && m_text == "(";
+	    if(parenthesized) {
+		advance(false);
+	    }
+	    if(m_kind != Kind::Identifier) {
+		m_kind = Kind::Bad;
+		return;
+	    }
+	    m_value = m_symbols.find(m_text, hashText(m_text)) != nullptr;
+	    if(parenthesized) {
+		advance(false);
+		if(m_kind != Kind::Operator || m_text != ")") {
+		    m_kind = Kind::Bad;
+		    return;
+		}
+	    }
+	    m_kind = Kind::Number;
+	    return;
+	}
+	const std::size_t index = m_symbols.indexOf(m_text, hashText(m_text));
+	const auto macro = static_cast<std::uint32_t>(index);
+	if(index == m_symbols.size() || m_symbols.at(index).paramCount >= 0
+	   || expanding(macro)) {
+	    m_kind = Kind::Number;
+	    m_value = 0;
+	    return;
+	}
+	m_segments.push_back({m_symbols.at(index).value, 0, macro});
+    }
+    m_kind = Kind::End;
+}
+
+// Moves past the operator op if it's next
+bool ConditionParser::accept(std::string_view op)
+{
+    if(m_kind == Kind::Operator && m_text == op) {
+	advance();
+	return true;
+    }
+    return false;
+}
+
+long long ConditionParser::parseUnary()
+{
+    if(++m_nesting > MaxNesting) {
+	m_ok = false;
+    }
+    long long value = 0;
+    if(!m_ok) {
+    } else if(m_kind == Kind::Number) {
+	value = m_value;
+	advance();
+    } else if(accept("(")) {
+	value = parseConditional();
+	m_ok = m_ok && accept(")");
+    } else if(m_kind == Kind::Operator && m_text.size() == 1
+	      && std::string_view("+-!~").find(m_text[0]) != std::string_view::npos) {
+	const char op = m_text[0];
+	advance();
+	const long long operand = parseUnary();
+	// Wrapping, rather than overflowing, as on any real machine
+	value = op == '+' ? operand
+	    : op == '-' ? static_cast<long long>(0ULL - static_cast<unsigned long long>(operand))
+	    : op == '!' ? !operand
+	    : ~operand;
+    } else {
+	m_ok = false;
+    }
+    --m_nesting;
+    return value;
+}
+
+// Binding strength of each binary operator, or 0 for anything else
+int precedenceOf(std::string_view op)
+{
+    static constexpr std::pair<std::string_view, int> Table[] = {
+	{"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6}, {"!=", 6},
+	{"<", 7}, {">", 7}, {"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8},
+	{"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10}
+    };
+    for(const auto &[name, precedence] : Table) {
+	if(name == op) return precedence;
+    }
+    return 0;
+}
+
+long long ConditionParser::parseBinary(int minPrecedence)
+{
+    long long left = parseUnary();
+    while(m_ok && m_kind == Kind::Operator && precedenceOf(m_text) >= minPrecedence) {
+	const std::string_view op(m_text);
+	const int precedence = precedenceOf(op);
+	advance();
+	const bool shortCircuit = (op == "&&" && !left) || (op == "||" && left);
+	m_unevaluated += shortCircuit;
+	const long long right = parseBinary(precedence + 1);
+	m_unevaluated -= shortCircuit;
+	const auto a = static_cast<unsigned long long>(left);
+	const auto b = static_cast<unsigned long long>(right);
+	if((op == "/" || op == "%") && (right == 0 || (left == LLONG_MIN && right == -1))) {
+	    m_ok = m_ok && m_unevaluated > 0;
+	    left = 0;
+	} else if(op == "||") left = left || right;
+	else if(op == "&&") left = left && right;
+	else if(op == "|") left = left | right;
+	else if(op == "^") left = left ^ right;
+	else if(op == "&") left = left & right;
+	else if(op == "==") left = left == right;
+	else if(op == "!=") left = left != right;
+	else if(op == "<") left = left < right;
+	else if(op == ">") left = left > right;
+	else if(op == "<=") left = left <= right;
+	else if(op == ">=") left = left >= right;
+	else if(op == "<<") left = right < 0 || right > 63 ? 0 : static_cast<long long>(a << right);
+	else if(op == ">>") left = right < 0 || right > 63 ? (left < 0 ? -1 : 0) : left >> right;
+	else if(op == "+") left = static_cast<long long>(a + b);
+	else if(op == "-") left = static_cast<long long>(a - b);
+	else if(op == "*") left = static_cast<long long>(a * b);
+	else if(op == "/") left = left / right;
+	else left = left % right;
+    }
+    return left;
+}
+
+long long ConditionParser::parseConditional()
+{
+    const long long condition = parseBinary(1);
+    if(!m_ok || !accept("?")) {
+	return condition;
+    }
+    m_unevaluated += !condition;
+    const long long ifTrue = parseConditional();
+    m_unevaluated -= !condition;
+    m_ok = m_ok && accept(":");
+    m_unevaluated += !!condition;
+    const long long ifFalse = parseConditional();
+    m_unevaluated -= !!condition;
+    return condition ? ifTrue : ifFalse;
+}
+
+bool ConditionParser::evaluate(long long &value)
+{
+    advance();
+    value = parseConditional();
+    return m_ok && m_kind == Kind::End;
+}
+
+// Where the input is among nested conditional blocks, and so whether text
+// is live or being skipped
+class Conditions {
+private:
+    struct Block {
+	// Whether the text around the block is live
+	bool outerLive;
+	// Whether one of the block's branches has been chosen yet
+	bool taken;
+	bool sawElse;
+    };
+    std::vector<Block> m_blocks;
+    // Blocks below this were opened by the files that included this one
+    std::size_t m_floor = 0;
+    bool m_live = true;
+    // Whether a skipped line left a comment open, which hides any
+    // directives until it's closed
+    bool m_inComment = false;
+    // Reused by each #if and #elif
+    mutable ConditionParser::Stack m_stack;
+    bool test(Directive directive, std::string_view rest, const SymbolTable &symbols,
+	      std::ostream &errors) const;
+public:
+    // Back to no blocks open, as at the start of an input
+    void clear()
+    {
+	m_blocks.clear();
+	m_floor = 0;
+	m_live = true;
+	m_inComment = false;
+    }
+    bool live() const { return m_live; }
+    bool open() const { return !m_blocks.empty(); }
+    std::size_t depth() const { return m_blocks.size(); }
+    // Acts on a directive, given the rest of its line
+    void apply(Directive directive, std::string_view rest, const SymbolTable &symbols,
+	       std::ostream &errors);
+    // Looks at a skipped line only as closely as it takes to find a
+    // directive, and the start of a comment that could hide one. Strings are
+    // stepped over since they could contain a `/*`. Returns the directive
+    // the line holds, if any.
+    Directive skipLine(std::string_view line, const SymbolTable &symbols, std::ostream &errors);
+    // An included file can't close blocks it didn't open. enterFile()
+    // returns what leaveFile() needs to restore the includer's view; if the
+    // file left blocks of its own open, they're closed and false returned.
+    std::size_t enterFile();
+    bool leaveFile(std::size_t outerFloor);
+    bool operator==(const Conditions &other) const
+    {
+	const auto same = [](const Block &a, const Block &b) {
+	    return a.outerLive == b.outerLive && a.taken == b.taken && a.sawElse == b.sawElse;
+	};
+	return m_floor == other.m_floor && m_live == other.m_live && m_inComment == other.m_inComment
+	    && std::equal(m_blocks.begin(), m_blocks.end(), other.m_blocks.begin(),
+			  other.m_blocks.end(), same);
+    }
+};
+
+bool Conditions::test(Directive directive, std::string_view rest, const SymbolTable &symbols,
+		      std::ostream &errors) const
+{
+    if(directive == Directive::If || directive == Directive::Elif) {
+	long long value = 0;
+	if(!ConditionParser(symbols, rest, m_stack).evaluate(value)) {
+	    errors << "\nError: malformed expression in #"
+		   << (directive == Directive::If ? "if" : "elif") << '\n';
+	    return false;
+	}
+	return value != 0;
+    }
+    const std::size_t start = std::min(rest.find_first_not_of(" \t"), rest.size());
+    std::size_t end = start;
+    while(end < rest.size() && isIdentChar(rest[end])) ++end;
+    const std::string_view name(rest.substr(start, end - start));
+    if(name.empty() || kindOf(name[0]) != CharKind::IdentStart) {
+	errors << "\nError: expected identifier after #"
+	       << (directive == Directive::Ifdef ? "ifdef" : "ifndef") << '\n';
+	return false;
+    }
+    const bool defined = symbols.find(name, hashText(name)) != nullptr;
+    return directive == Directive::Ifdef ? defined : !defined;
+}
+
+void Conditions::apply(Directive directive, std::string_view rest, const SymbolTable &symbols,
+		       std::ostream &errors)
+{
+    if(directive == Directive::If || directive == Directive::Ifdef
+       || directive == Directive::Ifndef) {
+	// Conditions nested in a skipped block aren't even evaluated
+	const bool live = m_live && test(directive, rest, symbols, errors);
+	m_blocks.push_back({m_live, live, false});
+	m_live = live;
+	return;
+    } else if(m_blocks.size() == m_floor) {
+	errors << (directive == Directive::Elif ? "\nError: #elif without #if\n"
+		   : directive == Directive::Else ? "\nError: #else without #if\n"
+		   : "\nError: #endif without #if\n");
+	return;
+    }
+    Block &block = m_blocks.back();
+    if(directive == Directive::Endif) {
+	m_live = block.outerLive;
+	m_blocks.pop_back();
+    } else if(block.sawElse) {
+	errors << (directive == Directive::Elif ? "\nError: #elif after #else\n"
+		   : "\nError: #else after #else\n");
+	m_live = false;
+    } else if(directive == Directive::Else) {
+	block.sawElse = true;
+	m_live = block.outerLive && !block.taken;
+	block.taken = true;
+    } else {
+	m_live = block.outerLive && !block.taken && test(directive, rest, symbols, errors);
+	block.taken = block.taken || m_live;
+    }
+}
+
+Directive Conditions::skipLine(std::string_view line, const SymbolTable &symbols,
+			       std::ostream &errors)
+{
+    if(!m_inComment) {
+	const std::size_t start = line.find_first_not_of(" \t");
+	if(start != std::string_view::npos && line[start] == '#') {
+	    std::size_t end = start + 1;
+	    while(end < line.size() && isIdentChar(line[end])) ++end;
+	    const std::string_view name(line.substr(start, end - start));
+	    const Directive directive = directiveOf(keywordOf(name, hashText(name)));
+	    if(directive != Directive::None) {
+		apply(directive, line.substr(end), symbols, errors);
+		return directive;
+	    }
+	}
+    }
+    std::size_t i = 0;
+    while(i < line.size()) {
+	if(m_inComment) {
+	    const std::size_t close = line.find("*/", i);
+	    if(close == std::string_view::npos) break;
+	    m_inComment = false;
+	    i = close + 2;
+	    continue;
+	}
+	const std::size_t stop = line.find_first_of("/\"'", i);
+	if(stop == std::string_view::npos) {
+	    break;
+	} else if(line[stop] != '/') {
+	    i = stringEnd(line, stop);
+	} else if(stop + 1 < line.size() && line[stop + 1] == '*') {
+	    m_inComment = true;
+	    i = stop + 2;
+	} else {
+	    i = stop + 1;
+	}
+    }
+    return Directive::None;
+}
+
+std::size_t Conditions::enterFile()
+{
+    const std::size_t outerFloor = m_floor;
+    m_floor = m_blocks.size();
+    return outerFloor;
+}
+
+bool Conditions::leaveFile(std::size_t outerFloor)
+{
+    const bool balanced = m_blocks.size() == m_floor;
+    if(!balanced) {
+	m_live = m_blocks[m_floor].outerLive;
+	m_blocks.resize(m_floor);
+    }
+    m_inComment = false;
+    m_floor = outerFloor;
+    return balanced;
+}
+
+// A map from strings to values that never change once added, which any
+// number of threads can read without locking. Adds are serialized by a mutex
+// and published with a release store, so a reader that finds a slot taken
+// sees all of it. Outgrown tables are kept until the map goes, since a
+// reader may still be probing one; a reader there can only miss what was
+// added since, and adding it again just returns what's there.
+template<typename Value>
+class ConcurrentMap {
+private:
+    struct Node {
+	std::string key;
+	std::uint64_t hash;
+	Value value;
+    };
+    struct Table {
+	std::size_t mask;
+	std::unique_ptr<std::atomic<const Node*>[]> slots;
+	explicit Table(std::size_t size)
+	    : mask(size - 1), slots(new std::atomic<const Node*>[size])
+	{
+	    for(std::size_t i = 0; i < size; ++i) {
+		slots[i].store(nullptr, std::memory_order_relaxed);
+	    }
+	}
+    };
+    std::atomic<const Table*> m_table;
+    // Only touched with m_mutex held
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<Table>> m_tables;
+    std::vector<std::unique_ptr<Node>> m_nodes;
+    static void place(Table &table, const Node *node, std::memory_order order)
+    {
+	std::size_t i = node->hash & table.mask;
+	while(table.slots[i].load(std::memory_order_relaxed) != nullptr) {
+	    i = (i + 1) & table.mask;
+	}
+	table.slots[i].store(node, order);
+    }
+public:
+    ConcurrentMap()
+    {
+	m_tables.push_back(std::make_unique<Table>(64));
+	m_table.store(m_tables.back().get(), std::memory_order_release);
+    }
+    bool find(std::string_view key, std::uint64_t hash, Value &value) const;
+    // Adds value under key unless another thread got there first; either
+    // way, returns the value the key ends up with
+    Value insert(std::string_view key, std::uint64_t hash, Value value);
+};
+
+template<typename Value>
+bool ConcurrentMap<Value>::find(std::string_view key, std::uint64_t hash, Value &value) const
+{
+    const Table &table = *m_table.load(std::memory_order_acquire);
+    for(std::size_t i = hash & table.mask;; i = (i + 1) & table.mask) {
+	const Node *node = table.slots[i].load(std::memory_order_acquire);
+	if(node == nullptr) {
+	    return false;
+	} else if(node->hash == hash && node->key == key) {
+	    value = node->value;
+	    return true;
+	}
+    }
+}
+
+template<typename Value>
+Value ConcurrentMap<Value>::insert(std::string_view key, std::uint64_t hash, Value value)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    Value existing;
+    if(find(key, hash, existing)) {
+	return existing;
+    }
+    Table *table = m_tables.back().get();
+    // Kept at most half full
+    if((m_nodes.size() + 1) * 2 > table->mask + 1) {
+	m_tables.push_back(std::make_unique<Table>((table->mask + 1) * 2));
+	table = m_tables.back().get();
+	for(const auto &node : m_nodes) {
+	    place(*table, node.get(), std::memory_order_relaxed);
+	}
+	m_table.store(table, std::memory_order_release);
+    }
+    m_nodes.push_back(std::make_unique<Node>(Node{std::string(key), hash, value}));
+    place(*table, m_nodes.back().get(), std::memory_order_release);
+    return value;
+}
+
+// A file that's been #included, loaded once for the whole process
+struct IncludedFile {
+    // Canonical path, and the directory quoted includes in it start from
+    std::string path;
+    std::string directory;
+    SourceFile source;
+    // Where preprocessing it starts: past a leading `#pragma once`, if any
+    std::size_t start = 0;
+    bool pragmaOnce = false;
+    // If the whole file is inside `#ifndef NAME` ... `#endif`, NAME, since
+    // including the file once NAME is defined does nothing at all
+    std::string guard;
+    std::uint64_t guardHash = 0;
+    std::string_view text() const
+    {
+	return std::string_view(source.begin(), source.size()).substr(start);
+    }
+};
+
+// One #include a run looked up, and what it found. Together they're what
+// the output cache checks to tell whether a stored result still holds.
+struct IncludeUse {
+    std::string directory;
+    std::string name;
+    bool quoted;
+    const IncludedFile *file;
+};
+
+// Splits the rest of an #include line into the file's name and whether it
+// was quoted rather than in angle brackets. Returns false if it's neither.
+bool includeName(std::string_view rest, std::string_view &name, bool &quoted)
+{
+    const std::size_t open = rest.find_first_not_of(" \t");
+    if(open == std::string_view::npos || (rest[open] != '"' && rest[open] != '<')) {
+	return false;
+    }
+    quoted = rest[open] == '"';
+    const std::size_t close = rest.find(quoted ? '"' : '>', open + 1);
+    if(close == std::string_view::npos || close == open + 1) {
+	return false;
+    }
+    name = rest.substr(open + 1, close - open - 1);
+    return true;
+}
+
+// Finds #include files along the search paths and keeps every one it's
+// loaded, mapped, for any thread to use. Both where a name leads from a
+// given directory and what's in each file are cached, so including the
+// same file again costs two lookups and no system calls.
+class IncludeCache {
+private:
+    std::vector<std::string> m_searchPaths;
+    // Keyed by including directory and name as written; nullptr if the name
+    // leads nowhere
+    ConcurrentMap<const IncludedFile*> m_resolved;
+    // Keyed by canonical path, so that different names for one file share it
+    ConcurrentMap<const IncludedFile*> m_files;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<IncludedFile>> m_owned;
+    const IncludedFile* load(const std::filesystem::path &path);
+public:
+    void addSearchPath(std::string path) { m_searchPaths.push_back(std::move(path)); }
+    const std::vector<std::string>& searchPaths() const { return m_searchPaths; }
+    // The file an #include of name from a file in directory means: for a
+    // quoted name, directory first, then the search paths in order; for a
+    // name in angle brackets, only the search paths. nullptr if not found.
+    const IncludedFile* find(std::string_view directory, std::string_view name, bool quoted);
+};
+
+// Whether name could have been the name in a #define
+inline bool isSymbolName(std::string_view name)
+{
+    return !name.empty() && kindOf(name[0]) == CharKind::IdentStart
+	&& std::all_of(name.begin(), name.end(), isIdentChar<>);
+}
+
+// text without the blanks at either end
+inline std::string_view trimmed(std::string_view text)
+{
+    const std::size_t start = std::min(text.find_first_not_of(" \t\r"), text.size());
+    return text.substr(start, text.find_last_not_of(" \t\r") + 1 - start);
+}
+
+// Sets start, pragmaOnce and guard from a quick scan of the file, tokenized
+// just as preprocessing it would be, so that a guard is only taken as one if
+// skipping the file while the guard is defined is exactly what preprocessing
+// it would do.
+void analyzeInclude(IncludedFile &file)
+{
+    const std::string_view text(file.source.begin(), file.source.size());
+    Scanner scanner(text);
+    scanner.setLog(nullptr);
+    // Tokens of nothing but newlines don't count
+    const auto significant = [&scanner]() {
+	Token token = scanner.nextToken();
+	while(token.state != State::EoF && token.state != State::Bad
+	      && token.text.find_first_not_of('\n') == std::string_view::npos) {
+	    token = scanner.nextToken();
+	}
+	return token;
+    };
+    Token token = significant();
+    if(token.keyword == Keyword::Pragma) {
+	if(trimmed(scanner.nextLine()) != "once") {
+	    return;
+	}
+	file.pragmaOnce = true;
+	file.start = scanner.position() - text.data();
+	token = significant();
+    }
+    if(directiveOf(token.keyword) != Directive::Ifndef) {
+	return;
+    }
+    const std::string_view name(trimmed(scanner.nextLine()));
+    if(!isSymbolName(name)) {
+	return;
+    }
+    // Run the skip the way it would go with the guard defined. An #elif or
+    // #else of the guard's own block means there's more to the file.
+    const SymbolTable noSymbols;
+    std::ostringstream errors;
+    Conditions conditions;
+    conditions.apply(Directive::If, "0", noSymbols, errors);
+    while(!conditions.live() && scanner.hasNext()) {
+	const Directive directive = conditions.skipLine(scanner.nextLine(), noSymbols, errors);
+	if((directive == Directive::Elif || directive == Directive::Else)
+	   && conditions.depth() == 1) {
+	    return;
+	}
+    }
+    if(conditions.open() || significant().state != State::EoF || scanner.hadError()) {
+	return;
+    }
+    file.guard.assign(name);
+    file.guardHash = hashText(name);
+}
+
+const IncludedFile* IncludeCache::load(const std::filesystem::path &path)
+{
+    std::error_code error;
+    const std::filesystem::path canonical(std::filesystem::canonical(path, error));
+    if(error || !std::filesystem::is_regular_file(canonical, error)) {
+	return nullptr;
+    }
+    const std::string key(canonical.string());
+    const std::uint64_t hash = hashText(key);
+    const IncludedFile *file = nullptr;
+    if(m_files.find(key, hash, file)) {
+	return file;
+    }
+    auto loaded = std::make_unique<IncludedFile>();
+    if(!loaded->source.open(key)) {
+	return nullptr;
+    }
+    loaded->path = key;
+    loaded->directory = canonical.parent_path().string();
+    analyzeInclude(*loaded);
+    file = m_files.insert(key, hash, loaded.get());
+    if(file == loaded.get()) {
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_owned.push_back(std::move(loaded));
+    }
+    return file;
+}
+
+const IncludedFile* IncludeCache::find(std::string_view directory, std::string_view name,
+				       bool quoted)
+{
+    std::string key(directory);
+    key += '\0';
+    key += quoted ? '"' : '<';
+    key += name;
+    const std::uint64_t hash = hashText(key);
+    const IncludedFile *file = nullptr;
+    if(m_resolved.find(key, hash, file)) {
+	return file;
+    }
+    const std::filesystem::path relative(name);
+    if(relative.is_absolute()) {
+	file = load(relative);
+    } else {
+	if(quoted) {
+	    file = load(std::filesystem::path(directory) / relative);
+	}
+	for(std::size_t i = 0; file == nullptr && i < m_searchPaths.size(); ++i) {
+	    file = load(std::filesystem::path(m_searchPaths[i]) / relative);
+	}
+    }
+    return m_resolved.insert(key, hash, file);
+}
+
+// What every input in a run shares: where #includes are found, the
+// symbols defined before any input starts, and how output is laid out
+struct Session {
+    IncludeCache includes;
+    // Backs predefined's names and values once loaded
+    SourceFile predefinedImage;
+    // Every input's symbols are layered on this, which must stay as it is
+    // while any input is being preprocessed
+    SymbolTable predefined;
+    // What predefined was made from, for the output cache: the hash stored
+    // in the image loaded, if any, and each -D and -U, in order
+    std::uint64_t imageHash = 0;
+    std::vector<std::string> predefinitions;
+    Whitespace whitespace = Whitespace::Tokens;
+    // Starts predefined off with the symbols in a .gsym file, mapped and
+    // used as it is; false if it can't be read or isn't one
+    bool loadSymbols(const std::string &path)
+    {
+	if(!predefinedImage.open(path)) {
+	    return false;
+	}
+	return predefined.load(std::string_view(predefinedImage.begin(), predefinedImage.size()),
+			       imageHash);
+    }
+    bool define(std::string_view definition);
+    bool undefine(std::string_view name);
+};
+
+// Defines a symbol from the command line, given as it is after -D: NAME or
+// NAME(params) alone, which defines it as 1 the way C compilers do, or
+// followed by `=` and its value. Returns false if it's malformed. The value
+// is passed on just as a #define line would have it, so it behaves the same.
+bool Session::define(std::string_view definition)
+{
+    const std::size_t nameEnd = std::min(definition.find_first_of("(="), definition.size());
+    const std::string_view name(definition.substr(0, nameEnd));
+    std::size_t bodyStart = nameEnd;
+    if(nameEnd < definition.size() && definition[nameEnd] == '(') {
+	bodyStart = definition.find(')', nameEnd);
+	if(bodyStart == std::string_view::npos) {
+	    return false;
+	}
+	++bodyStart;
+    }
+    if(!isSymbolName(name) || (bodyStart < definition.size() && definition[bodyStart] != '=')) {
+	return false;
+    }
+    const std::string_view body(bodyStart < definition.size()
+				? definition.substr(bodyStart + 1) : std::string_view("1"));
+    std::string value(definition.substr(nameEnd, bodyStart - nameEnd));
+    if(!body.empty()) {
+	value += ' ';
+	value += body;
+    }
+    std::vector<BodyToken> tokens;
+    bool redefined = false;
+    if(!defineMacro(predefined, name, hashText(name), value, tokens, redefined)) {
+	return false;
+    }
+    predefinitions.push_back("-D" + std::string(definition));
+    return true;
+}
+
+// Removes a symbol from the command line. Returns false only if name can't
+// be a symbol; one that isn't defined is fine, as in C.
+bool Session::undefine(std::string_view name)
+{
+    if(!isSymbolName(name)) {
+	return false;
+    }
+    predefined.undefine(name, hashText(name));
+    predefinitions.push_back("-U" + std::string(name));
+    return true;
+}
+
+// Where in the input an identifier token's name starts, given where the
+// token ends. Its text can have newlines that came before it ahead of the
+// name, and they weren't necessarily right next to it.
+inline const char* nameStart(std::string_view name, const char *end)
+{
+    return end - (name.size() - name.find_first_not_of('\n'));
+}
+
+// Steps for the usual case: a single pass with one symbol table, writing
+// straight to the output
+class DirectSteps {
+private:
+    SymbolTable m_symbols;
+    OutputBuffer &m_output;
+    std::ostream *m_errors;
+    // Reused for each definition's body
+    std::vector<BodyToken> m_body;
+    // A call to a function-like macro: either just its name so far, with
+    // the `(` yet to come, or a name and part of an argument list
+    enum class Call { None, Pending, Collecting };
+    Call m_call = Call::None;
+    std::string m_callName;
+    std::uint32_t m_callMacro = 0;
+    std::string m_callText;
+    // Where the argument list is up to: how deep in parentheses, and what
+    // quote it's inside, if any
+    std::size_t m_callDepth = 0;
+    char m_callQuote = 0;
+    bool m_callEscape = false;
+    MacroExpander m_expander;
+    std::string m_expansion;
+    Conditions m_conditions;
+    IncludeCache &m_includes;
+    // The directory of each file being read, innermost last: the input's,
+    // held in m_directory, then those of the files it's included
+    std::string m_directory;
+    std::vector<std::string_view> m_directories;
+    // Files included so far that have `#pragma once`
+    std::vector<const IncludedFile*> m_onceFiles;
+    // Only kept if asked for, since each takes a couple of strings
+    std::vector<IncludeUse> m_includeUses;
+    bool m_recordIncludes = true;
+    // Whether an included file had a fatal error
+    bool m_failed = false;
+    // For Whitespace::Preserve: the scanner reading the input, where its
+    // current step starts, and how much of the input before that has been
+    // copied out or dropped. While a call is being read, where its name
+    // starts, or if it started before what the input now holds, the text
+    // of it so far.
+    bool m_preserve;
+    const Scanner *m_scanner = nullptr;
+    const char *m_stepStart = nullptr;
+    const char *m_copied = nullptr;
+    const char *m_callStart = nullptr;
+    std::string m_heldCall;
+    // Where the last run that was tried for passing through stopped
+    const char *m_passBlocked = nullptr;
+    void flushPendingCall();
+    void collect(std::string_view text);
+    void drop();
+public:
+    // Deep enough for any real include graph, and a stop to cycles
+    static constexpr std::size_t MaxIncludeDepth = 200;
+    // Quoted includes in the input are looked for in directory first
+    DirectSteps(OutputBuffer &output, Session &session, std::string_view directory,
+		std::ostream &errors = std::cerr)
+	: m_output(output), m_includes(session.includes)
+    {
+	reset(session, directory, errors);
+    }
+    // Starts over on another input, as if newly made, but keeping the
+    // memory every table, buffer and stack has grown to. session must have
+    // the same includes as the one the steps were made with.
+    void reset(const Session &session, std::string_view directory, std::ostream &errors);
+    // Where the steps taken from here on are read from, as the scanner
+    // passed to runSteps(), which only Whitespace::Preserve has to know
+    void copyFrom(const Scanner &scanner)
+    {
+	m_scanner = &scanner;
+	m_copied = scanner.position();
+	m_passBlocked = scanner.position();
+    }
+    // For Whitespace::Preserve, copies out the input up to upTo, except for
+    // any call being read, which is held back in case it's replaced
+    void copy(const char *upTo);
+    void step(const char *position) { m_stepStart = position; }
+    void define(std::string_view symbol, std::uint64_t hash, std::string_view value);
+    void conditional(Directive directive, std::string_view rest);
+    bool skipping() const { return !m_conditions.live(); }
+    // Only Whitespace::Preserve has nothing to do for text with no macros
+    // in it, and then only outside a call
+    const char* passThrough(const char *from, const char *end)
+    {
+	if(!m_preserve || m_call != Call::None || from < m_passBlocked) {
+	    return from;
+	}
+	return passThroughEnd(from, end, m_symbols, m_passBlocked);
+    }
+    void skippedLine(std::string_view line)
+    {
+	drop();
+	m_conditions.skipLine(line, m_symbols, *m_errors);
+    }
+    bool include(std::string_view before, std::string_view rest);
+    void identifier(std::string_view name, std::uint64_t hash);
+    void text(std::string_view text, bool fromInput = true);
+    void error(std::string_view message) { *m_errors << message; }
+    // Called once the input has run out
+    void finish();
+    bool failed() const { return m_failed; }
+    // Every #include looked up so far, in order, repeats and all, unless
+    // recordIncludes(false) was called before the first
+    const std::vector<IncludeUse>& includeUses() const { return m_includeUses; }
+    void recordIncludes(bool record) { m_recordIncludes = record; }
+    // Hands over the symbols as they stand, leaving none behind
+    SymbolTable takeSymbols() { return std::move(m_symbols); }
+    // For picking a run up part way through a file (see Document): whether
+    // no step is left half done, the state that carries on to the next one,
+    // and setting that state. resume() shares names and values with symbols.
+    bool settled() const { return m_call == Call::None && m_directories.size() == 1; }
+    const SymbolTable& symbols() const { return m_symbols; }
+    const Conditions& conditions() const { return m_conditions; }
+    const std::vector<const IncludedFile*>& onceFiles() const { return m_onceFiles; }
+    void resume(const SymbolTable &symbols, const Conditions &conditions,
+		const std::vector<const IncludedFile*> &onceFiles)
+    {
+	m_symbols.copyFrom(symbols);
+	m_conditions = conditions;
+	m_onceFiles = onceFiles;
+    }
+};
+
+void DirectSteps::reset(const Session &session, std::string_view directory, std::ostream &errors)
+{
+    m_errors = &errors;
+    m_symbols.layerOn(session.predefined);
+    m_call = Call::None;
+    m_callName.clear();
+    m_callText.clear();
+    m_callDepth = 0;
+    m_callQuote = 0;
+    m_callEscape = false;
+    m_conditions.clear();
+    m_directory.assign(directory);
+    m_directories.assign(1, m_directory);
+    m_onceFiles.clear();
+    m_includeUses.clear();
+    m_recordIncludes = true;
+    m_failed = false;
+    m_preserve = session.whitespace == Whitespace::Preserve;
+    m_scanner = nullptr;
+    m_stepStart = m_copied = m_callStart = m_passBlocked = nullptr;
+    m_heldCall.clear();
+}
+
+void DirectSteps::define(std::string_view symbol, std::uint64_t hash, std::string_view value)
+{
+    if(m_call == Call::Pending) {
+	flushPendingCall();
+    }
+    drop();
+    bool redefined = false;
+    if(!defineMacro(m_symbols, symbol, hash, value, m_body, redefined)) {
+	*m_errors << "\nError: malformed parameter list for macro " << symbol << '\n';
+	return;
+    }
+    if(redefined) {
+	m_output.write("\nWarning: symbol ");
+	m_output.write(symbol);
+	m_output.write(" redefined\n");
+    }
+}
+
+void DirectSteps::conditional(Directive directive, std::string_view rest)
+{
+    if(m_call == Call::Pending) {
+	flushPendingCall();
+    }
+    drop();
+    m_conditions.apply(directive, rest, m_symbols, *m_errors);
+}
+
+// Preprocesses an included file in place, with the same symbols and output.
+// before is whatever the directive's token had ahead of the `#`.
+bool DirectSteps::include(std::string_view before, std::string_view rest)
+{
+    std::string_view name;
+    bool quoted = false;
+    if(!includeName(rest, name, quoted)) {
+	return false;
+    }
+    const IncludedFile *file = m_includes.find(m_directories.back(), name, quoted);
+    if(m_recordIncludes) {
+	m_includeUses.push_back({std::string(m_directories.back()), std::string(name), quoted, file});
+    }
+    if(file == nullptr) {
+	return false;
+    }
+    drop();
+    if(!before.empty()) {
+	text(before, false);
+    }
+    if(m_call == Call::Pending) {
+	flushPendingCall();
+    }
+    // Files that can't have any effect are skipped without being read again
+    if(!file->guard.empty() && m_symbols.find(file->guard, file->guardHash) != nullptr) {
+	return true;
+    } else if(file->pragmaOnce) {
+	if(std::find(m_onceFiles.begin(), m_onceFiles.end(), file) != m_onceFiles.end()) {
+	    return true;
+	}
+	m_onceFiles.push_back(file);
+    }
+    if(m_directories.size() > MaxIncludeDepth) {
+	*m_errors << "\nError: #include nested too deeply in " << file->path << '\n';
+	return true;
+    }
+    m_directories.push_back(file->directory);
+    const std::size_t outerFloor = m_conditions.enterFile();
+    const std::string_view source(file->text());
+    Scanner scanner(source);
+    scanner.setLog(m_errors);
+    const Scanner *outerScanner = m_scanner;
+    const char *outerStep = m_stepStart;
+    const char *outerCopied = m_copied;
+    const char *outerBlocked = m_passBlocked;
+    copyFrom(scanner);
+    runSteps(scanner, *this, source.data() + source.size());
+    copy(scanner.position());
+    m_scanner = outerScanner;
+    m_stepStart = outerStep;
+    m_copied = outerCopied;
+    m_passBlocked = outerBlocked;
+    m_failed = m_failed || scanner.hadError();
+    // As in C, a file ends its last line even if it's missing a newline
+    if(!source.empty() && source.back() != '\n') {
+	text("\n", false);
+    }
+    if(!m_conditions.leaveFile(outerFloor)) {
+	*m_errors << "\nError: unterminated #if in " << file->path << '\n';
+    }
+    m_directories.pop_back();
+    return true;
+}
+
+void DirectSteps::identifier(std::string_view name, std::uint64_t hash)
+{
+    if(m_call == Call::Collecting) {
+	collect(name);
+	collect(" ");
+	return;
+    } else if(m_call == Call::Pending) {
+	flushPendingCall();
+    }
+    const std::size_t index = m_symbols.indexOf(name, hash);
+    if(m_preserve && index == m_symbols.size()) {
+	return;
+    } else if(index == m_symbols.size()) {
+	m_output.write(name);
+    } else if(m_symbols.at(index).paramCount >= 0) {
+	// Only a call if a `(` comes next
+	m_call = Call::Pending;
+	m_callName.assign(name);
+	m_callMacro = static_cast<std::uint32_t>(index);
+	if(m_preserve) {
+	    m_callStart = nameStart(name, m_scanner->position());
+	}
+	return;
+    } else if(m_preserve) {
+	// The blanks around it were only there to set it apart in its #define
+	copy(nameStart(name, m_scanner->position()));
+	m_output.write(trimmed(m_symbols.at(index).value));
+	m_copied = m_scanner->position();
+	stats::substitution();
+	return;
+    } else {
+	m_output.write(m_symbols.at(index).value);
+	stats::substitution();
+    }
+    m_output.put(' ');
+}
+
+void DirectSteps::text(std::string_view text, bool fromInput)
+{
+    if(m_call == Call::Pending) {
+	const std::size_t open = text.find_first_not_of(" \t\n");
+	if(open != std::string_view::npos && text[open] == '(') {
+	    m_call = Call::Collecting;
+	    m_callText.clear();
+	    m_callDepth = 0;
+	    m_callQuote = 0;
+	    m_callEscape = false;
+	    collect(text.substr(open));
+	    return;
+	}
+	flushPendingCall();
+    } else if(m_call == Call::Collecting) {
+	collect(text);
+	return;
+    }
+    if(!m_preserve) {
+	m_output.write(text);
+    } else if(!fromInput) {
+	copy(m_stepStart);
+	m_output.write(text);
+    }
+}
+
+// A function-like macro's name without a call is left as it is
+void DirectSteps::flushPendingCall()
+{
+    m_call = Call::None;
+    if(m_preserve) {
+	// Whatever of it wasn't held back is still to be copied
+	m_output.write(m_heldCall);
+	m_heldCall.clear();
+	m_callStart = nullptr;
+	return;
+    }
+    m_output.write(m_callName);
+    m_output.put(' ');
+}
+
+void DirectSteps::copy(const char *upTo)
+{
+    if(!m_preserve || upTo <= m_copied) {
+	return;
+    } else if(m_call == Call::None) {
+	m_output.write(std::string_view(m_copied, upTo - m_copied));
+    } else {
+	const char *callStart = m_callStart != nullptr ? m_callStart : m_copied;
+	m_output.write(std::string_view(m_copied, callStart - m_copied));
+	m_heldCall.append(callStart, upTo - callStart);
+	m_callStart = nullptr;
+    }
+    m_copied = upTo;
+}
+
+// Leaves the step just read out of the output, for Whitespace::Preserve
+void DirectSteps::drop()
+{
+    if(m_preserve) {
+	copy(m_stepStart);
+	m_copied = m_scanner->position();
+    }
+}
+
+// Adds text to the argument list being read, expanding the call once the
+// list is closed. Whatever follows the `)` in the same token is passed on as
+// it is.
+void DirectSteps::collect(std::string_view text)
+{
+    for(std::size_t i = 0; i < text.size(); ++i) {
+	const char c = text[i];
+	if(m_callQuote != 0) {
+	    if(m_callEscape) {
+		m_callEscape = false;
+	    } else if(c == '\\') {
+		m_callEscape = true;
+	    } else if(c == m_callQuote || c == '\n') {
+		m_callQuote = 0;
+	    }
+	} else if(c == '\'' || c == '"') {
+	    m_callQuote = c;
+	} else if(c == '(') {
+	    ++m_callDepth;
+	} else if(c == ')' && --m_callDepth == 0) {
+	    m_callText.append(text.data(), i + 1);
+	    m_call = Call::None;
+	    if(m_preserve) {
+		// The call is replaced from its name to the end of the token
+		if(m_callStart != nullptr) {
+		    m_output.write(std::string_view(m_copied, m_callStart - m_copied));
+		}
+		m_heldCall.clear();
+		m_callStart = nullptr;
+		m_copied = m_scanner->position();
+	    }
+	    m_expansion.clear();
+	    m_expander.expand(m_symbols, m_callMacro, m_callName, m_callText, m_expansion);
+	    *m_errors << m_expander.messages();
+	    m_output.write(m_expansion);
+	    if(i + 1 < text.size()) {
+		m_output.write(text.substr(i + 1));
+	    } else if(!m_preserve) {
+		m_output.put(' ');
+	    }
+	    return;
+	}
+    }
+    m_callText += text;
+}
+
+void DirectSteps::finish()
+{
+    if(m_call == Call::Pending) {
+	flushPendingCall();
+    } else if(m_call == Call::Collecting) {
+	*m_errors << "\nError: unterminated call to macro " << m_callName << '\n';
+	if(m_preserve) {
+	    flushPendingCall();
+	} else {
+	    m_call = Call::None;
+	    m_output.write(m_callName);
+	    m_output.put(' ');
+	    m_output.write(m_callText);
+	}
+    }
+    if(m_preserve) {
+	copy(m_scanner->position());
+    }
+    if(m_conditions.open()) {
+	*m_errors << "\nError: unterminated #if\n";
+    }
+}
+
+// A fixed-size window onto input that arrives incrementally, like a pipe.
+// Once the scanner is done with the front of the window, the rest is slid
+// down to make room for more; the window only grows if a single step (say
+// one enormous line) doesn't fit in it. Fuzzing builds shrink it with
+// -DINPUT_WINDOW_SIZE, so that small inputs still slide through it.
+#ifndef INPUT_WINDOW_SIZE
+    #define INPUT_WINDOW_SIZE (64 * 1024)
+#endif
+class InputWindow {
+private:
+    std::vector<char> m_data;
+    std::size_t m_size = 0;
+    // Reads ahead while the window is being scanned
+    io::Reader m_reader;
+    // What's left of the last block read that didn't fit in the window
+    std::string_view m_pending;
+    bool m_eof = false;
+public:
+    explicit InputWindow(int fd) : m_data(INPUT_WINDOW_SIZE), m_reader(fd) {}
+    // Drops everything before keep, then reads whatever input is available
+    // into the space freed up. Returns false on a read error.
+    bool refill(const char *keep);
+    std::string_view data() const { return {m_data.data(), m_size}; }
+    // Whether the window now holds everything up to the end of the input
+    bool eof() const { return m_eof; }
+};
+
+bool InputWindow::refill(const char *keep)
+{
+    const stats::PhaseTimer timer(stats::Phase::Read);
+    const std::size_t kept = m_data.data() + m_size - keep;
+    std::memmove(m_data.data(), keep, kept);
+    m_size = kept;
+    if(m_size == m_data.size()) {
+	m_data.resize(m_data.size() * 2);
+    }
+    if(m_pending.empty() && !m_reader.next(m_pending)) {
+	return false;
+    }
+    const std::size_t count = std::min(m_pending.size(), m_data.size() - m_size);
+    std::memcpy(m_data.data() + m_size, m_pending.data(), count);
+    m_pending.remove_prefix(count);
+    m_size += count;
+    m_eof = count == 0;
+    return true;
+}
+
+// Steps for streaming input. Diagnostics are held back until the step they
+// belong to is known to be complete, since an unfinished step will be redone.
+class StreamSteps : public DirectSteps {
+private:
+    std::ostringstream &m_log;
+    const char *m_stepStart = nullptr;
+    std::streamoff m_logMark = 0;
+public:
+    StreamSteps(OutputBuffer &output, Session &session, std::ostringstream &log)
+	: DirectSteps(output, session, ".", log), m_log(log) {}
+    void step(const char *position)
+    {
+	DirectSteps::step(position);
+	m_stepStart = position;
+	m_logMark = m_log.tellp();
+    }
+    const char* stepStart() const { return m_stepStart; }
+    // Sends on the diagnostics of every step before the unfinished one
+    void flushLog(bool includeLastStep)
+    {
+	const std::string text(m_log.str());
+	std::cerr << (includeLastStep ? text : text.substr(0, m_logMark));
+	m_log.str({});
+	m_logMark = 0;
+    }
+};
+
+// Preprocesses input from fd as it arrives, holding only a small window of
+// it in memory at once. Output is flushed each time the input read so far
+// has been processed, so each line comes out as soon as it's complete, less
+// the newline of one that ends in a name, string or comment: that's read as
+// part of the next token, so it waits for the next line.
+bool preprocessStream(int fd, OutputBuffer &output, Session &session)
+{
+    InputWindow window(fd);
+    Scanner scanner({});
+    std::ostringstream log;
+    scanner.setLog(&log);
+    StreamSteps steps(output, session, log);
+    if(!window.refill(window.data().data())) {
+	std::cerr << "Error: failed to read input\n";
+	return false;
+    } else if(window.eof()) {
+	// Empty input
+	return false;
+    }
+    while(true) {
+	const std::string_view text(window.data());
+	scanner.reset(text, window.eof());
+	steps.copyFrom(scanner);
+	runSteps(scanner, steps, text.data() + text.size());
+	steps.flushLog(!scanner.needsMore());
+	const char *resume = scanner.needsMore() ? steps.stepStart() : scanner.position();
+	// What's before the next window can't be copied out of it
+	steps.copy(resume);
+	output.flush();
+	if(window.eof() || scanner.hadError()) {
+	    break;
+	}
+	if(!window.refill(resume)) {
+	    std::cerr << "Error: failed to read input\n";
+	    return false;
+	}
+    }
+    steps.finish();
+    steps.flushLog(true);
+    output.flush();
+    return !scanner.hadError() && !steps.failed();
+}
+
+// Calls task(worker, i) for every i in [0, count), spread over the given
+// number of threads, with the calling thread as worker 0
+template<typename Task>
+void parallelFor(std::size_t jobs, std::size_t count, const Task &task)
+{
+    jobs = std::max<std::size_t>(1, std::min(jobs, count));
+    WorkQueues queues(jobs, count);
+    const auto work = [&](std::size_t worker) {
+	std::size_t item;
+	while(queues.next(worker, item)) {
+	    task(worker, item);
+	}
+    };
+    std::vector<std::thread> workers;
+    for(std::size_t w = 1; w < jobs; ++w) {
+	workers.emplace_back(work, w);
+    }
+    work(0);
+    for(auto &worker : workers) {
+	worker.join();
+    }
+}
+
+// Splitting a single file across threads works in two parallel passes.
+// First, each chunk (starting at a line boundary) is scanned speculatively to
+// find where its steps start and which #defines it contains. Those guesses
+// are then checked in order: if the step that really crosses into a chunk
+// starts at one of that chunk's recorded step starts, the rest of its scan
+// is known to be right; otherwise the chunk is rescanned from there. With
+// every #define now known in order, the second pass substitutes and renders
+// all chunks at once, looking symbols up as of the point they appear at.
+namespace split {
+    // Chunks smaller than this aren't worth a thread. Fuzzing builds make it
+    // tiny with -DSPLIT_MIN_CHUNK_SIZE, so that small inputs are split too.
+#ifndef SPLIT_MIN_CHUNK_SIZE
+    #define SPLIT_MIN_CHUNK_SIZE (1024 * 1024)
+#endif
+    constexpr std::size_t MinChunkSize = SPLIT_MIN_CHUNK_SIZE;
+    // How many step starts to record per chunk when looking for the point
+    // where the speculative scan meets the real one
+    constexpr std::size_t MaxSyncSteps = 1024;
+
+    struct DefineSite {
+	const char *position;
+	std::string name;
+	std::uint64_t hash;
+	std::string_view value;
+    };
+
+    struct IncludeSite {
+	const char *position;
+	IncludeUse use;
+    };
+
+    // What the first pass learned about one chunk
+    struct ChunkScan {
+	// Where the chunk's scan began and where it had to stop
+	const char *start;
+	const char *stop;
+	// Where the first steps began, for syncing with the previous chunk
+	std::vector<const char*> steps;
+	std::vector<DefineSite> defines;
+	// Where any conditional directives and includes that were found are
+	std::vector<const char*> conditionals;
+	std::vector<IncludeSite> includes;
+	// Where the step after the chunk's last one starts
+	const char *end;
+	// Whether the input ended inside the chunk, and if it did with a
+	// fatal error
+	bool ended;
+	bool error;
+    };
+
+    // Steps for the first pass, which only records where things are
+    class ScanSteps {
+    private:
+	ChunkScan &m_chunk;
+	IncludeCache &m_includes;
+	std::string_view m_directory;
+	const char *m_step = nullptr;
+    public:
+	ScanSteps(ChunkScan &chunk, IncludeCache &includes, std::string_view directory)
+	    : m_chunk(chunk), m_includes(includes), m_directory(directory) {}
+	void step(const char *position)
+	{
+	    m_step = position;
+	    if(m_chunk.steps.size() < MaxSyncSteps) {
+		m_chunk.steps.push_back(position);
+	    }
+	}
+	void define(std::string_view symbol, std::uint64_t hash, std::string_view value)
+	{
+	    m_chunk.defines.push_back({m_step, std::string(symbol), hash, value});
+	}
+	void conditional(Directive, std::string_view) { m_chunk.conditionals.push_back(m_step); }
+	bool skipping() const { return false; }
+	// Every step start counts for syncing
+	const char* passThrough(const char *from, const char *) const { return from; }
+	void skippedLine(std::string_view) {}
+	// Whether a file is found here has to match the real pass
+	bool include(std::string_view, std::string_view rest)
+	{
+	    std::string_view name;
+	    bool quoted = false;
+	    if(!includeName(rest, name, quoted)) {
+		return false;
+	    }
+	    const IncludedFile *file = m_includes.find(m_directory, name, quoted);
+	    m_chunk.includes.push_back({m_step, {std::string(m_directory), std::string(name),
+						 quoted, file}});
+	    if(file == nullptr) {
+		return false;
+	    }
+	    m_chunk.conditionals.push_back(m_step);
+	    return true;
+	}
+	void identifier(std::string_view, std::uint64_t) {}
+	void text(std::string_view, bool = true) {}
+	void error(std::string_view) {}
+    };
+
+    void scanChunk(Scanner &scanner, ChunkScan &chunk, const char *from,
+		   IncludeCache &includes, std::string_view directory)
+    {
+	chunk.steps.clear();
+	chunk.defines.clear();
+	chunk.conditionals.clear();
+	chunk.includes.clear();
+	scanner.seek(from);
+	ScanSteps steps(chunk, includes, directory);
+	runSteps(scanner, steps, chunk.stop);
+	chunk.end = scanner.position();
+	chunk.ended = !scanner.hasNext();
+	chunk.error = scanner.hadError();
+    }
+
+    // Every #define in the file in order, so that the value a symbol had at
+    // any point can be looked up without replaying the defines before it
+    class DefineHistory {
+    private:
+	struct Version {
+	    std::size_t index;
+	    std::string_view value;
+	};
+	// Entry order in the table doubles as an id for each distinct name
+	SymbolTable m_names;
+	std::vector<std::vector<Version>> m_versions;
+	std::size_t m_count = 0;
+    public:
+	void add(const DefineSite &define);
+	// The value of the symbol once the first `count` defines have run,
+	// or nullptr if it didn't have one yet
+	const std::string_view* lookup(std::string_view name, std::uint64_t hash,
+				       std::size_t count) const;
+	// Every name defined anywhere in the file
+	const SymbolTable& names() const { return m_names; }
+    };
+
+    void DefineHistory::add(const DefineSite &define)
+    {
+	m_names.define(define.name, define.hash, {});
+	const std::size_t id = m_names.indexOf(define.name, define.hash);
+	if(id == m_versions.size()) {
+	    m_versions.emplace_back();
+	}
+	m_versions[id].push_back({m_count++, define.value});
+    }
+
+    const std::string_view* DefineHistory::lookup(std::string_view name, std::uint64_t hash,
+						  std::size_t count) const
+    {
+	const std::size_t id = m_names.indexOf(name, hash);
+	if(id == m_versions.size()) {
+	    return nullptr;
+	}
+	// Redefinitions are rare, so this is almost always one comparison
+	const auto &versions = m_versions[id];
+	for(auto version = versions.rbegin(); version != versions.rend(); ++version) {
+	    if(version->index < count) {
+		return &version->value;
+	    }
+	}
+	return nullptr;
+    }
+
+    // Steps for the second pass, rendering one chunk into memory. With
+    // Whitespace::Preserve, scanner is the one reading the chunk, which is
+    // copied out as DirectSteps does it.
+    class RenderSteps {
+    private:
+	const DefineHistory &m_history;
+	// How many defines come before the current step
+	std::size_t m_count;
+	std::string &m_output;
+	std::ostream &m_errors;
+	const Scanner *m_scanner;
+	const char *m_stepStart = nullptr;
+	const char *m_copied = nullptr;
+	const char *m_passBlocked = nullptr;
+    public:
+	RenderSteps(const DefineHistory &history, std::size_t count,
+		    std::string &output, std::ostream &errors, const Scanner *scanner)
+	    : m_history(history), m_count(count), m_output(output), m_errors(errors),
+	      m_scanner(scanner)
+	{
+	    if(m_scanner != nullptr) {
+		m_copied = m_scanner->position();
+		m_passBlocked = m_copied;
+	    }
+	}
+	// Copies out the input up to upTo
+	void copy(const char *upTo)
+	{
+	    if(m_scanner != nullptr && upTo > m_copied) {
+		m_output.append(m_copied, upTo - m_copied);
+		m_copied = upTo;
+	    }
+	}
+	void step(const char *position) { m_stepStart = position; }
+	void define(std::string_view symbol, std::uint64_t hash, std::string_view)
+	{
+	    if(m_scanner != nullptr) {
+		copy(m_stepStart);
+		m_copied = m_scanner->position();
+	    }
+	    if(m_history.lookup(symbol, hash, m_count) != nullptr) {
+		m_output += "\nWarning: symbol ";
+		m_output += symbol;
+		m_output += " redefined\n";
+	    }
+	    ++m_count;
+	}
+	// Files with conditionals or includes that are found are never split
+	void conditional(Directive, std::string_view) {}
+	bool skipping() const { return false; }
+	const char* passThrough(const char *from, const char *end)
+	{
+	    if(m_scanner == nullptr || from < m_passBlocked) {
+		return from;
+	    }
+	    return passThroughEnd(from, end, m_history.names(), m_passBlocked);
+	}
+	void skippedLine(std::string_view) {}
+	bool include(std::string_view, std::string_view) { return false; }
+	void identifier(std::string_view name, std::uint64_t hash)
+	{
+	    const std::string_view *value = m_history.lookup(name, hash, m_count);
+	    if(value != nullptr) {
+		stats::substitution();
+	    }
+	    if(m_scanner != nullptr) {
+		if(value != nullptr) {
+		    copy(nameStart(name, m_scanner->position()));
+		    m_output += trimmed(*value);
+		    m_copied = m_scanner->position();
+		}
+		return;
+	    }
+	    m_output += value == nullptr ? name : *value;
+	    m_output += ' ';
+	}
+	void text(std::string_view text, bool fromInput = true)
+	{
+	    if(m_scanner == nullptr) {
+		m_output += text;
+	    } else if(!fromInput) {
+		copy(m_stepStart);
+		m_output += text;
+	    }
+	}
+	void error(std::string_view message) { m_errors << message; }
+    };
+
+    // Chunks begin just after a newline, roughly evenly spaced
+    std::vector<ChunkScan> makeChunks(std::string_view source, std::size_t count)
+    {
+	std::vector<ChunkScan> chunks;
+	const char *start = source.data();
+	const char *end = source.data() + source.size();
+	for(std::size_t i = 1; i <= count; ++i) {
+	    const char *stop = end;
+	    if(i < count) {
+		stop = source.data() + source.size() * i / count;
+		const void *newline = std::memchr(stop, '\n', end - stop);
+		stop = newline != nullptr ? static_cast<const char*>(newline) + 1 : end;
+	    }
+	    if(stop > start) {
+		chunks.push_back({start, stop, {}, {}, {}, {}, nullptr, false, false});
+		start = stop;
+	    }
+	}
+	return chunks;
+    }
+
+    // A call to a function-like macro can run on past the end of a chunk,
+    // and what a conditional skips depends on the symbols defined so far, as
+    // do the symbols an included file sees, so files with any of these are
+    // done in a single pass. This looks for them on lines that start with a
+    // directive, which is cheap enough to do before the first pass; the
+    // rare ones it can't see, after a comment or broken up by a line splice,
+    // are still caught once the first pass has found them.
+    bool needsSinglePass(std::string_view source)
+    {
+	const char *begin = source.data();
+	const char *end = begin + source.size();
+	const auto skipBlanks = [end](const char *p) {
+	    while(p < end && (*p == ' ' || *p == '\t')) ++p;
+	    return p;
+	};
+	const auto skipName = [end](const char *p) {
+	    while(p < end && isIdentChar(*p)) ++p;
+	    return p;
+	};
+	for(const char *hash = begin;; ++hash) {
+	    hash = static_cast<const char*>(std::memchr(hash, '#', end - hash));
+	    if(hash == nullptr) {
+		return false;
+	    }
+	    const char *line = hash;
+	    while(line > begin && (line[-1] == ' ' || line[-1] == '\t')) --line;
+	    if(line > begin && line[-1] != '\n') {
+		continue;
+	    }
+	    const char *name = skipBlanks(hash + 1);
+	    const char *nameEnd = skipName(name);
+	    const std::string_view directive(name, nameEnd - name);
+	    if(directive == "define") {
+		const char *symbolEnd = skipName(skipBlanks(nameEnd));
+		if(symbolEnd < end && *symbolEnd == '(') {
+		    return true;
+		}
+	    } else if(directive == "if" || directive == "ifdef" || directive == "ifndef" ||
+		      directive == "elif" || directive == "else" || directive == "endif" ||
+		      directive == "include") {
+		return true;
+	    }
+	}
+    }
+
+    bool singlePass(std::string_view source, OutputBuffer &output, Session &session,
+		    std::string_view directory, std::ostream &errors,
+		    std::vector<IncludeUse> *uses)
+    {
+	Scanner scanner(source);
+	scanner.setLog(&errors);
+	DirectSteps steps(output, session, directory, errors);
+	steps.copyFrom(scanner);
+	runSteps(scanner, steps, source.data() + source.size());
+	steps.finish();
+	if(uses != nullptr) {
+	    *uses = steps.includeUses();
+	}
+	return !scanner.hadError() && !steps.failed();
+    }
+
+    // Preprocesses source using up to the given number of threads, with the
+    // same output as a single pass. Returns false on a fatal error. If uses
+    // isn't nullptr, every #include looked up is added to it.
+    bool preprocess(std::string_view source, OutputBuffer &output, Session &session,
+		    std::string_view directory, std::size_t jobs, std::ostream &errors,
+		    std::vector<IncludeUse> *uses)
+    {
+	if(needsSinglePass(source)) {
+	    return singlePass(source, output, session, directory, errors, uses);
+	}
+	const std::size_t chunkCount =
+	    std::max<std::size_t>(1, std::min(jobs, source.size() / MinChunkSize));
+	std::vector<ChunkScan> chunks(makeChunks(source, chunkCount));
+
+	// Pass 1: speculative scans to find step starts and defines
+	std::vector<Scanner> scanners(std::min(jobs, chunks.size()), Scanner(source));
+	for(auto &scanner : scanners) {
+	    scanner.setLog(nullptr);
+	}
+	parallelFor(jobs, chunks.size(), [&](std::size_t worker, std::size_t i) {
+	    scanChunk(scanners[worker], chunks[i], chunks[i].start, session.includes, directory);
+	});
+
+	// Check each chunk's guess against where the real steps cross into it
+	DefineHistory history;
+	std::vector<std::size_t> defineCounts(chunks.size(), 0);
+	std::size_t defineCount = 0;
+	const char *entry = source.data();
+	bool ended = false;
+	bool error = false;
+	bool serial = false;
+	for(std::size_t i = 0; i < chunks.size(); ++i) {
+	    ChunkScan &chunk = chunks[i];
+	    defineCounts[i] = defineCount;
+	    if(ended || entry >= chunk.stop) {
+		// Nothing starts in this chunk
+		chunk.start = chunk.end = entry;
+		chunk.defines.clear();
+		continue;
+	    }
+	    const bool synced = std::binary_search(chunk.steps.begin(), chunk.steps.end(), entry);
+	    if(!synced) {
+		scanChunk(scanners[0], chunk, entry, session.includes, directory);
+	    }
+	    chunk.start = entry;
+	    for(const DefineSite &define : chunk.defines) {
+		if(define.position >= entry) {
+		    history.add(define);
+		    ++defineCount;
+		    serial = serial || define.value.substr(0, 1) == "(";
+		}
+	    }
+	    serial = serial || std::any_of(chunk.conditionals.begin(), chunk.conditionals.end(),
+					   [&](const char *position) { return position >= entry; });
+	    for(const IncludeSite &include : chunk.includes) {
+		if(include.position >= entry && uses != nullptr) {
+		    uses->push_back(include.use);
+		}
+	    }
+	    entry = chunk.end;
+	    ended = chunk.ended;
+	    error = chunk.error;
+	}
+
+	// Directives that needsSinglePass() couldn't see
+	if(serial) {
+	    return singlePass(source, output, session, directory, errors, uses);
+	}
+
+	// Pass 2: substitute and render every chunk
+	std::vector<std::string> outputs(chunks.size());
+	std::vector<std::ostringstream> chunkErrors(chunks.size());
+	parallelFor(jobs, chunks.size(), [&](std::size_t worker, std::size_t i) {
+	    if(chunks[i].start == chunks[i].end) return;
+	    Scanner &scanner = scanners[worker];
+	    scanner.setLog(&chunkErrors[i]);
+	    scanner.seek(chunks[i].start);
+	    const bool preserve = session.whitespace == Whitespace::Preserve;
+	    RenderSteps steps(history, defineCounts[i], outputs[i], chunkErrors[i],
+			      preserve ? &scanner : nullptr);
+	    runSteps(scanner, steps, chunks[i].stop);
+	    steps.copy(scanner.position());
+	});
+	for(std::size_t i = 0; i < chunks.size(); ++i) {
+	    output.write(outputs[i]);
+	    errors << chunkErrors[i].str();
+	}
+	return !error;
+    }
+}
+
+// What a run leaves behind besides its output, for the output cache and
+// --emit-symbols: the diagnostics, which would otherwise have gone to stderr,
+// every #include looked up and, unless the file was split, the symbols
+// defined by its end
+struct RunRecord {
+    std::ostringstream errors;
+    std::vector<IncludeUse> includes;
+    SymbolTable symbols;
+};
+
+// What a thread that preprocesses one input after another keeps between
+// them, all writing to the same output: the scanner, and the steps with the
+// symbol table, buffers and stacks they've grown. Once it's been through a
+// few inputs, another one allocates nothing, barring a bigger one than any
+// yet.
+struct Workspace {
+    Scanner scanner;
+    DirectSteps steps;
+    Workspace(OutputBuffer &output, Session &session, std::string_view directory,
+	      std::ostream &errors = std::cerr)
+	: scanner({}), steps(output, session, directory, errors) {}
+};
+
+// The directory part of path, or "." if it has none, as a view of path
+// rather than a new string
+std::string_view directoryOf(std::string_view path)
+{
+    const std::size_t slash = path.rfind('/');
+    if(slash == std::string_view::npos) {
+	return ".";
+    }
+    const std::size_t end = path.find_last_not_of('/', slash);
+    return end == std::string_view::npos ? path.substr(0, 1) : path.substr(0, end + 1);
+}
+
+// Preprocesses the file at path, writing the result to output, optionally
+// splitting it across the given number of threads. Returns false if the
+// file couldn't be read or had a fatal error. If workspace is given, it's
+// reset and used instead of a new one; it must write to output. Diagnostics
+// go to the record if there is one, or else to log, or else to std::cerr.
+bool preprocess(const std::string &path, OutputBuffer &output, Session &session,
+		std::size_t splitJobs = 1, RunRecord *record = nullptr,
+		Workspace *workspace = nullptr, std::ostream *log = nullptr)
+{
+    std::ostream &errors = record != nullptr ? record->errors : log != nullptr ? *log : std::cerr;
+    // Standard input and other pipes are streamed rather than read whole
+    if(path == "-") {
+	return preprocessStream(STDIN_FILENO, output, session);
+    }
+    struct stat info;
+    if(stat(path.c_str(), &info) == 0 && S_ISFIFO(info.st_mode)) {
+	const int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd >= 0) {
+	    const bool ok = preprocessStream(fd, output, session);
+	    close(fd);
+	    return ok;
+	}
+    }
+    SourceFile source;
+    if(!source.open(path)) {
+	errors << "Error: file " << path << " can't be found\n";
+	return false;
+    } else if(source.size() == 0) {
+	return false;
+    }
+    const std::string_view text(source.begin(), source.size());
+    const std::string_view directory(directoryOf(path));
+    std::vector<IncludeUse> *uses = record != nullptr ? &record->includes : nullptr;
+    // The second pass of a split only knows about symbols defined in the
+    // file itself
+    if(splitJobs > 1 && text.size() >= 2 * split::MinChunkSize && session.predefined.size() == 0) {
+	return split::preprocess(text, output, session, directory, splitJobs, errors, uses);
+    }
+    std::optional<Workspace> local;
+    if(workspace == nullptr) {
+	workspace = &local.emplace(output, session, directory, errors);
+    } else {
+	workspace->steps.reset(session, directory, errors);
+    }
+    Scanner &scanner = workspace->scanner;
+    DirectSteps &steps = workspace->steps;
+    scanner.reset(text, true);
+    scanner.setLog(&errors);
+    steps.recordIncludes(record != nullptr);
+    steps.copyFrom(scanner);
+    runSteps(scanner, steps, source.end());
+    steps.finish();
+    if(record != nullptr) {
+	record->includes = steps.includeUses();
+	record->symbols = steps.takeSymbols();
+    }
+    return !scanner.hadError() && !steps.failed();
+}
+
+// The preprocessor as a library, for programs that run it many times over
+// rather than once per process. Set up like the command line does, then call
+// process() for each input. What's set up, and every file #included, stays
+// loaded between calls; nothing an input defines carries over to the next.
+// Nor does the memory it took get freed, so calls after the first few
+// allocate nothing. Failures are returned, never exited on.
+class Preprocessor {
 private:
-    std::ifstream m_file;
+    Session m_session;
+    std::ostream *m_errors = &std::cerr;
+    OutputBuffer m_output{-1};
+    Workspace m_workspace{m_output, m_session, "."};
 public:
-    Scanner(const std::string path);
-    bool hasNext() const { return !m_file.fail(); }
-    const std::string nextLine();
-    const std::pair<State,std::string> nextToken();
+    void addSearchPath(std::string path) { m_session.includes.addSearchPath(std::move(path)); }
+    bool loadSymbols(const std::string &path) { return m_session.loadSymbols(path); }
+    // As -D and -U, which see
+    bool define(std::string_view definition) { return m_session.define(definition); }
+    bool undefine(std::string_view name) { return m_session.undefine(name); }
+    // Where diagnostics go; std::cerr to begin with
+    void setErrors(std::ostream &errors) { m_errors = &errors; }
+    Session& session() { return m_session; }
+    // Preprocesses in, sending the result to out, with quoted includes
+    // looked for in directory first. Returns false if it had a fatal error
+    // or out wouldn't take the output.
+    bool process(std::string_view in, OutputSink &out, const std::string &directory = ".");
 };
 
-Scanner::Scanner(const std::string path) : m_file(path)
+bool Preprocessor::process(std::string_view in, OutputSink &out, const std::string &directory)
 {
-    if(!m_file) {
-	std::cerr << "Error: file " << path << " can't be found\n";
-	exit(1);
-    } else if(m_file.peek() == EOF) {
-	exit(1);
+    m_output.redirect(out);
+    m_output.setWhitespace(m_session.whitespace);
+    Scanner &scanner = m_workspace.scanner;
+    DirectSteps &steps = m_workspace.steps;
+    scanner.reset(in, true);
+    scanner.setLog(m_errors);
+    steps.reset(m_session, directory, *m_errors);
+    steps.recordIncludes(false);
+    steps.copyFrom(scanner);
+    runSteps(scanner, steps, in.data() + in.size());
+    steps.finish();
+    m_output.flush();
+    const bool ok = !scanner.hadError() && !steps.failed() && !m_output.failed();
+    // out needn't outlive the call
+    m_output.redirect(-1);
+    return ok;
+}
+
+// Writes parts one after another to a temporary file, then renames it to
+// path, so that anyone reading path (or mapping it) sees all of the old
+// contents or all of the new. Returns false if it fails part way.
+bool replaceFile(const std::filesystem::path &path,
+		 std::initializer_list<std::string_view> parts)
+{
+    static std::atomic<std::size_t> nextTemp{0};
+    std::filesystem::path temp(path);
+    temp += ".tmp" + std::to_string(getpid()) + "-" + std::to_string(nextTemp++);
+    const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+	return false;
     }
+    OutputBuffer out(fd);
+    for(const std::string_view part : parts) {
+	out.write(part);
+    }
+    out.flush();
+    const bool written = !out.failed();
+    close(fd);
+    if(!written || rename(temp.c_str(), path.c_str()) != 0) {
+	unlink(temp.c_str());
+	return false;
+    }
+    return true;
 }
 
-const std::string Scanner::nextLine()
+// Results of earlier runs, kept on disk so that preprocessing an input that
+// hasn't changed is just a copy out of the cache. An entry is found by a
+// hash of the input, the directory it's in, the search paths and the symbols
+// predefined for it. Since the
+// includes an input pulls in aren't known until it's been preprocessed,
+// each entry also lists them, as how each #include was looked up, what file
+// it led to and a hash of that file, and it only counts as a hit if every
+// lookup still leads to the same contents. Diagnostics and success are
+// stored along with the output. Entries are written to a temporary name and
+// renamed into place, so runs sharing the directory never see half of one.
+class OutputCache {
+private:
+    std::filesystem::path m_directory;
+    std::atomic<std::size_t> m_hits{0};
+    std::atomic<std::size_t> m_misses{0};
+    static constexpr std::string_view Magic = "gcache1\n";
+    bool replay(const std::filesystem::path &entry, OutputBuffer &output,
+		IncludeCache &includes, bool &ok, std::ostream &errors) const;
+    void store(const std::filesystem::path &entry, const RunRecord &record,
+	       std::string_view text, bool ok);
+public:
+    explicit OutputCache(std::filesystem::path directory) : m_directory(std::move(directory)) {}
+    // Creates the directory if need be; false if it can't be
+    bool prepare() const;
+    // The same as ::preprocess(), but through the cache
+    bool preprocess(const std::string &path, OutputBuffer &output, Session &session,
+		    std::size_t splitJobs, std::ostream &errors = std::cerr);
+    std::size_t hits() const { return m_hits; }
+    std::size_t misses() const { return m_misses; }
+};
+
+std::uint64_t contentHash(const IncludedFile *file)
 {
-    std::string line;
-    std::getline(m_file, line);
-    return line;
+    return file == nullptr ? 0 : hashText(std::string_view(file->source.begin(),
+							  file->source.size()));
 }
 
-// Extract the next token from the text stream, additionally determining
-// the type (state) of that token, returning both as a pair.
-const std::pair<State,std::string> Scanner::nextToken()
+bool OutputCache::prepare() const
 {
-    bool done = false;
-    char currChar = m_file.get();
-    State currState = State::Start;
-    std::string tokenText;
-    while(!done) {
-	switch(currState) {
-	case State::Start: {
-	    // Skip whitespace; not significant
-	    if(currChar == ' ' || currChar == '\t') {
-		break;
-	    // Start of `#define` or another `identifier`
-	    } else if(currChar == '#' || std::isalpha(currChar)) {
-		currState = State::InIdentifier;
-		tokenText += currChar;
-	    // Opening of single-quote string
-	    } else if(currChar == '\'') {
-		currState = State::InSingleQuote;
-		tokenText += currChar;
-	    // Opening of double-quote string
-	    } else if(currChar == '"') {
-		currState = State::InDoubleQuote;
-		tokenText += currChar;
-	    // Opening of multi-line comment
-	    } else if(currChar == '/' && m_file.peek() == '*') {
-		m_file.ignore(1);
-		currState = State::InComment;
-	    // File stream is empty; stop extracting 
-	    } else if(currChar == EOF) {
-		currState = State::EoF;
-		done = true;
-	    // Ignore newlines
-	    } else if(currChar == '\n') {
-		tokenText += currChar;
-	    // "Other" possibilities include things like parentheses, brackets,
-	    // and other non-string/identifier/comment things
-	    } else {
-		currState = State::Other;
-		tokenText += currChar;
-	    }
-	    break;
+    std::error_code error;
+    std::filesystem::create_directories(m_directory, error);
+    return std::filesystem::is_directory(m_directory, error);
+}
+
+// Writes out the entry's output and diagnostics if it's still valid
+bool OutputCache::replay(const std::filesystem::path &entry, OutputBuffer &output,
+			 IncludeCache &includes, bool &ok, std::ostream &errors) const
+{
+    SourceFile file;
+    if(!file.open(entry.string())) {
+	return false;
+    }
+    EntryReader reader(std::string_view(file.begin(), file.size()));
+    if(reader.bytes(Magic.size()) != Magic) {
+	return false;
+    }
+    ok = reader.integer<std::uint32_t>() != 0;
+    const auto useCount = reader.integer<std::uint32_t>();
+    for(std::uint32_t i = 0; i < useCount && reader.ok(); ++i) {
+	const bool quoted = reader.integer<std::uint8_t>() != 0;
+	const std::string_view directory(reader.string());
+	const std::string_view name(reader.string());
+	const std::string_view path(reader.string());
+	const auto hash = reader.integer<std::uint64_t>();
+	if(!reader.ok()) {
+	    return false;
 	}
-	case State::InIdentifier: {
-	    // Identifiers are words (with optional method calls on them)
-	    if(std::isalpha(currChar) || currChar == '.') {
-		tokenText += currChar;
-		break;
-	    }
-	    // If reached char that isn't part of identifier, put it back, stop
-	    m_file.putback(currChar);
-	    currState = State::Identifier;
-	    done = true;
-	    break;
+	const IncludedFile *found = includes.find(directory, name, quoted);
+	if((found == nullptr ? std::string_view() : std::string_view(found->path)) != path
+	   || contentHash(found) != hash) {
+	    return false;
 	}
-	case State::InSingleQuote: {
-	    // Closing of string
-	    if(currChar == '\'') {
-		currState = State::String;
-		tokenText += currChar;
-		done = true;
-	    // Escape backslashes within the string
-	    } else if(currChar == '\\' && m_file.peek() == '\'') {
-		tokenText += currChar + m_file.get();
-	    // Can't have newline in middle of string
-	    } else if(currChar == '\n') {
-		currState = State::Bad;
-		std::cerr << "\nError: Malformed string\n";
-		currChar = m_file.get(); //Move onto next line
-		done = true;
-	    // Can't have string cut-off by end of file
-	    } else if(currChar == EOF) {
-		currState = State::Bad;
-		std::cerr << "\nError: Unexpected end of file\n";
-		done = true;
-	    // Otherwise, just collect the contents of the string
-	    } else {
-		tokenText += currChar;
-	    }
-	    break;
+    }
+    const std::string_view stored(reader.string());
+    const std::string_view text(reader.rest());
+    if(!reader.ok()) {
+	return false;
+    }
+    errors << stored;
+    output.write(text);
+    return true;
+}
+
+void OutputCache::store(const std::filesystem::path &entry, const RunRecord &record,
+			std::string_view text, bool ok)
+{
+    // Each lookup only needs checking once
+    std::vector<const IncludeUse*> uses;
+    for(const IncludeUse &use : record.includes) {
+	uses.push_back(&use);
+    }
+    const auto order = [](const IncludeUse *a, const IncludeUse *b) {
+	return std::tie(a->directory, a->name, a->quoted) < std::tie(b->directory, b->name, b->quoted);
+    };
+    std::sort(uses.begin(), uses.end(), order);
+    uses.erase(std::unique(uses.begin(), uses.end(), [&](const IncludeUse *a, const IncludeUse *b) {
+	return !order(a, b) && !order(b, a);
+    }), uses.end());
+
+    std::string header(Magic);
+    putInteger(header, static_cast<std::uint32_t>(ok));
+    putInteger(header, static_cast<std::uint32_t>(uses.size()));
+    for(const IncludeUse *use : uses) {
+	putInteger(header, static_cast<std::uint8_t>(use->quoted));
+	putString(header, use->directory);
+	putString(header, use->name);
+	putString(header, use->file == nullptr ? std::string_view() : use->file->path);
+	putInteger(header, contentHash(use->file));
+    }
+    putString(header, record.errors.str());
+
+    // Nothing is lost if it can't be written
+    replaceFile(entry, {header, text});
+}
+
+bool OutputCache::preprocess(const std::string &path, OutputBuffer &output,
+			     Session &session, std::size_t splitJobs, std::ostream &errors)
+{
+    // Streams can't be looked up before they're read, and an input that's
+    // missing just gets the usual error
+    struct stat info;
+    SourceFile source;
+    if(path == "-" || stat(path.c_str(), &info) != 0 || !S_ISREG(info.st_mode)
+       || !source.open(path) || source.size() == 0) {
+	return ::preprocess(path, output, session, splitJobs, nullptr, nullptr, &errors);
+    }
+    std::string key(Magic);
+    putInteger(key, hashText(std::string_view(source.begin(), source.size())));
+    putString(key, std::filesystem::path(path).parent_path().string());
+    for(const std::string &searchPath : session.includes.searchPaths()) {
+	putString(key, searchPath);
+    }
+    putInteger(key, session.imageHash);
+    for(const std::string &predefinition : session.predefinitions) {
+	putString(key, predefinition);
+    }
+    // Builds for other dialects can share the directory
+    putString(key, Dialect::name);
+    putInteger(key, static_cast<std::uint8_t>(Dialect::lineComments));
+    putInteger(key, static_cast<std::uint8_t>(session.whitespace));
+    const std::uint64_t hash = hashText(key);
+    char name[17];
+    std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+    const std::filesystem::path entry(m_directory / name);
+
+    bool ok = true;
+    if(replay(entry, output, session.includes, ok, errors)) {
+	++m_hits;
+	return ok;
+    }
+    ++m_misses;
+    RunRecord record;
+    std::string text;
+    output.capture(&text);
+    ok = ::preprocess(path, output, session, splitJobs, &record);
+    output.capture(nullptr);
+    errors << record.errors.str();
+    store(entry, record, text, ok);
+    return ok;
+}
+
+// Preprocesses each input into its mirrored path under outputDir, spreading
+// the files over the given number of threads. Returns false if any failed.
+bool preprocessAll(const std::vector<std::string> &inputs,
+		   const std::filesystem::path &outputDir, Session &session,
+		   OutputCache *cache, std::size_t jobs)
+{
+    std::atomic<bool> allOk{true};
+    std::vector<std::unique_ptr<OutputBuffer>> outputs;
+    std::vector<std::unique_ptr<Workspace>> workspaces;
+    for(std::size_t w = 0; w < std::min(jobs, inputs.size()); ++w) {
+	outputs.push_back(std::make_unique<OutputBuffer>(-1));
+	outputs.back()->setWhitespace(session.whitespace);
+	workspaces.push_back(std::make_unique<Workspace>(*outputs.back(), session, "."));
+    }
+    // Every output path, and each directory they're in, is made up front,
+    // so the workers have nothing to do per file but preprocess it
+    std::vector<std::string> outPaths;
+    std::vector<std::filesystem::path> outDirs;
+    outPaths.reserve(inputs.size());
+    for(const std::string &input : inputs) {
+	const std::filesystem::path outPath(mirroredPath(outputDir, input));
+	outPaths.push_back(outPath.string());
+	if(hasValidExtension(input)
+	   && (outDirs.empty() || outDirs.back() != outPath.parent_path())) {
+	    outDirs.push_back(outPath.parent_path());
 	}
-	// Double quoted strings are treated essentially the same as single-quotes 
-	case State::InDoubleQuote: {
-	    if(currChar == '"') {
-		currState = State::String;
-		tokenText += currChar;
-		done = true;
-	    } else if(currChar == '\\' && m_file.peek() == '\"') {
-		m_file.get();
-	    } else if(currChar == '\n') {
-		currState = State::Bad;
-		std::cerr << "\nError: Malformed string\n";
-		tokenText += currChar;
-		done = true;
-	    } else if(currChar == EOF) {
-		currState = State::Bad;
-		std::cerr << "\nFatal error: Unexpected end of file\n";
-		exit(1);
-	    } else {
-		tokenText += currChar;
-	    }
-	    break;
+    }
+    // Inputs that mirror to the same output, say a.cpp named once from its
+    // own directory and once through .., would leave only one of them there,
+    // written by two workers at once, so they're refused before anything is
+    std::vector<std::size_t> byOutput;
+    for(std::size_t i = 0; i < inputs.size(); ++i) {
+	if(hasValidExtension(inputs[i])) {
+	    byOutput.push_back(i);
 	}
-	// Ignore all characters in comments until closing `*/`, then continue
-	case State::InComment: {
-	    if(currChar == '*' || m_file.peek() == '/') {
-		m_file.ignore(1);
-		if(m_file.peek() == '\n') m_file.ignore(1);
-		currState = State::Start;
-	    } else if(currChar == EOF) {
-		currState = State::Bad;
-		std::cerr << "\nFatal error: Unexpected end of file\n";
-		exit(1);
-	    }
-	    break;
+    }
+    std::sort(byOutput.begin(), byOutput.end(), [&outPaths](std::size_t a, std::size_t b) {
+	return outPaths[a] < outPaths[b];
+    });
+    bool clash = false;
+    for(std::size_t i = 1; i < byOutput.size(); ++i) {
+	const std::size_t first = byOutput[i - 1];
+	const std::size_t second = byOutput[i];
+	if(outPaths[first] == outPaths[second]) {
+	    std::cerr << "Error: " << inputs[first] << " and " << inputs[second]
+		      << " would both be written to " << outPaths[first] << '\n';
+	    clash = true;
 	}
-	// Try to process `Other` characters, ignoring comments as necessary
-	case State::Other: {
-	    if(currChar == ' ' || currChar == '\n') {
-		done = true;
-	    } else if(currChar == '/' && m_file.peek() == '*') {
-		m_file.ignore(1);
-		currState = State::InComment;
-		break;
+    }
+    if(clash) {
+	return false;
+    }
+    std::sort(outDirs.begin(), outDirs.end());
+    outDirs.erase(std::unique(outDirs.begin(), outDirs.end()), outDirs.end());
+    for(const auto &outDir : outDirs) {
+	std::error_code error;
+	std::filesystem::create_directories(outDir, error);
+    }
+    // Each input's diagnostics are kept until it's done, then written out in
+    // one go with its path on every line that isn't blank, so that those of
+    // inputs that run at the same time can't interleave
+    std::vector<std::ostringstream> logs(workspaces.size());
+    std::mutex reporting;
+    const auto report = [&reporting](const std::string &input, const std::string &text) {
+	std::string lines;
+	for(std::size_t start = 0; start < text.size(); ) {
+	    const std::size_t end = std::min(text.find('\n', start), text.size());
+	    if(end != start) {
+		lines += input + ": ";
+		lines.append(text, start, end - start);
+		lines += '\n';
 	    }
-	    tokenText += currChar;
+	    start = end + 1;
+	}
+	const std::lock_guard<std::mutex> lock(reporting);
+	std::cerr << lines << std::flush;
+    };
+    parallelFor(jobs, inputs.size(), [&](std::size_t worker, std::size_t item) {
+	OutputBuffer &output = *outputs[worker];
+	const std::string &input = inputs[item];
+	if(!hasValidExtension(input)) {
+	    report(input, "Invalid file extension");
+	    allOk = false;
+	    return;
+	}
+	const int fd = ::open(outPaths[item].c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0) {
+	    report(input, "Error: can't write to " + outPaths[item]);
+	    allOk = false;
+	    return;
+	}
+	std::ostringstream &log = logs[worker];
+	log.str({});
+	log.clear();
+	output.redirect(fd);
+	const bool ok = cache != nullptr ? cache->preprocess(input, output, session, 1, log)
+	    : preprocess(input, output, session, 1, nullptr, workspaces[worker].get(), &log);
+	if(!ok) allOk = false;
+	output.flush();
+	if(output.failed()) allOk = false;
+	output.redirect(-1);
+	close(fd);
+	if(log.tellp() > 0) {
+	    report(input, log.str());
+	}
+    });
+    return allOk;
+}
+
+// A file kept open by --daemon and edited in place. Besides the text, its
+// output and its diagnostics, it keeps checkpoints: a step start every so
+// often, with all the state that carries from one step to the next. An edit
+// is redone from the last checkpoint before it, and the redo stops as soon
+// as it reaches a step start that the old run had a checkpoint at with the
+// same state, since from there on everything is bound to come out the same.
+// Included files are read once for the life of the process, as in any run.
+class Document {
+public:
+    // Where the output changed: newLength bytes from start replaced
+    // oldLength bytes of what was there
+    struct Change {
+	std::size_t start;
+	std::size_t oldLength;
+	std::size_t newLength;
+    };
+    explicit Document(Session &session) : m_session(session) {}
+    // Starts over with the contents of path; false if it can't be read
+    bool open(const std::string &path, Change &change);
+    // Replaces length bytes of the text at offset with text; false if
+    // they're not all in it
+    bool edit(std::size_t offset, std::size_t length, std::string_view text, Change &change);
+    const std::string& output() const { return m_output; }
+    const std::string& errors() const { return m_errors; }
+private:
+    // Bytes of input between checkpoints, and how many more per symbol a
+    // change to the symbols needs before it's worth copying them again
+    // (those defined in the file, that is; the predefined ones are shared)
+    static constexpr std::size_t Spacing = 4 * 1024;
+    static constexpr std::size_t CopyCost = 16;
+    struct Checkpoint {
+	// Where the step starts, and how much output and diagnostics came
+	// before it
+	std::size_t input;
+	std::size_t output;
+	std::size_t errors;
+	// Shared by every checkpoint in a row that no symbol changed between
+	std::shared_ptr<const SymbolTable> symbols;
+	Conditions conditions;
+	std::vector<const IncludedFile*> onceFiles;
+    };
+    class Steps;
+    Session &m_session;
+    std::string m_directory;
+    std::string m_text;
+    std::string m_output;
+    std::string m_errors;
+    std::vector<Checkpoint> m_checkpoints;
+    // What each redo writes to, and the output it collects there, kept
+    // from one edit to the next
+    OutputBuffer m_buffer{-1};
+    std::string m_fresh;
+    Change redo(std::size_t from, std::size_t oldEnd, std::ptrdiff_t delta);
+};
+
+// Steps that also leave checkpoints behind as they go
+class Document::Steps : public DirectSteps {
+private:
+    std::vector<Checkpoint> &m_checkpoints;
+    const char *m_text;
+    OutputBuffer &m_output;
+    const std::string &m_fresh;
+    std::ostringstream &m_errors;
+    // Where the run started in the output and diagnostics
+    std::size_t m_outputBase;
+    std::size_t m_errorBase;
+    // Where the symbols were last copied for a checkpoint
+    std::size_t m_lastCopy;
+    // The last old table the symbols were compared with, and the outcome,
+    // which holds until either changes
+    const SymbolTable *m_compared = nullptr;
+    std::size_t m_comparedVersion = 0;
+    bool m_comparedSame = false;
+public:
+    Steps(Document &document, OutputBuffer &output, const std::string &fresh,
+	  std::ostringstream &errors)
+	: DirectSteps(output, document.m_session, document.m_directory, errors),
+	  m_checkpoints(document.m_checkpoints), m_text(document.m_text.data()),
+	  m_output(output), m_fresh(fresh), m_errors(errors)
+    {
+	const Checkpoint &start = m_checkpoints.back();
+	resume(*start.symbols, start.conditions, start.onceFiles);
+	m_outputBase = start.output;
+	m_errorBase = start.errors;
+	m_lastCopy = start.input;
+    }
+    void step(const char *position);
+    bool matches(const Checkpoint &old, const Checkpoint &start);
+};
+
+// Whether the state now is the same as it was at an old checkpoint, given
+// the one this run started from. The symbols are only compared one by one
+// if neither run can have changed them since then.
+bool Document::Steps::matches(const Checkpoint &old, const Checkpoint &start)
+{
+    if(!settled() || !(old.conditions == conditions()) || old.onceFiles != onceFiles()) {
+	return false;
+    } else if(old.symbols == start.symbols && symbols().version() == start.symbols->version()) {
+	return true;
+    } else if(old.symbols.get() != m_compared || symbols().version() != m_comparedVersion) {
+	m_compared = old.symbols.get();
+	m_comparedVersion = symbols().version();
+	m_comparedSame = symbols().sameAs(*old.symbols);
+    }
+    return m_comparedSame;
+}
+
+void Document::Steps::step(const char *position)
+{
+    DirectSteps::step(position);
+    const std::size_t input = position - m_text;
+    const Checkpoint &last = m_checkpoints.back();
+    if(input - last.input < Spacing || !settled()) {
+	return;
+    }
+    std::shared_ptr<const SymbolTable> snapshot(last.symbols);
+    if(symbols().version() != snapshot->version()) {
+	// Copying a big table is only worth it once there's been enough input
+	// since the last copy to pay for it
+	if(input - m_lastCopy < std::max(Spacing, CopyCost * symbols().ownSize())) {
+	    return;
+	}
+	auto copy = std::make_shared<SymbolTable>();
+	copy->cloneFrom(symbols());
+	snapshot = std::move(copy);
+	m_lastCopy = input;
+    }
+    m_output.flush();
+    m_checkpoints.push_back({input, m_outputBase + m_fresh.size(),
+			     m_errorBase + static_cast<std::size_t>(m_errors.tellp()),
+			     std::move(snapshot), conditions(), onceFiles()});
+}
+
+bool Document::open(const std::string &path, Change &change)
+{
+    SourceFile source;
+    if(!source.open(path)) {
+	return false;
+    }
+    m_text.assign(source.begin(), source.size());
+    m_directory.assign(directoryOf(path));
+    auto symbols = std::make_shared<SymbolTable>();
+    symbols->layerOn(m_session.predefined);
+    m_checkpoints.clear();
+    m_checkpoints.push_back({0, 0, 0, std::move(symbols), Conditions(), {}});
+    change = redo(0, 0, 0);
+    return true;
+}
+
+bool Document::edit(std::size_t offset, std::size_t length, std::string_view text,
+		    Change &change)
+{
+    if(offset > m_text.size() || length > m_text.size() - offset) {
+	return false;
+    }
+    m_text.replace(offset, length, text);
+    // The last checkpoint before the edit; the step there, and every one
+    // after, could be different now
+    const auto after = std::partition_point(m_checkpoints.begin() + 1, m_checkpoints.end(),
+					    [&](const Checkpoint &c) { return c.input < offset; });
+    change = redo(after - m_checkpoints.begin() - 1, offset + length,
+		  static_cast<std::ptrdiff_t>(text.size()) - static_cast<std::ptrdiff_t>(length));
+    return true;
+}
+
+// Runs again from checkpoint from, after text up to oldEnd (where it was
+// before the edit) has changed and what came after has moved by delta.
+// Checkpoints from there on are where the run can rejoin the old one.
+Document::Change Document::redo(std::size_t from, std::size_t oldEnd, std::ptrdiff_t delta)
+{
+    std::vector<Checkpoint> old(m_checkpoints.begin() + from + 1, m_checkpoints.end());
+    m_checkpoints.resize(from + 1);
+    old.erase(old.begin(), std::partition_point(old.begin(), old.end(), [&](const Checkpoint &c) {
+	return c.input < oldEnd;
+    }));
+    const Checkpoint start = m_checkpoints.back();
+
+    std::string &fresh = m_fresh;
+    OutputBuffer &output = m_buffer;
+    fresh.clear();
+    output.capture(&fresh);
+    std::ostringstream errors;
+    Scanner scanner(m_text);
+    scanner.setLog(&errors);
+    scanner.seek(m_text.data() + start.input);
+    Steps steps(*this, output, fresh, errors);
+    steps.copyFrom(scanner);
+    const char *end = m_text.data() + m_text.size();
+    const Checkpoint *rejoined = nullptr;
+    for(const Checkpoint &checkpoint : old) {
+	const char *target = m_text.data() + checkpoint.input + delta;
+	runSteps(scanner, steps, target);
+	if(!scanner.hasNext() || scanner.hadError()) {
+	    break;
+	} else if(scanner.position() == target && steps.matches(checkpoint, start)) {
+	    rejoined = &checkpoint;
 	    break;
 	}
-	default:
-	    // Have no clue how to deal with the current character, stop
-	    currState = State::Bad;
-	    done = true;
+    }
+    if(rejoined == nullptr) {
+	runSteps(scanner, steps, end);
+	steps.finish();
+    }
+    output.capture(nullptr);
+    const std::string diagnostics(errors.str());
+
+    const std::size_t outputEnd = rejoined != nullptr ? rejoined->output : m_output.size();
+    const std::size_t errorsEnd = rejoined != nullptr ? rejoined->errors : m_errors.size();
+    const Change change{start.output, outputEnd - start.output, fresh.size()};
+    m_output.replace(start.output, change.oldLength, fresh);
+    m_errors.replace(start.errors, errorsEnd - start.errors, diagnostics);
+    if(rejoined != nullptr) {
+	// The rest of the old checkpoints still hold, once moved along
+	const std::ptrdiff_t outputDelta = fresh.size() - change.oldLength;
+	const std::ptrdiff_t errorsDelta = diagnostics.size() - (errorsEnd - start.errors);
+	for(auto i = old.begin() + (rejoined - old.data()); i != old.end(); ++i) {
+	    i->input += delta;
+	    i->output += outputDelta;
+	    i->errors += errorsDelta;
+	    m_checkpoints.push_back(std::move(*i));
 	}
-	// Every iteration until token is complete, pull a character from the
-	// stream
-	if(!done) {
-	    currChar = m_file.get();
+    }
+    return change;
+}
+
+// Reads size bytes of in into text a block at a time, so that a size with
+// nothing behind it runs out of input rather than memory. False if in ends
+// first.
+bool readExactly(std::istream &in, std::string &text, std::size_t size)
+{
+    constexpr std::size_t Block = 64 * 1024;
+    text.clear();
+    while(text.size() < size) {
+	const std::size_t start = text.size();
+	text.resize(start + std::min(Block, size - start));
+	if(!in.read(text.data() + start, text.size() - start)) {
+	    return false;
 	}
     }
-    // Tell caller what type (state) the token is, what the token's content is
-    return {currState, tokenText};
+    return true;
 }
 
-int main(int argc, char **argv)
+// Answers --daemon requests, read from standard input one per line:
+//
+//     open PATH                  start on the file at PATH
+//     edit OFFSET LENGTH SIZE    replace LENGTH bytes of it at OFFSET with
+//                                the SIZE bytes that follow the line
+//
+// Each is answered on standard output by `output START LENGTH SIZE` and the
+// SIZE bytes that replace LENGTH bytes of the output at START, then `errors
+// SIZE` and every diagnostic for the file as it stands, or else by `error`
+// and what went wrong. The file is only read by open; edits never touch it.
+void serve(Session &session)
 {
-    if(argc != 2) {
-	std::cout << "usage: ./better filename[.cpp,.h]\n";
-	exit(1);
+    // Far more than any edit from an editor, and refused before any of it
+    // is read
+    constexpr std::size_t MaxEditSize = std::size_t(1) << 30;
+    Document document(session);
+    bool opened = false;
+    OutputBuffer out(STDOUT_FILENO);
+    std::string line;
+    std::string text;
+    while(std::getline(std::cin, line)) {
+	std::istringstream request(line);
+	std::string command;
+	request >> command;
+	Document::Change change{};
+	bool done = false;
+	if(command == "open") {
+	    std::string path;
+	    std::getline(request >> std::ws, path);
+	    done = opened = document.open(path, change);
+	    if(!done) {
+		out.write("error can't read " + path + "\n");
+	    }
+	} else if(command == "edit") {
+	    std::size_t offset = 0, length = 0, size = 0;
+	    request >> offset >> length >> size;
+	    if(!request || size > MaxEditSize || !readExactly(std::cin, text, size)) {
+		out.write("error malformed edit\n");
+	    } else if(!opened) {
+		out.write("error no file open\n");
+	    } else if(!(done = document.edit(offset, length, text, change))) {
+		out.write("error edit out of range\n");
+	    }
+	} else if(!command.empty()) {
+	    out.write("error unknown request " + command + "\n");
+	}
+	if(done) {
+	    out.write("output " + std::to_string(change.start) + " "
+		      + std::to_string(change.oldLength) + " "
+		      + std::to_string(change.newLength) + "\n");
+	    out.write(std::string_view(document.output()).substr(change.start, change.newLength));
+	    out.write("errors " + std::to_string(document.errors().size()) + "\n");
+	    out.write(document.errors());
+	}
+	out.flush();
     }
-    const std::string path(argv[1]);
-    if(path.size() < 2 || (path.substr(path.size()-2) != ".h"
-			   && path.substr(path.size()-4) != ".cpp")) {
-	std::cerr << "Invalid file extension\n";
-	exit(1);
+}
+
+// The count given with -j, or 0 if it isn't a positive integer
+std::size_t parseJobs(const char *text)
+{
+    if(!std::isdigit(static_cast<unsigned char>(text[0]))) {
+	return 0;
     }
-    Scanner scanner(path);
-    std::map<std::string, std::string> symbolTable;
-    while(scanner.hasNext()) {
-	const auto [tokenState, tokenText] = scanner.nextToken();
-	// Add symbol/value from all `#define SYMBOL value` statements
-	if(tokenText == "#define") {
-	    const auto [symbolState, symbol] = scanner.nextToken();
-	    const std::string value(scanner.nextLine());
-	    if(symbolState != State::Identifier) {
-		std::cerr << "\nError: expected identifier after #define\n";
-		std::cout << symbol << ' ' << value << '\n';
-	    } else {
-		if(symbolTable.count(symbol) > 0) {
-		    std::cout << "\nWarning: symbol " << symbol << " redefined\n";
-		}
-		// Add the mapping
-		symbolTable[symbol] = value;
+    char *end = nullptr;
+    errno = 0;
+    const unsigned long jobs = std::strtoul(text, &end, 10);
+    return *end != '\0' || errno != 0 ? 0 : jobs;
+}
+
+void usage()
+{
+    std::cout << "usage: ./better [options] [--cache-dir dir] [-j jobs] [--split] filename[.cpp,.h]|-\n"
+	"       ./better [options] --emit-symbols out.gsym filename[.cpp,.h]\n"
+	"       ./better [options] [--cache-dir dir] [-j jobs] -o outdir [--files-from list]"
+	" [filename[.cpp,.h]...]\n"
+	"       ./better [options] --daemon\n"
+	"options: [-I dir]... [--load-symbols in.gsym] [-D name[=value]]... [-U name]...\n"
+	"         [--whitespace tokens|preserve|minify] [--stats] [--stats-json out.json]\n"
+	"         (--daemon only lays out tokens)\n";
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    // Only diagnostics still go through iostreams
+    std::ios::sync_with_stdio(false);
+    std::vector<std::string> inputs;
+    std::string outputDir;
+    std::size_t jobs = std::max(1u, std::thread::hardware_concurrency());
+    bool splitFile = false;
+    bool daemon = false;
+    Preprocessor preprocessor;
+    std::string loadSymbols;
+    std::string emitSymbols;
+    // Each -D and -U, as 'D' or 'U' and what followed it
+    std::vector<std::pair<char, std::string>> predefinitions;
+    std::unique_ptr<OutputCache> cache;
+    bool showStats = false;
+    std::string statsJson;
+    Whitespace whitespace = Whitespace::Tokens;
+    for(int i = 1; i < argc; ++i) {
+	const std::string_view arg(argv[i]);
+	if((arg == "-o" || arg == "--output-dir") && i + 1 < argc) {
+	    outputDir = argv[++i];
+	} else if((arg == "-j" && i + 1 < argc) || (arg.size() > 2 && arg.substr(0, 2) == "-j")) {
+	    const char *count = arg.size() > 2 ? argv[i] + 2 : argv[++i];
+	    jobs = parseJobs(count);
+	    if(jobs == 0) {
+		std::cerr << "Error: -j takes a positive number of jobs, not " << count << '\n';
+		exit(1);
 	    }
-	// Print out identifiers separated with 1 space; replace any known symbols
-	// with their mapped values
-	} else if(tokenState == State::Identifier) {
-	    if(symbolTable.count(tokenText) < 1) {
-		std::cout << tokenText << ' ';
+	} else if(arg == "-I" && i + 1 < argc) {
+	    preprocessor.addSearchPath(argv[++i]);
+	} else if(arg.size() > 2 && arg.substr(0, 2) == "-I") {
+	    preprocessor.addSearchPath(argv[i] + 2);
+	} else if((arg == "-D" || arg == "-U") && i + 1 < argc) {
+	    predefinitions.emplace_back(arg[1], argv[++i]);
+	} else if(arg.size() > 2 && (arg.substr(0, 2) == "-D" || arg.substr(0, 2) == "-U")) {
+	    predefinitions.emplace_back(arg[1], argv[i] + 2);
+	} else if(arg == "--load-symbols" && i + 1 < argc) {
+	    loadSymbols = argv[++i];
+	} else if(arg == "--emit-symbols" && i + 1 < argc) {
+	    emitSymbols = argv[++i];
+	} else if(arg == "--whitespace" && i + 1 < argc) {
+	    const std::string_view layout(argv[++i]);
+	    if(layout == "tokens") {
+		whitespace = Whitespace::Tokens;
+	    } else if(layout == "preserve") {
+		whitespace = Whitespace::Preserve;
+	    } else if(layout == "minify") {
+		whitespace = Whitespace::Minify;
 	    } else {
-		std::cout << symbolTable[tokenText] << ' ';
+		usage();
 	    }
-	} else if(tokenState != State::Bad) {
-	    std::cout << tokenText;
+	} else if(arg == "--split") {
+	    splitFile = true;
+	} else if(arg == "--daemon") {
+	    daemon = true;
+	} else if(arg == "--stats") {
+	    showStats = true;
+	} else if(arg == "--stats-json" && i + 1 < argc) {
+	    statsJson = argv[++i];
+	} else if(arg == "--cache-dir" && i + 1 < argc) {
+	    cache = std::make_unique<OutputCache>(argv[++i]);
+	    if(!cache->prepare()) {
+		std::cerr << "Error: can't use cache directory " << argv[i] << '\n';
+		exit(1);
+	    }
+	} else if(arg == "--files-from" && i + 1 < argc) {
+	    std::ifstream list(argv[++i]);
+	    if(!list) {
+		std::cerr << "Error: file " << argv[i] << " can't be found\n";
+		exit(1);
+	    }
+	    std::string line;
+	    while(std::getline(list, line)) {
+		if(!line.empty()) inputs.push_back(line);
+	    }
+	} else if(arg.size() > 1 && arg[0] == '-') {
+	    usage();
 	} else {
-	    std::cerr << "Error: bad token: " << tokenText << '\n';
+	    inputs.emplace_back(arg);
+	}
+    }
+    // A checkpoint's output doesn't depend on what came before it, which
+    // the other layouts can't promise
+    if(daemon ? !inputs.empty() || !outputDir.empty() || !emitSymbols.empty() || cache != nullptr
+		|| whitespace != Whitespace::Tokens
+       : inputs.empty() || (!emitSymbols.empty() && (!outputDir.empty() || inputs[0] == "-"))) {
+	usage();
+    }
+    if(!StatsEnabled && (showStats || !statsJson.empty())) {
+	std::cerr << "Error: built without stats; rebuild with -DENABLE_STATS=1\n";
+	exit(1);
+    }
+    // Once every thread is done, on the way out
+    const auto reportStats = [&]() {
+	if(showStats) {
+	    stats::report(std::cerr);
+	}
+	if(!statsJson.empty()) {
+	    std::ofstream json(statsJson);
+	    stats::reportJson(json);
+	    if(!json) {
+		std::cerr << "Error: can't write stats to " << statsJson << '\n';
+	    }
+	}
+    };
+    if(!loadSymbols.empty() && !preprocessor.loadSymbols(loadSymbols)) {
+	std::cerr << "Error: can't load symbols from " << loadSymbols << '\n';
+	exit(1);
+    }
+    // On top of any symbols loaded, in the order given
+    for(const auto &[option, definition] : predefinitions) {
+	if(!(option == 'D' ? preprocessor.define(definition) : preprocessor.undefine(definition))) {
+	    std::cerr << "Error: malformed -" << option << ' ' << definition << '\n';
+	    exit(1);
 	}
     }
 
-    return 0;
+    Session &session = preprocessor.session();
+    session.whitespace = whitespace;
+    if(daemon) {
+	serve(session);
+	reportStats();
+	return 0;
+    }
+    bool ok = true;
+    if(outputDir.empty()) {
+	// Single file to stdout
+	if(inputs.size() != 1) {
+	    usage();
+	}
+	if(inputs[0] != "-" && !hasValidExtension(inputs[0])) {
+	    std::cerr << "Invalid file extension\n";
+	    exit(1);
+	}
+	OutputBuffer output(STDOUT_FILENO);
+	output.setWhitespace(whitespace);
+	output.writeBehind();
+	const std::size_t splitJobs = splitFile ? jobs : 1;
+	if(!emitSymbols.empty()) {
+	    // The symbols are only all in one table after a single pass, and
+	    // a cached run doesn't have them at all
+	    RunRecord record;
+	    ok = preprocess(inputs[0], output, session, 1, &record);
+	    std::cerr << record.errors.str();
+	    if(ok && !replaceFile(emitSymbols, {record.symbols.image()})) {
+		std::cerr << "Error: can't write symbols to " << emitSymbols << '\n';
+		ok = false;
+	    }
+	} else {
+	    ok = cache != nullptr ? cache->preprocess(inputs[0], output, session, splitJobs)
+		: preprocess(inputs[0], output, session, splitJobs);
+	}
+	// The last writes can only fail once they're made
+	ok = output.finish() && ok;
+    } else {
+	ok = preprocessAll(inputs, outputDir, session, cache.get(), jobs);
+    }
+    if(cache != nullptr) {
+	std::cerr << "cache: " << cache->hits() << " hits, " << cache->misses() << " misses\n";
+    }
+    reportStats();
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,3 @@
+#!/usr/bin/env sh
+clang++ -std=c++17 -O2 -Wall -pedantic-errors -Wextra -pthread -DBENCH_BETTER -o bench-better bench.cpp "$@"
+clang++ -std=c++17 -O2 -Wall -pedantic-errors -Wextra -pthread -o bench-ginevra++ bench.cpp "$@"
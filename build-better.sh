@@ -1,2 +1,2 @@
 #!/usr/bin/env sh
-clang++ -std=c++17 -Wall -pedantic-errors -Wextra -o better better.cpp
+clang++ -std=c++17 -Wall -pedantic-errors -Wextra -pthread -o better better.cpp "$@"
@@ -0,0 +1,2 @@
+#!/usr/bin/env sh
+clang++ -std=c++17 -O2 -Wall -pedantic-errors -Wextra -o difftest difftest.cpp "$@"
@@ -0,0 +1,3 @@
+#!/usr/bin/env sh
+clang++ -std=c++17 -g -O1 -pthread -fsanitize=fuzzer,address,undefined -DFUZZ_BETTER -DSPLIT_MIN_CHUNK_SIZE=64 -DINPUT_WINDOW_SIZE=256 -o fuzz-better fuzz.cpp "$@"
+clang++ -std=c++17 -g -O1 -pthread -fsanitize=fuzzer,address,undefined -o fuzz-ginevra++ fuzz.cpp "$@"
@@ -1,2 +1,2 @@
 #!/usr/bin/env sh
-clang++ -std=c++17 -Wall -Wextra -pedantic-errors -o ginevra++ ginevra++.cpp
+clang++ -std=c++17 -Wall -Wextra -pedantic-errors -o ginevra++ ginevra++.cpp "$@"
@@ -0,0 +1,3 @@
+#!/usr/bin/env sh
+clang++ -std=c++17 -O2 -Wall -pedantic-errors -Wextra -pthread -DSCALE_BETTER -o scale-better scale.cpp "$@"
+clang++ -std=c++17 -O2 -Wall -pedantic-errors -Wextra -pthread -o scale-ginevra++ scale.cpp "$@"
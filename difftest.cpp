@@ -0,0 +1,460 @@
+/* File: difftest.cpp
+ * Purpose: Differential testing of the two preprocessors. The same inputs
+ *  are fed to every way of running better (a mapped file, standard input
+ *  through the stream window, --split, a multi-file -o run on the thread
+ *  pool, and any other builds of it given with --also, say one built with
+ *  -DNO_SIMD), all of which must give the same output byte for byte, and to
+ *  ginevra++, whose differences from better are counted and kept rather
+ *  than failed on, unless --strict is given. Built separately, the two have
+ *  different dialects; build ginevra++ with -DSCANNER_DIALECT=BetterDialect
+ *  (or better with GinevraDialect) to compare like with like.
+ *  ginevra++ is also run with --line-markers, which may only add markers
+ *  and blank lines to its own output, whatever the dialect.
+ *  With --whitespace tokens, better --daemon opens each input and is sent
+ *  an edit far too big to be real, which it must refuse and carry on after,
+ *  then a line put in and taken out again, after which its output must be
+ *  the same as a plain run's.
+ *
+ *  The inputs are every file in the corpus directories given (bench.cpp's
+ *  corpora, say), plus -n generated ones made of the constructs the two
+ *  handle differently: digits and dots in names, comments with stray `*`
+ *  and `/`, escaped quotes, line splices, calls split over lines, unbalanced
+ *  conditionals. Each run is a child process with its output read back
+ *  through a pipe. Every input that makes two ways part is written to the
+ *  keep directory, with both outputs, and the throughput of each way is
+ *  reported at the end. Exits with 1 if any way of running better parted
+ *  from the rest.
+ *
+ *  usage: ./difftest [-n count] [-s seed] [-w tokens|preserve|minify]
+ *                    [-k keep-dir] [--also path]... [--strict]
+ *                    better ginevra++ [corpus-dir...]
+ */
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <algorithm>
+#include <utility>
+#include <iterator>
+#include <filesystem>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace generate {
+
+// Deterministic, so that a seed always makes the same inputs
+class Random {
+private:
+    std::uint64_t m_state;
+public:
+    explicit Random(std::uint64_t seed) : m_state(seed * 0x9e3779b97f4a7c15 + 1) {}
+    std::uint64_t next()
+    {
+	m_state ^= m_state << 13;
+	m_state ^= m_state >> 7;
+	m_state ^= m_state << 17;
+	return m_state;
+    }
+    std::size_t below(std::size_t limit) { return next() % limit; }
+    template<typename T, std::size_t N>
+    const T& pick(const T (&items)[N]) { return items[below(N)]; }
+};
+
+// A few dozen lines of fragments that the two scanners have been known to
+// read differently, run together at random
+std::string fuzzInput(Random &random)
+{
+    static constexpr std::string_view names[] = {
+	"A", "B", "VALUE", "x2", "a.b", "MAX.LEN", "F", "G", "_under", "$d"
+    };
+    static constexpr std::string_view fragments[] = {
+	"/* comment */", "/* over\n   lines */", "/*/ odd */", "/**/", "/* a * b / c */",
+	"/* star **/", "*/", "// line comment", "\"text\"", "\"esc\\\"aped\"", "'\\''",
+	"'x'", "\"open", "\"/* not a comment */\"", "a \\\n b", "\"splice \\\n d\"",
+	"( , )", "((1))", "# not a directive", "#include \"missing.h\"", "#", "##",
+	"123", "1.5e+3", "0x1F", ";", "{", "}", "\t", "  ", "+=", "->"
+    };
+    std::string out;
+    const std::size_t lines = 1 + random.below(40);
+    for(std::size_t line = 0; line < lines; ++line) {
+	const std::string_view name(random.pick(names));
+	switch(random.below(12)) {
+	case 0:
+	    out += "#define ";
+	    out += name;
+	    out += random.below(3) == 0 ? "(p, q) (p + q * " : " (";
+	    out += random.pick(names);
+	    out += ")";
+	    break;
+	case 1:
+	    out += random.pick({"#if ", "#ifdef ", "#ifndef ", "#elif "});
+	    out += name;
+	    break;
+	case 2:
+	    out += random.pick({"#else", "#endif", "#undef A", "#pragma once"});
+	    break;
+	case 3:
+	    out += name;
+	    out += random.pick({"(1, 2)", "\n(3, 4)", " (", "(a, (b, c))", "()", ""});
+	    break;
+	default:
+	    // An ordinary line, made of names and fragments
+	    for(std::size_t i = random.below(8); i > 0; --i) {
+		out += random.below(2) == 0 ? random.pick(names) : random.pick(fragments);
+		out += random.pick({" ", "", " ", "\n"});
+	    }
+	}
+	out += random.below(16) == 0 ? "" : "\n";
+    }
+    // Now and then, a comment or literal the input ends inside
+    if(random.below(16) == 0) {
+	out += random.pick({"/* unterminated", "\"unterminated", "F(1, "});
+    }
+    return out;
+}
+
+}
+
+namespace {
+
+// What one run wrote to standard output, and how long it took
+struct Result {
+    std::string output;
+    double seconds = 0;
+    bool ran = false;
+};
+
+// Runs program with args, its standard input read from input (or
+// /dev/null) and its diagnostics thrown away
+Result run(const std::string &program, const std::vector<std::string> &args,
+	   const std::string &input = {})
+{
+    Result result;
+    int out[2];
+    if(pipe(out) != 0) {
+	return result;
+    }
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t child = fork();
+    if(child == 0) {
+	const int null = ::open("/dev/null", O_RDWR);
+	const int in = input.empty() ? null : ::open(input.c_str(), O_RDONLY);
+	dup2(in, STDIN_FILENO);
+	dup2(out[1], STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	close(out[0]);
+	std::vector<char*> argv{const_cast<char*>(program.c_str())};
+	for(const std::string &arg : args) {
+	    argv.push_back(const_cast<char*>(arg.c_str()));
+	}
+	argv.push_back(nullptr);
+	execv(program.c_str(), argv.data());
+	_exit(127);
+    }
+    close(out[1]);
+    char buffer[64 * 1024];
+    ssize_t count;
+    while((count = ::read(out[0], buffer, sizeof(buffer))) > 0 || (count < 0 && errno == EINTR)) {
+	result.output.append(buffer, std::max<ssize_t>(count, 0));
+    }
+    close(out[0]);
+    int status = 0;
+    result.ran = child > 0 && waitpid(child, &status, 0) == child
+	&& !(WIFEXITED(status) && WEXITSTATUS(status) == 127) && !WIFSIGNALED(status);
+    result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return result;
+}
+
+std::string readFile(const std::filesystem::path &path)
+{
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+}
+
+void writeFile(const std::filesystem::path &path, std::string_view text)
+{
+    std::ofstream(path, std::ios::binary).write(text.data(), text.size());
+}
+
+// One way of getting an output for each input, and how it's gone so far
+struct Way {
+    std::string name;
+    // Whether it has to match the reference, rather than only being
+    // counted when it doesn't
+    bool mustAgree;
+    // What the reference is
+    std::string against = "better";
+    std::size_t runs = 0;
+    std::size_t diverged = 0;
+    std::size_t crashed = 0;
+    std::uint64_t bytes = 0;
+    double seconds = 0;
+};
+
+// The output with line markers and blank lines taken out, which is all
+// that --line-markers may add
+Result withoutMarkers(Result result)
+{
+    std::string kept;
+    std::string_view text(result.output);
+    while(!text.empty()) {
+	const std::size_t end = std::min(text.find('\n'), text.size());
+	const std::string_view line(text.substr(0, end));
+	if(!line.empty() && line.substr(0, 6) != "#line ") {
+	    kept += line;
+	    kept += '\n';
+	}
+	text.remove_prefix(std::min(end + 1, text.size()));
+    }
+    result.output = std::move(kept);
+    return result;
+}
+
+// What a --daemon session's replies come to: the output they describe,
+// each change applied in turn, and the error replies in order. ok is false
+// if the replies couldn't be made sense of.
+struct Session {
+    std::string output;
+    std::vector<std::string> errors;
+    bool ok = true;
+};
+
+Session replay(std::string_view replies)
+{
+    Session session;
+    const auto nextLine = [&replies]() {
+	const std::size_t end = std::min(replies.find('\n'), replies.size());
+	const std::string line(replies.substr(0, end));
+	replies.remove_prefix(std::min(end + 1, replies.size()));
+	return line;
+    };
+    while(!replies.empty() && session.ok) {
+	const std::string line(nextLine());
+	unsigned long long start = 0, length = 0, size = 0, errorSize = 0;
+	if(line.compare(0, 6, "error ") == 0) {
+	    session.errors.push_back(line.substr(6));
+	} else if(std::sscanf(line.c_str(), "output %llu %llu %llu", &start, &length, &size) == 3
+		  && start + length <= session.output.size() && size <= replies.size()) {
+	    session.output.replace(start, length, replies.substr(0, size));
+	    replies.remove_prefix(size);
+	    session.ok = std::sscanf(nextLine().c_str(), "errors %llu", &errorSize) == 1
+		&& errorSize <= replies.size();
+	    replies.remove_prefix(std::min<std::size_t>(errorSize, replies.size()));
+	} else {
+	    session.ok = false;
+	}
+    }
+    return session;
+}
+
+// The line the first difference is on, from 1
+std::size_t firstDifference(std::string_view a, std::string_view b)
+{
+    const auto at = std::mismatch(a.begin(), a.end(), b.begin(), b.end()).first;
+    return std::count(a.begin(), at, '\n') + 1;
+}
+
+void usage()
+{
+    std::cout << "usage: ./difftest [-n count] [-s seed] [-w tokens|preserve|minify]"
+	" [-k keep-dir] [--also path]... [--strict] better ginevra++ [corpus-dir...]\n";
+    exit(1);
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t count = 200;
+    std::uint64_t seed = 1;
+    std::vector<std::string> modes;
+    std::filesystem::path keep("difftest-failures");
+    std::vector<std::string> others;
+    bool strict = false;
+    std::vector<std::string> positional;
+    for(int i = 1; i < argc; ++i) {
+	const std::string_view arg(argv[i]);
+	if(arg == "-n" && i + 1 < argc) {
+	    count = std::strtoul(argv[++i], nullptr, 10);
+	} else if(arg == "-s" && i + 1 < argc) {
+	    seed = std::strtoull(argv[++i], nullptr, 10);
+	} else if(arg == "-w" && i + 1 < argc) {
+	    modes.emplace_back(argv[++i]);
+	} else if(arg == "-k" && i + 1 < argc) {
+	    keep = argv[++i];
+	} else if(arg == "--also" && i + 1 < argc) {
+	    others.emplace_back(argv[++i]);
+	} else if(arg == "--strict") {
+	    strict = true;
+	} else if(!arg.empty() && arg[0] != '-') {
+	    positional.emplace_back(arg);
+	} else {
+	    usage();
+	}
+    }
+    if(positional.size() < 2) {
+	usage();
+    }
+    if(modes.empty()) {
+	modes = {"tokens", "preserve", "minify"};
+    }
+    const std::string better(std::filesystem::absolute(positional[0]).string());
+    const std::string ginevra(std::filesystem::absolute(positional[1]).string());
+
+    // Generated inputs go in a scratch directory, along with batch output
+    char scratchTemplate[] = "/tmp/difftest.XXXXXX";
+    if(mkdtemp(scratchTemplate) == nullptr) {
+	std::cerr << "error: could not make a scratch directory\n";
+	return 1;
+    }
+    const std::filesystem::path scratch(scratchTemplate);
+    std::vector<std::filesystem::path> inputs;
+    generate::Random random(seed);
+    for(std::size_t i = 0; i < count; ++i) {
+	inputs.push_back(scratch / ("gen-" + std::to_string(i) + ".cpp"));
+	writeFile(inputs.back(), generate::fuzzInput(random));
+    }
+    for(std::size_t i = 2; i < positional.size(); ++i) {
+	for(const auto &entry : std::filesystem::recursive_directory_iterator(positional[i])) {
+	    const std::string extension(entry.path().extension().string());
+	    if(entry.is_regular_file() && (extension == ".cpp" || extension == ".h")) {
+		inputs.push_back(std::filesystem::absolute(entry.path()));
+	    }
+	}
+    }
+    std::vector<std::uint64_t> sizes;
+    for(const auto &input : inputs) {
+	sizes.push_back(std::filesystem::file_size(input));
+    }
+
+    std::vector<Way> ways{{"better", true}, {"better stdin", true}, {"better --split", true},
+			  {"better -o", true}};
+    for(const std::string &other : others) {
+	ways.push_back({other, true});
+    }
+    ways.push_back({"better --daemon", true});
+    ways.push_back({"ginevra++", strict});
+    ways.push_back({"ginevra++ --line-markers", true, "ginevra++"});
+    Way &daemonWay = ways[ways.size() - 3];
+    Way &ginevraWay = ways[ways.size() - 2];
+    Way &markersWay = ways.back();
+    std::size_t kept = 0;
+    const auto compare = [&](Way &way, std::size_t i, const std::string &mode,
+			     const Result &expected, const Result &actual) {
+	++way.runs;
+	way.bytes += sizes[i];
+	way.seconds += actual.seconds;
+	if(!actual.ran) {
+	    ++way.crashed;
+	} else if(actual.output == expected.output) {
+	    return;
+	}
+	++way.diverged;
+	const std::filesystem::path where(keep / std::to_string(kept++));
+	std::filesystem::create_directories(where);
+	std::filesystem::copy_file(inputs[i], where / inputs[i].filename(),
+				   std::filesystem::copy_options::overwrite_existing);
+	writeFile(where / "expected", expected.output);
+	writeFile(where / "actual", actual.output);
+	writeFile(where / "how", way.name + " --whitespace " + mode + "\n");
+	if(way.mustAgree) {
+	    std::cerr << inputs[i].filename().string() << " --whitespace " << mode << ": "
+		      << way.name << (actual.ran ? " differs from " + way.against + " at line "
+				      + std::to_string(firstDifference(expected.output, actual.output))
+				      : " crashed")
+		      << " (kept in " << where.string() << ")\n";
+	}
+    };
+
+    std::filesystem::remove_all(keep);
+    for(const std::string &mode : modes) {
+	std::vector<Result> reference;
+	for(std::size_t i = 0; i < inputs.size(); ++i) {
+	    const std::string path(inputs[i].string());
+	    reference.push_back(run(better, {"--whitespace", mode, path}));
+	    Way &file = ways[0];
+	    ++file.runs;
+	    file.bytes += sizes[i];
+	    file.seconds += reference.back().seconds;
+	    file.crashed += !reference.back().ran;
+	    compare(ways[1], i, mode, reference[i], run(better, {"--whitespace", mode, "-"}, path));
+	    compare(ways[2], i, mode, reference[i],
+		    run(better, {"--whitespace", mode, "--split", "-j", "4", path}));
+	    for(std::size_t other = 0; other < others.size(); ++other) {
+		compare(ways[4 + other], i, mode, reference[i],
+			run(std::filesystem::absolute(others[other]).string(),
+			    {"--whitespace", mode, path}));
+	    }
+	    // Opened, sent an edit too big to be real, which must be refused
+	    // without the daemon going down, then a line put in and taken out
+	    // again, leaving the output as it was. The daemon only lays out
+	    // tokens.
+	    if(mode == "tokens") {
+		const std::string insert("#define DAEMONEDIT 1\n");
+		const std::filesystem::path script(scratch / "daemon-session");
+		writeFile(script, "open " + path + "\nedit 0 0 99999999999999999\n"
+			  "edit 0 0 " + std::to_string(insert.size()) + "\n" + insert
+			  + "edit 0 " + std::to_string(insert.size()) + " 0\n");
+		Result daemon(run(better, {"--daemon"}, script.string()));
+		const Session session(replay(daemon.output));
+		if(session.ok && !session.errors.empty() && session.errors[0] == "malformed edit") {
+		    daemon.output = session.output;
+		} else {
+		    daemon.output.insert(0, "(the oversized edit wasn't refused as malformed)\n");
+		}
+		compare(daemonWay, i, mode, reference[i], daemon);
+	    }
+	    const Result plain(run(ginevra, {"--whitespace", mode, path}));
+	    compare(ginevraWay, i, mode, reference[i], plain);
+	    compare(markersWay, i, mode, withoutMarkers(plain),
+		    withoutMarkers(run(ginevra, {"--whitespace", mode, "--line-markers", path})));
+	}
+	// Every input at once on the thread pool, with the time shared out
+	// by size
+	const std::filesystem::path list(scratch / "inputs.txt");
+	std::string names;
+	for(const auto &input : inputs) {
+	    names += input.string() + '\n';
+	}
+	writeFile(list, names);
+	const std::filesystem::path outDir(scratch / ("out-" + mode));
+	const Result batch(run(better, {"--whitespace", mode, "-o", outDir.string(),
+					"--files-from", list.string()}));
+	std::uint64_t total = 0;
+	for(const std::uint64_t size : sizes) {
+	    total += size;
+	}
+	for(std::size_t i = 0; i < inputs.size(); ++i) {
+	    Result actual;
+	    const std::filesystem::path output(outDir / inputs[i].relative_path());
+	    actual.ran = batch.ran;
+	    actual.output = std::filesystem::exists(output) ? readFile(output) : std::string();
+	    actual.seconds = total == 0 ? 0 : batch.seconds * sizes[i] / total;
+	    compare(ways[3], i, mode, reference[i], actual);
+	}
+    }
+    std::filesystem::remove_all(scratch);
+
+    std::printf("%zu inputs (%zu generated from seed %llu), %zu whitespace modes\n",
+		inputs.size(), count, static_cast<unsigned long long>(seed), modes.size());
+    std::printf("%-24s %8s %9s %8s %9s\n", "way", "runs", "diverged", "crashed", "MB/s");
+    bool failed = false;
+    for(std::size_t i = 0; i < ways.size(); ++i) {
+	const Way &way = ways[i];
+	const std::string diverged(i == 0 ? "-" : std::to_string(way.diverged));
+	std::printf("%-24s %8zu %9s %8zu %9.1f\n", way.name.c_str(), way.runs, diverged.c_str(),
+		    way.crashed, way.seconds > 0 ? way.bytes / way.seconds / (1024 * 1024) : 0.0);
+	failed = failed || (way.mustAgree && (way.diverged != 0 || way.crashed != 0));
+    }
+    if(kept != 0) {
+	std::printf("inputs that parted kept in %s\n", keep.string().c_str());
+    }
+    return failed ? 1 : 0;
+}
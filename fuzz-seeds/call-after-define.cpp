@@ -0,0 +1,3 @@
+x
+#define F(a) a
+F(2) e
\ No newline at end of file
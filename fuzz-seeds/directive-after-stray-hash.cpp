@@ -0,0 +1,5 @@
+#
+G x
+#ifdef Q
+#endif
+F y
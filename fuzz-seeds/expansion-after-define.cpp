@@ -0,0 +1,2 @@
+#define Y 1
+Y e
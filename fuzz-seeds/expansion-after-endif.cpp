@@ -0,0 +1,3 @@
+#ifdef Q
+#endif
+Y x
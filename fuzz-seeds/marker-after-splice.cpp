@@ -0,0 +1,4 @@
+
+#
+ AX.LEN /**/x2"splice \
+123A 
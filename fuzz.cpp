@@ -0,0 +1,309 @@
+/* File: fuzz.cpp
+ * Purpose: A libFuzzer target for one of the preprocessors. Like bench.cpp,
+ *  it's built once per implementation (see build-fuzz.sh), with that
+ *  implementation compiled in and its main() renamed. Each input is run
+ *  through every way the implementation has of getting to its output, and
+ *  those that have to agree are checked against each other; any mismatch
+ *  aborts with the first place they part. Crashes and sanitizer reports come
+ *  for free.
+ *
+ *  For better, a plain single pass is the reference, and the input is also
+ *  read through the stream window and split across threads, in each
+ *  whitespace mode. The fuzz build shrinks the window and the split chunks
+ *  (-DINPUT_WINDOW_SIZE, -DSPLIT_MIN_CHUNK_SIZE) so that fuzzer-sized inputs
+ *  take those paths for real. For ginevra++, output with line markers must
+ *  be the output without them plus markers and blank lines, and the source
+ *  map must decode and stay within the input and output.
+ *
+ *  Built with -DFUZZ_STANDALONE instead of -fsanitize=fuzzer, it has a main()
+ *  of its own that runs the target over each file named, or each file in
+ *  each directory named, which is how crashes found elsewhere are replayed:
+ *
+ *  usage: ./fuzz-better [libFuzzer options] [corpus-dir...]
+ *         ./fuzz-better-replay file|dir...
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <initializer_list>
+#include <iterator>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define main implementationMain
+#ifdef FUZZ_BETTER
+    #include "better.cpp"
+#else
+    #include "ginevra++.cpp"
+#endif
+#undef main
+
+namespace fuzz {
+
+// Collects whatever is written to it
+class StringSink : public OutputSink {
+public:
+    std::string text;
+    bool write(std::string_view data) override
+    {
+	text += data;
+	return true;
+    }
+};
+
+constexpr Whitespace Modes[] = {Whitespace::Tokens, Whitespace::Preserve, Whitespace::Minify};
+
+const char* modeName(Whitespace whitespace)
+{
+    switch(whitespace) {
+    case Whitespace::Tokens: return "tokens";
+    case Whitespace::Preserve: return "preserve";
+    default: return "minify";
+    }
+}
+
+// Reports where two outputs that should match first part, then aborts so
+// the fuzzer keeps the input
+[[noreturn]] void mismatch(const char *what, Whitespace whitespace,
+			   std::string_view expected, std::string_view actual)
+{
+    const auto at = std::mismatch(expected.begin(), expected.end(),
+				  actual.begin(), actual.end()).first - expected.begin();
+    const auto context = [at](std::string_view text) {
+	const std::size_t start = at < 20 ? 0 : at - 20;
+	return std::string(text.substr(std::min<std::size_t>(start, text.size()), 60));
+    };
+    std::fprintf(stderr, "%s output differs with --whitespace %s at offset %zu\n"
+		 "  expected: %s\n  actual:   %s\n", what, modeName(whitespace),
+		 static_cast<std::size_t>(at), context(expected).c_str(), context(actual).c_str());
+    std::abort();
+}
+
+#ifdef FUZZ_BETTER
+
+std::string plainRun(std::string_view input, Whitespace whitespace)
+{
+    Preprocessor preprocessor;
+    std::ostringstream errors;
+    preprocessor.setErrors(errors);
+    preprocessor.session().whitespace = whitespace;
+    StringSink sink;
+    preprocessor.process(input, sink);
+    return sink.text;
+}
+
+std::string splitRun(std::string_view input, Whitespace whitespace)
+{
+    Session session;
+    session.whitespace = whitespace;
+    std::ostringstream errors;
+    StringSink sink;
+    {
+	OutputBuffer output(sink);
+	output.setWhitespace(whitespace);
+	split::preprocess(input, output, session, ".", 4, errors, nullptr);
+    }
+    return sink.text;
+}
+
+// Through a pipe, written from another thread so that a big input can't
+// fill it up first
+std::string streamRun(std::string_view input, Whitespace whitespace)
+{
+    int fds[2];
+    if(pipe(fds) != 0) {
+	std::abort();
+    }
+    std::thread writer([&input, fd = fds[1]] {
+	std::string_view rest(input);
+	while(!rest.empty()) {
+	    const ssize_t written = ::write(fd, rest.data(), rest.size());
+	    if(written <= 0) {
+		break;
+	    }
+	    rest.remove_prefix(written);
+	}
+	close(fd);
+    });
+    Session session;
+    session.whitespace = whitespace;
+    StringSink sink;
+    {
+	OutputBuffer output(sink);
+	output.setWhitespace(whitespace);
+	preprocessStream(fds[0], output, session);
+    }
+    writer.join();
+    close(fds[0]);
+    return sink.text;
+}
+
+void check(std::string_view input)
+{
+    for(const Whitespace whitespace : Modes) {
+	const std::string expected(plainRun(input, whitespace));
+	if(const std::string actual(streamRun(input, whitespace)); actual != expected) {
+	    mismatch("stream", whitespace, expected, actual);
+	}
+	if(const std::string actual(splitRun(input, whitespace)); actual != expected) {
+	    mismatch("split", whitespace, expected, actual);
+	}
+    }
+}
+
+#else
+
+std::string run(std::string_view input, Whitespace whitespace, bool lineMarkers,
+		StringSink *map = nullptr)
+{
+    Preprocessor preprocessor;
+    preprocessor.setWhitespace(whitespace);
+    preprocessor.setLineMarkers(lineMarkers);
+    preprocessor.setSourceMap(map);
+    StringSink sink;
+    preprocessor.process(input, sink, "fuzz.cpp");
+    return sink.text;
+}
+
+// The lines that aren't blank and aren't line markers
+std::string withoutMarkers(std::string_view text)
+{
+    std::string kept;
+    while(!text.empty()) {
+	const std::size_t end = std::min(text.find('\n'), text.size());
+	const std::string_view line(text.substr(0, end));
+	if(!line.empty() && line.substr(0, 6) != "#line ") {
+	    kept += line;
+	    kept += '\n';
+	}
+	text.remove_prefix(std::min(end + 1, text.size()));
+    }
+    return kept;
+}
+
+// Decodes the map, checking that its records stay in order and in range
+void checkMap(std::string_view map, std::string_view input, std::string_view output)
+{
+    std::size_t i = 0;
+    bool ok = map.substr(0, 4) == "GSMP" && map.size() > 5 && map[4] == SourceMap::version;
+    const auto varint = [&]() {
+	std::uint64_t value = 0;
+	for(int shift = 0; ok; shift += 7) {
+	    if(i == map.size() || shift > 63) {
+		ok = false;
+		break;
+	    }
+	    const auto byte = static_cast<unsigned char>(map[i++]);
+	    value |= std::uint64_t(byte & 0x7f) << shift;
+	    if(byte < 0x80) {
+		break;
+	    }
+	}
+	return value;
+    };
+    const auto zigzag = [&]() {
+	const std::uint64_t value = varint();
+	return value & 1 ? -std::int64_t(value >> 1) - 1 : std::int64_t(value >> 1);
+    };
+    i = 5;
+    const std::uint64_t nameSize = varint();
+    ok = ok && map.substr(i, nameSize) == "fuzz.cpp";
+    i += nameSize;
+    const std::int64_t lines = std::count(input.begin(), input.end(), '\n') + 1;
+    std::uint64_t offset = 0;
+    std::int64_t line = 1;
+    std::int64_t column = 1;
+    while(ok && i < map.size()) {
+	offset += varint();
+	line += zigzag();
+	column += zigzag();
+	ok = ok && offset <= output.size() && line >= 1 && line <= lines && column >= 1;
+    }
+    if(!ok) {
+	std::fprintf(stderr, "source map is malformed or out of range at byte %zu\n", i);
+	std::abort();
+    }
+}
+
+void check(std::string_view input)
+{
+    for(const Whitespace whitespace : Modes) {
+	const std::string plain(run(input, whitespace, false));
+	StringSink map;
+	const std::string marked(run(input, whitespace, true, &map));
+	if(withoutMarkers(marked) != withoutMarkers(plain)) {
+	    mismatch("line-marked", whitespace, withoutMarkers(plain), withoutMarkers(marked));
+	}
+	checkMap(map.text, input, marked);
+    }
+}
+
+#endif
+
+} // namespace fuzz
+
+extern "C" int LLVMFuzzerInitialize(int*, char***)
+{
+    // Diagnostics are expected for most inputs, and only slow things down
+    std::cerr.rdbuf(nullptr);
+    return 0;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const std::uint8_t *data, std::size_t size)
+{
+    fuzz::check(std::string_view(reinterpret_cast<const char*>(data), size));
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int argc, char **argv)
+{
+    LLVMFuzzerInitialize(&argc, &argv);
+    std::vector<std::filesystem::path> inputs;
+    for(int i = 1; i < argc; ++i) {
+	if(std::filesystem::is_directory(argv[i])) {
+	    for(const auto &entry : std::filesystem::recursive_directory_iterator(argv[i])) {
+		if(entry.is_regular_file()) {
+		    inputs.push_back(entry.path());
+		}
+	    }
+	} else {
+	    inputs.emplace_back(argv[i]);
+	}
+    }
+    for(const auto &path : inputs) {
+	std::ifstream file(path, std::ios::binary);
+	const std::string text((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	std::printf("%s\n", path.c_str());
+	std::fflush(stdout);
+	LLVMFuzzerTestOneInput(reinterpret_cast<const std::uint8_t*>(text.data()), text.size());
+    }
+    std::printf("%zu inputs passed\n", inputs.size());
+    return 0;
+}
+#endif
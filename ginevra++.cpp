@@ -9,8 +9,36 @@
  */
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <string>
-#include <map>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <utility>
+#include <chrono>
+#include <new>
+#include <cassert>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+// POSIX file access for memory-mapped input
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+// Vector fast paths for the scanner's inner loops, where available, unless
+// built with -DNO_SIMD
+#if defined(__SSE2__) && !defined(NO_SIMD)
+    #include <emmintrin.h>
+    #define HAVE_SIMD 1
+#elif defined(__aarch64__) && defined(__ARM_NEON) && !defined(NO_SIMD)
+    #include <arm_neon.h>
+    #define HAVE_SIMD 1
+#endif
 
 enum class State : std::int_least16_t {
     Start, Identifier, InIdentifier, InComment, String, InSingleQuote,
@@ -24,254 +52,3377 @@ namespace Token {
     constexpr int EoF = 259;
 }
 
-class Scanner {
+/**
+   What each char means at the start of a token. Indexed by the char as an
+   unsigned value; EOF stored in a char looks the same as 0xFF.
+*/
+enum class CharKind : std::int_least8_t {
+    Blank, Newline, SingleQuote, DoubleQuote, Letter, Slash, Backslash, End, Other
+};
+
+/**
+   A dialect: the token rules the scanner is specialized on at compile time,
+   so that no char is checked against a setting while scanning. Identifiers
+   start with a letter; identDigits is whether digits can continue one, and
+   identChars what else can besides letters. lineComments is whether `//`
+   starts a comment that runs to the end of the line, as well as slash-star
+   starting one, and lineSplices whether a backslash at the end of a line
+   joins it to the next, in strings and out.
+*/
+struct GinevraDialect {
+    static constexpr bool identDigits = true;
+    static constexpr std::string_view identChars = "";
+    static constexpr bool lineComments = false;
+    static constexpr bool lineSplices = true;
+};
+
+/**
+   Identifiers as in better.cpp, letters and dots, with no line splices
+*/
+struct BetterDialect {
+    static constexpr bool identDigits = false;
+    static constexpr std::string_view identChars = ".";
+    static constexpr bool lineComments = false;
+    static constexpr bool lineSplices = false;
+};
+
+/**
+   Either of the above, also taking C++-style `//` comments
+*/
+template<typename Base>
+struct LineComments : Base {
+    static constexpr bool lineComments = true;
+};
+
+/**
+   The dialect this program is built for. Build with, for example,
+   -DSCANNER_DIALECT='LineComments<GinevraDialect>' to pick another.
+*/
+#ifndef SCANNER_DIALECT
+    #define SCANNER_DIALECT GinevraDialect
+#endif
+using Dialect = SCANNER_DIALECT;
+
+constexpr std::array<CharKind,256> makeStartTable()
+{
+    std::array<CharKind,256> table{};
+    for(auto &kind : table) kind = CharKind::Other;
+    for(int c = 'a'; c <= 'z'; ++c) {
+	table[c] = CharKind::Letter;
+	table[c - 'a' + 'A'] = CharKind::Letter;
+    }
+    table[' '] = CharKind::Blank;
+    table['\t'] = CharKind::Blank;
+    table['\n'] = CharKind::Newline;
+    table['\''] = CharKind::SingleQuote;
+    table['"'] = CharKind::DoubleQuote;
+    table['/'] = CharKind::Slash;
+    table['\\'] = CharKind::Backslash;
+    table[static_cast<unsigned char>(EOF)] = CharKind::End;
+    return table;
+}
+
+/**
+   Chars that can continue an identifier in dialect D
+*/
+template<typename D>
+constexpr std::array<bool,256> makeIdentTable()
+{
+    std::array<bool,256> table{};
+    for(int c = 'a'; c <= 'z'; ++c) {
+	table[c] = true;
+	table[c - 'a' + 'A'] = true;
+    }
+    for(int c = '0'; c <= '9'; ++c) {
+	table[c] = D::identDigits;
+    }
+    for(const char c : D::identChars) {
+	table[static_cast<unsigned char>(c)] = true;
+    }
+    return table;
+}
+
+constexpr auto startTable = makeStartTable();
+template<typename D>
+constexpr std::array<bool,256> identTable = makeIdentTable<D>();
+
+#ifdef HAVE_SIMD
+/**
+   The few 16-byte vector operations used by the scanning fast paths.
+*/
+namespace simd {
+    constexpr int width = 16;
+#if defined(__SSE2__)
+    using Bytes = __m128i;
+    inline Bytes load(const char *p) { return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)); }
+    inline Bytes eq(Bytes v, char c) { return _mm_cmpeq_epi8(v, _mm_set1_epi8(c)); }
+    inline Bytes either(Bytes a, Bytes b) { return _mm_or_si128(a, b); }
+    inline Bytes both(Bytes a, Bytes b) { return _mm_and_si128(a, b); }
+    inline Bytes lower(Bytes v) { return _mm_or_si128(v, _mm_set1_epi8(0x20)); }
+    inline Bytes inRange(Bytes v, char low, char high)
+    {
+	const Bytes offset = _mm_sub_epi8(v, _mm_set1_epi8(low));
+	return _mm_cmpeq_epi8(_mm_min_epu8(offset, _mm_set1_epi8(high - low)), offset);
+    }
+    inline int firstSet(Bytes mask)
+    {
+	const unsigned bits = _mm_movemask_epi8(mask);
+	return bits != 0 ? __builtin_ctz(bits) : width;
+    }
+    inline int firstClear(Bytes mask)
+    {
+	const unsigned bits = ~_mm_movemask_epi8(mask) & 0xFFFF;
+	return bits != 0 ? __builtin_ctz(bits) : width;
+    }
+#else
+    using Bytes = uint8x16_t;
+    inline Bytes load(const char *p) { return vld1q_u8(reinterpret_cast<const uint8_t*>(p)); }
+    inline Bytes eq(Bytes v, char c) { return vceqq_u8(v, vdupq_n_u8(c)); }
+    inline Bytes either(Bytes a, Bytes b) { return vorrq_u8(a, b); }
+    inline Bytes both(Bytes a, Bytes b) { return vandq_u8(a, b); }
+    inline Bytes lower(Bytes v) { return vorrq_u8(v, vdupq_n_u8(0x20)); }
+    inline Bytes inRange(Bytes v, char low, char high)
+    {
+	return vcleq_u8(vsubq_u8(v, vdupq_n_u8(low)), vdupq_n_u8(high - low));
+    }
+    inline int firstSet(Bytes mask)
+    {
+	const uint64_t bits = vget_lane_u64(vreinterpret_u64_u8(
+	    vshrn_n_u16(vreinterpretq_u16_u8(mask), 4)), 0);
+	return bits != 0 ? __builtin_ctzll(bits) / 4 : width;
+    }
+    inline int firstClear(Bytes mask) { return firstSet(vmvnq_u8(mask)); }
+#endif
+}
+#endif
+
+/**
+   Returns the first char in [p, end) that isn't a space or tab.
+*/
+inline const char* skipBlanks(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::width; p += simd::width) {
+	const simd::Bytes v = simd::load(p);
+	const int i = simd::firstClear(simd::either(simd::eq(v, ' '), simd::eq(v, '\t')));
+	if(i < simd::width) return p + i;
+    }
+#endif
+    while(p < end && (*p == ' ' || *p == '\t')) ++p;
+    return p;
+}
+
+/**
+   Returns the first char in [p, end) that can't continue an identifier in
+   dialect D.
+*/
+template<typename D>
+inline const char* skipIdentChars(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::width; p += simd::width) {
+	const simd::Bytes v = simd::load(p);
+	simd::Bytes ident = simd::inRange(simd::lower(v), 'a', 'z');
+	if constexpr(D::identDigits) {
+	    ident = simd::either(ident, simd::inRange(v, '0', '9'));
+	}
+	// Unrolled, since identChars is a constant
+	for(const char c : D::identChars) {
+	    ident = simd::either(ident, simd::eq(v, c));
+	}
+	const int i = simd::firstClear(ident);
+	if(i < simd::width) return p + i;
+    }
+#endif
+    while(p < end && identTable<D>[static_cast<unsigned char>(*p)]) ++p;
+    return p;
+}
+
+/**
+   Returns the first char in [p, end) that needs a closer look inside a
+   string: the closing quote, a backslash, a newline, or an EOF-valued char.
+*/
+inline const char* findStringStop(const char *p, const char *end, char quote)
+{
+#ifdef HAVE_SIMD
+    for(; end - p >= simd::width; p += simd::width) {
+	const simd::Bytes v = simd::load(p);
+	const int i = simd::firstSet(simd::either(
+	    simd::either(simd::eq(v, quote), simd::eq(v, '\\')),
+	    simd::either(simd::eq(v, '\n'), simd::eq(v, EOF))));
+	if(i < simd::width) return p + i;
+    }
+#endif
+    while(p < end && *p != quote && *p != '\\' && *p != '\n' && *p != EOF) ++p;
+    return p;
+}
+
+/**
+   Returns the first `*` in [p, end) that is directly followed by a slash,
+   or the first EOF-valued char if that comes sooner.
+*/
+inline const char* findCommentEnd(const char *p, const char *end)
+{
+#ifdef HAVE_SIMD
+    for(; end - p > simd::width; p += simd::width) {
+	const simd::Bytes v = simd::load(p);
+	const simd::Bytes next = simd::load(p + 1);
+	const int i = simd::firstSet(simd::either(
+	    simd::both(simd::eq(v, '*'), simd::eq(next, '/')), simd::eq(v, EOF)));
+	if(i < simd::width) return p + i;
+    }
+#endif
+    while(p < end && *p != EOF && !(*p == '*' && p + 1 < end && p[1] == '/')) ++p;
+    return p;
+}
+
+/**
+   Where a `//` comment starts in line, or line.size() if none does. String
+   literals and slash-star comments are stepped over, since they could hold
+   a `//`.
+*/
+inline std::size_t lineCommentStart(std::string_view line)
+{
+    std::size_t i = 0;
+    while((i = line.find_first_of("/\"'", i)) < line.size()) {
+	if(line[i] != '/') {
+	    const char quote = line[i];
+	    for(++i; i < line.size() && line[i] != quote; i += line[i] == '\\' ? 2 : 1) {}
+	    ++i;
+	} else if(i + 1 < line.size() && line[i + 1] == '/') {
+	    return i;
+	} else if(i + 1 < line.size() && line[i + 1] == '*') {
+	    i = line.find("*/", i + 2);
+	    if(i == std::string_view::npos) break;
+	    i += 2;
+	} else {
+	    ++i;
+	}
+    }
+    return line.size();
+}
+
+/**
+   Counters for --stats, only kept if the program is built with
+   -DENABLE_STATS=1. Otherwise every hook below is an empty inline function,
+   and the hot paths compile to exactly what they'd be without them.
+*/
+#ifndef ENABLE_STATS
+    #define ENABLE_STATS 0
+#endif
+constexpr bool statsEnabled = ENABLE_STATS;
+
+namespace stats {
+    /**
+       Where the time goes. It's charged to the innermost phase running, so
+       the phases add up to the whole run.
+    */
+    enum class Phase : std::size_t { Other, Read, Scan, Expand, Write, Count };
+    constexpr std::size_t phaseCount = static_cast<std::size_t>(Phase::Count);
+    constexpr std::array<const char*, phaseCount> phaseNames{
+	"other", "read", "scan", "expand", "write"
+    };
+    /**
+       What nextToken() returned, by kind: Token::Identifier, Token::Define,
+       Token::String, '\n', Token::EoF, or any other char.
+    */
+    constexpr std::size_t kindCount = 6;
+    constexpr std::array<const char*, kindCount> kindNames{
+	"identifier", "define", "string", "newline", "eof", "other"
+    };
+
+    struct Counters {
+	std::array<std::uint64_t, phaseCount> nanoseconds{};
+	Phase phase = Phase::Other;
+	std::chrono::steady_clock::time_point since = std::chrono::steady_clock::now();
+	// Tokens, and the input each took up, including blanks and comments
+	// before it
+	std::array<std::uint64_t, kindCount> tokens{};
+	std::array<std::uint64_t, kindCount> tokenBytes{};
+	std::uint64_t lines = 0; //read whole: directives and skipped lines
+	std::uint64_t lineBytes = 0;
+	std::uint64_t lookups = 0; //symbol table probes
+	std::uint64_t hits = 0;
+	std::uint64_t slots = 0; //slots looked at by all lookups
+	std::uint64_t substitutions = 0; //object-like macros replaced
+	std::uint64_t calls = 0; //function-like bodies substituted
+	std::uint64_t outputBytes = 0;
+	std::uint64_t writes = 0;
+	// Counted in operator new
+	std::uint64_t allocations = 0;
+	std::uint64_t allocatedBytes = 0;
+    };
+
+    const auto startTime = std::chrono::steady_clock::now();
+    Counters counters;
+
+    /**
+       Charges the time since the last switch to the phase running, then
+       starts on the given one, returning the old one.
+    */
+    inline Phase switchTo(Phase phase)
+    {
+	const auto now = std::chrono::steady_clock::now();
+	counters.nanoseconds[static_cast<std::size_t>(counters.phase)] +=
+	    std::chrono::duration_cast<std::chrono::nanoseconds>(now - counters.since).count();
+	counters.since = now;
+	const Phase outer = counters.phase;
+	counters.phase = phase;
+	return outer;
+    }
+
+    /**
+       Runs the rest of a scope in the given phase, then goes back to the one
+       it interrupted.
+    */
+    class PhaseTimer {
+    private:
+	Phase outer = Phase::Other;
+    public:
+	explicit PhaseTimer(Phase phase)
+	{
+	    if constexpr(statsEnabled) outer = switchTo(phase);
+	}
+	~PhaseTimer()
+	{
+	    if constexpr(statsEnabled) switchTo(outer);
+	}
+	PhaseTimer(const PhaseTimer&) = delete;
+	PhaseTimer& operator=(const PhaseTimer&) = delete;
+    };
+
+    inline void token(int kind, std::size_t bytes)
+    {
+	if constexpr(statsEnabled) {
+	    const std::size_t index = kind == Token::Identifier ? 0 : kind == Token::Define ? 1
+		: kind == Token::String ? 2 : kind == '\n' ? 3 : kind == Token::EoF ? 4 : 5;
+	    ++counters.tokens[index];
+	    counters.tokenBytes[index] += bytes;
+	}
+    }
+
+    inline void line(std::size_t bytes)
+    {
+	if constexpr(statsEnabled) {
+	    ++counters.lines;
+	    counters.lineBytes += bytes;
+	}
+    }
+
+    inline void lookup(std::size_t slots, bool hit)
+    {
+	if constexpr(statsEnabled) {
+	    ++counters.lookups;
+	    counters.hits += hit;
+	    counters.slots += slots;
+	}
+    }
+
+    inline void substitution()
+    {
+	if constexpr(statsEnabled) ++counters.substitutions;
+    }
+
+    inline void call()
+    {
+	if constexpr(statsEnabled) ++counters.calls;
+    }
+
+    inline void output(std::size_t bytes)
+    {
+	if constexpr(statsEnabled) {
+	    ++counters.writes;
+	    counters.outputBytes += bytes;
+	}
+    }
+
+    std::uint64_t wallNanoseconds()
+    {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	    std::chrono::steady_clock::now() - startTime).count();
+    }
+
+    /**
+       For people: the counts that aren't zero, with a few ratios.
+    */
+    void report(std::ostream &out)
+    {
+	switchTo(Phase::Other);
+	const auto ms = [](std::uint64_t ns) { return ns / 1e6; };
+	out << "stats: " << ms(wallNanoseconds()) << " ms wall\n  time (ms):";
+	for(std::size_t i = 0; i < phaseCount; ++i) {
+	    out << ' ' << phaseNames[i] << ' ' << ms(counters.nanoseconds[i]);
+	}
+	out << "\n  tokens:";
+	for(std::size_t i = 0; i < kindCount; ++i) {
+	    if(counters.tokens[i] != 0) {
+		out << ' ' << kindNames[i] << ' ' << counters.tokens[i]
+		    << " (" << counters.tokenBytes[i] << " bytes)";
+	    }
+	}
+	out << "\n  lines read whole: " << counters.lines << " (" << counters.lineBytes
+	    << " bytes)\n  symbol lookups: " << counters.lookups << ", " << counters.hits
+	    << " hits, " << counters.lookups - counters.hits << " misses, "
+	    << (counters.lookups == 0 ? 0.0 : double(counters.slots) / counters.lookups)
+	    << " slots each\n  substitutions: " << counters.substitutions << " object-like, "
+	    << counters.calls << " function-like\n  allocations: " << counters.allocations
+	    << " (" << counters.allocatedBytes << " bytes)\n  output: " << counters.outputBytes
+	    << " bytes in " << counters.writes << " writes\n";
+    }
+
+    /**
+       For dashboards: everything, on one line.
+    */
+    void reportJson(std::ostream &out)
+    {
+	switchTo(Phase::Other);
+	out << "{\"implementation\":\"ginevra++\",\"wall_ns\":" << wallNanoseconds()
+	    << ",\"threads\":1,\"phase_ns\":{";
+	for(std::size_t i = 0; i < phaseCount; ++i) {
+	    out << (i == 0 ? "" : ",") << '"' << phaseNames[i] << "\":" << counters.nanoseconds[i];
+	}
+	out << "},\"tokens\":{";
+	for(std::size_t i = 0; i < kindCount; ++i) {
+	    out << (i == 0 ? "" : ",") << '"' << kindNames[i] << "\":{\"count\":"
+		<< counters.tokens[i] << ",\"bytes\":" << counters.tokenBytes[i] << '}';
+	}
+	out << "},\"lines\":{\"count\":" << counters.lines << ",\"bytes\":" << counters.lineBytes
+	    << "},\"symbols\":{\"lookups\":" << counters.lookups << ",\"hits\":" << counters.hits
+	    << ",\"misses\":" << counters.lookups - counters.hits << ",\"slots\":"
+	    << counters.slots << "},\"substitutions\":{\"object_like\":"
+	    << counters.substitutions << ",\"function_like\":" << counters.calls
+	    << "},\"allocations\":{\"count\":" << counters.allocations << ",\"bytes\":"
+	    << counters.allocatedBytes << "},\"output\":{\"bytes\":" << counters.outputBytes
+	    << ",\"writes\":" << counters.writes << "}}\n";
+    }
+}
+
+/**
+   Allocations can also be counted without the rest of the stats, with
+   -DCOUNT_ALLOCATIONS=1, which is how bench.cpp counts them.
+*/
+#ifndef COUNT_ALLOCATIONS
+    #define COUNT_ALLOCATIONS ENABLE_STATS
+#endif
+
+#if COUNT_ALLOCATIONS
+/**
+   Counts every allocation for --stats. Kept out of line, like the deletes,
+   since wherever both are inlined the compiler takes free() on memory from
+   malloc() via operator new for a mismatch.
+*/
+[[gnu::noinline]] void* operator new(std::size_t size)
+{
+    ++stats::counters.allocations;
+    stats::counters.allocatedBytes += size;
+    if(void *p = std::malloc(size == 0 ? 1 : size)) {
+	return p;
+    }
+    throw std::bad_alloc();
+}
+
+// The array forms end up in these
+[[gnu::noinline]] void operator delete(void *p) noexcept { std::free(p); }
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+void* operator new[](std::size_t size) { return operator new(size); }
+#endif
+
+/**
+   64-bit FNV-1a hash of a symbol name.
+*/
+constexpr std::uint64_t hashText(std::string_view text)
+{
+    std::uint64_t hash = 14695981039346656037ull;
+    for(const char c : text) {
+	hash ^= static_cast<unsigned char>(c);
+	hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+/**
+   One token of a macro's body, recorded when the macro is defined. In an
+   object-like macro, an identifier that was itself an object-like macro then
+   covers the text it expanded to. Identifiers naming a macro keep its index
+   in symbol, so nested expansions never need rescanning; otherwise symbol is
+   SymbolTable::noSymbol. In a function-like macro, param is which parameter
+   the token names, counting from 1, or 0 if none.
+*/
+struct BodyToken {
+    int kind;
+    std::uint16_t param;
+    std::uint32_t offset; //where the token is within the macro's value
+    std::uint32_t length;
+    std::uint32_t symbol;
+};
+
+/**
+   A defined symbol: the fully expanded value to copy to the output, and the
+   range of the table's BodyTokens it was built from. paramCount is how many
+   parameters a function-like macro takes, or -1 for an object-like one.
+*/
+struct Macro {
+    std::string_view value;
+    std::uint32_t firstToken;
+    std::uint32_t tokenCount;
+    std::int32_t paramCount;
+};
+
+/**
+   Maps each #define'd symbol to its value using open addressing with linear
+   probing. Slots only hold the low half of the hash and an index into the
+   dense entries array, so mismatches rarely touch an entry's strings.
+
+   A table layered on another (see layerOn()) reads through to it rather
+   than copying it. Its own entries are numbered on from the base's, and a
+   base symbol that's redefined is shadowed under the same index, so bodies
+   that name it see the new definition. Nothing ever writes to the base, so
+   it can be shared freely.
+*/
+class SymbolTable {
+private:
+    /**
+       Bump-pointer storage for names and values, which are never freed
+       individually; blocks are only released along with the table, or
+       handed out again once it's clear()ed.
+    */
+    class Arena {
+    private:
+	static constexpr std::size_t blockSize = 64 * 1024;
+	std::vector<std::unique_ptr<char[]>> blocks;
+	std::size_t used = 0; //how many of blocks hold anything
+	// Text too big to share a block, which isn't worth keeping around
+	std::vector<std::unique_ptr<char[]>> large;
+	char *next = nullptr;
+	std::size_t left = 0;
+    public:
+	std::string_view copy(std::string_view text);
+	void clear() { used = 0; large.clear(); next = nullptr; left = 0; }
+    };
+    struct Slot {
+	std::uint32_t hash;
+	std::uint32_t entry; //index into entries plus one; 0 if empty
+    };
+    struct Entry {
+	std::string_view name;
+	Macro macro;
+	std::uint64_t hash;
+    };
+    /**
+       An Entry as saved in an image, with its strings as offsets into the
+       image's pool.
+    */
+    struct StoredEntry {
+	std::uint64_t hash;
+	std::uint32_t name;
+	std::uint32_t nameLength;
+	std::uint32_t value;
+	std::uint32_t valueLength;
+	std::uint32_t firstToken;
+	std::uint32_t tokenCount;
+	std::int32_t paramCount;
+	std::uint32_t unused;
+    };
+    static constexpr std::string_view imageMagic = "gsymG01\n";
+    Arena arena;
+    std::vector<Slot> slots = std::vector<Slot>(16);
+    std::vector<Entry> entries;
+    std::vector<BodyToken> tokens; //every macro's body, back to back
+    // What the table is layered on, if anything, with its entry and token
+    // counts, which is where this table's own start
+    const SymbolTable *base = nullptr;
+    std::uint32_t baseSize = 0;
+    std::uint32_t baseTokens = 0;
+    // Base symbols redefined here, and for each base entry, its shadow's
+    // index plus one, or 0; empty until the first shadow
+    std::vector<Entry> shadows;
+    std::vector<std::uint32_t> shadowIndex;
+    std::size_t probe(std::string_view name, std::uint64_t hash) const;
+    void rehash(std::size_t slotCount);
+    const Entry& entryAt(std::uint32_t index) const
+    {
+	if(index >= baseSize) {
+	    return entries[index - baseSize];
+	} else if(!shadowIndex.empty() && shadowIndex[index] != 0) {
+	    return shadows[shadowIndex[index] - 1];
+	}
+	return base->entries[index];
+    }
+public:
+    static constexpr std::uint32_t noSymbol = UINT32_MAX;
+    const Macro* find(std::string_view name, std::uint64_t hash) const;
+    std::uint32_t indexOf(std::string_view name, std::uint64_t hash) const;
+    const Macro& macro(std::uint32_t index) const { return entryAt(index).macro; }
+    const BodyToken* bodyTokens(const Macro &macro) const
+    {
+	return macro.firstToken < baseTokens ? base->tokens.data() + macro.firstToken
+	    : tokens.data() + (macro.firstToken - baseTokens);
+    }
+    std::size_t size() const { return baseSize + entries.size(); }
+    void define(std::string_view name, std::uint64_t hash, std::string_view value,
+		const std::vector<BodyToken> &body, std::int32_t paramCount);
+    void undefine(std::string_view name, std::uint64_t hash);
+    void copyFrom(const SymbolTable &base);
+    void layerOn(const SymbolTable &base);
+    void flatten();
+    std::string image() const;
+    bool load(std::string_view image);
+};
+
+/**
+   Returns a copy of text that lives as long as the arena. Text too big to
+   share a block gets a block of its own.
+*/
+std::string_view SymbolTable::Arena::copy(std::string_view text)
+{
+    if(text.empty()) {
+	return {};
+    }
+    if(text.size() > left) {
+	if(text.size() > blockSize / 4) {
+	    large.emplace_back(new char[text.size()]);
+	    std::memcpy(large.back().get(), text.data(), text.size());
+	    return {large.back().get(), text.size()};
+	}
+	if(used == blocks.size()) {
+	    blocks.emplace_back(new char[blockSize]);
+	}
+	next = blocks[used++].get();
+	left = blockSize;
+    }
+    std::memcpy(next, text.data(), text.size());
+    const std::string_view copied(next, text.size());
+    next += text.size();
+    left -= text.size();
+    return copied;
+}
+
+/**
+   Returns the index of the slot holding name, or of the empty slot where it
+   would go.
+*/
+std::size_t SymbolTable::probe(std::string_view name, std::uint64_t hash) const
+{
+    const std::size_t mask = slots.size() - 1;
+    const auto fragment = static_cast<std::uint32_t>(hash);
+    std::size_t i = hash & mask;
+    std::size_t looked = 1;
+    while(slots[i].entry != 0 && (slots[i].hash != fragment
+				  || entries[slots[i].entry - 1].name != name)) {
+	i = (i + 1) & mask;
+	++looked;
+    }
+    stats::lookup(looked, slots[i].entry != 0);
+    return i;
+}
+
+void SymbolTable::rehash(std::size_t slotCount)
+{
+    slots.assign(slotCount, Slot{0, 0});
+    const std::size_t mask = slots.size() - 1;
+    for(std::size_t index = 0; index < entries.size(); ++index) {
+	std::size_t i = entries[index].hash & mask;
+	while(slots[i].entry != 0) {
+	    i = (i + 1) & mask;
+	}
+	slots[i] = {static_cast<std::uint32_t>(entries[index].hash),
+		    static_cast<std::uint32_t>(index + 1)};
+    }
+}
+
+/**
+   Returns the value of the given symbol, or nullptr if it isn't defined.
+*/
+const Macro* SymbolTable::find(std::string_view name, std::uint64_t hash) const
+{
+    const Slot &slot = slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	return &entries[slot.entry - 1].macro;
+    } else if(base == nullptr) {
+	return nullptr;
+    }
+    const std::uint32_t index = base->indexOf(name, hash);
+    return index == noSymbol ? nullptr : &entryAt(index).macro;
+}
+
+/**
+   Returns the index of the given symbol, or noSymbol if it isn't defined.
+*/
+std::uint32_t SymbolTable::indexOf(std::string_view name, std::uint64_t hash) const
+{
+    const Slot &slot = slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	return baseSize + slot.entry - 1;
+    }
+    return base == nullptr ? noSymbol : base->indexOf(name, hash);
+}
+
+void SymbolTable::define(std::string_view name, std::uint64_t hash, std::string_view value,
+			 const std::vector<BodyToken> &body, std::int32_t paramCount)
+{
+    const Macro macro{arena.copy(value), static_cast<std::uint32_t>(baseTokens + tokens.size()),
+		      static_cast<std::uint32_t>(body.size()), paramCount};
+    tokens.insert(tokens.end(), body.begin(), body.end());
+    Slot &slot = slots[probe(name, hash)];
+    if(slot.entry != 0) {
+	entries[slot.entry - 1].macro = macro;
+	return;
+    }
+    if(const std::uint32_t index = base == nullptr ? noSymbol : base->indexOf(name, hash);
+       index != noSymbol) {
+	if(shadowIndex.empty()) {
+	    shadowIndex.assign(baseSize, 0);
+	}
+	if(shadowIndex[index] == 0) {
+	    shadows.push_back({arena.copy(name), macro, hash});
+	    shadowIndex[index] = static_cast<std::uint32_t>(shadows.size());
+	} else {
+	    shadows[shadowIndex[index] - 1].macro = macro;
+	}
+	return;
+    }
+    entries.push_back({arena.copy(name), macro, hash});
+    slot = {static_cast<std::uint32_t>(hash),
+	    static_cast<std::uint32_t>(entries.size())};
+    if(entries.size() * 2 > slots.size()) {
+	rehash(slots.size() * 2);
+    }
+}
+
+/**
+   Removes a symbol, if it's defined. The entries after it move down, and
+   body tokens that named it name nothing from then on, as if it had never
+   been defined. This goes over the whole table, but only -U ever does it.
+*/
+void SymbolTable::undefine(std::string_view name, std::uint64_t hash)
+{
+    flatten();
+    const std::uint32_t index = indexOf(name, hash);
+    if(index == noSymbol) {
+	return;
+    }
+    entries.erase(entries.begin() + index);
+    for(BodyToken &token : tokens) {
+	if(token.symbol == index) {
+	    token.symbol = noSymbol;
+	} else if(token.symbol != noSymbol && token.symbol > index) {
+	    --token.symbol;
+	}
+    }
+    rehash(slots.size());
+}
+
+/**
+   Makes the table the same as base, sharing base's names and values, so
+   base must outlive what's in the table now. Whatever the table held before
+   is dropped, but its storage is kept for what's defined next.
+*/
+void SymbolTable::copyFrom(const SymbolTable &base)
+{
+    arena.clear();
+    slots = base.slots;
+    entries = base.entries;
+    tokens = base.tokens;
+    this->base = base.base;
+    baseSize = base.baseSize;
+    baseTokens = base.baseTokens;
+    shadows = base.shadows;
+    shadowIndex = base.shadowIndex;
+}
+
+/**
+   Empties the table and layers it on base, which mustn't be layered itself,
+   and mustn't change or go away while the table reads through to it. Until
+   then the table is a copy of base plus whatever is defined in it, for the
+   cost of only what's defined.
+*/
+void SymbolTable::layerOn(const SymbolTable &base)
+{
+    arena.clear();
+    slots.assign(16, Slot{0, 0});
+    entries.clear();
+    tokens.clear();
+    shadows.clear();
+    shadowIndex.clear();
+    // Reading through to an empty table would only be another probe
+    this->base = base.size() == 0 ? nullptr : &base;
+    baseSize = static_cast<std::uint32_t>(base.size());
+    baseTokens = static_cast<std::uint32_t>(base.tokens.size());
+}
+
+/**
+   Stops reading through to the base, if any, taking copies of what the
+   table had from it. Indices stay as they were.
+*/
+void SymbolTable::flatten()
+{
+    if(base == nullptr) {
+	return;
+    }
+    SymbolTable flat;
+    std::vector<BodyToken> body;
+    for(std::uint32_t i = 0; i < size(); ++i) {
+	const Entry &entry = entryAt(i);
+	const BodyToken *first = bodyTokens(entry.macro);
+	body.assign(first, first + entry.macro.tokenCount);
+	flat.define(entry.name, entry.hash, entry.macro.value, body, entry.macro.paramCount);
+    }
+    *this = std::move(flat);
+}
+
+/**
+   Returns the table as a .gsym image: a header, then the slots, entries and
+   body tokens exactly as they are laid out in memory, then a pool of every
+   name and value. Only the tokens of each symbol's latest definition go in.
+*/
+std::string SymbolTable::image() const
+{
+    if(base != nullptr) {
+	SymbolTable flat;
+	flat.copyFrom(*this);
+	flat.flatten();
+	return flat.image();
+    }
+    std::string pool;
+    std::vector<StoredEntry> stored;
+    std::vector<BodyToken> kept;
+    for(const Entry &entry : entries) {
+	StoredEntry out{entry.hash, static_cast<std::uint32_t>(pool.size()),
+			static_cast<std::uint32_t>(entry.name.size()), 0,
+			static_cast<std::uint32_t>(entry.macro.value.size()),
+			static_cast<std::uint32_t>(kept.size()), entry.macro.tokenCount,
+			entry.macro.paramCount, 0};
+	pool += entry.name;
+	out.value = static_cast<std::uint32_t>(pool.size());
+	pool += entry.macro.value;
+	kept.insert(kept.end(), tokens.begin() + entry.macro.firstToken,
+		    tokens.begin() + entry.macro.firstToken + entry.macro.tokenCount);
+	stored.push_back(out);
+    }
+    const std::uint32_t counts[] = {
+	static_cast<std::uint32_t>(stored.size()), static_cast<std::uint32_t>(slots.size()),
+	static_cast<std::uint32_t>(kept.size()), static_cast<std::uint32_t>(pool.size()),
+	sizeof(StoredEntry), sizeof(BodyToken)
+    };
+    std::string body(reinterpret_cast<const char*>(counts), sizeof(counts));
+    body.append(reinterpret_cast<const char*>(slots.data()), slots.size() * sizeof(Slot));
+    body.append(reinterpret_cast<const char*>(stored.data()), stored.size() * sizeof(StoredEntry));
+    body.append(reinterpret_cast<const char*>(kept.data()), kept.size() * sizeof(BodyToken));
+    body += pool;
+    const std::uint64_t hash = hashText(body);
+    std::string image(imageMagic);
+    image.append(reinterpret_cast<const char*>(&hash), sizeof(hash));
+    return image + body;
+}
+
+/**
+   Replaces the table's contents with an image(), with no rescanning or
+   rehashing: the arrays are copied as they are, and names and values are
+   used where they lie in image, which must outlive the table. Returns false,
+   leaving the table alone, if image isn't a sound one from this build.
+*/
+bool SymbolTable::load(std::string_view image)
+{
+    std::uint32_t counts[6];
+    const std::size_t headerSize = imageMagic.size() + sizeof(std::uint64_t) + sizeof(counts);
+    if(image.size() < headerSize || image.substr(0, imageMagic.size()) != imageMagic) {
+	return false;
+    }
+    std::memcpy(counts, image.data() + imageMagic.size() + sizeof(std::uint64_t), sizeof(counts));
+    const auto [entryCount, slotCount, tokenCount, poolSize, entrySize, tokenSize] = counts;
+    const std::uint64_t slotBytes = std::uint64_t(slotCount) * sizeof(Slot);
+    const std::uint64_t entryBytes = std::uint64_t(entryCount) * sizeof(StoredEntry);
+    const std::uint64_t tokenBytes = std::uint64_t(tokenCount) * sizeof(BodyToken);
+    if(entrySize != sizeof(StoredEntry) || tokenSize != sizeof(BodyToken)
+       || slotCount < 16 || (slotCount & (slotCount - 1)) != 0
+       || std::uint64_t(entryCount) * 2 > slotCount
+       || headerSize + slotBytes + entryBytes + tokenBytes + poolSize != image.size()) {
+	return false;
+    }
+    const char *at = image.data() + headerSize;
+    std::vector<Slot> newSlots(slotCount);
+    std::memcpy(newSlots.data(), at, slotBytes);
+    at += slotBytes;
+    const char *storedAt = at;
+    at += entryBytes;
+    std::vector<BodyToken> newTokens(tokenCount);
+    if(tokenCount != 0) {
+	std::memcpy(newTokens.data(), at, tokenBytes);
+    }
+    const std::string_view pool(at + tokenBytes, poolSize);
+
+    const auto within = [](std::uint64_t start, std::uint64_t length, std::uint64_t limit) {
+	return start + length <= limit;
+    };
+    std::vector<Entry> newEntries;
+    newEntries.reserve(entryCount);
+    for(std::uint32_t i = 0; i < entryCount; ++i) {
+	StoredEntry entry;
+	std::memcpy(&entry, storedAt + std::size_t(i) * sizeof(StoredEntry), sizeof(entry));
+	if(!within(entry.name, entry.nameLength, poolSize)
+	   || !within(entry.value, entry.valueLength, poolSize)
+	   || !within(entry.firstToken, entry.tokenCount, tokenCount)
+	   || entry.paramCount < -1 || entry.paramCount > UINT16_MAX) {
+	    return false;
+	}
+	for(std::uint32_t t = entry.firstToken; t < entry.firstToken + entry.tokenCount; ++t) {
+	    const BodyToken &token = newTokens[t];
+	    if(!within(token.offset, token.length, entry.valueLength)
+	       || token.param > std::max(entry.paramCount, 0)
+	       || (token.symbol >= entryCount && token.symbol != noSymbol)) {
+		return false;
+	    }
+	}
+	newEntries.push_back({pool.substr(entry.name, entry.nameLength),
+			      {pool.substr(entry.value, entry.valueLength), entry.firstToken,
+			       entry.tokenCount, entry.paramCount},
+			      entry.hash});
+    }
+    // Each entry must be in exactly one slot, under its own hash
+    std::vector<bool> placed(entryCount, false);
+    std::size_t used = 0;
+    for(const Slot &slot : newSlots) {
+	if(slot.entry == 0) {
+	    continue;
+	} else if(slot.entry > entryCount || placed[slot.entry - 1]
+		  || slot.hash != static_cast<std::uint32_t>(newEntries[slot.entry - 1].hash)) {
+	    return false;
+	}
+	placed[slot.entry - 1] = true;
+	++used;
+    }
+    if(used != entryCount) {
+	return false;
+    }
+    slots = std::move(newSlots);
+    entries = std::move(newEntries);
+    tokens = std::move(newTokens);
+    base = nullptr;
+    baseSize = baseTokens = 0;
+    shadows.clear();
+    shadowIndex.clear();
+    return true;
+}
+
+/**
+   Read-only view of an input file's full contents. Regular files are
+   mmap'd; anything else (pipes, FIFOs) is read into an owned buffer.
+*/
+class SourceFile {
+private:
+    void *mapping = nullptr;
+    std::size_t mappingSize = 0;
+    std::string buffer;
+public:
+    SourceFile() = default;
+    ~SourceFile();
+    SourceFile(const SourceFile&) = delete;
+    SourceFile& operator=(const SourceFile&) = delete;
+    bool open(const std::string &path);
+    const char *data = nullptr;
+    std::size_t size = 0;
+};
+
+SourceFile::~SourceFile()
+{
+    if(mapping != nullptr) {
+	munmap(mapping, mappingSize);
+    }
+}
+
+bool SourceFile::open(const std::string &path)
+{
+    const stats::PhaseTimer timer(stats::Phase::Read);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if(fd < 0) {
+	return false;
+    }
+    struct stat info;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+	void *region = mmap(nullptr, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(region != MAP_FAILED) {
+	    madvise(region, info.st_size, MADV_SEQUENTIAL);
+	    mapping = region;
+	    mappingSize = info.st_size;
+	    data = static_cast<const char*>(region);
+	    size = mappingSize;
+	    close(fd);
+	    return true;
+	}
+    }
+    char chunk[64 * 1024];
+    ssize_t count;
+    while((count = read(fd, chunk, sizeof(chunk))) != 0) {
+	if(count < 0) {
+	    close(fd);
+	    return false;
+	}
+	buffer.append(chunk, count);
+    }
+    close(fd);
+    data = buffer.data();
+    size = buffer.size();
+    return true;
+}
+
+/**
+   Where preprocessed output goes, in big chunks. write() returns false if
+   it couldn't take the text.
+*/
+class OutputSink {
+public:
+    virtual ~OutputSink() = default;
+    virtual bool write(std::string_view text) = 0;
+};
+
+/**
+   Writes output straight to a file descriptor.
+*/
+class FileSink : public OutputSink {
+private:
+    int fd;
+public:
+    explicit FileSink(int fd) : fd(fd) {}
+    bool write(std::string_view text) override;
+};
+
+bool FileSink::write(std::string_view text)
+{
+    while(!text.empty()) {
+	const ssize_t written = ::write(fd, text.data(), text.size());
+	if(written < 0) {
+	    if(errno == EINTR) continue;
+	    std::cerr << "error: could not write output\n";
+	    return false;
+	}
+	text.remove_prefix(written);
+    }
+    return true;
+}
+
+/**
+   How output is laid out. Tokens is each token as it was scanned, with a
+   space after every identifier. Preserve is the input as it was written,
+   spacing and comments and all, less its directives and skipped lines and
+   with its macros replaced. Minify is Tokens with every space that doesn't
+   keep two tokens apart, and every blank line, taken out.
+*/
+enum class Whitespace { Tokens, Preserve, Minify };
+
+/**
+   Chars that run together into one word (a name, a number, or the prefix or
+   suffix on a literal) when nothing separates them
+*/
+constexpr std::array<bool,256> makeWordTable()
+{
+    std::array<bool,256> table{};
+    for(int c = 0; c < 256; ++c) {
+	table[c] = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')
+	    || c == '_' || c == '.' || c == '$' || c >= 0x80;
+    }
+    return table;
+}
+
+/**
+   Chars that a run of minified output can be copied straight through up
+   to: anything but blanks, newlines and quotes
+*/
+constexpr std::array<bool,256> makePlainTable()
+{
+    std::array<bool,256> table{};
+    for(auto &plain : table) plain = true;
+    for(const char c : {' ', '\t', '\n', '\r', '\f', '\v', '"', '\''}) {
+	table[static_cast<unsigned char>(c)] = false;
+    }
+    return table;
+}
+
+constexpr auto wordTable = makeWordTable();
+constexpr auto plainTable = makePlainTable();
+
+/**
+   Whether a space between a and b keeps them from running together into
+   something else without it: another token, or a prefix or suffix on a
+   literal
+*/
+inline bool separates(char a, char b)
+{
+    const auto word = [](char c) { return wordTable[static_cast<unsigned char>(c)]; };
+    if(word(a)) {
+	// The sign of an exponent, as far as can be told from here
+	const bool exponent = a == 'e' || a == 'E' || a == 'p' || a == 'P';
+	return word(b) || b == '"' || b == '\'' || (exponent && (b == '+' || b == '-'));
+    } else if(a == '"' || a == '\'') {
+	return word(b);
+    }
+    switch(a) {
+    case '+': return b == '+' || b == '=';
+    case '-': return b == '-' || b == '=' || b == '>';
+    case '&': return b == '&' || b == '=';
+    case '|': return b == '|' || b == '=';
+    case '<': return b == '<' || b == '=' || b == ':' || b == '%';
+    case '>': return b == '>' || b == '=';
+    case '/': return b == '/' || b == '*' || b == '=';
+    case '*': return b == '/' || b == '=';
+    case '%': return b == '>' || b == ':' || b == '=';
+    case ':': return b == ':' || b == '>';
+    case '#': return b == '#';
+    case '=': case '!': case '^': return b == '=';
+    default: return false;
+    }
+}
+
+/**
+   Accumulates output into a large buffer that is handed to the sink in big
+   chunks, rather than going through std::cout for every token. Whatever is
+   left is flushed on destruction, or when the sink is changed. With no sink,
+   output is dropped.
+*/
+class OutputBuffer {
+private:
+    static constexpr std::size_t capacity = 256 * 1024;
+    OutputSink *sink;
+    std::size_t size = 0;
+    char *data;
+    bool sinkFailed = false;
+    // With Whitespace::Minify, what's been written so far: its last char
+    // that isn't a blank, whether blanks have come since, and the quote of
+    // the literal it ends inside, if any
+    bool minify = false;
+    char last = '\n';
+    bool blank = false;
+    char quote = 0;
+    bool escaped = false;
+    // How much has gone to the sink since it was set, and with countLines,
+    // how many newlines were in that and in data up to counted. Newlines are
+    // only counted when lines() asks or data is flushed, so writes do
+    // nothing extra for them.
+    bool countLines = false;
+    std::uint64_t sent = 0;
+    std::uint64_t newlines = 0;
+    std::size_t counted = 0;
+    // The last char to go to the sink
+    char lastSent = '\n';
+    void writeAll(const char *text, std::size_t count);
+    void append(std::string_view text);
+    void writeMinified(std::string_view text);
+public:
+    explicit OutputBuffer(OutputSink *sink = nullptr) : sink(sink), data(new char[capacity]) {}
+    ~OutputBuffer() { flush(); delete[] data; }
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+    void put(char c);
+    void write(std::string_view text);
+    /**
+       Writes text as it is, even with Minify, and without it counting
+       towards what Minify has seen; for whole lines of the program's own,
+       such as line markers
+    */
+    void writeVerbatim(std::string_view text) { append(text); }
+    void flush();
+    void setSink(OutputSink *newSink);
+    /**
+       Minify is done here, on whatever is written; Preserve is up to the
+       writer
+    */
+    void setWhitespace(Whitespace whitespace) { minify = whitespace == Whitespace::Minify; }
+    /**
+       Whether the sink has refused anything since it was set
+    */
+    bool failed() const { return sinkFailed; }
+    /**
+       How many bytes have been written since the sink was set, and if
+       setCountLines(true) was called before it was, how many lines
+    */
+    std::uint64_t offset() const { return sent + size; }
+    std::uint64_t lines();
+    void setCountLines(bool count) { countLines = count; }
+    /**
+       Whether nothing has been written since the sink was set, or the last
+       thing written ended a line
+    */
+    bool atLineStart() const { return (size != 0 ? data[size - 1] : lastSent) == '\n'; }
+};
+
+void OutputBuffer::writeAll(const char *text, std::size_t count)
+{
+    const stats::PhaseTimer timer(stats::Phase::Write);
+    stats::output(count);
+    sent += count;
+    if(sink != nullptr && count > 0 && !sink->write(std::string_view(text, count))) {
+	sinkFailed = true;
+    }
+}
+
+inline void OutputBuffer::put(char c)
+{
+    if(minify) {
+	writeMinified(std::string_view(&c, 1));
+	return;
+    }
+    if(size == capacity) flush();
+    data[size++] = c;
+}
+
+inline void OutputBuffer::write(std::string_view text)
+{
+    if(minify) {
+	writeMinified(text);
+	return;
+    }
+    append(text);
+}
+
+inline void OutputBuffer::append(std::string_view text)
+{
+    if(text.size() > capacity - size) {
+	flush();
+	if(text.size() >= capacity) {
+	    if(countLines) {
+		newlines += std::count(text.begin(), text.end(), '\n');
+	    }
+	    lastSent = text.back();
+	    writeAll(text.data(), text.size());
+	    return;
+	}
+    }
+    std::memcpy(data + size, text.data(), text.size());
+    size += text.size();
+}
+
+void OutputBuffer::flush()
+{
+    if(countLines) {
+	lines();
+    }
+    if(size != 0) {
+	lastSent = data[size - 1];
+    }
+    writeAll(data, size);
+    size = 0;
+    counted = 0;
+}
+
+std::uint64_t OutputBuffer::lines()
+{
+    newlines += std::count(data + counted, data + size, '\n');
+    counted = size;
+    return newlines;
+}
+
+void OutputBuffer::setSink(OutputSink *newSink)
+{
+    flush();
+    sink = newSink;
+    sinkFailed = false;
+    sent = 0;
+    newlines = 0;
+    // A new output starts on a new line
+    lastSent = '\n';
+    last = '\n';
+    blank = false;
+    quote = 0;
+    escaped = false;
+}
+
+/**
+   Leaves out blanks at the start and end of lines, blank lines, and blanks
+   elsewhere that separates() says aren't needed, making what's left of each
+   run of blanks a single space. Literals are copied as they are.
+*/
+void OutputBuffer::writeMinified(std::string_view text)
+{
+    std::size_t i = 0;
+    while(i < text.size()) {
+	const char c = text[i];
+	std::size_t next = i + 1;
+	if(quote != 0) {
+	    // As far as the end of the literal, or of its line
+	    for(next = i; next < text.size(); ) {
+		const char d = text[next++];
+		if(escaped) {
+		    escaped = false;
+		} else if(d == '\\') {
+		    escaped = true;
+		} else if(d == quote || d == '\n') {
+		    quote = 0;
+		    escaped = false;
+		    break;
+		}
+	    }
+	} else if(c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+	    blank = true;
+	    i = next;
+	    continue;
+	} else if(c == '\n') {
+	    blank = false;
+	    if(last == '\n') {
+		i = next;
+		continue;
+	    }
+	} else {
+	    if(blank && last != '\n' && separates(last, c)) {
+		append(" ");
+	    }
+	    blank = false;
+	    if(c == '"' || c == '\'') {
+		quote = c;
+	    } else {
+		// The rest of the run that needs nothing done to it
+		while(next < text.size() && plainTable[static_cast<unsigned char>(text[next])]) {
+		    ++next;
+		}
+	    }
+	}
+	append(text.substr(i, next - i));
+	last = text[next - 1];
+	i = next;
+    }
+}
+
+/**
+   A place in the input: its line and its column in bytes, both from 1
+*/
+struct Location {
+    std::uint32_t line;
+    std::uint32_t column;
+};
+
+/**
+   Maps offsets in the output back to the places in the input they came
+   from, and is written to its sink as it's built. A map is "GSMP", a
+   version byte, and the input's name as a varint length and its bytes,
+   then a record for each point where the output stops following on from
+   the input: its offset in the output and the line and column it came
+   from. Each field is a LEB128 varint of its difference from the last
+   record's, zigzagged for the line and column, and the first record's are
+   taken from offset 0, line 1, column 1. From one record to the next, the
+   output's lines follow on from the input's one for one, although lines
+   that were left out, such as directives, may come out blank. With
+   Whitespace::Preserve the rest are the same byte for byte too, since each
+   macro's expansion and what follows it get records of their own.
+*/
+class SourceMap {
+private:
+    static constexpr std::size_t flushSize = 64 * 1024;
+    OutputSink *sink = nullptr;
+    std::string data;
+    bool sinkFailed = false;
+    std::uint64_t lastOffset = 0;
+    Location last{1, 1};
+    // The newest record is held back, since a later one at the same offset
+    // replaces it
+    bool held = false;
+    std::uint64_t heldOffset = 0;
+    Location heldAt{1, 1};
+    void putVarint(std::uint64_t value);
+    void putSigned(std::int64_t value)
+    {
+	// Zigzagged, so that small differences either way stay small
+	putVarint(value < 0 ? ~(std::uint64_t(value) << 1) : std::uint64_t(value) << 1);
+    }
+    void encodeHeld();
+    void flush();
+public:
+    static constexpr std::uint8_t version = 1;
+    /**
+       Begins the map of the input called name, which goes to sink
+    */
+    void start(OutputSink *sink, std::string_view name);
+    void add(std::uint64_t offset, Location at);
+    /**
+       Writes out the rest of the map. Returns false if the sink refused
+       any of it.
+    */
+    bool finish();
+    bool active() const { return sink != nullptr; }
+};
+
+void SourceMap::putVarint(std::uint64_t value)
+{
+    while(value >= 0x80) {
+	data += static_cast<char>((value & 0x7f) | 0x80);
+	value >>= 7;
+    }
+    data += static_cast<char>(value);
+}
+
+void SourceMap::encodeHeld()
+{
+    putVarint(heldOffset - lastOffset);
+    putSigned(std::int64_t(heldAt.line) - last.line);
+    putSigned(std::int64_t(heldAt.column) - last.column);
+    lastOffset = heldOffset;
+    last = heldAt;
+    held = false;
+    if(data.size() >= flushSize) {
+	flush();
+    }
+}
+
+void SourceMap::flush()
+{
+    if(!data.empty() && !sink->write(data)) {
+	sinkFailed = true;
+    }
+    data.clear();
+}
+
+void SourceMap::start(OutputSink *sink, std::string_view name)
+{
+    this->sink = sink;
+    sinkFailed = false;
+    lastOffset = 0;
+    last = {1, 1};
+    held = false;
+    data.assign("GSMP");
+    data += static_cast<char>(version);
+    putVarint(name.size());
+    data += name;
+}
+
+void SourceMap::add(std::uint64_t offset, Location at)
+{
+    if(held && offset != heldOffset) {
+	encodeHeld();
+    }
+    held = true;
+    heldOffset = offset;
+    heldAt = at;
+}
+
+bool SourceMap::finish()
+{
+    if(held) {
+	encodeHeld();
+    }
+    flush();
+    sink = nullptr;
+    return !sinkFailed;
+}
+
+/**
+   Tokenizes text in memory, which must outlive the scanner, following the
+   rules of dialect D.
+*/
+template<typename D>
+class BasicScanner {
+private:
+    const char *begin = nullptr;
+    const char *pos = nullptr;
+    const char *end = nullptr;
+    // Where currChar was read from, and where the last token read started
+    const char *currPos = nullptr;
+    const char *tokenPos = nullptr;
+    // currText is a span of the source unless the token had to be
+    // rewritten (escapes, line splices), in which case it views scratch
+    bool textOwned;
+    std::string scratch;
+    char getCh();
+    int peek() const { return pos < end ? static_cast<unsigned char>(*pos) : EOF; }
+    void keepChar();
+    void keepRun(const char *runEnd);
+    void appendChar(char c);
+    int scanToken();
+    bool fatal = false;
+    // How far locate() has counted lines, and where the last line it
+    // counted starts
+    const char *counted = nullptr;
+    const char *lineStart = nullptr;
+    std::uint32_t countedLine = 1;
+    // Whether a comment or a line splice, either of which can hide a
+    // newline, has been skipped since takeJoined() was last called
+    bool joined = false;
+public:
+    BasicScanner() : currChar(EOF) {}
+    // Scans text that's already in memory, which must outlive the scanner
+    BasicScanner(const char *begin, const char *end) { reset(begin, end); }
+    /**
+       Starts over on new text, keeping the scratch space already grown.
+    */
+    void reset(const char *begin, const char *end);
+    int nextToken()
+    {
+	const stats::PhaseTimer timer(stats::Phase::Scan);
+	const char *start = pos;
+	const int token = scanToken();
+	stats::token(token, pos - start);
+	return token;
+    }
+    std::string_view nextLine();
+    std::string_view restOfLine();
+    bool atEnd() const { return currChar == EOF && pos == end; }
+    /**
+       Where in the input the char after the last token read is
+    */
+    const char* position() const { return atEnd() ? end : currPos; }
+    /**
+       Where in the input the last token read starts
+    */
+    const char* tokenStart() const { return tokenPos; }
+    /**
+       Whether lines might have been joined, by a comment or line splice
+       that spanned them, since this was last called
+    */
+    bool takeJoined()
+    {
+	const bool was = joined;
+	joined = false;
+	return was;
+    }
+    /**
+       Where at is in the input. Lines are counted on from the last place
+       asked for, so asking in order costs one pass over the input in all,
+       and nothing while scanning.
+    */
+    Location locate(const char *at);
+    /**
+       Whether the input ended somewhere it can't be picked up from, after
+       which nextToken() only returns Token::EoF
+    */
+    bool failed() const { return fatal; }
+    // Only valid until the next call to nextToken()
+    std::string_view currText;
+    // Hash of currText; only set for identifiers
+    std::uint64_t currHash = 0;
+    char currChar;
+};
+
+template<typename D>
+void BasicScanner<D>::reset(const char *begin, const char *end)
+{
+    this->begin = begin;
+    pos = begin;
+    this->end = end;
+    currPos = nullptr;
+    currText = {};
+    fatal = false;
+    counted = begin;
+    lineStart = begin;
+    countedLine = 1;
+    joined = false;
+    // Extract first char from stream so nextToken() can be safely called the
+    // first time
+    currChar = getCh();
+}
+
+template<typename D>
+char BasicScanner<D>::getCh()
+{
+    if(pos == end) {
+	return EOF;
+    }
+    currPos = pos;
+    return *pos++;
+}
+
+/**
+   Adds currChar to the end of currText, copying the token into scratch
+   if currChar doesn't directly follow the token's text in the source.
+*/
+template<typename D>
+void BasicScanner<D>::keepChar()
+{
+    if(textOwned) {
+	scratch += currChar;
+	currText = scratch;
+    } else if(currText.empty()) {
+	currText = std::string_view(currPos, 1);
+    } else if(currText.data() + currText.size() == currPos) {
+	currText = std::string_view(currText.data(), currText.size() + 1);
+    } else {
+	appendChar(currChar);
+    }
+}
+
+/**
+   Adds everything from the read position up to runEnd to currText in one
+   step, leaving currChar on the last of those chars. Must directly follow
+   keepChar().
+*/
+template<typename D>
+void BasicScanner<D>::keepRun(const char *runEnd)
+{
+    if(textOwned) {
+	scratch.append(pos, runEnd - pos);
+	currText = scratch;
+    } else {
+	currText = std::string_view(currText.data(), currText.size() + (runEnd - pos));
+    }
+    pos = runEnd;
+    currPos = runEnd - 1;
+    currChar = *currPos;
+}
+
+/**
+   Adds a char that doesn't appear at this point in the source to currText.
+*/
+template<typename D>
+void BasicScanner<D>::appendChar(char c)
+{
+    if(!textOwned) {
+	scratch.assign(currText.data(), currText.size());
+	textOwned = true;
+    }
+    scratch += c;
+    currText = scratch;
+}
+
+template<typename D>
+Location BasicScanner<D>::locate(const char *at)
+{
+    if(at < counted) {
+	counted = begin;
+	lineStart = begin;
+	countedLine = 1;
+    }
+    while(const void *newline = std::memchr(counted, '\n', at - counted)) {
+	++countedLine;
+	counted = static_cast<const char*>(newline) + 1;
+	lineStart = counted;
+    }
+    counted = at;
+    return {countedLine, static_cast<std::uint32_t>(at - lineStart + 1)};
+}
+
+template<typename D>
+std::string_view BasicScanner<D>::nextLine()
+{
+    const stats::PhaseTimer timer(stats::Phase::Scan);
+    const char *lineEnd = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+    if(lineEnd == nullptr) lineEnd = end;
+    const std::string_view line(pos, lineEnd - pos);
+    pos = lineEnd < end ? lineEnd + 1 : end;
+    stats::line(line.size());
+    if constexpr(D::lineComments) {
+	return line.substr(0, lineCommentStart(line));
+    }
+    return line;
+}
+
+/**
+   Reads the rest of the current line from currChar on, leaving currChar on
+   the first char of the next line. Unlike nextLine(), this is safe to call
+   straight after a token, since it takes the lookahead char into account.
+*/
+template<typename D>
+std::string_view BasicScanner<D>::restOfLine()
+{
+    const stats::PhaseTimer timer(stats::Phase::Scan);
+    if(atEnd()) {
+	return {};
+    } else if(currChar == '\n') {
+	currChar = getCh();
+	return {};
+    }
+    const char *lineEnd = static_cast<const char*>(std::memchr(currPos, '\n', end - currPos));
+    if(lineEnd == nullptr) lineEnd = end;
+    const std::string_view line(currPos, lineEnd - currPos);
+    pos = lineEnd;
+    stats::line(line.size());
+    // Past the newline, then onto what follows it
+    currChar = getCh();
+    currChar = getCh();
+    if constexpr(D::lineComments) {
+	return line.substr(0, lineCommentStart(line));
+    }
+    return line;
+}
+
+template<typename D>
+int BasicScanner<D>::scanToken()
+{
+    State currState = State::Start;
+    currText = {};
+    textOwned = false;
+    scratch.clear();
+    bool done = false;
+    while(!done) {
+	switch(currState) {
+	case State::Start:
+	    tokenPos = currPos;
+	    switch(startTable[static_cast<unsigned char>(currChar)]) {
+	    case CharKind::Blank:
+		pos = skipBlanks(pos, end);
+		break;
+	    case CharKind::End:
+		currState = State::EoF;
+		done = true;
+		break;
+	    case CharKind::Newline:
+		keepChar();
+		currState = State::EoL;
+		currChar = getCh();
+		done = true;
+		break;
+	    case CharKind::SingleQuote:
+		keepChar();
+		currState = State::InSingleQuote;
+		break;
+	    case CharKind::DoubleQuote:
+		keepChar();
+		currState = State::InDoubleQuote;
+		break;
+	    case CharKind::Letter:
+		keepChar();
+		currState = State::InIdentifier;
+		break;
+	    case CharKind::Slash:
+		if(peek() == '*') {
+		    currChar = getCh();
+		    currState = State::InComment;
+		    joined = true;
+		    break;
+		} else if(D::lineComments && peek() == '/') {
+		    // Up to the newline, which is read next
+		    const char *lineEnd = static_cast<const char*>(std::memchr(pos, '\n', end - pos));
+		    pos = lineEnd != nullptr ? lineEnd : end;
+		    break;
+		}
+		keepChar();
+		currChar = getCh();
+		currState = State::Other;
+		done = true;
+		break;
+	    case CharKind::Backslash:
+		if(D::lineSplices && peek() == '\n') {
+		    currChar = getCh();
+		    joined = true;
+		    break;
+		}
+		keepChar();
+		currChar = getCh();
+		currState = State::Other;
+		done = true;
+		break;
+	    case CharKind::Other:
+		keepChar();
+		currChar = getCh();
+		currState = State::Other;
+		done = true;
+		break;
+	    }
+	    break;
+	case State::InSingleQuote:
+	    if(currChar == '\'') {
+		keepChar();
+		currState = State::String;
+		currChar = getCh();
+		done = true;
+	    } else if(currChar == '\\' && peek() == '\'') {
+		appendChar('\'');
+		currChar = getCh();
+	    } else if(D::lineSplices && currChar == '\\' && peek() == '\n') {
+		currChar = getCh(); //Skip backslash newline
+		joined = true;
+	    } else if(currChar == EOF || currChar == '\n') {
+		currState = State::Bad;
+		done = true;
+	    } else {
+		keepChar();
+		keepRun(findStringStop(pos, end, '\''));
+	    }
+	    break;
+	case State::InDoubleQuote:
+	    if(currChar == '"') {
+		keepChar();
+		currState = State::String;
+		currChar = getCh();
+		done = true;
+	    } else if(currChar == '\\' && peek() == '"') {
+		appendChar('\'');
+		currChar = getCh();
+	    } else if(D::lineSplices && currChar == '\\' && peek() == '\n') {
+		currChar = getCh(); //Skip backslash newline
+		joined = true;
+	    } else if(currChar == EOF || currChar == '\n') {
+		currState = State::Bad;
+		done = true;
+	    } else {
+		keepChar();
+		keepRun(findStringStop(pos, end, '"'));
+	    }
+	    break;
+	case State::InComment:
+	    if(currChar != '*' && currChar != EOF) {
+		// Skip the body in one go
+		pos = findCommentEnd(pos, end);
+		currChar = getCh();
+	    }
+	    if(currChar == '*' && peek() == '/') {
+		//End of comment
+		currChar = getCh();
+		currState = State::Start;
+	    } else if(currChar == EOF) {
+		std::cerr << "Error: Unexpected end of input";
+		fatal = true;
+		pos = end;
+		currState = State::EoF;
+		done = true;
+	    }
+	    break;
+	case State::InIdentifier:
+	    if(identTable<D>[static_cast<unsigned char>(currChar)]) {
+		keepChar();
+		keepRun(skipIdentChars<D>(pos, end));
+		break;
+	    }
+	    currState = State::Identifier;
+	    done = true;
+	    break;
+	default:
+	    break;
+	}
+	if(!done) {
+	    currChar = getCh();
+	}
+    }
+
+    switch(currState) {
+    case State::Bad: {
+	std::cerr << "malformed token " << currText;
+	return scanToken();
+    }
+    case State::EoF:
+	return Token::EoF;
+    case State::EoL:
+    case State::Other:
+	return currText[0];
+    case State::Identifier:
+	currHash = hashText(currText);
+	if(currHash == hashText("define") && currText == "define") {
+	    return Token::Define;
+	} else {
+	    return Token::Identifier;
+	}
+    case State::String:
+	return Token::String;
+    default:
+	assert(0 && "Deciding what to return from getToken()");
+    }
+
+    assert(0 && "Deciding what to return from getToken()");
+    return EOF;
+}
+
+using Scanner = BasicScanner<Dialect>;
+
+/**
+   Expands calls to function-like macros. Arguments are fully expanded before
+   they're substituted, and the result is rescanned for more calls, but
+   object-like macros expand to their value as is, the same as they do
+   outside a call.
+
+   There's no recursion: the expander works from an explicit stack of
+   contexts, each a range of tokens still to be read, tagged with the macro
+   whose body it is. A macro is disabled while any of its contexts are
+   still on the stack, and a disabled macro's name is painted so that it's
+   never expanded again, which is what stops a macro from expanding itself.
+   While a call's arguments are being expanded it sits on a stack of calls,
+   and each level of that stack has its own output buffer. All the buffers
+   are reused from one expansion to the next.
+*/
+class MacroExpander {
+private:
+    struct Piece {
+	int kind;
+	bool painted; //never to be expanded
+	bool spaceAfter;
+	std::uint32_t symbol; //the symbol an identifier names, if known already
+	std::string_view text;
+    };
+    struct Range {
+	std::uint32_t begin;
+	std::uint32_t end;
+    };
+    struct Context {
+	std::uint32_t next;
+	std::uint32_t end;
+	std::uint32_t macro; //the macro this is the body of, or noSymbol
+    };
+    /**
+       A call whose arguments are being expanded. Its arguments are in args
+       from firstArg, first as read and then expanded; contexts from
+       contextBase up belong to the argument being expanded.
+    */
+    struct Call {
+	std::uint32_t macro;
+	std::size_t firstArg;
+	std::size_t argCount;
+	std::size_t nextArg;
+	std::size_t contextBase;
+    };
+    const SymbolTable *table = nullptr;
+    std::vector<Piece> pool;
+    std::vector<Context> contexts;
+    std::vector<Call> calls;
+    std::vector<Range> args;
+    std::vector<std::vector<Piece>> outputs;
+    // How many contexts each macro has on the stack; since every context is
+    // gone by the end of an expansion, all zeros between them
+    std::vector<std::uint32_t> active;
+    // Where the ) matching each ( in pool is, once known; 0 if not
+    std::vector<std::uint32_t> match;
+    std::vector<std::uint32_t> open;
+    std::string messageText;
+    bool next(std::size_t base, Piece &piece);
+    bool nextIsOpenParen(std::size_t base);
+    std::uint32_t symbolOf(const Piece &piece) const;
+    bool argumentsInPlace(Range &raw);
+    bool argumentsCopied(std::size_t base, Range &raw);
+    void invoke(const Piece &name, std::uint32_t macro, std::size_t base);
+    void finishArgument();
+    void pushBody(std::uint32_t macro, std::size_t firstArg, std::size_t argCount);
+public:
+    void expand(const SymbolTable &symbols, std::uint32_t macro, std::string_view name,
+		std::string_view text, const std::vector<BodyToken> &call, std::string &out);
+    /**
+       Errors found by the last expand().
+    */
+    std::string_view messages() const { return messageText; }
+};
+
+/**
+   Takes the next token from the current level's contexts, dropping any that
+   are used up.
+*/
+bool MacroExpander::next(std::size_t base, Piece &piece)
+{
+    while(contexts.size() > base) {
+	Context &context = contexts.back();
+	if(context.next < context.end) {
+	    piece = pool[context.next++];
+	    return true;
+	}
+	if(context.macro != SymbolTable::noSymbol) {
+	    --active[context.macro];
+	}
+	contexts.pop_back();
+    }
+    return false;
+}
+
+bool MacroExpander::nextIsOpenParen(std::size_t base)
+{
+    while(contexts.size() > base) {
+	const Context &context = contexts.back();
+	if(context.next < context.end) {
+	    return pool[context.next].kind == '(';
+	}
+	if(context.macro != SymbolTable::noSymbol) {
+	    --active[context.macro];
+	}
+	contexts.pop_back();
+    }
+    return false;
+}
+
+std::uint32_t MacroExpander::symbolOf(const Piece &piece) const
+{
+    if(piece.symbol != SymbolTable::noSymbol) {
+	return piece.symbol;
+    }
+    return table->indexOf(piece.text, hashText(piece.text));
+}
+
+/**
+   Finds the arguments of the call whose ( is next in the innermost context
+   without copying them, if the whole call is inside that context, which it
+   nearly always is. Matching parentheses found on the way are remembered,
+   so calls nested in the arguments are skipped over when their turn comes
+   instead of being scanned again; that keeps deep nesting linear.
+*/
+bool MacroExpander::argumentsInPlace(Range &raw)
+{
+    Context &context = contexts.back();
+    if(match.size() < pool.size()) {
+	match.resize(pool.size(), 0);
+    }
+    const std::size_t firstArg = args.size();
+    open.clear();
+    open.push_back(context.next);
+    std::uint32_t argStart = context.next + 1;
+    for(std::uint32_t i = argStart; i < context.end; ++i) {
+	const int kind = pool[i].kind;
+	if(kind == '(') {
+	    if(match[i] != 0 && match[i] < context.end) {
+		i = match[i];
+	    } else {
+		open.push_back(i);
+	    }
+	} else if(kind == ')') {
+	    match[open.back()] = i;
+	    open.pop_back();
+	    if(open.empty()) {
+		args.push_back({argStart, i});
+		raw = {context.next, i + 1};
+		context.next = i + 1;
+		return true;
+	    }
+	} else if(kind == ',' && open.size() == 1) {
+	    args.push_back({argStart, i});
+	    argStart = i + 1;
+	}
+    }
+    args.resize(firstArg);
+    return false;
+}
+
+/**
+   Reads the arguments of a call that runs on past the end of the innermost
+   context, copying them into pool as they're read.
+*/
+bool MacroExpander::argumentsCopied(std::size_t base, Range &raw)
+{
+    raw.begin = static_cast<std::uint32_t>(pool.size());
+    Piece piece;
+    next(base, piece);
+    pool.push_back(piece);
+    std::size_t depth = 1;
+    auto argStart = static_cast<std::uint32_t>(pool.size());
+    bool closed = false;
+    while(!closed && next(base, piece)) {
+	if(piece.kind == '(') {
+	    ++depth;
+	} else if((piece.kind == ',' || piece.kind == ')') && depth == 1) {
+	    args.push_back({argStart, static_cast<std::uint32_t>(pool.size())});
+	    argStart = static_cast<std::uint32_t>(pool.size() + 1);
+	    closed = piece.kind == ')';
+	} else if(piece.kind == ')') {
+	    --depth;
+	}
+	pool.push_back(piece);
+    }
+    raw.end = static_cast<std::uint32_t>(pool.size());
+    return closed;
+}
+
+/**
+   Reads the arguments of a call to macro, up to its closing parenthesis,
+   and starts expanding them. On an error the call is passed through
+   unexpanded.
+*/
+void MacroExpander::invoke(const Piece &name, std::uint32_t macro, std::size_t base)
+{
+    const std::size_t firstArg = args.size();
+    Range raw;
+    const bool closed = argumentsInPlace(raw) || argumentsCopied(base, raw);
+    const Macro &definition = table->macro(macro);
+    std::size_t argCount = args.size() - firstArg;
+    // f() has one empty argument, which is right for a macro taking none
+    if(definition.paramCount == 0 && argCount == 1 && args.back().begin == args.back().end) {
+	argCount = 0;
+    }
+    if(!closed || argCount != static_cast<std::size_t>(definition.paramCount)) {
+	messageText += closed ? "error: wrong number of arguments to macro "
+	    : "error: unterminated call to macro ";
+	messageText += name.text;
+	messageText += '\n';
+	args.resize(firstArg);
+	std::vector<Piece> &output = outputs[calls.size()];
+	output.push_back(name);
+	output.back().painted = true;
+	for(std::uint32_t i = raw.begin; i < raw.end; ++i) {
+	    output.push_back(pool[i]);
+	}
+	return;
+    }
+    args.resize(firstArg + argCount);
+    if(argCount == 0) {
+	pushBody(macro, firstArg, 0);
+	return;
+    }
+    // Room for the expanded arguments after the ones as read
+    args.resize(firstArg + 2 * argCount);
+    calls.push_back({macro, firstArg, argCount, 0, contexts.size()});
+    if(outputs.size() <= calls.size()) {
+	outputs.emplace_back();
+    }
+    const Range first = args[firstArg];
+    contexts.push_back({first.begin, first.end, SymbolTable::noSymbol});
+}
+
+/**
+   Called once the innermost call's current argument is fully expanded.
+*/
+void MacroExpander::finishArgument()
+{
+    Call &call = calls.back();
+    std::vector<Piece> &output = outputs[calls.size()];
+    const auto begin = static_cast<std::uint32_t>(pool.size());
+    pool.insert(pool.end(), output.begin(), output.end());
+    output.clear();
+    args[call.firstArg + call.argCount + call.nextArg] =
+	{begin, static_cast<std::uint32_t>(pool.size())};
+    if(++call.nextArg < call.argCount) {
+	const Range arg = args[call.firstArg + call.nextArg];
+	contexts.push_back({arg.begin, arg.end, SymbolTable::noSymbol});
+	return;
+    }
+    const Call done = call;
+    calls.pop_back();
+    pushBody(done.macro, done.firstArg, done.argCount);
+    args.resize(done.firstArg);
+}
+
+/**
+   Substitutes the expanded arguments into the macro's body and pushes the
+   result to be rescanned.
+*/
+void MacroExpander::pushBody(std::uint32_t macro, std::size_t firstArg, std::size_t argCount)
+{
+    const Macro &definition = table->macro(macro);
+    const BodyToken *body = table->bodyTokens(definition);
+    const auto begin = static_cast<std::uint32_t>(pool.size());
+    stats::call();
+    for(std::uint32_t i = 0; i < definition.tokenCount; ++i) {
+	const BodyToken &token = body[i];
+	if(token.param == 0) {
+	    pool.push_back({token.kind, false, token.kind == Token::Identifier, token.symbol,
+			    definition.value.substr(token.offset, token.length)});
+	    continue;
+	}
+	const Range arg = args[firstArg + argCount + token.param - 1];
+	pool.reserve(pool.size() + (arg.end - arg.begin));
+	for(std::uint32_t j = arg.begin; j < arg.end; ++j) {
+	    pool.push_back(pool[j]);
+	}
+    }
+    contexts.push_back({begin, static_cast<std::uint32_t>(pool.size()), macro});
+    ++active[macro];
+}
+
+/**
+   Expands a call to the function-like macro with the given index. call
+   holds the call's tokens, from its opening to its closing parenthesis,
+   as offsets into text. The result is appended to out.
+*/
+void MacroExpander::expand(const SymbolTable &symbols, std::uint32_t macro,
+			   std::string_view name, std::string_view text,
+			   const std::vector<BodyToken> &call, std::string &out)
+{
+    table = &symbols;
+    pool.clear();
+    contexts.clear();
+    calls.clear();
+    args.clear();
+    messageText.clear();
+    match.clear();
+    if(active.size() < symbols.size()) {
+	active.resize(symbols.size(), 0);
+    }
+    if(outputs.empty()) {
+	outputs.emplace_back();
+    }
+    outputs[0].clear();
+    for(const BodyToken &token : call) {
+	pool.push_back({token.kind, false, token.kind == Token::Identifier,
+			SymbolTable::noSymbol, text.substr(token.offset, token.length)});
+    }
+    contexts.push_back({0, static_cast<std::uint32_t>(pool.size()), SymbolTable::noSymbol});
+    invoke({Token::Identifier, false, true, macro, name}, macro, 0);
+
+    Piece piece;
+    while(true) {
+	const std::size_t base = calls.empty() ? 0 : calls.back().contextBase;
+	if(!next(base, piece)) {
+	    if(calls.empty()) {
+		break;
+	    }
+	    finishArgument();
+	    continue;
+	}
+	if(piece.kind == Token::Identifier && !piece.painted) {
+	    const std::uint32_t symbol = symbolOf(piece);
+	    if(symbol != SymbolTable::noSymbol) {
+		const Macro &definition = symbols.macro(symbol);
+		if(active[symbol] > 0) {
+		    piece.painted = true;
+		} else if(definition.paramCount < 0) {
+		    piece = {Token::String, true, true, SymbolTable::noSymbol, definition.value};
+		    stats::substitution();
+		} else if(nextIsOpenParen(base)) {
+		    invoke(piece, symbol, base);
+		    continue;
+		}
+	    }
+	}
+	outputs[calls.size()].push_back(piece);
+    }
+
+    for(const Piece &output : outputs[0]) {
+	out += output.text;
+	if(output.spaceAfter) {
+	    out += ' ';
+	}
+    }
+}
+
+/**
+   Reads the parameter list of a function-like macro, from just after its
+   opening parenthesis, into params. Returns false if it's malformed.
+*/
+bool readParameters(Scanner &scanner, std::vector<std::string> &params)
+{
+    params.clear();
+    int token = scanner.nextToken();
+    if(token == ')') {
+	return true;
+    }
+    while(token == Token::Identifier) {
+	if(std::find(params.begin(), params.end(), scanner.currText) != params.end()
+	   || params.size() == UINT16_MAX) {
+	    return false;
+	}
+	params.emplace_back(scanner.currText);
+	token = scanner.nextToken();
+	if(token == ')') {
+	    return true;
+	} else if(token != ',') {
+	    return false;
+	}
+	token = scanner.nextToken();
+    }
+    return false;
+}
+
+/**
+   The conditional directives, by the name that follows the #
+*/
+enum class Directive { None, If, Ifdef, Ifndef, Elif, Else, Endif };
+
+/**
+   Each directive's name and its hash, worked out at compile time.
+*/
+struct DirectiveName {
+    std::string_view name;
+    std::uint64_t hash;
+    Directive directive;
+};
+
+constexpr std::array<DirectiveName, 6> directiveNames{{
+    {"if", hashText("if"), Directive::If},
+    {"ifdef", hashText("ifdef"), Directive::Ifdef},
+    {"ifndef", hashText("ifndef"), Directive::Ifndef},
+    {"elif", hashText("elif"), Directive::Elif},
+    {"else", hashText("else"), Directive::Else},
+    {"endif", hashText("endif"), Directive::Endif}
+}};
+
+/**
+   The directive name spells, given its hash. Only a name whose hash
+   matches has its text compared.
+*/
+Directive directiveOf(std::string_view name, std::uint64_t hash)
+{
+    for(const DirectiveName &entry : directiveNames) {
+	if(entry.hash == hash) {
+	    return entry.name == name ? entry.directive : Directive::None;
+	}
+    }
+    return Directive::None;
+}
+
+/**
+   Where the string or char literal opened at text[start] ends: just past
+   its closing quote, or wherever the line cut it off.
+*/
+std::size_t literalEnd(std::string_view text, std::size_t start)
+{
+    const char quote = text[start];
+    std::size_t i = start + 1;
+    while(i < text.size() && text[i] != quote) {
+	i += text[i] == '\\' ? 2 : 1;
+    }
+    return std::min(i + 1, text.size());
+}
+
+/**
+   Evaluates the expression of an #if or #elif, on long long as in C.
+   defined NAME and defined(NAME) test whether a macro is defined. Object-like
+   macros are expanded and rescanned, since a name left over just counts as
+   0; so does any other identifier, including a function-like macro's.
+   Expansion goes through a stack of the values being read, and a macro
+   already on the stack isn't expanded again.
+*/
+class ConditionParser {
+private:
+    enum class Kind { Number, Identifier, Operator, End, Bad };
+    struct Segment {
+	std::string_view text;
+	std::size_t pos;
+	std::uint32_t macro; //the macro this is the value of, or noSymbol
+    };
+    // Deep enough for any sensible expression, shallow enough for the stack
+    static constexpr int maxNesting = 256;
+    const SymbolTable &table;
+    std::vector<Segment> &segments;
+    Kind kind = Kind::End;
+    std::string_view text;
+    long long value = 0;
+    int nesting = 0;
+    // Inside the unevaluated side of &&, || or ?:, where dividing by zero
+    // is harmless
+    int unevaluated = 0;
+    bool ok = true;
+    bool expanding(std::uint32_t macro) const;
+    void advance(bool expand = true);
+    bool accept(std::string_view op);
+    long long parseUnary();
+    long long parseBinary(int minPrecedence);
+    long long parseConditional();
+public:
+    /**
+       Room for the segments, which can be kept for the next parser so that
+       it needn't allocate.
+    */
+    using Stack = std::vector<Segment>;
+    ConditionParser(const SymbolTable &table, std::string_view expression, Stack &stack)
+	: table(table), segments(stack)
+    {
+	segments.assign(1, {expression, 0, SymbolTable::noSymbol});
+    }
+    /**
+       Returns false if the expression is malformed.
+    */
+    bool evaluate(long long &result);
+};
+
+bool ConditionParser::expanding(std::uint32_t macro) const
+{
+    for(const Segment &segment : segments) {
+	if(segment.macro == macro) return true;
+    }
+    return false;
+}
+
+/**
+   Moves on to the next token, expanding macro names along the way unless
+   told not to.
+*/
+void ConditionParser::advance(bool expand)
+{
+    while(!segments.empty()) {
+	Segment &segment = segments.back();
+	const std::string_view source(segment.text);
+	std::size_t i = segment.pos;
+	while(i < source.size()) {
+	    if(source[i] == ' ' || source[i] == '\t' || source[i] == '\r') {
+		++i;
+	    } else if(source.compare(i, 2, "/*") == 0) {
+		const std::size_t close = source.find("*/", i + 2);
+		i = close == std::string_view::npos ? source.size() : close + 2;
+	    } else {
+		break;
+	    }
+	}
+	if(i == source.size()) {
+	    segments.pop_back();
+	    continue;
+	}
+	const std::size_t start = i;
+	const char c = source[i];
+	if(c >= '0' && c <= '9') {
+	    // Over letters and digits, whatever identifiers are made of
+	    while(i < source.size()
+		  && identTable<GinevraDialect>[static_cast<unsigned char>(source[i])]) ++i;
+	    const std::string digits(source.substr(start, i - start));
+	    char *suffix = nullptr;
+	    errno = 0;
+	    value = static_cast<long long>(std::strtoull(digits.c_str(), &suffix, 0));
+	    kind = errno == 0 && std::strspn(suffix, "uUlL") == std::strlen(suffix)
+		? Kind::Number : Kind::Bad;
+	} else if(c == '\'') {
+	    // A char constant, with the common escapes
+	    i = literalEnd(source, i);
+	    const std::string_view body(source.substr(start + 1, i - start - 2));
+	    kind = Kind::Bad;
+	    if(i - start < 3 || source[i - 1] != '\'') {
+	    } else if(body.size() == 2 && body[0] == '\\') {
+		kind = Kind::Number;
+		value = body[1] == 'n' ? '\n' : body[1] == 't' ? '\t' : body[1] == '0' ? 0 : body[1];
+	    } else if(body.size() == 1) {
+		kind = Kind::Number;
+		value = static_cast<unsigned char>(body[0]);
+	    }
+	} else if(startTable[static_cast<unsigned char>(c)] == CharKind::Letter) {
+	    while(i < source.size() && identTable<Dialect>[static_cast<unsigned char>(source[i])]) ++i;
+	    text = source.substr(start, i - start);
+	    kind = Kind::Identifier;
+	} else {
+	    static constexpr std::string_view pairs[] = {
+		"<<", ">>", "<=", ">=", "==", "!=", "&&", "||"
+	    };
+	    kind = Kind::Operator;
+	    text = source.substr(start, 1);
+	    for(const std::string_view pair : pairs) {
+		if(source.compare(start, 2, pair) == 0) {
+		    text = source.substr(start, 2);
+		}
+	    }
+	    if(text.size() == 1 && std::string_view("+-*/%<>&^|!~?:()").find(c)
+	       == std::string_view::npos) {
+		kind = Kind::Bad;
+	    }
+	    i = start + text.size();
+	}
+	segment.pos = i;
+	if(kind != Kind::Identifier || !expand) {
+	    return;
+	} else if(text == "defined") {
+	    // The operand is taken as written, not expanded
+	    advance(false);
+	    const bool parenthesized = kind == Kind::Operator && text == "(";
+	    if(parenthesized) {
+		advance(false);
+	    }
+	    if(kind != Kind::Identifier) {
+		kind = Kind::Bad;
+		return;
+	    }
+	    value = table.find(text, hashText(text)) != nullptr;
+	    if(parenthesized) {
+		advance(false);
+		if(kind != Kind::Operator || text != ")") {
+		    kind = Kind::Bad;
+		    return;
+		}
+	    }
+	    kind = Kind::Number;
+	    return;
+	}
+	const std::uint32_t index = table.indexOf(text, hashText(text));
+	if(index == SymbolTable::noSymbol || table.macro(index).paramCount >= 0
+	   || expanding(index)) {
+	    kind = Kind::Number;
+	    value = 0;
+	    return;
+	}
+	segments.push_back({table.macro(index).value, 0, index});
+    }
+    kind = Kind::End;
+}
+
+/**
+   Moves past the operator op if it's next.
+*/
+bool ConditionParser::accept(std::string_view op)
+{
+    if(kind == Kind::Operator && text == op) {
+	advance();
+	return true;
+    }
+    return false;
+}
+
+long long ConditionParser::parseUnary()
+{
+    if(++nesting > maxNesting) {
+	ok = false;
+    }
+    long long result = 0;
+    if(!ok) {
+    } else if(kind == Kind::Number) {
+	result = value;
+	advance();
+    } else if(accept("(")) {
+	result = parseConditional();
+	ok = ok && accept(")");
+    } else if(kind == Kind::Operator && text.size() == 1
+	      && std::string_view("+-!~").find(text[0]) != std::string_view::npos) {
+	const char op = text[0];
+	advance();
+	const long long operand = parseUnary();
+	// Negation wraps rather than overflowing
+	result = op == '+' ? operand
+	    : op == '-' ? static_cast<long long>(0ULL - static_cast<unsigned long long>(operand))
+	    : op == '!' ? !operand
+	    : ~operand;
+    } else {
+	ok = false;
+    }
+    --nesting;
+    return result;
+}
+
+/**
+   Binding strength of each binary operator, or 0 for anything else.
+*/
+int precedenceOf(std::string_view op)
+{
+    static constexpr std::pair<std::string_view, int> operators[] = {
+	{"||", 1}, {"&&", 2}, {"|", 3}, {"^", 4}, {"&", 5}, {"==", 6}, {"!=", 6},
+	{"<", 7}, {">", 7}, {"<=", 7}, {">=", 7}, {"<<", 8}, {">>", 8},
+	{"+", 9}, {"-", 9}, {"*", 10}, {"/", 10}, {"%", 10}
+    };
+    for(const auto &[name, precedence] : operators) {
+	if(name == op) return precedence;
+    }
+    return 0;
+}
+
+long long ConditionParser::parseBinary(int minPrecedence)
+{
+    long long left = parseUnary();
+    while(ok && kind == Kind::Operator && precedenceOf(text) >= minPrecedence) {
+	const std::string_view op(text);
+	const int precedence = precedenceOf(op);
+	advance();
+	const bool shortCircuit = (op == "&&" && !left) || (op == "||" && left);
+	unevaluated += shortCircuit;
+	const long long right = parseBinary(precedence + 1);
+	unevaluated -= shortCircuit;
+	const auto a = static_cast<unsigned long long>(left);
+	const auto b = static_cast<unsigned long long>(right);
+	if((op == "/" || op == "%") && (right == 0 || (left == LLONG_MIN && right == -1))) {
+	    ok = ok && unevaluated > 0;
+	    left = 0;
+	} else if(op == "||") left = left || right;
+	else if(op == "&&") left = left && right;
+	else if(op == "|") left = left | right;
+	else if(op == "^") left = left ^ right;
+	else if(op == "&") left = left & right;
+	else if(op == "==") left = left == right;
+	else if(op == "!=") left = left != right;
+	else if(op == "<") left = left < right;
+	else if(op == ">") left = left > right;
+	else if(op == "<=") left = left <= right;
+	else if(op == ">=") left = left >= right;
+	else if(op == "<<") left = right < 0 || right > 63 ? 0 : static_cast<long long>(a << right);
+	else if(op == ">>") left = right < 0 || right > 63 ? (left < 0 ? -1 : 0) : left >> right;
+	else if(op == "+") left = static_cast<long long>(a + b);
+	else if(op == "-") left = static_cast<long long>(a - b);
+	else if(op == "*") left = static_cast<long long>(a * b);
+	else if(op == "/") left = left / right;
+	else left = left % right;
+    }
+    return left;
+}
+
+long long ConditionParser::parseConditional()
+{
+    const long long condition = parseBinary(1);
+    if(!ok || !accept("?")) {
+	return condition;
+    }
+    unevaluated += !condition;
+    const long long ifTrue = parseConditional();
+    unevaluated -= !condition;
+    ok = ok && accept(":");
+    unevaluated += !!condition;
+    const long long ifFalse = parseConditional();
+    unevaluated -= !!condition;
+    return condition ? ifTrue : ifFalse;
+}
+
+bool ConditionParser::evaluate(long long &result)
+{
+    advance();
+    result = parseConditional();
+    return ok && kind == Kind::End;
+}
+
+/**
+   Where the input is among nested conditional blocks, and so whether text
+   is live or being skipped.
+*/
+class Conditions {
 private:
-    std::ifstream file;
-    char getCh();
+    struct Block {
+	bool outerLive; //whether the text around the block is live
+	bool taken; //whether one of its branches has been chosen yet
+	bool sawElse;
+    };
+    std::vector<Block> blocks;
+    bool isLive = true;
+    // Whether a skipped line left a comment open, which hides any directives
+    // until it's closed
+    bool inComment = false;
+    // Reused by each #if and #elif
+    mutable ConditionParser::Stack stack;
+    bool test(Directive directive, std::string_view rest, const SymbolTable &table) const;
 public:
-    Scanner(const std::string &path);
-    int nextToken();
-    std::string nextLine();
-    std::string currText;
-    char currChar;
-    int lineNum = 1;
-    int currColumn = 1;
+    bool live() const { return isLive; }
+    bool open() const { return !blocks.empty(); }
+    void reset() { blocks.clear(); isLive = true; inComment = false; }
+    /**
+       Acts on a directive, given the rest of its line.
+    */
+    void apply(Directive directive, std::string_view rest, const SymbolTable &table);
+    /**
+       Looks at a skipped line only as closely as it takes to find a
+       directive, and the start of a comment that could hide one. Literals
+       are stepped over since they could contain a slash-star.
+    */
+    void skipLine(std::string_view line, const SymbolTable &table);
 };
 
-Scanner::Scanner(const std::string &path) : file(path)
+bool Conditions::test(Directive directive, std::string_view rest,
+		      const SymbolTable &table) const
 {
-    if(!file) {
-	std::cerr << "error: could not open input file: " << path << '\n';
-	exit(1);
-    } else if(file.peek() == EOF) {
-	exit(1);
+    if(directive == Directive::If || directive == Directive::Elif) {
+	long long value = 0;
+	if(!ConditionParser(table, rest, stack).evaluate(value)) {
+	    std::cerr << "error: malformed expression in #"
+		      << (directive == Directive::If ? "if" : "elif") << '\n';
+	    return false;
+	}
+	return value != 0;
     }
-    // Extract first char from stream so nextToken() can be safely called the
-    // first time
-    currChar = getCh();
+    const std::size_t start = std::min(rest.find_first_not_of(" \t"), rest.size());
+    std::size_t end = start;
+    while(end < rest.size() && identTable<Dialect>[static_cast<unsigned char>(rest[end])]) ++end;
+    const std::string_view name(rest.substr(start, end - start));
+    if(name.empty() || startTable[static_cast<unsigned char>(name[0])] != CharKind::Letter) {
+	std::cerr << "error: identifier expected after #"
+		  << (directive == Directive::Ifdef ? "ifdef" : "ifndef") << '\n';
+	return false;
+    }
+    const bool defined = table.find(name, hashText(name)) != nullptr;
+    return directive == Directive::Ifdef ? defined : !defined;
 }
 
-char Scanner::getCh()
+void Conditions::apply(Directive directive, std::string_view rest, const SymbolTable &table)
 {
-    if(file.peek() == '\n') {
-	++lineNum;
-	currColumn = 1;
+    if(directive == Directive::If || directive == Directive::Ifdef
+       || directive == Directive::Ifndef) {
+	// Conditions nested in a skipped block aren't even evaluated
+	const bool taken = isLive && test(directive, rest, table);
+	blocks.push_back({isLive, taken, false});
+	isLive = taken;
+	return;
+    } else if(blocks.empty()) {
+	std::cerr << (directive == Directive::Elif ? "error: #elif without #if\n"
+		      : directive == Directive::Else ? "error: #else without #if\n"
+		      : "error: #endif without #if\n");
+	return;
+    }
+    Block &block = blocks.back();
+    if(directive == Directive::Endif) {
+	isLive = block.outerLive;
+	blocks.pop_back();
+    } else if(block.sawElse) {
+	std::cerr << (directive == Directive::Elif ? "error: #elif after #else\n"
+		      : "error: #else after #else\n");
+	isLive = false;
+    } else if(directive == Directive::Else) {
+	block.sawElse = true;
+	isLive = block.outerLive && !block.taken;
+	block.taken = true;
+    } else {
+	isLive = block.outerLive && !block.taken && test(directive, rest, table);
+	block.taken = block.taken || isLive;
     }
-    return file.get();
 }
 
-std::string Scanner::nextLine()
+void Conditions::skipLine(std::string_view line, const SymbolTable &table)
 {
-    std::string line;
-    std::getline(file, line);
-    return line;
+    if(!inComment) {
+	std::size_t start = line.find_first_not_of(" \t");
+	if(start != std::string_view::npos && line[start] == '#') {
+	    start = std::min(line.find_first_not_of(" \t", start + 1), line.size());
+	    std::size_t end = start;
+	    while(end < line.size() && identTable<Dialect>[static_cast<unsigned char>(line[end])]) ++end;
+	    const std::string_view name(line.substr(start, end - start));
+	    const Directive directive = directiveOf(name, hashText(name));
+	    if(directive != Directive::None) {
+		apply(directive, line.substr(end), table);
+		return;
+	    }
+	}
+    }
+    std::size_t i = 0;
+    while(i < line.size()) {
+	if(inComment) {
+	    const std::size_t close = line.find("*/", i);
+	    if(close == std::string_view::npos) return;
+	    inComment = false;
+	    i = close + 2;
+	    continue;
+	}
+	const std::size_t stop = line.find_first_of("/\"'", i);
+	if(stop == std::string_view::npos) {
+	    return;
+	} else if(line[stop] != '/') {
+	    i = literalEnd(line, stop);
+	} else if(stop + 1 < line.size() && line[stop + 1] == '*') {
+	    inComment = true;
+	    i = stop + 2;
+	} else {
+	    i = stop + 1;
+	}
+    }
 }
 
-int Scanner::nextToken()
+/**
+   Whether name could be the name in a #define
+*/
+bool isSymbolName(std::string_view name)
 {
-    State currState = State::Start;
-    currText = "";
-    bool done = false;
-    while(!done) {
-	switch(currState) {
-	case State::Start:
-	    if(currChar == ' ' || currChar == '\t') {
-	        break;
-	    } else if(currChar == EOF) {
-		currState = State::EoF;
-		done = true;
-	    } else if(currChar == '\n') {
-		currText += currChar;
-		currState = State::EoL;
-		currChar = getCh();
-		done = true;
-	    } else if(currChar == '\'') {
-		currText += currChar;
-		currState = State::InSingleQuote;
-	    } else if(currChar == '"') {
-		currText += currChar;
-		currState = State::InDoubleQuote;
-	    } else if(std::isalpha(currChar)) {
-		currText += currChar;
-		currState = State::InIdentifier;
-	    } else if(currChar == '/' && file.peek() == '*') {
-		currChar = getCh();
-		currState = State::InComment;
-	    } else if(currChar == '\\' && file.peek() == '\n') {
-		currChar = getCh();
-	    } else {
-		currText += currChar;
-		currChar = getCh();
-		currState = State::Other;
-		done = true;
-	    }
-	    break;
-	case State::InSingleQuote:
-	    if(currChar == '\'') {
-		currText += currChar;
-		currState = State::String;
-		currChar = getCh();
-		done = true;
-	    } else if(currChar == '\\' && file.peek() == '\'') {
-		currText += '\'';
-		currChar = getCh();
-	    } else if(currChar == '\\' && file.peek() == '\n') {
-		currChar = getCh(); //Skip backslash newline
-	    } else if(currChar == EOF || currChar == '\n') {
-		currState = State::Bad;
-		done = true;
-	    } else {
-		currText += currChar;
-	    }
-	    break;
-	case State::InDoubleQuote:
-	    if(currChar == '"') {
-		currText += currChar;
-		currState = State::String;
-		currChar = getCh();
-		done = true;
-	    } else if(currChar == '\\' && file.peek() == '"') {
-		currText += '\'';
-		currChar = getCh();
-	    } else if(currChar == '\\' && file.peek() == '\n') {
-		currChar = getCh(); //Skip backslash newline
-	    } else if(currChar == EOF || currChar == '\n') {
-		currState = State::Bad;
-		done = true;
-	    } else {
-		currText += currChar;
-	    }
-	    break;
-	case State::InComment:
-	    if(currChar == '*' && file.peek() == '/') {
-		//End of comment
-		currChar = getCh();
-		currState = State::Start;
-	    } else if(currChar == EOF) {
-		std::cerr << "Error: Unexpected end of input"; exit(1);
-	    }
-	    break;
-	case State::InIdentifier:
-	    if(std::isalnum(currChar)) {
-		currText += currChar;
-		break;
-	    }
-	    currState = State::Identifier;
-	    done = true;
-	    break;
-	default:
-	    break;
-	}
-	if(!done) {
-	    currChar = getCh();
+    return !name.empty() && startTable[static_cast<unsigned char>(name[0])] == CharKind::Letter
+	&& std::all_of(name.begin(), name.end(), [](char c) {
+	    return identTable<Dialect>[static_cast<unsigned char>(c)];
+	});
+}
+
+/**
+   The preprocessor, for linking into a program that runs it over many
+   inputs rather than once per process. The symbols it starts each input
+   with are set up first, then process() is called for each input; nothing
+   an input defines carries over to the next. The table, the scanner, the
+   output buffer and the scratch space for building definitions and
+   expanding calls are all kept from one input to the next, so once they've
+   grown to fit, an input only allocates for what it defines. Fatal errors
+   are returned, with a message on std::cerr, rather than exiting.
+*/
+class Preprocessor {
+private:
+    // Backs predefined's names and values when they're loaded
+    std::unique_ptr<SourceFile> symbolFile;
+    SymbolTable predefined;
+    SymbolTable symbolTable;
+    Scanner scanner;
+    Conditions conditions;
+    OutputBuffer output;
+    // Scratch space for defineSymbol() and expandCall(); the tables keep
+    // their own copies of what ends up in them
+    std::string key, value, callName, callText, expansion;
+    std::vector<BodyToken> body, call;
+    std::vector<std::string> params;
+    MacroExpander expander;
+    // With Whitespace::Preserve, how far the input has been copied to the
+    // output
+    bool preserve = false;
+    bool minify = false;
+    const char *copied = nullptr;
+    // For line markers and the source map: the input's name, the input line
+    // the output was last put in step with, and how many lines had been
+    // written by then. After a step that drops or joins lines,
+    // syncAtNewline says to check that the output is still in step at the
+    // start of the next line; syncPending says that the output is at the
+    // start of a line, to be checked before anything more is written.
+    bool lineMarkers = false;
+    OutputSink *mapSink = nullptr;
+    SourceMap sourceMap;
+    bool tracking = false;
+    std::string_view inputName;
+    std::uint32_t markedLine = 1;
+    std::uint64_t markedAt = 0;
+    bool syncPending = false;
+    bool syncAtNewline = false;
+    void sync(const char *at);
+    void mark(const char *at)
+    {
+	if(sourceMap.active()) {
+	    sourceMap.add(output.offset(), scanner.locate(at));
 	}
     }
+    void copyTo(const char *upTo);
+    void copyToExpansion(const char *at);
+    bool defineSymbol(SymbolTable &table, Scanner &scanner);
+    bool expandCall(std::uint32_t macro);
+    bool run();
+public:
+    /**
+       Starts the predefined symbols off with those in a .gsym file, which
+       are used straight out of the mapped file. Returns false if it can't
+       be read or isn't one.
+    */
+    bool loadSymbols(const std::string &path);
+    /**
+       Adds to the predefined symbols as -D and -U do.
+    */
+    bool define(std::string_view definition);
+    bool undefine(std::string_view name);
+    /**
+       How the output is laid out, Whitespace::Tokens to begin with
+    */
+    void setWhitespace(Whitespace whitespace);
+    /**
+       Whether to put `#line` markers in the output wherever its lines stop
+       matching up with the input's, and where to write the SourceMap of
+       each input, if anywhere. Both are off to begin with.
+    */
+    void setLineMarkers(bool on) { lineMarkers = on; }
+    void setSourceMap(OutputSink *sink) { mapSink = sink; }
+    /**
+       Preprocesses in, sending the result to out. name is what line markers
+       and the source map call the input. Returns false if the input ended
+       somewhere it shouldn't have or out or the source map's sink wouldn't
+       take what was written to it.
+    */
+    bool process(std::string_view in, OutputSink &out, std::string_view name = {});
+    /**
+       The same for the file at path, which must not be empty
+    */
+    bool processFile(const std::string &path, OutputSink &out);
+    /**
+       The symbols defined by the end of the last input, as a .gsym image
+    */
+    std::string symbolImage() const { return symbolTable.image(); }
+};
 
-    switch(currState) {
-    case State::Bad: {
-	std::cerr << "malformed token " << currText;
-	return nextToken();
+bool Preprocessor::loadSymbols(const std::string &path)
+{
+    auto file = std::make_unique<SourceFile>();
+    if(!file->open(path) || !predefined.load(std::string_view(file->data, file->size))) {
+	return false;
     }
-    case State::EoF:
-	return Token::EoF;
-    case State::EoL:
-    case State::Other:
-	return currText[0];
-    case State::Identifier:
-	if(currText == "define") {
-	    return Token::Define;
-	} else {
-	    return Token::Identifier;
+    // The last input's symbols may still be in the old file
+    symbolTable.layerOn(predefined);
+    symbolFile = std::move(file);
+    return true;
+}
+
+/**
+   Defines a symbol given on the command line after -D: NAME or NAME(params)
+   alone, which defines it as 1 as C compilers do, or followed by = and its
+   value. It's scanned just as the #define line it stands for would be.
+   Returns false if the name part is malformed.
+*/
+bool Preprocessor::define(std::string_view definition)
+{
+    const std::string_view name(definition.substr(0, definition.find('=')));
+    const std::size_t open = name.find('(');
+    if(open != std::string_view::npos && name.back() != ')') {
+	return false;
+    }
+    std::string line(name);
+    line += ' ';
+    line += name.size() < definition.size() ? definition.substr(name.size() + 1) : "1";
+    line += '\n';
+    Scanner lineScanner(line.data(), line.data() + line.size());
+    if(lineScanner.nextToken() != Token::Identifier
+       || lineScanner.currText != name.substr(0, open)) {
+	return false;
+    }
+    // The last input's symbols read through to predefined as it was
+    symbolTable.flatten();
+    return defineSymbol(predefined, lineScanner);
+}
+
+bool Preprocessor::undefine(std::string_view name)
+{
+    if(!isSymbolName(name)) {
+	return false;
+    }
+    symbolTable.flatten();
+    predefined.undefine(name, hashText(name));
+    return true;
+}
+
+void Preprocessor::setWhitespace(Whitespace whitespace)
+{
+    preserve = whitespace == Whitespace::Preserve;
+    minify = whitespace == Whitespace::Minify;
+    output.setWhitespace(whitespace);
+}
+
+bool Preprocessor::processFile(const std::string &path, OutputSink &out)
+{
+    SourceFile file;
+    if(!file.open(path)) {
+	std::cerr << "error: could not open input file: " << path << '\n';
+	return false;
+    }
+    return file.size != 0 && process(std::string_view(file.data, file.size), out, path);
+}
+
+bool Preprocessor::process(std::string_view in, OutputSink &out, std::string_view name)
+{
+    symbolTable.layerOn(predefined);
+    conditions.reset();
+    scanner.reset(in.data(), in.data() + in.size());
+    copied = in.data();
+    tracking = lineMarkers || mapSink != nullptr;
+    inputName = name;
+    markedLine = 1;
+    markedAt = 0;
+    syncPending = false;
+    syncAtNewline = false;
+    output.setCountLines(tracking);
+    output.setSink(&out);
+    if(mapSink != nullptr) {
+	sourceMap.start(mapSink, name);
+    }
+    const bool ok = run();
+    output.flush();
+    const bool written = !output.failed();
+    output.setSink(nullptr);
+    const bool mapped = !sourceMap.active() || sourceMap.finish();
+    return ok && written && mapped;
+}
+
+/**
+   Puts the output back in step with the input at at: with a `#line` marker
+   if line markers are on, or with blank lines if only a few are missing and
+   they won't be minified away, and with a record in the source map. Neither
+   can go in the middle of a line, so if the output isn't at the start of
+   one after all, this waits for the next.
+*/
+void Preprocessor::sync(const char *at)
+{
+    // Past this many missing lines a marker is shorter
+    constexpr std::uint32_t maxBlankLines = 8;
+    syncPending = false;
+    syncAtNewline = !output.atLineStart();
+    if(syncAtNewline) {
+	return;
+    }
+    const Location location = scanner.locate(at);
+    const std::uint64_t line = markedLine + (output.lines() - markedAt);
+    if(location.line == line) {
+	return;
+    }
+    if(lineMarkers && !minify && location.line > line && location.line - line <= maxBlankLines) {
+	for(std::uint64_t i = line; i < location.line; ++i) {
+	    output.put('\n');
 	}
-    case State::String:
-	return Token::String;
-    default:
-	assert(0 && "Deciding what to return from getToken()");
+    } else if(lineMarkers) {
+	// Past the minifier, whose idea of what's in a literal the marker's
+	// quotes would otherwise change
+	std::string marker("#line " + std::to_string(location.line));
+	if(!inputName.empty()) {
+	    marker += " \"";
+	    for(const char c : inputName) {
+		if(c == '"' || c == '\\') {
+		    marker += '\\';
+		}
+		marker += c;
+	    }
+	    marker += '"';
+	}
+	marker += '\n';
+	output.writeVerbatim(marker);
     }
+    markedLine = location.line;
+    markedAt = output.lines();
+    mark(at);
+}
 
-    assert(0 && "Deciding what to return from getToken()");
-    return EOF;
+/**
+   For Whitespace::Preserve, writes out the input from where it was last
+   copied to up to upTo
+*/
+void Preprocessor::copyTo(const char *upTo)
+{
+    if(upTo <= copied) {
+	return;
+    } else if(syncPending) {
+	sync(copied);
+    } else if(syncAtNewline) {
+	const void *newline = std::memchr(copied, '\n', upTo - copied);
+	if(newline != nullptr) {
+	    const char *lineEnd = static_cast<const char*>(newline) + 1;
+	    output.write(std::string_view(copied, lineEnd - copied));
+	    copied = lineEnd;
+	    syncAtNewline = false;
+	    syncPending = true;
+	    if(upTo > copied) {
+		sync(copied);
+	    }
+	}
+    }
+    output.write(std::string_view(copied, upTo - copied));
+    copied = upTo;
+}
+
+/**
+   For Whitespace::Preserve, copies the input out up to at, where an
+   expansion is about to be written, and puts the output in step first if
+   at starts a line that's due to be checked
+*/
+void Preprocessor::copyToExpansion(const char *at)
+{
+    copyTo(at);
+    if(syncPending) {
+	sync(copied);
+    }
 }
 
 /**
-   Adds a new symbol/value to the symbol table.
-   key: the identifier (the word after #define)
-   value: the value of identifier (ex: some number constant)
+   Adds a new symbol/value to the symbol table, from the name (the word
+   after #define), which scanner has just read, to the end of the line.
+   Returns false if the input ends first.
 */
-void defineSymbol(std::map<std::string,std::string> &table, Scanner &scanner,
-		  int token)
+bool Preprocessor::defineSymbol(SymbolTable &table, Scanner &scanner)
 {
-    std::string value;
-    const std::string key(scanner.currText);
+    int token;
+    key = scanner.currText;
+    value.clear();
+    body.clear();
+    const std::uint64_t keyHash = scanner.currHash;
+    // As in C, a ( straight after the name makes the macro function-like
+    const bool function = scanner.currChar == '(';
+    if(function) {
+	scanner.nextToken();
+	if(!readParameters(scanner, params)) {
+	    std::cerr << "error: malformed parameter list for macro " << key << '\n';
+	    while((token = scanner.nextToken()) != '\n') {
+		if(token == Token::EoF) {
+		    if(!scanner.failed()) {
+			std::cerr << "error: premature end of file\n";
+		    }
+		    return false;
+		}
+	    }
+	    return true;
+	}
+    }
     token = scanner.nextToken();
     while(true) {
 	if(token == Token::EoF) {
-	    std::cerr << "error: premature end of file\n";
-	    exit(1);
-	} else if(token == Token::Identifier) {
-	    if(table.find(scanner.currText) != table.end()) {
-		value += table[scanner.currText];
-	    } else {
-		value += scanner.currText;
+	    if(!scanner.failed()) {
+		std::cerr << "error: premature end of file\n";
 	    }
+	    return false;
 	} else if(token == '\n') {
-	    table[key] = value;
-	    return;
+	    table.define(key, keyHash, value, body,
+			 function ? static_cast<std::int32_t>(params.size()) : -1);
+	    return true;
 	} else {
-	    value += scanner.currText;
+	    std::uint32_t symbol = SymbolTable::noSymbol;
+	    std::uint16_t param = 0;
+	    if(token == Token::Identifier && function) {
+		const auto match = std::find(params.begin(), params.end(), scanner.currText);
+		if(match != params.end()) {
+		    param = static_cast<std::uint16_t>(match - params.begin() + 1);
+		}
+	    }
+	    if(token == Token::Identifier && param == 0) {
+		symbol = table.indexOf(scanner.currText, scanner.currHash);
+	    }
+	    // Object-like macros inside an object-like macro are expanded right
+	    // away; the rest are left for the expander
+	    const bool expand = !function && symbol != SymbolTable::noSymbol
+		&& table.macro(symbol).paramCount < 0;
+	    if(expand) {
+		stats::substitution();
+	    }
+	    const std::string_view text(expand ? table.macro(symbol).value : scanner.currText);
+	    body.push_back({token, param, static_cast<std::uint32_t>(value.size()),
+			    static_cast<std::uint32_t>(text.size()), symbol});
+	    value += text;
 	}
 	token = scanner.nextToken();
     }
 }
 
-int main(int argc, char **argv)
+/**
+   Reads the rest of a call to the function-like macro with the given index,
+   named callName, whose ( has just been read, and writes out its expansion.
+   Returns false if the input ends first.
+*/
+bool Preprocessor::expandCall(std::uint32_t macro)
 {
-    if(argc != 2) {
-	std::cout << "usage: ginevra++ filename[.cpp,.h]\n";
-	exit(1);
+    std::string &text = callText;
+    text.clear();
+    call.clear();
+    int depth = 0;
+    int token = '(';
+    while(true) {
+	if(token == Token::EoF) {
+	    if(!scanner.failed()) {
+		std::cerr << "error: unterminated call to macro " << callName << '\n';
+	    }
+	    return false;
+	} else if(token != '\n') {
+	    call.push_back({token, 0, static_cast<std::uint32_t>(text.size()),
+			    static_cast<std::uint32_t>(scanner.currText.size()),
+			    SymbolTable::noSymbol});
+	    text += scanner.currText;
+	}
+	if(token == '(') {
+	    ++depth;
+	} else if(token == ')' && --depth == 0) {
+	    break;
+	}
+	token = scanner.nextToken();
     }
-    std::string path(argv[1]);
-    if(path.size() < 2 || (path.substr(path.size()-2) != ".h"
-			   && path.substr(path.size()-4) != ".cpp")) {
-	std::cerr << "Invalid file extension\n"; exit(1);
+    expansion.clear();
+    expander.expand(symbolTable, macro, callName, text, call, expansion);
+    std::cerr << expander.messages();
+    output.write(expansion);
+    // The call may have spanned lines
+    syncAtNewline = tracking;
+    if(preserve) {
+	copied = scanner.position();
+	mark(copied);
+    } else {
+	output.put(' ');
     }
-    Scanner scanner(path);
-    std::map<std::string,std::string> symbolTable;
+    return true;
+}
 
-    int token = Token::EoF;
-    while((token = scanner.nextToken()) != Token::EoF) {
-	if(scanner.currColumn == 1 && token == '#') {
+/**
+   Preprocesses the scanner's input into output, starting from the symbols
+   and conditions each input starts with. With Whitespace::Preserve, the
+   input is copied out between the tokens that change it rather than
+   written token by token.
+*/
+bool Preprocessor::run()
+{
+    const stats::PhaseTimer timer(stats::Phase::Expand);
+    int token = scanner.nextToken();
+    while(token != Token::EoF) {
+	// At the start of a line, lines can only have gone missing if they
+	// were joined or minified away. With Preserve, copyTo() does this
+	// once it's caught up.
+	if(syncPending && !preserve && token != '\n' && token != '#') {
+	    syncPending = false;
+	    if(syncAtNewline || minify || scanner.takeJoined()) {
+		sync(scanner.tokenStart());
+	    }
+	}
+	if(token == '#') {
+	    if(preserve) {
+		copyTo(scanner.currText.data());
+	    }
 	    token = scanner.nextToken();
 	    if(token == Token::Define) {
 		token = scanner.nextToken();
 		if(token == Token::EoF) {
-		    std::cerr << "error: premature end of file\n"; exit(1);
+		    if(!scanner.failed()) {
+			std::cerr << "error: premature end of file\n";
+		    }
+		    return false;
 		} else if(token == '\n') {
 		    std::cerr << "error: premature end of #define\n";
 		} else if(token == Token::Identifier) {
-		    if(symbolTable.count(scanner.currText) > 0) {
+		    if(symbolTable.find(scanner.currText, scanner.currHash) != nullptr) {
 			std::cerr << "error: multiple symbol definitions\n";
 		    }
-		    defineSymbol(symbolTable, scanner, token);
+		    if(!defineSymbol(symbolTable, scanner)) {
+			return false;
+		    }
 		} else {
 		    std::cerr << "error: identifier expected after #define\n";
 		}
+		copied = scanner.position();
+		syncPending = syncAtNewline = tracking;
+	    } else if(const Directive directive = token == Token::Identifier
+		      ? directiveOf(scanner.currText, scanner.currHash) : Directive::None;
+		      directive != Directive::None) {
+		conditions.apply(directive, scanner.restOfLine(), symbolTable);
+		// Skipped lines are only looked at for the directives that
+		// could end the skip, never tokenized
+		while(!conditions.live() && !scanner.atEnd()) {
+		    conditions.skipLine(scanner.restOfLine(), symbolTable);
+		}
+		copied = scanner.position();
+		syncPending = syncAtNewline = tracking;
 	    } else {
 		std::cerr << "warning: # in column 1, but not a #define\n";
-		std::cout << '#' << scanner.currText << ' ' << scanner.nextLine() << '\n';
+		const std::string_view name(scanner.currText);
+		const std::string_view line(scanner.nextLine());
+		if(!preserve) {
+		    output.put('#');
+		    output.write(name);
+		    output.put(' ');
+		    output.write(line);
+		    output.put('\n');
+		}
 	    }
 	} else if(token == Token::Identifier) {
-	    if(symbolTable.find(scanner.currText) != symbolTable.end()) {
-		std::cout << symbolTable[scanner.currText] << ' ';
+	    const std::uint32_t index = symbolTable.indexOf(scanner.currText, scanner.currHash);
+	    if(index != SymbolTable::noSymbol && symbolTable.macro(index).paramCount >= 0) {
+		// A function-like macro's name is only a call if ( comes next;
+		// otherwise it's left as it is
+		callName = scanner.currText;
+		if(preserve) {
+		    copyToExpansion(scanner.currText.data());
+		    mark(scanner.currText.data());
+		}
+		token = scanner.nextToken();
+		if(token == '(') {
+		    if(!expandCall(index)) {
+			return false;
+		    }
+		    token = scanner.nextToken();
+		} else if(!preserve) {
+		    output.write(callName);
+		    output.put(' ');
+		}
+		continue;
+	    }
+	    if(index != SymbolTable::noSymbol) {
+		stats::substitution();
+	    }
+	    if(!preserve) {
+		output.write(index != SymbolTable::noSymbol
+			     ? symbolTable.macro(index).value : scanner.currText);
+		output.put(' ');
+	    } else if(index != SymbolTable::noSymbol) {
+		copyToExpansion(scanner.currText.data());
+		mark(scanner.currText.data());
+		output.write(symbolTable.macro(index).value);
+		copied = scanner.currText.data() + scanner.currText.size();
+		mark(copied);
+	    }
+	} else if(!preserve) {
+	    // Anything else is copied along with what follows it in Preserve
+	    if(token == '\n') {
+		output.put('\n');
+		syncPending = tracking;
 	    } else {
-		std::cout << scanner.currText << ' ';
+		output.write(scanner.currText);
 	    }
-	} else if(token == '\n') {
-	    std::cout << '\n';
+	}
+	token = scanner.nextToken();
+    }
+    if(scanner.failed()) {
+	return false;
+    } else if(preserve) {
+	copyTo(scanner.position());
+    }
+    if(conditions.open()) {
+	std::cerr << "error: unterminated #if\n";
+    }
+    return true;
+}
+
+/**
+   Writes text to a temporary file and renames it to path, so that a run
+   mapping the old file never sees it change under it.
+*/
+bool replaceFile(const std::string &path, std::string_view text)
+{
+    const std::string temp(path + ".tmp" + std::to_string(getpid()));
+    const int fd = ::open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) {
+	return false;
+    }
+    while(!text.empty()) {
+	const ssize_t written = ::write(fd, text.data(), text.size());
+	if(written < 0 && errno == EINTR) {
+	    continue;
+	} else if(written < 0) {
+	    break;
+	}
+	text.remove_prefix(written);
+    }
+    close(fd);
+    if(!text.empty() || rename(temp.c_str(), path.c_str()) != 0) {
+	unlink(temp.c_str());
+	return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    // Only diagnostics still go through iostreams
+    std::ios::sync_with_stdio(false);
+    std::string path;
+    std::string loadPath;
+    std::string emitPath;
+    std::string mapPath;
+    bool lineMarkers = false;
+    bool showStats = false;
+    std::string statsPath;
+    Whitespace whitespace = Whitespace::Tokens;
+    bool badWhitespace = false;
+    // Each -D and -U, as 'D' or 'U' and what followed it
+    std::vector<std::pair<char, std::string_view>> predefinitions;
+    for(int i = 1; i < argc; ++i) {
+	const std::string_view arg(argv[i]);
+	if((arg == "-D" || arg == "-U") && i + 1 < argc) {
+	    predefinitions.emplace_back(arg[1], argv[++i]);
+	} else if(arg.size() > 2 && (arg.substr(0, 2) == "-D" || arg.substr(0, 2) == "-U")) {
+	    predefinitions.emplace_back(arg[1], arg.substr(2));
+	} else if(arg == "--load-symbols" && i + 1 < argc) {
+	    loadPath = argv[++i];
+	} else if(arg == "--emit-symbols" && i + 1 < argc) {
+	    emitPath = argv[++i];
+	} else if(arg == "--line-markers") {
+	    lineMarkers = true;
+	} else if(arg == "--source-map" && i + 1 < argc) {
+	    mapPath = argv[++i];
+	} else if(arg == "--stats") {
+	    showStats = true;
+	} else if(arg == "--stats-json" && i + 1 < argc) {
+	    statsPath = argv[++i];
+	} else if(arg == "--whitespace" && i + 1 < argc) {
+	    const std::string_view mode(argv[++i]);
+	    if(mode == "tokens") {
+		whitespace = Whitespace::Tokens;
+	    } else if(mode == "preserve") {
+		whitespace = Whitespace::Preserve;
+	    } else if(mode == "minify") {
+		whitespace = Whitespace::Minify;
+	    } else {
+		badWhitespace = true;
+	    }
+	} else if(arg == "-") {
+	    // Streaming is better's; this scanner needs the whole input in one piece
+	    std::cerr << "error: ginevra++ only reads named files; better reads standard input\n";
+	    return 1;
+	} else if(path.empty() && !arg.empty() && arg[0] != '-') {
+	    path = arg;
 	} else {
-	    std::cout << scanner.currText;
+	    path.clear();
+	    break;
 	}
     }
-    
-    return 0;
+    if(path.empty() || badWhitespace) {
+	std::cout << "usage: ginevra++ [--load-symbols in.gsym] [--emit-symbols out.gsym]"
+	    " [-D name[=value]]... [-U name]... [--whitespace tokens|preserve|minify]"
+	    " [--line-markers] [--source-map out.gmap]"
+	    " [--stats] [--stats-json out.json] filename[.cpp,.h]\n";
+	return 1;
+    }
+    if(!statsEnabled && (showStats || !statsPath.empty())) {
+	std::cerr << "error: built without stats; rebuild with -DENABLE_STATS=1\n";
+	return 1;
+    }
+    if(path.size() < 2 || (path.substr(path.size()-2) != ".h"
+			   && path.substr(path.size()-4) != ".cpp")) {
+	std::cerr << "Invalid file extension\n";
+	return 1;
+    }
+    Preprocessor preprocessor;
+    preprocessor.setWhitespace(whitespace);
+    preprocessor.setLineMarkers(lineMarkers);
+    if(!loadPath.empty() && !preprocessor.loadSymbols(loadPath)) {
+	std::cerr << "error: could not load symbols from " << loadPath << '\n';
+	return 1;
+    }
+    // On top of any symbols loaded, in the order given
+    for(const auto &[option, definition] : predefinitions) {
+	if(!(option == 'D' ? preprocessor.define(definition) : preprocessor.undefine(definition))) {
+	    std::cerr << "error: malformed -" << option << ' ' << definition << '\n';
+	    return 1;
+	}
+    }
+    const int mapFd = mapPath.empty() ? -1
+	: ::open(mapPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(!mapPath.empty() && mapFd < 0) {
+	std::cerr << "error: could not open " << mapPath << '\n';
+	return 1;
+    }
+    FileSink mapSink(mapFd);
+    if(mapFd >= 0) {
+	preprocessor.setSourceMap(&mapSink);
+    }
+    FileSink output(STDOUT_FILENO);
+    bool ok = preprocessor.processFile(path, output);
+    if(mapFd >= 0) {
+	close(mapFd);
+    }
+    if(ok && !emitPath.empty() && !replaceFile(emitPath, preprocessor.symbolImage())) {
+	std::cerr << "error: could not write symbols to " << emitPath << '\n';
+	ok = false;
+    }
+    if(showStats) {
+	stats::report(std::cerr);
+    }
+    if(!statsPath.empty()) {
+	std::ofstream json(statsPath);
+	stats::reportJson(json);
+	if(!json) {
+	    std::cerr << "error: could not write stats to " << statsPath << '\n';
+	}
+    }
+
+    return ok ? 0 : 1;
 }
@@ -0,0 +1,111 @@
+/* File: harness.h
+ * Purpose: What bench.cpp and scale.cpp share: a deterministic source of
+ *  names and numbers for generating inputs, and a way of calling the
+ *  implementation's main() in a forked child, which gives each run a fresh
+ *  heap and lets its peak RSS be read back on its own. It's included after
+ *  the implementation, with its main() renamed implementationMain.
+ */
+#ifndef HARNESS_H
+#define HARNESS_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace generate {
+
+// Deterministic, so every run and both implementations see the same files
+class Random {
+private:
+    std::uint64_t m_state;
+public:
+    explicit Random(std::uint64_t seed) : m_state(seed) {}
+    std::uint64_t next()
+    {
+	m_state ^= m_state << 13;
+	m_state ^= m_state >> 7;
+	m_state ^= m_state << 17;
+	return m_state;
+    }
+    std::size_t below(std::size_t limit) { return next() % limit; }
+};
+
+// The i-th name with the given prefix, in letters only, since better's
+// identifiers can't hold digits
+inline std::string nameOf(char prefix, std::size_t i)
+{
+    std::string name(1, prefix);
+    do {
+	name += static_cast<char>('A' + i % 26);
+	i /= 26;
+    } while(i != 0);
+    return name;
+}
+
+}
+
+// Calls the implementation's main() as program with the given arguments
+inline int callMain(std::string_view program, const std::vector<std::string> &call)
+{
+    std::vector<std::string> args{std::string(program)};
+    args.insert(args.end(), call.begin(), call.end());
+    std::vector<char*> argv;
+    for(std::string &arg : args) {
+	argv.push_back(arg.data());
+    }
+    argv.push_back(nullptr);
+    return implementationMain(static_cast<int>(args.size()), argv.data());
+}
+
+// What a forked child sent back: whether it reported a result, and if so
+// what, with how it exited and its peak RSS
+template<typename Result>
+struct ChildRun {
+    Result result{};
+    bool reported = false;
+    int status = 0;
+    long peakKilobytes = 0;
+};
+
+// Runs body in a forked child with its output thrown away. If body returns
+// true, the Result it filled in, which must be trivially copyable, is sent
+// back through a pipe; otherwise the child exits with 1. Anything else the
+// child needs, such as limits or standard input, is for body to set up.
+template<typename Result, typename Body>
+ChildRun<Result> runInChild(const Body &body)
+{
+    ChildRun<Result> run;
+    int results[2];
+    if(pipe(results) != 0) {
+	return run;
+    }
+    const pid_t child = fork();
+    if(child == 0) {
+	close(results[0]);
+	const int null = ::open("/dev/null", O_WRONLY);
+	dup2(null, STDOUT_FILENO);
+	dup2(null, STDERR_FILENO);
+	Result result{};
+	if(!body(result) || ::write(results[1], &result, sizeof(result)) != sizeof(result)) {
+	    _exit(1);
+	}
+	_exit(0);
+    }
+    close(results[1]);
+    run.reported = child > 0
+	&& ::read(results[0], &run.result, sizeof(run.result)) == sizeof(run.result);
+    close(results[0]);
+    struct rusage usage{};
+    if(child > 0) {
+	wait4(child, &run.status, 0, &usage);
+    }
+    run.peakKilobytes = usage.ru_maxrss;
+    return run;
+}
+
+#endif
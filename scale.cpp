@@ -0,0 +1,433 @@
+/* File: scale.cpp
+ * Purpose: Measures how one of the preprocessors scales. Like bench.cpp, it's
+ *  built once per implementation (see build-scale.sh), with that
+ *  implementation compiled in and its main() renamed, and every run happens
+ *  in a forked child so that its time and peak RSS can be read back on their
+ *  own.
+ *
+ *  usage: ./scale-better [-n symbols] [-d depth] [-m MB] [-t seconds] [-M MB] dir
+ *
+ *  Each sweep grows one thing and holds the rest still:
+ *   symbols       the number of macros defined and used once each, from 10 up
+ *                 to -n (1M by default), both defined in the file and loaded
+ *                 from an --emit-symbols image
+ *   object-chain  the depth of a chain of object-like macros, each defined as
+ *                 the one before plus 1, up to -d (1M by default)
+ *   call-chain    the same with function-like macros
+ *   file-KB       the size of a macro-heavy file, from 16 KB up to -m MB (1 GB
+ *                 by default)
+ *  The inputs are generated into dir the first time, so both implementations
+ *  can be run over the same files.
+ *
+ *  Between each point and the next, time and peak RSS may grow by no more
+ *  than n log n would, with some slack for noise; points too quick or too
+ *  small to tell are let through. A point that runs past -t seconds (60) or
+ *  -M MB of address space (4096) ends its sweep, and counts against it if the
+ *  point before would have stayed within both at that rate. The exit status
+ *  is 1 if anything grew faster, failed or crashed.
+ */
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <deque>
+#include <algorithm>
+#include <tuple>
+#include <utility>
+#include <initializer_list>
+#include <iterator>
+#include <filesystem>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cassert>
+#include <cctype>
+#include <cerrno>
+#include <climits>
+#include <cmath>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define main implementationMain
+#ifdef SCALE_BETTER
+    #include "better.cpp"
+#else
+    #include "ginevra++.cpp"
+#endif
+#undef main
+#include "harness.h"
+
+#ifdef SCALE_BETTER
+constexpr std::string_view ImplementationName = "better";
+#else
+constexpr std::string_view ImplementationName = "ginevra++";
+#endif
+
+// How much faster than n log n a step may grow before it counts: the timings
+// are single runs, and a big enough table falls out of the caches on the way.
+// Quadratic growth still clears it at every step a sweep takes.
+constexpr double Slack = 2;
+// Steps from a point quicker or smaller than these are mostly noise and
+// fixed costs, so they aren't judged
+constexpr double MinJudgedSeconds = 0.05;
+constexpr long MinJudgedKilobytes = 16 * 1024;
+// What a child that runs out of memory exits with
+constexpr int OverLimitStatus = 3;
+
+namespace generate {
+
+// Writes a file in pieces as they're made, under a temporary name until
+// it's whole, so that a file that's there is always complete
+class Writer {
+private:
+    std::filesystem::path m_path;
+    std::filesystem::path m_partial;
+    std::ofstream m_file;
+    std::string m_pending;
+public:
+    explicit Writer(const std::filesystem::path &path)
+	: m_path(path), m_partial(path.string() + ".partial"),
+	  m_file(m_partial, std::ios::binary) {}
+    std::string& text() { return m_pending; }
+    void flush()
+    {
+	m_file.write(m_pending.data(), m_pending.size());
+	m_pending.clear();
+    }
+    void close()
+    {
+	flush();
+	m_file.close();
+	std::filesystem::rename(m_partial, m_path);
+    }
+};
+
+// count macros, each a number, then a use of each of them in random order
+void symbols(const std::filesystem::path &definitions, const std::filesystem::path &uses,
+	     std::size_t count)
+{
+    Writer out(definitions);
+    for(std::size_t i = 0; i < count; ++i) {
+	out.text() += "#define " + nameOf('M', i) + ' ' + std::to_string(i) + '\n';
+    }
+    out.close();
+    Random random(count);
+    Writer in(uses);
+    for(std::size_t i = 0; i < count; ++i) {
+	in.text() += "    x = " + nameOf('M', random.below(count)) + ";\n";
+	if(in.text().size() > 1 << 20) {
+	    in.flush();
+	}
+    }
+    in.close();
+}
+
+// A chain of depth macros, each the one before plus 1, and a use of the last
+void chain(const std::filesystem::path &path, std::size_t depth, bool calls)
+{
+    const char prefix = calls ? 'F' : 'C';
+    const std::string params(calls ? "(x)" : "");
+    Writer out(path);
+    out.text() += "#define " + nameOf(prefix, 0) + params + " 0\n";
+    for(std::size_t i = 1; i < depth; ++i) {
+	out.text() += "#define " + nameOf(prefix, i) + params + ' '
+	    + nameOf(prefix, i - 1) + params + " + 1\n";
+	if(out.text().size() > 1 << 20) {
+	    out.flush();
+	}
+    }
+    out.text() += "    x = " + nameOf(prefix, depth - 1) + (calls ? "(y)" : "") + ";\n";
+    out.close();
+}
+
+// The same few hundred macros, object-like and function-like, used densely
+// for as long as it takes to reach size bytes
+void macroHeavy(const std::filesystem::path &path, std::size_t size)
+{
+    constexpr std::size_t macros = 256;
+    Random random(1);
+    Writer out(path);
+    for(std::size_t i = 0; i < macros; ++i) {
+	out.text() += "#define " + nameOf('M', i);
+	if(i % 4 == 3) {
+	    out.text() += "(a, b) ((a) + (b) * " + nameOf('M', random.below(i)) + ")\n";
+	} else if(i % 2 == 1) {
+	    out.text() += " (" + nameOf('M', random.below(i)) + " + " + std::to_string(i) + ")\n";
+	} else {
+	    out.text() += ' ' + std::to_string(i) + '\n';
+	}
+    }
+    std::size_t written = 0;
+    while(written + out.text().size() < size) {
+	out.text() += "    x = ";
+	for(std::size_t i = 0; i < 6; ++i) {
+	    const std::size_t macro = random.below(macros);
+	    out.text() += nameOf('M', macro);
+	    if(macro % 4 == 3) {
+		out.text() += "(y, " + nameOf('M', random.below(macros)) + ")";
+	    }
+	    out.text() += i < 5 ? " + " : ";\n";
+	}
+	if(out.text().size() > 1 << 20) {
+	    written += out.text().size();
+	    out.flush();
+	}
+    }
+    out.close();
+}
+
+}
+
+// One way of running the implementation: the argument lists to call its
+// main() with, the first of them only to get ready, untimed
+struct Run {
+    std::vector<std::string> prepare;
+    std::vector<std::string> call;
+};
+
+struct Sweep {
+    std::string name;
+    std::string backend;
+    std::size_t first;
+    std::size_t last;
+    std::size_t factor;
+    // What n is shown in, as a divisor
+    std::size_t unit;
+    // Generates the inputs for n, if they aren't there yet, and says how to
+    // run over them
+    Run (*plan)(const std::filesystem::path &directory, std::size_t n);
+};
+
+std::vector<Sweep> sweeps(std::size_t symbols, std::size_t depth, std::size_t megabytes)
+{
+    return {
+	{"symbols", "file", 10, symbols, 10, 1, [](const std::filesystem::path &directory, std::size_t n) {
+	    const std::filesystem::path definitions(directory / ("symbols-" + std::to_string(n) + ".h"));
+	    const std::filesystem::path uses(directory / ("uses-" + std::to_string(n) + ".cpp"));
+	    const std::filesystem::path whole(directory / ("symbols-" + std::to_string(n) + ".cpp"));
+	    if(!std::filesystem::exists(definitions) || !std::filesystem::exists(uses)) {
+		generate::symbols(definitions, uses, n);
+	    }
+	    if(!std::filesystem::exists(whole)) {
+		generate::Writer out(whole);
+		for(const auto &part : {definitions, uses}) {
+		    std::ifstream in(part, std::ios::binary);
+		    out.text().assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+		    out.flush();
+		}
+		out.close();
+	    }
+	    return Run{{}, {whole.string()}};
+	}},
+	{"symbols", "loaded", 10, symbols, 10, 1, [](const std::filesystem::path &directory, std::size_t n) {
+	    const std::filesystem::path definitions(directory / ("symbols-" + std::to_string(n) + ".h"));
+	    const std::filesystem::path uses(directory / ("uses-" + std::to_string(n) + ".cpp"));
+	    if(!std::filesystem::exists(definitions) || !std::filesystem::exists(uses)) {
+		generate::symbols(definitions, uses, n);
+	    }
+	    // Each implementation's own image, since the two formats differ
+	    const std::string image((directory / (std::string(ImplementationName) + "-"
+						  + std::to_string(n) + ".gsym")).string());
+	    return Run{{"--emit-symbols", image, definitions.string()},
+		       {"--load-symbols", image, uses.string()}};
+	}},
+	{"object-chain", "file", 16, depth, 4, 1, [](const std::filesystem::path &directory, std::size_t n) {
+	    const std::filesystem::path path(directory / ("object-chain-" + std::to_string(n) + ".cpp"));
+	    if(!std::filesystem::exists(path)) {
+		generate::chain(path, n, false);
+	    }
+	    return Run{{}, {path.string()}};
+	}},
+	{"call-chain", "file", 16, depth, 4, 1, [](const std::filesystem::path &directory, std::size_t n) {
+	    const std::filesystem::path path(directory / ("call-chain-" + std::to_string(n) + ".cpp"));
+	    if(!std::filesystem::exists(path)) {
+		generate::chain(path, n, true);
+	    }
+	    return Run{{}, {path.string()}};
+	}},
+	{"file-KB", "file", 16 << 10, megabytes << 20, 4, 1 << 10,
+	 [](const std::filesystem::path &directory, std::size_t n) {
+	    const std::filesystem::path path(directory / ("file-" + std::to_string(n) + ".cpp"));
+	    if(!std::filesystem::exists(path)) {
+		generate::macroHeavy(path, n);
+	    }
+	    return Run{{}, {path.string()}};
+	}},
+    };
+}
+
+struct Limits {
+    unsigned seconds;
+    std::size_t megabytes;
+};
+
+enum class Outcome { Ok, Failed, OverLimit };
+
+struct Measurement {
+    double seconds = 0;
+    long peakKilobytes = 0;
+    Outcome outcome = Outcome::Failed;
+};
+
+// Runs a plan in a forked child with its output thrown away, within the
+// limits, which cover getting ready as well
+Measurement measure(const Run &run, const Limits &limits)
+{
+    const auto child = runInChild<double>([&](double &seconds) {
+	const rlim_t bytes = static_cast<rlim_t>(limits.megabytes) << 20;
+	const struct rlimit space{bytes, bytes};
+	setrlimit(RLIMIT_AS, &space);
+	std::set_new_handler([] { _exit(OverLimitStatus); });
+	alarm(limits.seconds);
+	if(!run.prepare.empty() && callMain(ImplementationName, run.prepare) != 0) {
+	    return false;
+	}
+	const auto start = std::chrono::steady_clock::now();
+	const bool ok = callMain(ImplementationName, run.call) == 0;
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return ok;
+    });
+    Measurement result;
+    result.seconds = child.result;
+    result.peakKilobytes = child.peakKilobytes;
+    const int status = child.status;
+    if(child.reported && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+	result.outcome = Outcome::Ok;
+    } else if((WIFSIGNALED(status) && WTERMSIG(status) == SIGALRM)
+	      || (WIFEXITED(status) && WEXITSTATUS(status) == OverLimitStatus)) {
+	result.outcome = Outcome::OverLimit;
+    }
+    return result;
+}
+
+// How much n log n grows from a to b
+double allowedGrowth(std::size_t a, std::size_t b)
+{
+    return Slack * (double(b) / a) * (std::log2(double(b)) / std::log2(double(a)));
+}
+
+// Prints a growth, or nothing if the step wasn't judged
+std::string growth(double ratio, bool judged)
+{
+    if(!judged) {
+	return "-";
+    }
+    char text[32];
+    std::snprintf(text, sizeof(text), "x%.1f", ratio);
+    return text;
+}
+
+void scaleUsage()
+{
+    std::cout << "usage: ./scale-" << ImplementationName
+	      << " [-n symbols] [-d depth] [-m MB] [-t seconds] [-M MB] dir\n";
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    std::size_t symbols = 1000000;
+    std::size_t depth = 1 << 20;
+    std::size_t megabytes = 1024;
+    Limits limits{60, 4096};
+    std::string directory;
+    for(int i = 1; i < argc; ++i) {
+	const std::string_view arg(argv[i]);
+	if(arg == "-n" && i + 1 < argc) {
+	    symbols = std::max<std::size_t>(10, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-d" && i + 1 < argc) {
+	    depth = std::max<std::size_t>(16, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-m" && i + 1 < argc) {
+	    megabytes = std::max<std::size_t>(1, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-t" && i + 1 < argc) {
+	    limits.seconds = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+	} else if(arg == "-M" && i + 1 < argc) {
+	    limits.megabytes = std::max<std::size_t>(64, std::strtoul(argv[++i], nullptr, 10));
+	} else if(directory.empty() && !arg.empty() && arg[0] != '-') {
+	    directory = arg;
+	} else {
+	    scaleUsage();
+	}
+    }
+    if(directory.empty()) {
+	scaleUsage();
+    }
+    std::filesystem::create_directories(directory);
+
+    std::printf("%-10s %-13s %-7s %9s %10s %12s %8s %8s %8s\n", "impl", "sweep", "backend",
+		"n", "seconds", "peak RSS", "time", "memory", "allowed");
+    const std::string name(ImplementationName);
+    bool steep = false;
+    for(const Sweep &sweep : sweeps(symbols, depth, megabytes)) {
+	std::size_t previous = 0;
+	Measurement before;
+	long baseKilobytes = 0;
+	for(std::size_t n = sweep.first; n <= sweep.last; n *= sweep.factor) {
+	    const Measurement result(measure(sweep.plan(directory, n), limits));
+	    const double allowed = previous != 0 ? allowedGrowth(previous, n) : 0;
+	    if(previous == 0) {
+		baseKilobytes = result.peakKilobytes;
+	    }
+	    const char *verdict = "";
+	    if(result.outcome == Outcome::Ok) {
+		// Memory is judged on what the run added to where the sweep started
+		const bool timeJudged = previous != 0 && before.seconds >= MinJudgedSeconds;
+		const double timeGrowth = timeJudged ? result.seconds / before.seconds : 0;
+		const long grownFrom = before.peakKilobytes - baseKilobytes;
+		const bool memoryJudged = previous != 0 && grownFrom >= MinJudgedKilobytes;
+		const double memoryGrowth = memoryJudged
+		    ? double(result.peakKilobytes - baseKilobytes) / grownFrom : 0;
+		if(timeGrowth > allowed || memoryGrowth > allowed) {
+		    verdict = "  too steep";
+		    steep = true;
+		}
+		std::printf("%-10s %-13s %-7s %9zu %10.3f %9ld KB %8s %8s %8s%s\n", name.c_str(),
+			    sweep.name.c_str(), sweep.backend.c_str(), n / sweep.unit,
+			    result.seconds, result.peakKilobytes,
+			    growth(timeGrowth, timeJudged).c_str(),
+			    growth(memoryGrowth, memoryJudged).c_str(),
+			    growth(allowed, previous != 0).c_str(), verdict);
+	    } else {
+		// Past a limit it only counts if the point before, grown by
+		// n log n, would have come in under it
+		const bool within = previous != 0
+		    && before.seconds * allowed < limits.seconds
+		    && before.peakKilobytes * allowed < double(limits.megabytes << 10);
+		if(result.outcome == Outcome::Failed) {
+		    verdict = "  failed";
+		    steep = true;
+		} else if(within) {
+		    verdict = "  over limit, too steep";
+		    steep = true;
+		} else {
+		    verdict = "  over limit";
+		}
+		std::printf("%-10s %-13s %-7s %9zu %10s %12s %8s %8s %8s%s\n", name.c_str(),
+			    sweep.name.c_str(), sweep.backend.c_str(), n / sweep.unit, "-", "-",
+			    "-", "-", growth(allowed, previous != 0).c_str(), verdict);
+	    }
+	    std::fflush(stdout);
+	    if(result.outcome != Outcome::Ok) {
+		break;
+	    }
+	    previous = n;
+	    before = result;
+	}
+    }
+    return steep ? 1 : 0;
+}